@@ -61,6 +61,7 @@ let package = Package(
                 "kj/string-tree.c++",
                 "kj/string.c++",
                 "kj/table.c++",
+                "kj/thread-pool.c++",
                 "kj/thread.c++",
                 "kj/time.c++",
                 "kj/timer.c++",
@@ -93,6 +94,7 @@ let package = Package(
                 "capnp/message.c++",
                 "capnp/persistent.capnp.c++",
                 "capnp/reconnect.c++",
+                "capnp/rpc-shared-memory.c++",
                 "capnp/rpc-twoparty.c++",
                 "capnp/rpc-twoparty.capnp.c++",
                 "capnp/rpc.c++",
@@ -101,7 +103,9 @@ let package = Package(
                 "capnp/schema-parser.c++",
                 "capnp/schema.c++",
                 "capnp/schema.capnp.c++",
+                "capnp/serialize-archive.c++",
                 "capnp/serialize-async.c++",
+                "capnp/serialize-mmap.c++",
                 "capnp/serialize-packed.c++",
                 "capnp/serialize-text.c++",
                 "capnp/serialize.c++",
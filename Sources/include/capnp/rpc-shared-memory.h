@@ -0,0 +1 @@
+../../../c++/src/capnp/rpc-shared-memory.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../c++/src/capnp/serialize-archive.h
\ No newline at end of file
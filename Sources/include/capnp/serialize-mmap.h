@@ -0,0 +1 @@
+../../../c++/src/capnp/serialize-mmap.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../c++/src/kj/thread-pool.h
\ No newline at end of file
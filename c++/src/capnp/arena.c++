@@ -62,6 +62,19 @@ void SegmentBuilder::throwNotWritable() {
       "referenced data, only Readers, because that data is const.");
 }
 
+void SegmentBuilder::zeroThrough(word* end) {
+  // Zero ahead of the allocation in chunks, so that a message made of many small objects doesn't
+  // end up calling memset() for each one.
+  static constexpr size_t LAZY_ZERO_CHUNK_WORDS = 128;
+
+  word* segmentEnd = const_cast<word*>(ptr.end());
+  word* newEnd = zeroedEnd + LAZY_ZERO_CHUNK_WORDS <= segmentEnd
+      ? kj::max(end, zeroedEnd + LAZY_ZERO_CHUNK_WORDS) : segmentEnd;
+  KJ_DASSERT(end <= newEnd);
+  memset(zeroedEnd, 0, (newEnd - zeroedEnd) * sizeof(word));
+  zeroedEnd = newEnd;
+}
+
 // =======================================================================================
 
 static SegmentWordCount verifySegmentSize(size_t size) {
@@ -232,7 +245,8 @@ BuilderArena::AllocateResult BuilderArena::allocate(SegmentWordCount amount) {
     // Re-allocate segment0 in-place.  This is a bit of a hack, but we have not returned any
     // pointers to this segment yet, so it should be fine.
     kj::dtor(segment0);
-    kj::ctor(segment0, this, SegmentId(0), ptr.begin(), actualSize, &this->dummyLimiter);
+    kj::ctor(segment0, this, SegmentId(0), ptr.begin(), actualSize, &this->dummyLimiter,
+             ZERO * WORDS, message->getSegmentZeroing());
 
     segmentWithSpace = &segment0;
     return AllocateResult { &segment0, segment0.allocate(amount) };
@@ -252,7 +266,8 @@ BuilderArena::AllocateResult BuilderArena::allocate(SegmentWordCount amount) {
     }
 
     // Need to allocate a new segment.
-    SegmentBuilder* result = addSegmentInternal(message->allocateSegment(unbound(amount / WORDS)));
+    SegmentBuilder* result = addSegmentInternal(message->allocateSegment(unbound(amount / WORDS)),
+                                                ZERO * WORDS, message->getSegmentZeroing());
 
     // Check this new segment first the next time we need to allocate.
     segmentWithSpace = result;
@@ -266,8 +281,8 @@ SegmentBuilder* BuilderArena::addExternalSegment(kj::ArrayPtr<const word> conten
   return addSegmentInternal(content);
 }
 
-template <typename T>
-SegmentBuilder* BuilderArena::addSegmentInternal(kj::ArrayPtr<T> content) {
+template <typename T, typename... Params>
+SegmentBuilder* BuilderArena::addSegmentInternal(kj::ArrayPtr<T> content, Params&&... params) {
   // This check should never fail in practice, since you can't get an Orphanage without allocating
   // the root segment.
   KJ_REQUIRE(segment0.getArena() != nullptr,
@@ -286,7 +301,7 @@ SegmentBuilder* BuilderArena::addSegmentInternal(kj::ArrayPtr<T> content) {
 
   kj::Own<SegmentBuilder> newBuilder = kj::heap<SegmentBuilder>(
       this, SegmentId(segmentState->builders.size() + 1),
-      content.begin(), contentSize, &this->dummyLimiter);
+      content.begin(), contentSize, &this->dummyLimiter, kj::fwd<Params>(params)...);
   SegmentBuilder* result = newBuilder.get();
   segmentState->builders.add(kj::mv(newBuilder));
 
@@ -89,6 +89,9 @@ public:
   // Adds back some words to the limit.  Useful when the caller knows they are double-reading
   // some data.
 
+  inline uint64_t getRemainingWords() const { return readLimit(); }
+  // Returns the number of words which may still be read before the limit is reached.
+
 private:
   alignas(8) volatile uint64_t limit;
   // Current limit, decremented each time catRead() is called. We modify this variable using atomics
@@ -168,6 +171,8 @@ public:
   inline void unread(WordCount64 amount);
   // Add back some words to the ReadLimiter.
 
+  inline ReadLimiter* getReadLimiter() { return readLimiter; }
+
 private:
   Arena* arena;
   SegmentId id;
@@ -185,7 +190,10 @@ private:
 class SegmentBuilder: public SegmentReader {
 public:
   inline SegmentBuilder(BuilderArena* arena, SegmentId id, word* ptr, SegmentWordCount size,
-                        ReadLimiter* readLimiter, SegmentWordCount wordsUsed = ZERO * WORDS);
+                        ReadLimiter* readLimiter, SegmentWordCount wordsUsed = ZERO * WORDS,
+                        SegmentZeroing zeroing = SegmentZeroing::EAGER);
+  // With `SegmentZeroing::LAZY`, the space after the first `wordsUsed` words may be uninitialized;
+  // it will be zero'd in chunks as allocate() reaches it.
   inline SegmentBuilder(BuilderArena* arena, SegmentId id, const word* ptr, SegmentWordCount size,
                         ReadLimiter* readLimiter);
   inline SegmentBuilder(BuilderArena* arena, SegmentId id, decltype(nullptr),
@@ -222,10 +230,17 @@ private:
   // Pointer to a pointer to the current end point of the segment, i.e. the location where the
   // next object should be allocated.
 
+  word* zeroedEnd;
+  // Everything between `pos` and `zeroedEnd` is known to be zero.  For segments which were
+  // zero'd up-front this is the end of the segment, so allocate() never has to zero anything.
+
   bool readOnly;
 
   [[noreturn]] void throwNotWritable();
 
+  void zeroThrough(word* end);
+  // Zero the memory from `zeroedEnd` to at least `end` and advance `zeroedEnd`.
+
   KJ_DISALLOW_COPY_AND_MOVE(SegmentBuilder);
 };
 
@@ -375,8 +390,9 @@ private:
   // segment.  This is not necessarily the last segment because addExternalSegment() may add a
   // segment that is already-full, in which case we don't update this pointer.
 
-  template <typename T>  // Can be `word` or `const word`.
-  SegmentBuilder* addSegmentInternal(kj::ArrayPtr<T> content);
+  template <typename T, typename... Params>  // Can be `word` or `const word`.
+  SegmentBuilder* addSegmentInternal(kj::ArrayPtr<T> content, Params&&... params);
+  // `params` are passed on to the SegmentBuilder constructor after the read limiter.
 };
 
 // =======================================================================================
@@ -452,20 +468,22 @@ inline void SegmentReader::unread(WordCount64 amount) { readLimiter->unread(amou
 
 inline SegmentBuilder::SegmentBuilder(
     BuilderArena* arena, SegmentId id, word* ptr, SegmentWordCount size,
-    ReadLimiter* readLimiter, SegmentWordCount wordsUsed)
+    ReadLimiter* readLimiter, SegmentWordCount wordsUsed, SegmentZeroing zeroing)
     : SegmentReader(arena, id, ptr, size, readLimiter),
-      pos(ptr + wordsUsed), readOnly(false) {}
+      pos(ptr + wordsUsed),
+      zeroedEnd(zeroing == SegmentZeroing::LAZY ? pos : ptr + size),
+      readOnly(false) {}
 inline SegmentBuilder::SegmentBuilder(
     BuilderArena* arena, SegmentId id, const word* ptr, SegmentWordCount size,
     ReadLimiter* readLimiter)
     : SegmentReader(arena, id, ptr, size, readLimiter),
       // const_cast is safe here because the member won't ever be dereferenced because it appears
       // to point to the end of the segment anyway.
-      pos(const_cast<word*>(ptr + size)), readOnly(true) {}
+      pos(const_cast<word*>(ptr + size)), zeroedEnd(pos), readOnly(true) {}
 inline SegmentBuilder::SegmentBuilder(BuilderArena* arena, SegmentId id, decltype(nullptr),
                                       ReadLimiter* readLimiter)
     : SegmentReader(arena, id, nullptr, ZERO * WORDS, readLimiter),
-      pos(nullptr), readOnly(false) {}
+      pos(nullptr), zeroedEnd(nullptr), readOnly(false) {}
 
 inline word* SegmentBuilder::allocate(SegmentWordCount amount) {
   if (intervalLength(pos, ptr.end(), MAX_SEGMENT_WORDS) < amount) {
@@ -475,6 +493,7 @@ inline word* SegmentBuilder::allocate(SegmentWordCount amount) {
     // Success.
     word* result = pos;
     pos = pos + amount;
+    if (KJ_UNLIKELY(pos > zeroedEnd)) zeroThrough(pos);
     return result;
   }
 }
@@ -511,6 +530,7 @@ inline bool SegmentBuilder::tryExtend(word* from, word* to) {
   // Careful about overflow.
   if (pos == from && to <= ptr.end() && to >= from) {
     pos = to;
+    if (KJ_UNLIKELY(pos > zeroedEnd)) zeroThrough(pos);
     return true;
   } else {
     return false;
@@ -0,0 +1,865 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// capnp-benchmarks: a suite of micro- and macro-benchmarks covering message building, reading,
+// serialization (packed and unpacked), canonicalization, cloning, and local RPC.
+//
+// Each benchmark runs a single operation in a loop and reports nanoseconds per op, throughput
+// when the op has a natural byte size, and -- when built with KJ_BENCHMARK_MALLOC -- the number
+// of heap allocations per op. Use `--json` to get machine-readable output suitable for tracking
+// over time.
+
+#include <capnp/benchmark/benchmark.capnp.h>
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <capnp/serialize-packed.h>
+#include <capnp/rpc-twoparty.h>
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/function.h>
+#include <kj/io.h>
+#include <kj/main.h>
+#include <kj/thread.h>
+#include <kj/time.h>
+#include <kj/timer.h>
+#include <kj/vector.h>
+#include <atomic>
+#include <math.h>
+#if KJ_BENCHMARK_MALLOC
+#include <dlfcn.h>
+#endif
+
+namespace capnp {
+namespace benchmark {
+namespace {
+
+// =======================================================================================
+// Metrics-gathering
+
+static std::atomic<size_t> globalMallocCount(0);
+static std::atomic<size_t> globalMallocBytes(0);
+// Atomic because some benchmarks allocate from several threads at once.
+
+#if KJ_BENCHMARK_MALLOC
+// If KJ_BENCHMARK_MALLOC is defined then we override malloc() and calloc() in order to measure
+// total allocations. (MallocMessageBuilder uses calloc(), so counting malloc() alone would miss
+// most segment allocations.) The build must only define this when it won't break linking, e.g.
+// when not statically linking a malloc implementation.
+
+}  // namespace
+}  // namespace benchmark
+}  // namespace capnp
+
+extern "C" {
+
+void* malloc(size_t size) {
+  typedef void* Malloc(size_t);
+  static Malloc* realMalloc = reinterpret_cast<Malloc*>(dlsym(RTLD_NEXT, "malloc"));
+
+  capnp::benchmark::globalMallocCount.fetch_add(1, std::memory_order_relaxed);
+  capnp::benchmark::globalMallocBytes.fetch_add(size, std::memory_order_relaxed);
+  return realMalloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  typedef void* Calloc(size_t, size_t);
+  static bool resolving = false;
+  static Calloc* realCalloc = nullptr;
+
+  if (realCalloc == nullptr) {
+    if (resolving) {
+      // Some libc implementations call calloc() from within dlsym(). They tolerate failure, so
+      // just report it rather than recursing forever.
+      return nullptr;
+    }
+    resolving = true;
+    realCalloc = reinterpret_cast<Calloc*>(dlsym(RTLD_NEXT, "calloc"));
+    resolving = false;
+  }
+
+  capnp::benchmark::globalMallocCount.fetch_add(1, std::memory_order_relaxed);
+  capnp::benchmark::globalMallocBytes.fetch_add(count * size, std::memory_order_relaxed);
+  return realCalloc(count, size);
+}
+
+}  // extern "C"
+
+namespace capnp {
+namespace benchmark {
+namespace {
+
+#endif  // KJ_BENCHMARK_MALLOC
+
+struct Result {
+  kj::StringPtr name;
+  uint64_t iterations;
+  uint64_t nanos;
+  uint64_t bytes;
+  // Total bytes processed across all iterations, or zero if the benchmark has no natural size.
+
+  size_t mallocCount;
+  size_t mallocBytes;
+};
+
+// =======================================================================================
+// Test data generation
+//
+// We use a fixed-seed xorshift generator so that every run (and every build) sees the same data.
+
+class FastRand {
+public:
+  uint32_t next() {
+    uint32_t t = x ^ (x << 11);
+    x = y; y = z; z = w;
+    return w = w ^ (w >> 19) ^ t ^ (t >> 8);
+  }
+
+  uint32_t next(uint32_t range) { return next() % range; }
+  double nextDouble(double range) { return next() * range / 4294967296.0; }
+
+private:
+  uint32_t x = 0x1d2acd47;
+  uint32_t y = 0x58ca3e14;
+  uint32_t z = 0xf563f232;
+  uint32_t w = 0x0bc76199;
+};
+
+static const char* const MAKES[] = { "Toyota", "GM", "Ford", "Honda", "Tesla" };
+static const char* const MODELS[] = { "Camry", "Prius", "Volt", "Accord", "Leaf", "Model S" };
+static const char* const WORDS[] = {
+  "foo ", "bar ", "baz ", "qux ", "quux ", "corge ", "grault ", "garply ", "waldo ", "fred ",
+  "plugh ", "xyzzy ", "thud "
+};
+
+template <typename T, size_t n>
+constexpr size_t arraySize(T (&)[n]) { return n; }
+
+void randomCar(FastRand& rng, Car::Builder car) {
+  car.setMake(MAKES[rng.next(arraySize(MAKES))]);
+  car.setModel(MODELS[rng.next(arraySize(MODELS))]);
+
+  car.setColor(static_cast<Color>(rng.next(static_cast<uint>(Color::SILVER) + 1)));
+  car.setSeats(2 + rng.next(6));
+  car.setDoors(2 + rng.next(3));
+
+  for (auto wheel: car.initWheels(4)) {
+    wheel.setDiameter(25 + rng.next(15));
+    wheel.setAirPressure(30 + rng.nextDouble(20));
+    wheel.setSnowTires(rng.next(16) == 0);
+  }
+
+  car.setLength(170 + rng.next(150));
+  car.setWidth(48 + rng.next(36));
+  car.setHeight(54 + rng.next(48));
+  car.setWeight(car.getLength() * car.getWidth() * car.getHeight() / 200);
+
+  auto engine = car.initEngine();
+  engine.setHorsepower(100 * rng.next(400));
+  engine.setCylinders(4 + 2 * rng.next(3));
+  engine.setCc(800 + rng.next(10000));
+  engine.setUsesGas(true);
+  engine.setUsesElectric(rng.next(2));
+
+  car.setFuelCapacity(10.0 + rng.nextDouble(30.0));
+  car.setFuelLevel(rng.nextDouble(car.getFuelCapacity()));
+  car.setHasPowerWindows(rng.next(2));
+  car.setHasPowerSteering(rng.next(2));
+  car.setHasCruiseControl(rng.next(2));
+  car.setCupHolders(rng.next(12));
+  car.setHasNavSystem(rng.next(2));
+}
+
+uint64_t carValue(Car::Reader car) {
+  // Do not think too hard about realism.
+
+  uint64_t result = 0;
+
+  result += car.getSeats() * 200;
+  result += car.getDoors() * 350;
+  for (auto wheel: car.getWheels()) {
+    result += wheel.getDiameter() * wheel.getDiameter();
+    result += wheel.getSnowTires() ? 100 : 0;
+  }
+
+  result += car.getLength() * car.getWidth() * car.getHeight() / 50;
+
+  auto engine = car.getEngine();
+  result += engine.getHorsepower() * 40;
+  if (engine.getUsesElectric()) {
+    if (engine.getUsesGas()) {
+      // hybrid
+      result += 5000;
+    } else {
+      result += 3000;
+    }
+  }
+
+  result += car.getHasPowerWindows() ? 100 : 0;
+  result += car.getHasPowerSteering() ? 200 : 0;
+  result += car.getHasCruiseControl() ? 400 : 0;
+  result += car.getHasNavSystem() ? 2000 : 0;
+
+  result += car.getCupHolders() * 25;
+
+  return result;
+}
+
+void randomParkingLot(FastRand& rng, ParkingLot::Builder lot, uint carCount) {
+  for (auto car: lot.initCars(carCount)) {
+    randomCar(rng, car);
+  }
+}
+
+uint64_t parkingLotValue(ParkingLot::Reader lot) {
+  uint64_t result = 0;
+  for (auto car: lot.getCars()) {
+    result += carValue(car);
+  }
+  return result;
+}
+
+void randomSearchResults(FastRand& rng, SearchResultList::Builder list, uint count) {
+  auto results = list.initResults(count);
+  for (auto result: results) {
+    result.setScore(1000 - rng.next(1000));
+    result.setUrl(kj::str("http://example.com/", rng.next(1000000)));
+
+    kj::Vector<char> snippet;
+    uint wordCount = rng.next(20);
+    for (uint i = 0; i < wordCount; i++) {
+      snippet.addAll(kj::StringPtr(WORDS[rng.next(arraySize(WORDS))]));
+      if (rng.next(8) == 0) snippet.addAll(kj::StringPtr(" cat "));
+      if (rng.next(8) == 0) snippet.addAll(kj::StringPtr(" dog "));
+    }
+    snippet.add('\0');
+    result.setSnippet(kj::StringPtr(snippet.begin(), snippet.size() - 1));
+  }
+}
+
+double rankSearchResults(SearchResultList::Reader list) {
+  // Re-score each result by the presence of "cat" (good) and "dog" (bad) in the snippet.
+  double total = 0;
+  for (auto result: list.getResults()) {
+    double score = result.getScore();
+    kj::StringPtr snippet = result.getSnippet();
+    if (strstr(snippet.cStr(), " cat ") != nullptr) score *= 10000;
+    if (strstr(snippet.cStr(), " dog ") != nullptr) score /= 10000;
+    total += score;
+  }
+  return total;
+}
+
+void randomExpression(FastRand& rng, Expression::Builder exp, uint depth) {
+  exp.setOp(static_cast<Operation>(rng.next(static_cast<uint>(Operation::MODULUS) + 1)));
+
+  if (rng.next(8) < depth) {
+    exp.getLeft().setValue(rng.next(128) + 1);
+  } else {
+    randomExpression(rng, exp.getLeft().initExpression(), depth + 1);
+  }
+
+  if (rng.next(8) < depth) {
+    exp.getRight().setValue(rng.next(128) + 1);
+  } else {
+    randomExpression(rng, exp.getRight().initExpression(), depth + 1);
+  }
+}
+
+int32_t evaluateExpression(Expression::Reader exp) {
+  int32_t left = 0, right = 0;
+
+  switch (exp.getLeft().which()) {
+    case Expression::Left::VALUE:
+      left = exp.getLeft().getValue();
+      break;
+    case Expression::Left::EXPRESSION:
+      left = evaluateExpression(exp.getLeft().getExpression());
+      break;
+  }
+
+  switch (exp.getRight().which()) {
+    case Expression::Right::VALUE:
+      right = exp.getRight().getValue();
+      break;
+    case Expression::Right::EXPRESSION:
+      right = evaluateExpression(exp.getRight().getExpression());
+      break;
+  }
+
+  // Use unsigned arithmetic so that overflow is well-defined.
+  switch (exp.getOp()) {
+    case Operation::ADD: return uint32_t(left) + uint32_t(right);
+    case Operation::SUBTRACT: return uint32_t(left) - uint32_t(right);
+    case Operation::MULTIPLY: return uint32_t(left) * uint32_t(right);
+    case Operation::DIVIDE: return right == 0 ? 0 : left / right;
+    case Operation::MODULUS: return right == 0 ? 0 : left % right;
+  }
+
+  KJ_UNREACHABLE;
+}
+
+// =======================================================================================
+
+class EchoImpl final: public Echo::Server {
+protected:
+  kj::Promise<void> echo(EchoContext context) override {
+    context.getResults().setValue(context.getParams().getValue());
+    return kj::READY_NOW;
+  }
+};
+
+class EchoFactoryImpl final: public EchoFactory::Server {
+protected:
+  kj::Promise<void> newEchoes(NewEchoesContext context) override {
+    auto count = context.getParams().getCount();
+    auto echoes = context.getResults().initEchoes(count);
+    for (auto i: kj::zeroTo(count)) {
+      echoes.set(i, kj::heap<EchoImpl>());
+    }
+    return kj::READY_NOW;
+  }
+};
+
+// =======================================================================================
+
+class BenchmarkMain {
+public:
+  BenchmarkMain(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Cap'n Proto benchmarks",
+          "Runs the Cap'n Proto benchmark suite. If any <filter>s are given, only benchmarks "
+          "whose names contain one of them are run.")
+        .addOptionWithArg({'i', "iterations"}, KJ_BIND_METHOD(*this, setIterations), "<scale>",
+            "Multiply each benchmark's default iteration count by <scale> (default: 1). "
+            "Fractional values are allowed.")
+        .addOption({"json"}, KJ_BIND_METHOD(*this, setJson),
+            "Write results to stdout as JSON instead of a human-readable table.")
+        .expectZeroOrMoreArgs("<filter>", KJ_BIND_METHOD(*this, addFilter))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  double scale = 1;
+  bool json = false;
+  kj::Vector<kj::String> filters;
+  kj::Vector<Result> results;
+
+  kj::MainBuilder::Validity setIterations(kj::StringPtr arg) {
+    KJ_IF_MAYBE(value, arg.tryParseAs<double>()) {
+      if (*value > 0) {
+        scale = *value;
+        return true;
+      }
+    }
+    return "must be a positive number";
+  }
+
+  kj::MainBuilder::Validity setJson() {
+    json = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity addFilter(kj::StringPtr arg) {
+    filters.add(kj::heapString(arg));
+    return true;
+  }
+
+  bool isEnabled(kj::StringPtr name) {
+    if (filters.empty()) return true;
+    for (auto& filter: filters) {
+      if (strstr(name.cStr(), filter.cStr()) != nullptr) return true;
+    }
+    return false;
+  }
+
+  bool isGroupEnabled(kj::StringPtr prefix) {
+    // Whether any benchmark whose name starts with `prefix` might be enabled, so that a group's
+    // setup can be skipped if not. A filter may match the prefix itself or name something within
+    // the group.
+
+    if (isEnabled(prefix)) return true;
+    for (auto& filter: filters) {
+      if (filter.startsWith(prefix)) return true;
+    }
+    return false;
+  }
+
+  void bench(kj::StringPtr name, uint64_t defaultIterations, kj::Function<size_t()> op) {
+    // Runs `op` repeatedly. `op` returns the number of bytes it processed, or zero.
+
+    if (!isEnabled(name)) return;
+
+    uint64_t iterations = kj::max<uint64_t>(1, uint64_t(defaultIterations * scale));
+
+    // Warm up caches, lazy initialization, freelists, etc.
+    for (uint64_t i = 0, n = kj::max<uint64_t>(1, iterations / 10); i < n; i++) {
+      op();
+    }
+
+    auto& clock = kj::systemPreciseMonotonicClock();
+    size_t startMallocCount = globalMallocCount.load(std::memory_order_relaxed);
+    size_t startMallocBytes = globalMallocBytes.load(std::memory_order_relaxed);
+    uint64_t bytes = 0;
+    auto start = clock.now();
+    for (uint64_t i = 0; i < iterations; i++) {
+      bytes += op();
+    }
+    auto end = clock.now();
+
+    results.add(Result {
+      name, iterations, static_cast<uint64_t>((end - start) / kj::NANOSECONDS), bytes,
+      globalMallocCount.load(std::memory_order_relaxed) - startMallocCount,
+      globalMallocBytes.load(std::memory_order_relaxed) - startMallocBytes
+    });
+
+    if (!json) {
+      context.warning(formatHuman(results.back()));
+    }
+  }
+
+  static kj::String formatHuman(const Result& result) {
+    double nsPerOp = double(result.nanos) / result.iterations;
+    kj::String throughput;
+    if (result.bytes > 0 && result.nanos > 0) {
+      throughput = kj::str("  ", result.bytes * 1000.0 / result.nanos, " MB/s");
+    }
+    kj::String mallocs;
+#if KJ_BENCHMARK_MALLOC
+    mallocs = kj::str("  ", double(result.mallocCount) / result.iterations, " mallocs/op");
+#endif
+    return kj::str(result.name, ": ", nsPerOp, " ns/op", throughput, mallocs);
+  }
+
+  static kj::String formatJson(const Result& result) {
+    double nsPerOp = double(result.nanos) / result.iterations;
+    double opsPerSec = result.nanos == 0 ? 0 : result.iterations * 1e9 / result.nanos;
+    double bytesPerSec = result.nanos == 0 ? 0 : result.bytes * 1e9 / result.nanos;
+#if KJ_BENCHMARK_MALLOC
+    auto mallocs = kj::str(
+        ", \"mallocsPerOp\": ", double(result.mallocCount) / result.iterations,
+        ", \"mallocBytesPerOp\": ", double(result.mallocBytes) / result.iterations);
+#else
+    auto mallocs = kj::str(", \"mallocsPerOp\": null, \"mallocBytesPerOp\": null");
+#endif
+    return kj::str(
+        "{\"name\": \"", result.name, "\", \"iterations\": ", result.iterations,
+        ", \"totalNanos\": ", result.nanos, ", \"nsPerOp\": ", nsPerOp,
+        ", \"opsPerSec\": ", opsPerSec, ", \"bytesPerOp\": ", result.bytes / result.iterations,
+        ", \"bytesPerSec\": ", bytesPerSec, mallocs, "}");
+  }
+
+  // -------------------------------------------------------------------
+
+  void runBuildAndRead() {
+    // Each op builds a fresh message from the same random seed, or reads a prebuilt one.
+
+    bench("carsales/build", 5000, [&]() -> size_t {
+      FastRand rng;
+      MallocMessageBuilder message;
+      randomParkingLot(rng, message.initRoot<ParkingLot>(), 100);
+      return 0;
+    });
+
+    {
+      auto pool = kj::refcounted<MessageBuilderPool>();
+      bench("carsales/build-pooled", 5000, [&]() -> size_t {
+        FastRand rng;
+        PooledMessageBuilder message(kj::addRef(*pool));
+        randomParkingLot(rng, message.initRoot<ParkingLot>(), 100);
+        return 0;
+      });
+    }
+
+    // Small messages in an over-provisioned first segment, zeroed up-front vs. on demand.
+    bench("carsales/build-64k-eager", 2000, [&]() -> size_t {
+      FastRand rng;
+      MallocMessageBuilder message(1u << 16);
+      randomParkingLot(rng, message.initRoot<ParkingLot>(), 10);
+      return 0;
+    });
+    bench("carsales/build-64k-lazy", 2000, [&]() -> size_t {
+      FastRand rng;
+      MallocMessageBuilder message(1u << 16, SUGGESTED_ALLOCATION_STRATEGY, SegmentZeroing::LAZY);
+      randomParkingLot(rng, message.initRoot<ParkingLot>(), 10);
+      return 0;
+    });
+
+    {
+      FastRand rng;
+      MallocMessageBuilder message;
+      randomParkingLot(rng, message.initRoot<ParkingLot>(), 100);
+      auto reader = message.getRoot<ParkingLot>().asReader();
+      bench("carsales/read", 20000, [&]() -> size_t {
+        KJ_ASSERT(parkingLotValue(reader) != 0);
+        return 0;
+      });
+    }
+
+    bench("catrank/build", 5000, [&]() -> size_t {
+      FastRand rng;
+      MallocMessageBuilder message;
+      randomSearchResults(rng, message.initRoot<SearchResultList>(), 200);
+      return 0;
+    });
+
+    {
+      FastRand rng;
+      MallocMessageBuilder message;
+      randomSearchResults(rng, message.initRoot<SearchResultList>(), 200);
+      auto reader = message.getRoot<SearchResultList>().asReader();
+      bench("catrank/read", 20000, [&]() -> size_t {
+        KJ_ASSERT(rankSearchResults(reader) != 0);
+        return 0;
+      });
+    }
+
+    bench("eval/build", 50000, [&]() -> size_t {
+      FastRand rng;
+      MallocMessageBuilder message;
+      randomExpression(rng, message.initRoot<Expression>(), 0);
+      return 0;
+    });
+
+    {
+      FastRand rng;
+      MallocMessageBuilder message;
+      randomExpression(rng, message.initRoot<Expression>(), 0);
+      auto reader = message.getRoot<Expression>().asReader();
+      volatile int32_t sink = 0;
+      bench("eval/read", 500000, [&]() -> size_t {
+        sink = evaluateExpression(reader);
+        return 0;
+      });
+    }
+  }
+
+  void runSerialization() {
+    // Serialization benchmarks all operate on the same carsales message, which has a typical mix
+    // of zeros and non-zeros for packing.
+
+    FastRand rng;
+    MallocMessageBuilder message;
+    randomParkingLot(rng, message.initRoot<ParkingLot>(), 100);
+    auto segments = message.getSegmentsForOutput();
+
+    auto flat = messageToFlatArray(segments);
+    auto flatBytes = flat.asBytes();
+
+    kj::VectorOutputStream packedOut;
+    writePackedMessage(packedOut, segments);
+    auto packed = kj::heapArray<byte>(packedOut.getArray());
+
+    auto scratch = kj::heapArray<byte>(flatBytes.size());
+
+    bench("serialize/unpacked-encode", 50000, [&]() -> size_t {
+      kj::ArrayOutputStream output(scratch);
+      writeMessage(output, segments);
+      return output.getArray().size();
+    });
+
+    bench("serialize/unpacked-decode", 50000, [&]() -> size_t {
+      kj::ArrayInputStream input(flatBytes);
+      InputStreamMessageReader reader(input);
+      reader.getRoot<ParkingLot>();
+      return flatBytes.size();
+    });
+
+    bench("serialize/packed-encode", 20000, [&]() -> size_t {
+      kj::ArrayOutputStream output(scratch);
+      writePackedMessage(output, segments);
+      return flatBytes.size();
+    });
+
+    bench("serialize/packed-decode", 20000, [&]() -> size_t {
+      kj::ArrayInputStream input(packed);
+      PackedMessageReader reader(input);
+      reader.getRoot<ParkingLot>();
+      return flatBytes.size();
+    });
+
+    bench("serialize/messageToFlatArray", 50000, [&]() -> size_t {
+      return messageToFlatArray(segments).asBytes().size();
+    });
+
+    bench("serialize/flat-array-reader", 200000, [&]() -> size_t {
+      FlatArrayMessageReader reader(flat);
+      reader.getRoot<ParkingLot>();
+      return 0;
+    });
+
+    auto root = message.getRoot<ParkingLot>().asReader();
+
+    bench("message/canonicalize", 5000, [&]() -> size_t {
+      return canonicalize(root).asBytes().size();
+    });
+
+    bench("message/clone", 5000, [&]() -> size_t {
+      clone(root);
+      return 0;
+    });
+  }
+
+  void runRpc() {
+    if (!isGroupEnabled("rpc/")) return;
+
+    auto io = kj::setupAsyncIo();
+    auto pipe = io.provider->newTwoWayPipe();
+
+    TwoPartyServer server(kj::heap<EchoImpl>());
+    server.accept(kj::mv(pipe.ends[0]));
+    TwoPartyClient client(*pipe.ends[1]);
+    auto echo = client.bootstrap().castAs<Echo>();
+
+    uint64_t counter = 0;
+    bench("rpc/two-party-round-trip", 20000, [&]() -> size_t {
+      auto request = echo.echoRequest();
+      request.setValue(++counter);
+      auto response = request.send().wait(io.waitScope);
+      KJ_ASSERT(response.getValue() == counter);
+      return 0;
+    });
+
+    bench("rpc/two-party-batch-100", 2000, [&]() -> size_t {
+      auto batch = echo.batch(&Echo::Client::echoRequest);
+      for (auto i: kj::zeroTo(100)) {
+        batch.add().setValue(i);
+      }
+      KJ_ASSERT(batch.send().wait(io.waitScope).size() == 100);
+      return 0;
+    });
+
+    // The same 100 calls to a local object, sent individually and as a batch.
+    Echo::Client local = kj::heap<EchoImpl>();
+    bench("rpc/local/individual-100", 5000, [&]() -> size_t {
+      auto promises = kj::heapArrayBuilder<kj::Promise<void>>(100);
+      for (auto i: kj::zeroTo(100)) {
+        auto request = local.echoRequest();
+        request.setValue(i);
+        promises.add(request.send().ignoreResult());
+      }
+      kj::joinPromises(promises.finish()).wait(io.waitScope);
+      return 0;
+    });
+
+    bench("rpc/local/batch-100", 5000, [&]() -> size_t {
+      auto batch = local.batch(&Echo::Client::echoRequest);
+      for (auto i: kj::zeroTo(100)) {
+        batch.add().setValue(i);
+      }
+      KJ_ASSERT(batch.send().wait(io.waitScope).size() == 100);
+      return 0;
+    });
+
+    runRpcCallArena(io);
+    runRpcManyCaps(io);
+  }
+
+  void runRpcCallArena(kj::AsyncIoContext& io) {
+    // Same as rpc/two-party-round-trip, but the server gives each call an arena.
+
+    if (!isEnabled("rpc/two-party-round-trip-arena")) return;
+
+    auto pipe = io.provider->newTwoWayPipe();
+    TwoPartyServer server(kj::heap<EchoImpl>());
+    server.setCallArenaSize(4096);
+    server.accept(kj::mv(pipe.ends[0]));
+    TwoPartyClient client(*pipe.ends[1]);
+    auto echo = client.bootstrap().castAs<Echo>();
+
+    uint64_t counter = 0;
+    bench("rpc/two-party-round-trip-arena", 20000, [&]() -> size_t {
+      auto request = echo.echoRequest();
+      request.setValue(++counter);
+      auto response = request.send().wait(io.waitScope);
+      KJ_ASSERT(response.getValue() == counter);
+      return 0;
+    });
+  }
+
+  void runRpcManyCaps(kj::AsyncIoContext& io) {
+    // Export/import table performance on a connection which already has a large number of live
+    // capabilities: 1M at the default scale (but at least 10k, so that the tables are still
+    // big when smoke-testing).
+
+    if (!isGroupEnabled("rpc/many-caps/")) return;
+
+    auto pipe = io.provider->newTwoWayPipe();
+    TwoPartyServer server(kj::heap<EchoFactoryImpl>());
+    server.accept(kj::mv(pipe.ends[0]));
+    TwoPartyClient client(*pipe.ends[1]);
+    auto factory = client.bootstrap().castAs<EchoFactory>();
+
+    constexpr uint BATCH_SIZE = 1000;
+    auto liveCount = kj::max<uint>(10000, uint(1000000 * scale)) / BATCH_SIZE * BATCH_SIZE;
+    kj::Vector<Echo::Client> live(liveCount);
+    while (live.size() < liveCount) {
+      auto request = factory.newEchoesRequest();
+      request.setCount(BATCH_SIZE);
+      auto response = request.send().wait(io.waitScope);
+      for (auto echo: response.getEchoes()) {
+        live.add(echo);
+      }
+    }
+
+    // Each op exports and imports 100 new capabilities on top of the live ones, then releases
+    // them again.
+    bench("rpc/many-caps/export-import-release-100", 2000, [&]() -> size_t {
+      auto request = factory.newEchoesRequest();
+      request.setCount(100);
+      {
+        auto response = request.send().wait(io.waitScope);
+        KJ_ASSERT(response.getEchoes().size() == 100);
+      }
+
+      // Make sure the server has processed the `Release` messages before the next op.
+      auto echo = live[0].echoRequest();
+      echo.send().wait(io.waitScope);
+      return 0;
+    });
+
+    FastRand rng;
+    bench("rpc/many-caps/call-random", 20000, [&]() -> size_t {
+      auto request = live[rng.next(live.size())].echoRequest();
+      request.setValue(123);
+      KJ_ASSERT(request.send().wait(io.waitScope).getValue() == 123);
+      return 0;
+    });
+  }
+
+  void runTimers() {
+    // kj::TimerImpl with its default ordered set vs. its timing wheel, with 1M timers pending at
+    // the default scale (but at least 10k when smoke-testing).
+
+    runTimers({}, "timer/set/", "timer/set/arm-cancel-100", "timer/set/arm-fire-100");
+
+    kj::TimerImpl::Options wheel;
+    wheel.useTimerWheel = true;
+    runTimers(wheel, "timer/wheel/", "timer/wheel/arm-cancel-100", "timer/wheel/arm-fire-100");
+  }
+
+  void runTimers(kj::TimerImpl::Options options, kj::StringPtr prefix,
+                 kj::StringPtr armCancelName, kj::StringPtr armFireName) {
+    if (!isGroupEnabled(prefix)) return;
+
+    kj::EventLoop loop;
+    kj::WaitScope waitScope(loop);
+
+    auto now = kj::origin<kj::TimePoint>();
+    kj::TimerImpl timer(now, options);
+    FastRand rng;
+
+    // Background timers, due between one hour and one day from now, none of which fire.
+    auto liveCount = kj::max<uint>(10000, uint(1000000 * scale));
+    kj::Vector<kj::Promise<void>> live(liveCount);
+    for (auto i KJ_UNUSED: kj::zeroTo(liveCount)) {
+      live.add(timer.afterDelay(3600 * kj::SECONDS + rng.next(23 * 3600) * kj::SECONDS));
+    }
+
+    // Each op arms 100 request-style timeouts and cancels them all.
+    bench(armCancelName, 2000, [&]() -> size_t {
+      auto promises = kj::heapArrayBuilder<kj::Promise<void>>(100);
+      for (auto i KJ_UNUSED: kj::zeroTo(100)) {
+        promises.add(timer.afterDelay(rng.next(30000) * kj::MILLISECONDS));
+      }
+      return 0;
+    });
+
+    // Each op arms 100 timers due within the next 10ms, then advances 10ms and fires them.
+    bench(armFireName, 2000, [&]() -> size_t {
+      uint fired = 0;
+      auto promises = kj::heapArrayBuilder<kj::Promise<void>>(100);
+      for (auto i KJ_UNUSED: kj::zeroTo(100)) {
+        promises.add(timer.afterDelay(rng.next(10000) * kj::MICROSECONDS)
+            .then([&]() { ++fired; }));
+      }
+      now += 10 * kj::MILLISECONDS;
+      timer.advanceTo(now);
+      kj::joinPromises(promises.finish()).wait(waitScope);
+      KJ_ASSERT(fired == 100);
+      return 0;
+    });
+  }
+
+  void runFiberPool() {
+    // kj::FiberPool with only its shared freelist vs. with thread-local freelists in front of it,
+    // from one thread and from four threads at once.
+
+    runFiberPool(false, "fiber-pool/shared/", "fiber-pool/shared/run",
+                 "fiber-pool/shared/run-4-threads-1000");
+    runFiberPool(true, "fiber-pool/thread-local/", "fiber-pool/thread-local/run",
+                 "fiber-pool/thread-local/run-4-threads-1000");
+  }
+
+  void runFiberPool(bool threadLocal, kj::StringPtr prefix,
+                    kj::StringPtr runName, kj::StringPtr threadsName) {
+    if (!isGroupEnabled(prefix)) return;
+
+    kj::FiberPool pool(65536);
+    if (threadLocal) pool.useThreadLocalFreelists();
+    pool.prefault(4);
+
+    bench(runName, 200000, [&]() -> size_t {
+      pool.runSynchronously([]() {});
+      return 0;
+    });
+
+    // Each op starts four threads which each run 250 fibers.
+    bench(threadsName, 200, [&]() -> size_t {
+      kj::Vector<kj::Own<kj::Thread>> threads;
+      for (auto i KJ_UNUSED: kj::zeroTo(4)) {
+        threads.add(kj::heap<kj::Thread>([&]() {
+          for (auto j KJ_UNUSED: kj::zeroTo(250)) {
+            pool.runSynchronously([]() {});
+          }
+        }));
+      }
+      return 0;
+    });
+  }
+
+  kj::MainBuilder::Validity run() {
+    runBuildAndRead();
+    runSerialization();
+    runTimers();
+    runFiberPool();
+    runRpc();
+
+    if (json) {
+      kj::Vector<kj::String> entries;
+      for (auto& result: results) {
+        entries.add(formatJson(result));
+      }
+      context.exitInfo(kj::str(
+          "{\"benchmarks\": [\n  ", kj::strArray(entries, ",\n  "), "\n]}"));
+    }
+
+    return true;
+  }
+};
+
+}  // namespace
+}  // namespace benchmark
+}  // namespace capnp
+
+KJ_MAIN(capnp::benchmark::BenchmarkMain);
@@ -35,6 +35,8 @@
 #include "test-util.h"
 #include <kj/debug.h>
 #include <kj/compat/gtest.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
 
 namespace capnp {
 namespace _ {
@@ -80,6 +82,61 @@ TEST(Capability, Basic) {
   EXPECT_TRUE(barFailed);
 }
 
+KJ_TEST("request batches to a local capability") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  int callCount = 0;
+  test::TestInterface::Client client(kj::heap<TestInterfaceImpl>(callCount));
+
+  // More calls than fit in the first chunk of params.
+  auto batch = client.batch(&test::TestInterface::Client::fooRequest);
+  for (auto i KJ_UNUSED: kj::zeroTo(100)) {
+    auto params = batch.add();
+    params.setI(123);
+    params.setJ(true);
+  }
+  KJ_EXPECT(batch.size() == 100);
+
+  auto promise = batch.send();
+  KJ_EXPECT(callCount == 0);
+
+  auto responses = promise.wait(waitScope);
+  KJ_EXPECT(callCount == 100);
+  KJ_ASSERT(responses.size() == 100);
+  for (auto& response: responses) {
+    KJ_EXPECT(response.getX() == "foo");
+  }
+
+  // Calls are delivered in order, and after calls sent before them.
+  test::TestCallOrder::Client order(kj::heap<TestCallOrderImpl>());
+  auto first = order.getCallSequenceRequest().send();
+  auto orderBatch = order.batch(&test::TestCallOrder::Client::getCallSequenceRequest);
+  for (auto i KJ_UNUSED: kj::zeroTo(10)) {
+    orderBatch.add();
+  }
+  auto orderResponses = orderBatch.send().wait(waitScope);
+  KJ_EXPECT(first.wait(waitScope).getN() == 0);
+  for (auto i: kj::indices(orderResponses)) {
+    KJ_EXPECT(orderResponses[i].getN() == i + 1);
+  }
+
+  // Methods inherited from a superclass work too.
+  int handleCount = 0;
+  test::TestMoreStuff::Client moreStuff(kj::heap<TestMoreStuffImpl>(callCount, handleCount));
+  auto inheritedBatch = moreStuff.batch(&test::TestMoreStuff::Client::getCallSequenceRequest);
+  inheritedBatch.add();
+  inheritedBatch.add();
+  auto inheritedResponses = inheritedBatch.send().wait(waitScope);
+  KJ_ASSERT(inheritedResponses.size() == 2);
+  KJ_EXPECT(inheritedResponses[1].getN() == inheritedResponses[0].getN() + 1);
+
+  // A failing call fails the batch.
+  auto barBatch = client.batch(&test::TestInterface::Client::barRequest);
+  barBatch.add();
+  KJ_EXPECT_THROW(UNIMPLEMENTED, barBatch.send().wait(waitScope));
+}
+
 TEST(Capability, CapabilityList) {
   kj::EventLoop loop;
   kj::WaitScope waitScope(loop);
@@ -1419,6 +1476,98 @@ KJ_TEST("RevocableServer") {
       revocable.getClient().waitForeverRequest().send().ignoreResult().wait(waitScope));
 }
 
+KJ_TEST("CrossThreadCapability") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  struct Exported {
+    CrossThreadCapability interface;
+    CrossThreadCapability pipeline;
+    kj::Own<const kj::Executor> executor;
+    kj::Own<kj::CrossThreadPromiseFulfiller<void>> done;
+  };
+  kj::MutexGuarded<kj::Maybe<Exported>> shared;
+
+  int callCount = 0;
+  int pipelineCallCount = 0;
+  kj::Thread thread([&]() {
+    kj::EventLoop loop;
+    kj::WaitScope waitScope(loop);
+    auto paf = kj::newPromiseAndCrossThreadFulfiller<void>();
+    *shared.lockExclusive() = Exported {
+      CrossThreadCapability(kj::heap<TestInterfaceImpl>(callCount)),
+      CrossThreadCapability(kj::heap<TestPipelineImpl>(pipelineCallCount)),
+      kj::getCurrentThreadExecutor().addRef(),
+      kj::mv(paf.fulfiller)
+    };
+    paf.promise.wait(waitScope);
+  });
+
+  auto exported = shared.when([](const kj::Maybe<Exported>& e) { return e != nullptr; },
+                              [](kj::Maybe<Exported>& e) {
+    return kj::mv(KJ_ASSERT_NONNULL(e));
+  });
+
+  {
+    // Several calls in the same turn are delivered together.
+    auto client = exported.interface.getClientAs<test::TestInterface>();
+    kj::Vector<kj::Promise<void>> promises;
+    for (uint i = 0; i < 10; i++) {
+      auto request = client.fooRequest();
+      request.setI(123);
+      request.setJ(true);
+      promises.add(request.send().then([](auto&& response) {
+        KJ_EXPECT(response.getX() == "foo");
+      }));
+    }
+    kj::joinPromises(promises.releaseAsArray()).wait(waitScope);
+    KJ_EXPECT(callCount == 10);
+  }
+
+  {
+    // Pipelining, with a capability from this thread passed as a parameter and called back.
+    int chainedCallCount = 0;
+    auto client = exported.pipeline.getClientAs<test::TestPipeline>();
+
+    auto request = client.getCapRequest();
+    request.setN(234);
+    request.setInCap(test::TestInterface::Client(kj::heap<TestInterfaceImpl>(chainedCallCount)));
+    auto promise = request.send();
+
+    auto pipelineRequest = promise.getOutBox().getCap().fooRequest();
+    pipelineRequest.setI(321);
+    auto pipelinePromise = pipelineRequest.send();
+
+    auto pipelineRequest2 = promise.getOutBox().getCap().castAs<test::TestExtends>()
+        .graultRequest();
+    auto pipelinePromise2 = pipelineRequest2.send();
+
+    promise = nullptr;  // Drop the original promise; the pipeline keeps the call alive.
+
+    auto response = pipelinePromise.wait(waitScope);
+    KJ_EXPECT(response.getX() == "bar");
+    checkTestMessage(pipelinePromise2.wait(waitScope));
+
+    KJ_EXPECT(pipelineCallCount == 3);
+    KJ_EXPECT(chainedCallCount == 1);
+  }
+
+  {
+    // A capability sent back to its home thread is unwrapped.
+    int localCount = 0;
+    Capability::Client local = kj::heap<TestInterfaceImpl>(localCount);
+    auto hook = ClientHook::from(CrossThreadCapability(local).getClient());
+    KJ_EXPECT(hook.get() == ClientHook::from(kj::mv(local)).get());
+  }
+
+  // Make sure the other thread has processed our releases before stopping it.
+  auto executor = kj::mv(exported.executor);
+  auto done = kj::mv(exported.done);
+  { auto drop = kj::mv(exported); }
+  executor->executeAsync([]() {}).wait(waitScope);
+  done->fulfill();
+}
+
 }  // namespace
 }  // namespace _
 }  // namespace capnp
@@ -24,6 +24,7 @@
 #include "capnp/capability.h"
 #include "capnp/message.h"
 #include "capnp/arena.h"
+#include "capnp/schema.capnp.h"
 #include <kj/refcount.h>
 #include <kj/debug.h>
 #include <kj/vector.h>
@@ -125,6 +126,76 @@ kj::Promise<void> Capability::Client::whenResolved() {
   return hook->whenResolved().attach(hook->addRef());
 }
 
+namespace {
+
+class SequentialCallBatch final: public CallBatchHook {
+  // Default batch: just a list of ordinary requests, sent one after another.
+
+public:
+  SequentialCallBatch(kj::Own<ClientHook>&& client, uint64_t interfaceId, uint16_t methodId,
+                      ClientHook::CallHints hints)
+      : client(kj::mv(client)), interfaceId(interfaceId), methodId(methodId), hints(hints) {}
+
+  AnyPointer::Builder add(kj::Maybe<MessageSize> sizeHint) override {
+    auto request = client->newCall(interfaceId, methodId, sizeHint, hints);
+    AnyPointer::Builder params = request;
+    requests.add(kj::mv(request));
+    return params;
+  }
+
+  size_t size() override {
+    return requests.size();
+  }
+
+  kj::Promise<kj::Array<Response<AnyPointer>>> send() override {
+    auto promises = kj::heapArrayBuilder<kj::Promise<Response<AnyPointer>>>(requests.size());
+    for (auto& request: requests) {
+      promises.add(request.send());
+    }
+    requests.clear();
+    return kj::joinPromises(promises.finish());
+  }
+
+private:
+  kj::Own<ClientHook> client;
+  uint64_t interfaceId;
+  uint16_t methodId;
+  ClientHook::CallHints hints;
+  kj::Vector<Request<AnyPointer, AnyPointer>> requests;
+};
+
+}  // namespace
+
+kj::Own<CallBatchHook> ClientHook::newCallBatch(
+    uint64_t interfaceId, uint16_t methodId, CallHints hints) {
+  return kj::heap<SequentialCallBatch>(addRef(), interfaceId, methodId, hints);
+}
+
+namespace _ {  // private
+
+MethodIdentity findMethod(const RawSchema& interface, uint64_t paramsId, uint64_t resultsId) {
+  interface.ensureInitialized();
+  auto methods = readMessageUnchecked<schema::Node>(interface.encodedNode)
+      .getInterface().getMethods();
+
+  kj::Vector<MethodIdentity> matches;
+  for (auto i: kj::indices(methods)) {
+    auto method = methods[i];
+    if (method.getParamStructType() == paramsId && method.getResultStructType() == resultsId) {
+      matches.add(MethodIdentity { interface.id, static_cast<uint16_t>(i) });
+    }
+  }
+  KJ_REQUIRE(matches.size() > 0, "method passed to batch() doesn't belong to its interface",
+             interface.id, paramsId, resultsId);
+  KJ_REQUIRE(matches.size() == 1,
+             "batch() can't tell methods of this interface apart, because they have the same "
+             "param and result types; use typelessRequest() instead",
+             interface.id, paramsId, resultsId);
+  return matches[0];
+}
+
+}  // namespace _ (private)
+
 // =======================================================================================
 
 static inline uint firstSegmentSize(kj::Maybe<MessageSize> sizeHint) {
@@ -145,14 +216,20 @@ public:
 
 class LocalCallContext final: public CallContextHook, public ResponseHook, public kj::Refcounted {
 public:
-  LocalCallContext(kj::Own<MallocMessageBuilder>&& request, kj::Own<ClientHook> clientRef,
+  LocalCallContext(kj::Own<MallocMessageBuilder>&& requestParam, kj::Own<ClientHook> clientRef,
                    ClientHook::CallHints hints, bool isStreaming)
-      : request(kj::mv(request)), clientRef(kj::mv(clientRef)), hints(hints),
-        isStreaming(isStreaming) {}
+      : params(requestParam->getRoot<AnyPointer>()), request(kj::mv(requestParam)),
+        clientRef(kj::mv(clientRef)), hints(hints), isStreaming(isStreaming) {}
+  LocalCallContext(kj::Own<MallocMessageBuilder>&& request, AnyPointer::Reader params,
+                   kj::Own<ClientHook> clientRef, ClientHook::CallHints hints)
+      : params(params), request(kj::mv(request)), clientRef(kj::mv(clientRef)), hints(hints),
+        isStreaming(false) {}
+  // `params` points somewhere inside `request` other than its root. Used by batches, whose calls
+  // all share one message.
 
   AnyPointer::Reader getParams() override {
-    KJ_IF_MAYBE(r, request) {
-      return r->get()->getRoot<AnyPointer>();
+    if (request != nullptr) {
+      return params;
     } else {
       KJ_FAIL_REQUIRE("Can't call getParams() after releaseParams().");
     }
@@ -212,6 +289,7 @@ public:
     return kj::addRef(*this);
   }
 
+  AnyPointer::Reader params;
   kj::Maybe<kj::Own<MallocMessageBuilder>> request;
   kj::Maybe<Response<AnyPointer>> response;
   AnyPointer::Builder responseBuilder = nullptr;  // only valid if `response` is non-null
@@ -221,6 +299,28 @@ public:
   bool isStreaming;
 };
 
+static Response<AnyPointer> takeLocalResponse(kj::Own<LocalCallContext>&& context) {
+  // Extracts the response from a local call which has completed.
+
+  // force response allocation
+  auto reader = context->getResults(MessageSize { 0, 0 }).asReader();
+
+  if (context->isShared()) {
+    // We can't just move away context->response as `context` itself is still referenced by
+    // something -- probably a Pipeline object. As a bit of a hack, LocalCallContext itself
+    // implements ResponseHook so that we can just return a ref on it.
+    //
+    // TODO(cleanup): Maybe ResponseHook should be refcounted? Note that context->response
+    //   might not necessarily contain a LocalResponse if it was resolved by a tail call, so
+    //   we'd have to add refcounting to all ResponseHook implementations.
+    context->releaseParams();      // The call is done so params can definitely be dropped.
+    context->clientRef = nullptr;  // Definitely not using the client cap anymore either.
+    return Response<AnyPointer>(reader, kj::mv(context));
+  } else {
+    return kj::mv(KJ_ASSERT_NONNULL(context->response));
+  }
+}
+
 class LocalRequest final: public RequestHook {
 public:
   inline LocalRequest(uint64_t interfaceId, uint16_t methodId,
@@ -274,23 +374,7 @@ private:
 
     // Now the other branch returns the response from the context.
     auto promise = promiseAndPipeline.promise.then([context=kj::mv(context)]() mutable {
-      // force response allocation
-      auto reader = context->getResults(MessageSize { 0, 0 }).asReader();
-
-      if (context->isShared()) {
-        // We can't just move away context->response as `context` itself is still referenced by
-        // something -- probably a Pipeline object. As a bit of a hack, LocalCallContext itself
-        // implements ResponseHook so that we can just return a ref on it.
-        //
-        // TODO(cleanup): Maybe ResponseHook should be refcounted? Note that context->response
-        //   might not necessarily contain a LocalResponse if it was resolved by a tail call, so
-        //   we'd have to add refcounting to all ResponseHook implementations.
-        context->releaseParams();      // The call is done so params can definitely be dropped.
-        context->clientRef = nullptr;  // Definitely not using the client cap anymore either.
-        return Response<AnyPointer>(reader, kj::mv(context));
-      } else {
-        return kj::mv(KJ_ASSERT_NONNULL(context->response));
-      }
+      return takeLocalResponse(kj::mv(context));
     });
 
     // We return the other branch.
@@ -665,6 +749,16 @@ public:
         kj::refcounted<QueuedPipeline>(kj::mv(pipelinePromise)) };
   }
 
+  kj::Own<CallBatchHook> newCallBatch(
+      uint64_t interfaceId, uint16_t methodId, CallHints hints) override {
+    KJ_IF_MAYBE(r, resolved) {
+      // As in newCall(), go directly to the replacement capability.
+      return r->get()->newCallBatch(interfaceId, methodId, hints);
+    }
+
+    return kj::heap<LocalCallBatch>(*this, interfaceId, methodId, hints);
+  }
+
   kj::Maybe<ClientHook&> getResolved() override {
     return resolved.map([](kj::Own<ClientHook>& hook) -> ClientHook& { return *hook; });
   }
@@ -826,6 +920,100 @@ private:
     }
   };
 
+  class LocalCallBatch final: public CallBatchHook {
+    // Batch of calls to a local object. All params are built in a single message, which is shared
+    // by the calls' contexts, and all calls are dispatched from a single event loop turn, rather
+    // than each call allocating its own message and scheduling its own evalLater().
+
+  public:
+    LocalCallBatch(LocalClient& client, uint64_t interfaceId, uint16_t methodId, CallHints hints)
+        : client(kj::addRef(client)), interfaceId(interfaceId), methodId(methodId), hints(hints),
+          arena(kj::refcounted<Arena>()) {}
+    KJ_DISALLOW_COPY_AND_MOVE(LocalCallBatch);
+
+    AnyPointer::Builder add(kj::Maybe<MessageSize> sizeHint) override {
+      KJ_REQUIRE(!sent, "Already called send() on this batch.");
+
+      if (params.size() == params.capacity()) {
+        params.reserve(kj::max(params.size() * 2, 16u));
+      }
+      if (params.size() == chunkEnd) {
+        // The params live in lists of pointers, each twice as long as the last, so that adding a
+        // call is usually just a bump of an index.
+        uint chunkSize = kj::max<uint>(params.size(), 16);
+        arena->chunks.add(arena->getOrphanage().newOrphan<List<AnyPointer>>(chunkSize));
+        chunk = arena->chunks.back().get();
+        chunkEnd += chunkSize;
+      }
+
+      auto result = chunk[chunk.size() - (chunkEnd - params.size())];
+      params.add(result);
+      return result;
+    }
+
+    size_t size() override {
+      return params.size();
+    }
+
+    kj::Promise<kj::Array<Response<AnyPointer>>> send() override {
+      KJ_REQUIRE(!sent, "Already called send() on this batch.");
+      sent = true;
+
+      KJ_IF_MAYBE(r, client->resolved) {
+        // Resolved since the batch was created, so send the calls individually to the new
+        // destination.
+        auto batch = r->get()->newCallBatch(interfaceId, methodId, hints);
+        for (auto& p: params) {
+          batch->add(p.targetSize()).set(p.asReader());
+        }
+        return batch->send();
+      }
+
+      auto contexts = kj::heapArrayBuilder<kj::Own<LocalCallContext>>(params.size());
+      for (auto& p: params) {
+        contexts.add(kj::refcounted<LocalCallContext>(
+            kj::addRef(*arena), p.asReader(), client->addRef(), hints));
+      }
+
+      // As in call(), dispatch in a later turn, but only one for the whole batch.
+      return kj::evalLater([client = kj::addRef(*client), interfaceId = interfaceId,
+                            methodId = methodId, contexts = contexts.finish()]() mutable {
+        auto& self = *client;
+        auto results = kj::heapArrayBuilder<kj::Promise<Response<AnyPointer>>>(contexts.size());
+        for (auto& context: contexts) {
+          auto promise = self.blocked
+              ? kj::newAdaptedPromise<kj::Promise<void>, BlockedCall>(
+                    self, interfaceId, methodId, *context)
+              : self.callInternal(interfaceId, methodId, *context);
+          results.add(promise.then([context = kj::mv(context)]() mutable {
+            return takeLocalResponse(kj::mv(context));
+          }));
+        }
+        return kj::joinPromises(results.finish()).attach(kj::mv(client));
+      }).eagerlyEvaluate(nullptr);
+    }
+
+  private:
+    class Arena final: public MallocMessageBuilder, public kj::Refcounted {
+      // The message holding the params. Each call's context holds a reference to it as an
+      // `Own<MallocMessageBuilder>`, so handing one out doesn't need an allocation of its own.
+
+    public:
+      kj::Vector<Orphan<List<AnyPointer>>> chunks;
+    };
+
+    kj::Own<LocalClient> client;
+    uint64_t interfaceId;
+    uint16_t methodId;
+    CallHints hints;
+    kj::Own<Arena> arena;
+    bool sent = false;
+
+    kj::Vector<AnyPointer::Builder> params;
+    List<AnyPointer>::Builder chunk = nullptr;
+    size_t chunkEnd = 0;
+  };
+
   class BlockingScope {
   public:
     BlockingScope(LocalClient& client): client(client) { client.blocked = true; }
@@ -869,6 +1057,7 @@ private:
     }
 
     // `server` can't be null here since `brokenException` is null.
+    context.delivered();
     auto result = KJ_ASSERT_NONNULL(server)->dispatchCall(interfaceId, methodId,
                                        CallContext<AnyPointer, AnyPointer>(context));
 
@@ -1100,6 +1289,492 @@ kj::Own<PipelineHook> getDisabledPipeline() {
   return instance.addRef();
 }
 
+// =======================================================================================
+// Cross-thread capabilities
+
+namespace {
+
+bool isCurrentThread(const kj::Executor& executor) {
+  return &kj::getCurrentThreadExecutor() == &executor;
+}
+
+template <typename T>
+void destroyOnThread(const kj::Executor& home, kj::Own<T>&& object) {
+  // Drops `object`, which belongs to `home`'s event loop, on that loop.
+
+  if (object.get() == nullptr || isCurrentThread(home) || !home.isLive()) {
+    // If the home loop is gone then nothing there can still be using the object.
+    object = nullptr;
+    return;
+  }
+
+  struct Orphan {
+    kj::Own<T> object;
+
+    explicit Orphan(kj::Own<T>&& object): object(kj::mv(object)) {}
+    Orphan(Orphan&&) = default;
+    ~Orphan() noexcept(false) {
+      if (object.get() != nullptr) {
+        // The event was canceled before it ran on the home thread, which only happens when this
+        // thread's event loop is being torn down. We can't destroy the object here, so leak it.
+        new kj::Own<T>(kj::mv(object));
+      }
+    }
+  };
+
+  home.executeAsync([orphan = Orphan(kj::mv(object))]() mutable {
+    orphan.object = nullptr;
+  }).detach([](kj::Exception&& e) {
+    if (e.getType() != kj::Exception::Type::DISCONNECTED) {
+      KJ_LOG(ERROR, "failed to release cross-thread object", e);
+    }
+  });
+}
+
+}  // namespace
+
+namespace _ {  // private
+
+class CrossThreadCapRef final: public kj::AtomicRefcounted {
+  // A thread-safe reference to a ClientHook belonging to another thread.
+
+public:
+  explicit CrossThreadCapRef(kj::Own<ClientHook> hook)
+      : home(kj::getCurrentThreadExecutor().addRef()), hook(kj::mv(hook)) {}
+  ~CrossThreadCapRef() noexcept(false) {
+    destroyOnThread(*home, kj::mv(hook));
+  }
+
+  const kj::Executor& getHome() const { return *home; }
+
+  ClientHook& getHook() const {
+    // May only be called on the home thread.
+    return *hook;
+  }
+
+private:
+  kj::Own<const kj::Executor> home;
+  mutable kj::Own<ClientHook> hook;
+};
+
+}  // namespace _ (private)
+
+namespace {
+
+using _::CrossThreadCapRef;
+typedef kj::Array<kj::Maybe<kj::Own<const CrossThreadCapRef>>> CrossThreadCapTable;
+
+kj::Own<const CrossThreadCapRef> exportCap(kj::Own<ClientHook>&& hook);
+kj::Own<ClientHook> importCap(kj::Own<const CrossThreadCapRef>&& ref);
+
+CrossThreadCapTable exportCaps(kj::ArrayPtr<kj::Maybe<kj::Own<ClientHook>>> table) {
+  return KJ_MAP(cap, table) -> kj::Maybe<kj::Own<const CrossThreadCapRef>> {
+    return cap.map([](kj::Own<ClientHook>& hook) { return exportCap(hook->addRef()); });
+  };
+}
+
+kj::Array<kj::Maybe<kj::Own<ClientHook>>> importCaps(CrossThreadCapTable&& table) {
+  return KJ_MAP(cap, table) -> kj::Maybe<kj::Own<ClientHook>> {
+    return cap.map([](kj::Own<const CrossThreadCapRef>& ref) { return importCap(kj::mv(ref)); });
+  };
+}
+
+struct CrossThreadReply {
+  AnyPointer::Reader results;
+  // Points into the results message, which is kept alive by the call's CrossThreadCallRef.
+
+  CrossThreadCapTable caps;
+};
+
+class CrossThreadCallContext final: public CallContextHook, public kj::Refcounted {
+  // Context for a call made from another thread, living on the callee's thread. The params are
+  // read directly from the caller's message.
+
+public:
+  CrossThreadCallContext(kj::Own<MallocMessageBuilder>&& paramsMessage,
+                         AnyPointer::Reader paramsParam, CrossThreadCapTable&& paramCaps)
+      : paramsMessage(kj::mv(paramsMessage)),
+        params(paramCapTable.emplace(importCaps(kj::mv(paramCaps))).imbue(paramsParam)) {}
+
+  AnyPointer::Reader getParams() override {
+    KJ_REQUIRE(paramsMessage.get() != nullptr, "Can't call getParams() after releaseParams().");
+    return params;
+  }
+  void releaseParams() override {
+    paramsMessage = nullptr;
+    paramCapTable = nullptr;
+  }
+  AnyPointer::Builder getResults(kj::Maybe<MessageSize> sizeHint) override {
+    if (resultsMessage.get() == nullptr) {
+      resultsMessage = kj::heap<MallocMessageBuilder>(firstSegmentSize(sizeHint));
+      results = resultCapTable.imbue(resultsMessage->getRoot<AnyPointer>());
+    }
+    return results;
+  }
+  void setPipeline(kj::Own<PipelineHook>&& pipeline) override {}
+  kj::Promise<void> tailCall(kj::Own<RequestHook>&& request) override {
+    return directTailCall(kj::mv(request)).promise;
+  }
+  ClientHook::VoidPromiseAndPipeline directTailCall(kj::Own<RequestHook>&& request) override {
+    KJ_REQUIRE(resultsMessage.get() == nullptr,
+               "Can't call tailCall() after initializing the results struct.");
+
+    // The results have to end up in our own message for the caller to read them, so copy them.
+    auto promise = request->send();
+    auto voidPromise = promise.then([this](Response<AnyPointer>&& response) {
+      getResults(response.targetSize()).set(response);
+    });
+    return { kj::mv(voidPromise), PipelineHook::from(kj::mv(promise)) };
+  }
+  kj::Promise<AnyPointer::Pipeline> onTailCall() override {
+    return kj::NEVER_DONE;
+  }
+  kj::Own<CallContextHook> addRef() override {
+    return kj::addRef(*this);
+  }
+
+  CrossThreadReply makeReply() {
+    auto root = getResults(MessageSize { 0, 0 }).asReader();
+    return { root, exportCaps(resultCapTable.getTable()) };
+  }
+
+private:
+  kj::Own<MallocMessageBuilder> paramsMessage;
+  kj::Maybe<ReaderCapabilityTable> paramCapTable;
+  AnyPointer::Reader params;
+
+  kj::Own<MallocMessageBuilder> resultsMessage;
+  BuilderCapabilityTable resultCapTable;
+  AnyPointer::Builder results = nullptr;
+};
+
+class CrossThreadCallRef final: public kj::AtomicRefcounted {
+  // Refers to a call in progress on another thread. Dropping the last reference cancels the call.
+
+public:
+  explicit CrossThreadCallRef(const kj::Executor& home): home(home.addRef()) {}
+  ~CrossThreadCallRef() noexcept(false) {
+    destroyOnThread(*home, kj::mv(state));
+  }
+
+  const kj::Executor& getHome() const { return *home; }
+
+  struct State {
+    kj::Own<kj::CrossThreadPromiseFulfiller<CrossThreadReply>> reply;
+    kj::Own<CrossThreadCallContext> context;
+    kj::Own<PipelineHook> pipeline;
+    kj::Promise<void> completion = nullptr;
+  };
+
+  void start(kj::Own<State>&& newState) const {
+    // Called on the home thread once the call has been delivered.
+    state = kj::mv(newState);
+  }
+
+  kj::Own<ClientHook> getPipelinedCap(kj::ArrayPtr<const PipelineOp> ops) const {
+    // May only be called on the home thread, after start().
+    if (state.get() == nullptr) {
+      return newBrokenCap("cross-thread call was canceled before it was delivered");
+    }
+    return state->pipeline->getPipelinedCap(ops);
+  }
+
+private:
+  kj::Own<const kj::Executor> home;
+  mutable kj::Own<State> state;
+};
+
+struct CrossThreadCallPacket {
+  // A call on its way to the callee's thread.
+
+  uint64_t interfaceId;
+  uint16_t methodId;
+  ClientHook::CallHints hints;
+  kj::Own<MallocMessageBuilder> paramsMessage;
+  AnyPointer::Reader params;
+  CrossThreadCapTable paramCaps;
+  kj::Own<const CrossThreadCallRef> call;
+  kj::Own<kj::CrossThreadPromiseFulfiller<CrossThreadReply>> reply;
+
+  void deliver(ClientHook& target) {
+    // Starts the call. Runs on the callee's thread.
+
+    auto state = kj::heap<CrossThreadCallRef::State>();
+    auto& reply = *(state->reply = kj::mv(this->reply));
+
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      state->context = kj::refcounted<CrossThreadCallContext>(
+          kj::mv(paramsMessage), params, kj::mv(paramCaps));
+      auto& context = *state->context;
+
+      auto vpap = target.call(interfaceId, methodId, kj::addRef(context), hints);
+      state->pipeline = kj::mv(vpap.pipeline);
+      state->completion = vpap.promise.then([&context,&reply]() {
+        reply.fulfill(context.makeReply());
+      }, [&reply](kj::Exception&& e) {
+        reply.reject(kj::mv(e));
+      }).eagerlyEvaluate(nullptr);
+    })) {
+      state->pipeline = newBrokenPipeline(kj::cp(*exception));
+      reply.reject(kj::mv(*exception));
+    }
+
+    call->start(kj::mv(state));
+  }
+};
+
+class CrossThreadResponse final: public ResponseHook {
+public:
+  CrossThreadResponse(kj::Own<const CrossThreadCallRef>&& call, CrossThreadCapTable&& caps)
+      : call(kj::mv(call)), capTable(importCaps(kj::mv(caps))) {}
+
+  kj::Own<const CrossThreadCallRef> call;
+  ReaderCapabilityTable capTable;
+};
+
+class CrossThreadClient;
+
+class CrossThreadRequest final: public RequestHook {
+public:
+  CrossThreadRequest(kj::Own<CrossThreadClient>&& client, uint64_t interfaceId, uint16_t methodId,
+                     kj::Maybe<MessageSize> sizeHint, ClientHook::CallHints hints)
+      : client(kj::mv(client)), interfaceId(interfaceId), methodId(methodId), hints(hints),
+        message(kj::heap<MallocMessageBuilder>(firstSegmentSize(sizeHint))) {}
+
+  AnyPointer::Builder getRoot() {
+    return capTable.imbue(message->getRoot<AnyPointer>());
+  }
+
+  RemotePromise<AnyPointer> send() override;
+
+  kj::Promise<void> sendStreaming() override {
+    return send().ignoreResult();
+  }
+
+  AnyPointer::Pipeline sendForPipeline() override {
+    auto promise = send();
+    return kj::mv(promise);
+  }
+
+  const void* getBrand() override {
+    return nullptr;
+  }
+
+private:
+  kj::Own<CrossThreadClient> client;
+  uint64_t interfaceId;
+  uint16_t methodId;
+  ClientHook::CallHints hints;
+  kj::Own<MallocMessageBuilder> message;
+  BuilderCapabilityTable capTable;
+};
+
+class CrossThreadPipeline final: public PipelineHook, public kj::Refcounted {
+public:
+  CrossThreadPipeline(kj::Own<ClientHook>&& client, kj::Own<const CrossThreadCallRef>&& call,
+                      kj::Promise<void> delivered)
+      : client(kj::mv(client)), call(kj::mv(call)), delivered(delivered.fork()) {}
+
+  kj::Own<PipelineHook> addRef() override {
+    return kj::addRef(*this);
+  }
+
+  kj::Own<ClientHook> getPipelinedCap(kj::ArrayPtr<const PipelineOp> ops) override {
+    // The pipelined capability can only be looked up once the call has been delivered, after
+    // which we have to ask the callee's thread for it. Calls made in the meantime are queued.
+    auto promise = delivered.addBranch()
+        .then([call = kj::atomicAddRef(*call), ops = kj::heapArray(ops)]() mutable {
+      auto& home = call->getHome();
+      return home.executeAsync([call = kj::mv(call), ops = kj::mv(ops)]() {
+        return exportCap(call->getPipelinedCap(ops));
+      });
+    }).then([](kj::Own<const CrossThreadCapRef>&& cap) {
+      return importCap(kj::mv(cap));
+    });
+    return newLocalPromiseClient(kj::mv(promise));
+  }
+
+private:
+  kj::Own<ClientHook> client;
+  // Keeps the client alive until its pending calls have been delivered.
+
+  kj::Own<const CrossThreadCallRef> call;
+  kj::ForkedPromise<void> delivered;
+};
+
+class CrossThreadClient final: public ClientHook, public kj::Refcounted,
+                               private kj::TaskSet::ErrorHandler {
+  // Forwards calls to a capability belonging to another thread.
+
+public:
+  explicit CrossThreadClient(kj::Own<const CrossThreadCapRef>&& target)
+      : target(kj::mv(target)), tasks(*this) {}
+
+  const CrossThreadCapRef& getTarget() { return *target; }
+
+  Request<AnyPointer, AnyPointer> newCall(
+      uint64_t interfaceId, uint16_t methodId, kj::Maybe<MessageSize> sizeHint,
+      CallHints hints) override {
+    auto hook = kj::heap<CrossThreadRequest>(
+        kj::addRef(*this), interfaceId, methodId, sizeHint, hints);
+    auto root = hook->getRoot();
+    return Request<AnyPointer, AnyPointer>(root, kj::mv(hook));
+  }
+
+  VoidPromiseAndPipeline call(uint64_t interfaceId, uint16_t methodId,
+                              kj::Own<CallContextHook>&& context, CallHints hints) override {
+    // The context belongs to this thread, so we have to copy the params into a message of our
+    // own, and copy the results back when they arrive.
+    context->delivered();
+    auto params = context->getParams();
+    auto request = newCall(interfaceId, methodId, params.targetSize(), hints);
+    request.set(params);
+    context->releaseParams();
+
+    auto promise = request.send();
+    auto voidPromise = promise.then(
+        [context = kj::mv(context)](Response<AnyPointer>&& response) mutable {
+      context->getResults(response.targetSize()).set(response);
+    });
+    return { kj::mv(voidPromise), PipelineHook::from(kj::mv(promise)) };
+  }
+
+  kj::Maybe<ClientHook&> getResolved() override {
+    return nullptr;
+  }
+
+  kj::Maybe<kj::Promise<kj::Own<ClientHook>>> whenMoreResolved() override {
+    return nullptr;
+  }
+
+  kj::Own<ClientHook> addRef() override {
+    return kj::addRef(*this);
+  }
+
+  static const uint BRAND;
+  // Value is irrelevant; used for pointer.
+
+  const void* getBrand() override {
+    return &BRAND;
+  }
+
+  kj::Maybe<int> getFd() override {
+    return nullptr;
+  }
+
+  RemotePromise<AnyPointer> send(CrossThreadCallPacket&& packet) {
+    auto call = kj::atomicRefcounted<CrossThreadCallRef>(target->getHome());
+    auto paf = kj::newPromiseAndCrossThreadFulfiller<CrossThreadReply>();
+    packet.call = kj::atomicAddRef(*call);
+    packet.reply = kj::mv(paf.fulfiller);
+
+    // Calls made in the same turn are delivered together.
+    if (batch == nullptr) {
+      auto deliveredPaf = kj::newPromiseAndFulfiller<void>();
+      batch = kj::heap<Batch>(Batch {
+        {}, kj::mv(deliveredPaf.fulfiller), deliveredPaf.promise.fork()
+      });
+      tasks.add(kj::evalLater([this]() { return flush(); }));
+    }
+    auto& currentBatch = *KJ_ASSERT_NONNULL(batch);
+    currentBatch.calls.add(kj::mv(packet));
+    auto delivered = currentBatch.delivered.addBranch();
+
+    auto promise = paf.promise.then(
+        [call = kj::atomicAddRef(*call)](CrossThreadReply&& reply) mutable {
+      auto response = kj::heap<CrossThreadResponse>(kj::mv(call), kj::mv(reply.caps));
+      auto reader = response->capTable.imbue(reply.results);
+      return Response<AnyPointer>(reader, kj::mv(response));
+    }).attach(kj::addRef(*this));
+    auto pipeline = kj::refcounted<CrossThreadPipeline>(
+        kj::addRef(*this), kj::mv(call), kj::mv(delivered));
+    return RemotePromise<AnyPointer>(kj::mv(promise), AnyPointer::Pipeline(kj::mv(pipeline)));
+  }
+
+private:
+  kj::Own<const CrossThreadCapRef> target;
+
+  struct Batch {
+    kj::Vector<CrossThreadCallPacket> calls;
+    kj::Own<kj::PromiseFulfiller<void>> deliveredFulfiller;
+    kj::ForkedPromise<void> delivered;
+  };
+  kj::Maybe<kj::Own<Batch>> batch;
+  kj::TaskSet tasks;
+
+  kj::Promise<void> flush() {
+    auto current = kj::mv(KJ_ASSERT_NONNULL(batch));
+    batch = nullptr;
+
+    auto promise = target->getHome().executeAsync(
+        [target = kj::atomicAddRef(*target), calls = current->calls.releaseAsArray()]() mutable {
+      auto& hook = target->getHook();
+      for (auto& call: calls) {
+        call.deliver(hook);
+      }
+    });
+
+    auto& fulfiller = *current->deliveredFulfiller;
+    return promise.then([&fulfiller]() {
+      fulfiller.fulfill();
+    }, [&fulfiller](kj::Exception&& e) {
+      fulfiller.reject(kj::mv(e));
+    }).attach(kj::mv(current));
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, exception);
+  }
+};
+
+const uint CrossThreadClient::BRAND = 0;
+
+RemotePromise<AnyPointer> CrossThreadRequest::send() {
+  KJ_REQUIRE(message.get() != nullptr, "Already called send() on this request.");
+
+  auto params = message->getRoot<AnyPointer>().asReader();
+  auto paramCaps = exportCaps(capTable.getTable());
+  return client->send(CrossThreadCallPacket {
+    interfaceId, methodId, hints, kj::mv(message), params, kj::mv(paramCaps), {}, {}
+  });
+}
+
+kj::Own<const CrossThreadCapRef> exportCap(kj::Own<ClientHook>&& hook) {
+  if (hook->getBrand() == &CrossThreadClient::BRAND) {
+    // Already a proxy; refer to the original instead.
+    return kj::atomicAddRef(kj::downcast<CrossThreadClient>(*hook).getTarget());
+  }
+  return kj::atomicRefcounted<CrossThreadCapRef>(kj::mv(hook));
+}
+
+kj::Own<ClientHook> importCap(kj::Own<const CrossThreadCapRef>&& ref) {
+  if (isCurrentThread(ref->getHome())) {
+    return ref->getHook().addRef();
+  }
+  return kj::refcounted<CrossThreadClient>(kj::mv(ref));
+}
+
+}  // namespace
+
+CrossThreadCapability::CrossThreadCapability(Capability::Client cap)
+    : ref(exportCap(ClientHook::from(kj::mv(cap)))) {}
+
+CrossThreadCapability::CrossThreadCapability(const CrossThreadCapability& other)
+    : ref(kj::atomicAddRef(*other.ref)) {}
+
+CrossThreadCapability& CrossThreadCapability::operator=(const CrossThreadCapability& other) {
+  ref = kj::atomicAddRef(*other.ref);
+  return *this;
+}
+
+CrossThreadCapability::CrossThreadCapability(CrossThreadCapability&& other) = default;
+CrossThreadCapability& CrossThreadCapability::operator=(CrossThreadCapability&& other) = default;
+CrossThreadCapability::~CrossThreadCapability() noexcept(false) {}
+
+Capability::Client CrossThreadCapability::getClient() const {
+  return Capability::Client(importCap(kj::atomicAddRef(*ref)));
+}
+
 // =======================================================================================
 
 ReaderCapabilityTable::ReaderCapabilityTable(
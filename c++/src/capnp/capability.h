@@ -73,6 +73,7 @@ namespace _ { // private
 extern const RawSchema NULL_INTERFACE_SCHEMA;  // defined in schema.c++
 class CapabilityServerSetBase;
 struct PipelineBuilderPair;
+struct MethodIdentity;
 }  // namespace _ (private)
 
 struct Capability {
@@ -101,8 +102,11 @@ class RequestHook;
 class ResponseHook;
 class PipelineHook;
 class ClientHook;
+class CallBatchHook;
 template <typename T>
 class RevocableServer;
+template <typename Params, typename Results>
+class RequestBatch;
 
 template <typename Params, typename Results>
 class Request: public Params::Builder {
@@ -184,9 +188,42 @@ private:
 
   template <typename, typename>
   friend class Request;
+  template <typename, typename>
+  friend class RequestBatch;
   friend class ResponseHook;
 };
 
+template <typename Params, typename Results>
+class RequestBatch {
+  // Many calls to the same method of the same capability, built up and then sent together. Get
+  // one from `Capability::Client::batch()`.
+  //
+  // Compared to sending each call as a separate `Request`, the capability's implementation may
+  // amortize per-call costs across the batch. Calls to a local object share one arena for their
+  // params and are dispatched in a single turn of the event loop. Calls over RPC are still sent as
+  // separate messages, each with its own question, but the messages are built in one shared arena
+  // and the question table grows once for the whole batch. Either way, no pipeline is set up for
+  // any call in the batch, and the results arrive together as a single promise.
+
+public:
+  inline explicit RequestBatch(kj::Own<CallBatchHook>&& hook): hook(kj::mv(hook)) {}
+  inline RequestBatch(decltype(nullptr)) {}
+
+  typename Params::Builder add(kj::Maybe<MessageSize> sizeHint = nullptr);
+  // Add a call to the batch and return its params to be filled in. The builder is valid until
+  // send() is called.
+
+  size_t size();
+  // Number of calls added so far.
+
+  kj::Promise<kj::Array<Response<Results>>> send() KJ_WARN_UNUSED_RESULT;
+  // Send all of the calls. The responses are returned in the order the calls were added. If any
+  // call fails, the promise is rejected, but only once all calls have completed.
+
+private:
+  kj::Own<CallBatchHook> hook;
+};
+
 class Capability::Client {
   // Base type for capability clients.
 
@@ -267,6 +304,18 @@ public:
   // Make a request without knowing the types of the params or results. You specify the type ID
   // and method number manually.
 
+  template <typename C, typename Params, typename Results>
+  RequestBatch<Params, Results> batch(
+      Request<Params, Results> (C::*method)(kj::Maybe<MessageSize>));
+  // Start a batch of calls to `method`, which must be one of the `fooRequest()` methods of this
+  // capability's generated client class. For example:
+  //
+  //     auto batch = cap.batch(&Foo::Client::barRequest);
+  //     for (auto i: kj::zeroTo(10000)) batch.add().setI(i);
+  //     auto responses = batch.send().wait(waitScope);
+  //
+  // See `RequestBatch`.
+
   kj::Promise<kj::Maybe<int>> getFd();
   // If the capability's server implemented Capability::Server::getFd() returning non-null, and all
   // RPC links between the client and server support FD passing, returns a file descriptor pointing
@@ -718,6 +767,48 @@ public:
   // accepts an lvalue input).
 };
 
+namespace _ { class CrossThreadCapRef; }
+
+class CrossThreadCapability {
+  // A reference to a capability which can be passed to other threads and called from there.
+  //
+  // Capabilities normally belong to the event loop of the thread that created them and can only be
+  // called from that thread. Construct a CrossThreadCapability on that thread, hand it (or copies
+  // of it) to other threads, and call `getClient()` on them to get a Client whose calls are
+  // delivered to the capability's home thread through kj::Executor and whose results are delivered
+  // back the same way.
+  //
+  // Messages are not copied between threads: the home thread reads the caller's params message in
+  // place, and the caller reads the results message in place. Capabilities in params and results
+  // are wrapped in the same way, in both directions; a capability which is sent back to its home
+  // thread is unwrapped rather than proxied twice. Promise pipelining works as usual. Calls made on
+  // the same Client in the same turn of the event loop are delivered in a single cross-thread
+  // event.
+  //
+  // A CrossThreadCapability may be copied and destroyed on any thread with an event loop. Clients
+  // obtained from it belong to the calling thread, like any other Client.
+
+public:
+  explicit CrossThreadCapability(Capability::Client cap);
+  // Must be called on the thread that owns `cap`.
+
+  CrossThreadCapability(const CrossThreadCapability& other);
+  CrossThreadCapability(CrossThreadCapability&& other);
+  CrossThreadCapability& operator=(const CrossThreadCapability& other);
+  CrossThreadCapability& operator=(CrossThreadCapability&& other);
+  ~CrossThreadCapability() noexcept(false);
+
+  Capability::Client getClient() const;
+  // Gets a Client for use on the calling thread. On the capability's home thread, this returns the
+  // original capability.
+
+  template <typename T>
+  typename T::Client getClientAs() const { return getClient().castAs<T>(); }
+
+private:
+  kj::Own<const _::CrossThreadCapRef> ref;
+};
+
 // =======================================================================================
 // Hook interfaces which must be implemented by the RPC system.  Applications never call these
 // directly; the RPC system implements them and the types defined earlier in this file wrap them.
@@ -746,6 +837,19 @@ public:
   }
 };
 
+class CallBatchHook {
+  // Hook interface behind `RequestBatch`. See `ClientHook::newCallBatch()`.
+
+public:
+  virtual AnyPointer::Builder add(kj::Maybe<MessageSize> sizeHint) = 0;
+  // Add a call and return a builder for its params.
+
+  virtual size_t size() = 0;
+
+  virtual kj::Promise<kj::Array<Response<AnyPointer>>> send() = 0;
+  // Send all calls and return their responses, in order.
+};
+
 class ResponseHook {
   // Hook interface implemented by RPC system representing a response.
   //
@@ -793,6 +897,12 @@ public:
   // later turn of the event loop. Otherwise, application code may call back and affect the
   // callee's state in an unexpected way.
 
+  virtual kj::Own<CallBatchHook> newCallBatch(
+      uint64_t interfaceId, uint16_t methodId, CallHints hints);
+  // Start a batch of calls to one method; see `RequestBatch`. The default implementation creates
+  // each call with `newCall()` and sends them one after another, saving nothing over separate
+  // calls. Local objects and RPC capabilities override this to share work across the batch.
+
   virtual kj::Maybe<ClientHook&> getResolved() = 0;
   // If this ClientHook is a promise that has already resolved, returns the inner, resolved version
   // of the capability.  The caller may permanently replace this client with the resolved one if
@@ -873,6 +983,11 @@ public:
 
   virtual kj::Own<CallContextHook> addRef() = 0;
 
+  virtual void delivered() {}
+  // Called by the ClientHook which finally executes the call, or forwards it to another vat or
+  // thread, just before it does so.  The RPC system uses this to tell how long an incoming call
+  // waited for its target to resolve.  Hooks which wrap another context should pass it through.
+
   template <typename Params, typename Results>
   static CallContextHook& from(CallContext<Params, Results>& context) { return *context.hook; }
   template <typename Params>
@@ -1120,6 +1235,56 @@ inline StreamingRequest<Params> Capability::Client::newStreamingCall(
   return StreamingRequest<Params>(typeless.template getAs<Params>(), kj::mv(typeless.hook));
 }
 
+namespace _ {  // private
+
+struct MethodIdentity {
+  uint64_t interfaceId;
+  uint16_t methodId;
+};
+
+MethodIdentity findMethod(const RawSchema& interface, uint64_t paramsId, uint64_t resultsId);
+// Finds the method of `interface` whose params and results are the structs with the given IDs,
+// according to the schema compiled into the generated code. Used to find out which method a
+// generated `fooRequest()` calls.
+
+}  // namespace _ (private)
+
+template <typename C, typename Params, typename Results>
+RequestBatch<Params, Results> Capability::Client::batch(
+    Request<Params, Results> (C::*)(kj::Maybe<MessageSize>)) {
+  // The method pointer is only used to deduce types: `C` is the client class of the interface
+  // which declares the method (even if it was named through a subclass's client), and `Params`
+  // and `Results` identify the method.
+  auto identity = _::findMethod(*C::Calls::_capnpPrivate::schema,
+      Params::_capnpPrivate::typeId, Results::_capnpPrivate::typeId);
+  CallHints hints;
+  hints.noPromisePipelining = true;
+  return RequestBatch<Params, Results>(
+      hook->newCallBatch(identity.interfaceId, identity.methodId, hints));
+}
+
+template <typename Params, typename Results>
+inline typename Params::Builder RequestBatch<Params, Results>::add(
+    kj::Maybe<MessageSize> sizeHint) {
+  return hook->add(sizeHint).template getAs<Params>();
+}
+
+template <typename Params, typename Results>
+inline size_t RequestBatch<Params, Results>::size() {
+  return hook->size();
+}
+
+template <typename Params, typename Results>
+kj::Promise<kj::Array<Response<Results>>> RequestBatch<Params, Results>::send() {
+  auto promise = hook->send();
+  hook = nullptr;  // prevent reuse
+  return promise.then([](kj::Array<Response<AnyPointer>>&& responses) {
+    return KJ_MAP(response, responses) {
+      return Response<Results>(response.getAs<Results>(), kj::mv(response.hook));
+    };
+  });
+}
+
 template <typename Params, typename Results>
 inline CallContext<Params, Results>::CallContext(CallContextHook& hook): hook(&hook) {}
 template <typename Params>
@@ -23,8 +23,11 @@
 #include "capnp/layout.h"
 #include <kj/debug.h>
 #include "capnp/arena.h"
+#include <kj/thread.h>
 #include <string.h>
 #include <stdlib.h>
+#include <atomic>
+#include <thread>
 
 #if !CAPNP_LITE
 #include "capnp/capability.h"
@@ -347,6 +350,102 @@ struct SegmentAnd {
   T value;
 };
 
+class ShadowArena final: public Arena {
+  // Exposes the same segments as some other arena, but charges reads to its own ReadLimiter.  Each
+  // thread of a parallel traversal reads through one of these, so that the threads don't race on
+  // the message's limiter.
+
+public:
+  ShadowArena(Arena& inner, uint64_t limitWords)
+      : inner(inner), initialLimit(limitWords), limiter(bounded(limitWords) * WORDS) {}
+
+  uint64_t getWordsRead() { return initialLimit - limiter.getRemainingWords(); }
+
+  SegmentReader* tryGetSegment(SegmentId id) override {
+    KJ_IF_MAYBE(segment, segments.find(id.value)) {
+      return *segment;
+    }
+
+    SegmentReader* real = inner.tryGetSegment(id);
+    if (real == nullptr) return nullptr;
+
+    auto shadow = kj::heap<SegmentReader>(this, id, real->getStartPtr(), real->getSize(),
+                                          &limiter);
+    auto result = shadow.get();
+    segments.insert(id.value, kj::mv(shadow));
+    return result;
+  }
+
+  void reportReadLimitReached() override {
+    inner.reportReadLimitReached();
+  }
+
+private:
+  Arena& inner;
+  uint64_t initialLimit;
+  ReadLimiter limiter;
+  kj::HashMap<uint, kj::Own<SegmentReader>> segments;
+};
+
+uint64_t runParallel(SegmentReader* segment, uint threadCount, size_t taskCount,
+                     kj::FunctionParam<void(size_t task, SegmentReader* shadow)> func) {
+  // Calls `func` once for each task in [0, taskCount), using `threadCount` threads including this
+  // one.  Each thread claims the next task when it finishes its previous one, and reads through
+  // its own ShadowArena whose version of `segment` is passed to `func`.  When all threads are
+  // done, the words they read are charged to `segment`'s limiter, and their number is returned.
+
+  uint64_t budget = segment->getReadLimiter()->getRemainingWords();
+  std::atomic<size_t> nextTask(0);
+  std::atomic<uint64_t> totalRead(0);
+  kj::MutexGuarded<kj::Maybe<kj::Exception>> firstException;
+
+  auto work = [&]() {
+    ShadowArena arena(*segment->getArena(), budget);
+    SegmentReader* shadow = arena.tryGetSegment(segment->getSegmentId());
+    uint64_t reported = 0;
+
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      for (;;) {
+        size_t task = nextTask.fetch_add(1, std::memory_order_relaxed);
+        if (task >= taskCount) break;
+
+        func(task, shadow);
+
+        // Give up early if the threads have collectively read more than the limit allows.
+        uint64_t read = arena.getWordsRead();
+        if (totalRead.fetch_add(read - reported) + (read - reported) > budget) {
+          nextTask.store(taskCount, std::memory_order_relaxed);
+        }
+        reported = read;
+      }
+    })) {
+      nextTask.store(taskCount, std::memory_order_relaxed);
+      auto lock = firstException.lockExclusive();
+      if (*lock == nullptr) *lock = kj::mv(*exception);
+    }
+
+    totalRead.fetch_add(arena.getWordsRead() - reported);
+  };
+
+  {
+    kj::Vector<kj::Own<kj::Thread>> threads(threadCount - 1);
+    for (uint i = 1; i < threadCount; i++) {
+      threads.add(kj::heap<kj::Thread>([&]() { work(); }));
+    }
+    work();
+  }
+
+  KJ_IF_MAYBE(exception, *firstException.lockExclusive()) {
+    kj::throwRecoverableException(kj::mv(*exception));
+  }
+
+  uint64_t result = totalRead.load();
+  if (result > 0) {
+    segment->getReadLimiter()->canRead(bounded(result) * WORDS, segment->getArena());
+  }
+  return result;
+}
+
 }  // namespace
 
 struct WireHelpers {
@@ -461,7 +560,7 @@ struct WireHelpers {
       SegmentWordCount amount, WirePointer::Kind kind, BuilderArena* orphanArena)) {
     // Allocate space in the message for a new object, creating far pointers if necessary. The
     // space is guaranteed to be zero'd (because MessageBuilder implementations are required to
-    // return zero'd memory).
+    // return zero'd memory, or else SegmentBuilder zeroes it lazily as it is allocated).
     //
     // * `ref` starts out being a reference to the pointer which shall be assigned to point at the
     //   new object.  On return, `ref` points to a pointer which needs to be initialized with
@@ -774,7 +873,8 @@ struct WireHelpers {
   // -----------------------------------------------------------------
 
   static MessageSizeCounts totalSize(
-      SegmentReader* segment, const WirePointer* ref, int nestingLimit) {
+      SegmentReader* segment, const WirePointer* ref, int nestingLimit,
+      const ParallelOptions* parallel = nullptr) {
     // Compute the total size of the object pointed to, not counting far pointer overhead.
 
     MessageSizeCounts result = { ZERO * WORDS, 0 };
@@ -807,7 +907,7 @@ struct WireHelpers {
         const WirePointer* pointerSection =
             reinterpret_cast<const WirePointer*>(ptr + ref->structRef.dataSize.get());
         for (auto i: kj::zeroTo(ref->structRef.ptrCount.get())) {
-          result += totalSize(segment, pointerSection + i, nestingLimit);
+          result += totalSize(segment, pointerSection + i, nestingLimit, parallel);
         }
         break;
       }
@@ -843,9 +943,17 @@ struct WireHelpers {
 
             result.addWords(count * WORDS_PER_POINTER);
 
+            KJ_IF_MAYBE(plan, planParallel(segment, parallel,
+                reinterpret_cast<const WirePointer*>(ptr), unbound(count / POINTERS), 1, 1)) {
+              for (auto& size: childSizes(segment, *plan, nestingLimit, true)) {
+                result += size;
+              }
+              break;
+            }
+
             for (auto i: kj::zeroTo(count)) {
               result += totalSize(segment, reinterpret_cast<const WirePointer*>(ptr) + i,
-                                  nestingLimit);
+                                  nestingLimit, parallel);
             }
             break;
           }
@@ -882,12 +990,23 @@ struct WireHelpers {
 
             if (pointerCount > ZERO * POINTERS) {
               const word* pos = ptr + POINTER_SIZE_IN_WORDS;
+
+              KJ_IF_MAYBE(plan, planParallel(segment, parallel,
+                  reinterpret_cast<const WirePointer*>(pos + dataSize),
+                  unbound(count / ELEMENTS), unbound(elementTag->structRef.wordSize() / WORDS),
+                  unbound(pointerCount / POINTERS))) {
+                for (auto& size: childSizes(segment, *plan, nestingLimit, true)) {
+                  result += size;
+                }
+                break;
+              }
+
               for (auto i KJ_UNUSED: kj::zeroTo(count)) {
                 pos += dataSize;
 
                 for (auto j KJ_UNUSED: kj::zeroTo(pointerCount)) {
                   result += totalSize(segment, reinterpret_cast<const WirePointer*>(pos),
-                                      nestingLimit);
+                                      nestingLimit, parallel);
                   pos += POINTER_SIZE_IN_WORDS;
                 }
               }
@@ -914,6 +1033,140 @@ struct WireHelpers {
     return result;
   }
 
+  // -----------------------------------------------------------------
+  // Parallel traversal of large lists.  Only the list's elements are divided among threads; each
+  // thread traverses whole elements sequentially, reading through its own ShadowArena.
+
+  struct ParallelPlan {
+    const WirePointer* firstPointer;  // First pointer of the first element.
+    uint64_t elementCount;
+    uint64_t stride;                  // Words from one element's pointers to the next element's.
+    uint pointersPerElement;
+    uint threadCount;
+    size_t chunkCount;
+
+    inline uint64_t chunkBegin(size_t chunk) const {
+      return elementCount * chunk / chunkCount;
+    }
+    inline const WirePointer* pointer(uint64_t element, uint index) const {
+      return firstPointer + element * stride + index;
+    }
+  };
+
+  static kj::Maybe<ParallelPlan> planParallel(
+      SegmentReader* segment, const ParallelOptions* parallel, const WirePointer* firstPointer,
+      uint64_t elementCount, uint64_t stride, uint pointersPerElement) {
+    // Decide whether a list is worth traversing in parallel.  Unchecked messages (which have no
+    // segment) are always traversed sequentially.
+
+    if (parallel == nullptr || segment == nullptr || pointersPerElement == 0 ||
+        elementCount < kj::max(parallel->minListElements, 2u)) {
+      return nullptr;
+    }
+
+    uint threadCount = parallel->threadCount;
+    if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+    if (threadCount <= 1) return nullptr;
+
+    // Several chunks per thread, so that threads which draw cheap elements pick up the slack.
+    size_t chunkCount = kj::min(elementCount, uint64_t(threadCount) * 8);
+    return ParallelPlan {
+      firstPointer, elementCount, stride, pointersPerElement, threadCount, chunkCount
+    };
+  }
+
+  static kj::Array<MessageSizeCounts> childSizes(
+      SegmentReader* segment, const ParallelPlan& plan, int nestingLimit, bool chargeReads) {
+    // Compute the total size of the objects pointed to by each chunk's elements.  If
+    // `chargeReads` is false, the traversal is not counted against the read limit (unless it
+    // exceeds it), because the caller is about to traverse the same objects again.
+
+    auto result = kj::heapArray<MessageSizeCounts>(plan.chunkCount);
+    uint64_t wordsRead = runParallel(segment, plan.threadCount, plan.chunkCount,
+        [&](size_t chunk, SegmentReader* shadow) {
+      MessageSizeCounts size = { ZERO * WORDS, 0 };
+      for (uint64_t i = plan.chunkBegin(chunk); i < plan.chunkBegin(chunk + 1); i++) {
+        for (uint j = 0; j < plan.pointersPerElement; j++) {
+          size += totalSize(shadow, plan.pointer(i, j), nestingLimit);
+        }
+      }
+      result[chunk] = size;
+    });
+
+    if (!chargeReads) {
+      segment->unread(bounded(wordsRead) * WORDS);
+    }
+    return result;
+  }
+
+  static bool isCanonicalParallel(
+      const ListReader& list, const ParallelPlan& plan, const word* childrenBegin,
+      const word** childrenEnd, bool* dataTrunc, bool* ptrTrunc) {
+    // Parallel version of the element loop in ListReader::isCanonical().  In a canonical message,
+    // each element's children immediately follow those of the previous element, so sizing each
+    // chunk's children first tells us where that chunk's children must begin.  The chunks can then
+    // be checked independently, each having to end exactly where the next begins.
+
+    auto sizes = childSizes(list.segment, plan, list.nestingLimit, false);
+
+    const word* segmentEnd = list.segment->getStartPtr() + list.segment->getSize();
+    auto starts = kj::heapArray<const word*>(plan.chunkCount + 1);
+    starts[0] = childrenBegin;
+    for (auto i: kj::zeroTo(plan.chunkCount)) {
+      uint64_t words = unbound(sizes[i].wordCount / WORDS);
+      if (sizes[i].capCount > 0 || words > uint64_t(segmentEnd - starts[i])) {
+        // Capabilities are never canonical, and the children must fit in the (only) segment.
+        return false;
+      }
+      starts[i + 1] = starts[i] + words;
+    }
+
+    struct ChunkResult {
+      bool canonical = false;
+      bool dataTrunc = false;
+      bool ptrTrunc = false;
+    };
+    auto results = kj::heapArray<ChunkResult>(plan.chunkCount);
+    bool isStructList = list.elementSize == ElementSize::INLINE_COMPOSITE;
+
+    runParallel(list.segment, plan.threadCount, plan.chunkCount,
+        [&](size_t chunk, SegmentReader* shadow) {
+      ListReader shadowList = list;
+      shadowList.segment = shadow;
+      uint64_t begin = plan.chunkBegin(chunk);
+      const word* readHead = reinterpret_cast<const word*>(list.ptr) + begin * plan.stride;
+      const word* ptrHead = starts[chunk];
+      auto& result = results[chunk];
+
+      for (uint64_t i = begin; i < plan.chunkBegin(chunk + 1); i++) {
+        auto index = assumeBits<LIST_ELEMENT_COUNT_BITS>(i) * ELEMENTS;
+        if (isStructList) {
+          bool elementDataTrunc = false, elementPtrTrunc = false;
+          if (!shadowList.getStructElement(index).isCanonical(
+                &readHead, &ptrHead, &elementDataTrunc, &elementPtrTrunc)) {
+            return;
+          }
+          result.dataTrunc |= elementDataTrunc;
+          result.ptrTrunc |= elementPtrTrunc;
+        } else {
+          if (!shadowList.getPointerElement(index).isCanonical(&ptrHead)) {
+            return;
+          }
+        }
+      }
+
+      result.canonical = ptrHead == starts[chunk + 1];
+    });
+
+    for (auto& result: results) {
+      if (!result.canonical) return false;
+      *dataTrunc |= result.dataTrunc;
+      *ptrTrunc |= result.ptrTrunc;
+    }
+    *childrenEnd = starts[plan.chunkCount];
+    return true;
+  }
+
   // -----------------------------------------------------------------
   // Copy from an unchecked message.
 
@@ -1766,7 +2019,8 @@ struct WireHelpers {
 
   static SegmentAnd<word*> setStructPointer(
       SegmentBuilder* segment, CapTableBuilder* capTable, WirePointer* ref, StructReader value,
-      BuilderArena* orphanArena = nullptr, bool canonical = false) {
+      BuilderArena* orphanArena = nullptr, bool canonical = false,
+      const ParallelOptions* parallel = nullptr) {
     auto dataSize = roundBitsUpToBytes(value.dataSize);
     auto ptrCount = value.pointerCount;
 
@@ -1816,7 +2070,7 @@ struct WireHelpers {
     for (auto i: kj::zeroTo(ptrCount)) {
       copyPointer(segment, capTable, pointerSection + i,
                   value.segment, value.capTable, value.pointers + i,
-                  value.nestingLimit, nullptr, canonical);
+                  value.nestingLimit, nullptr, canonical, parallel);
     }
 
     return { segment, ptr };
@@ -1839,13 +2093,27 @@ struct WireHelpers {
 
   static SegmentAnd<word*> setListPointer(
       SegmentBuilder* segment, CapTableBuilder* capTable, WirePointer* ref, ListReader value,
-      BuilderArena* orphanArena = nullptr, bool canonical = false) {
+      BuilderArena* orphanArena = nullptr, bool canonical = false,
+      const ParallelOptions* parallel = nullptr) {
     auto totalSize = assertMax<kj::maxValueForBits<SEGMENT_WORD_COUNT_BITS>() - 1>(
         roundBitsUpToWords(upgradeBound<uint64_t>(value.elementCount) * value.step),
         []() { KJ_FAIL_ASSERT("encountered impossibly long struct list ListReader"); });
 
     if (value.elementSize != ElementSize::INLINE_COMPOSITE) {
       // List of non-structs.
+
+      if (value.elementSize == ElementSize::POINTER && !canonical) {
+        KJ_IF_MAYBE(plan, planParallel(value.segment, parallel,
+            reinterpret_cast<const WirePointer*>(value.ptr),
+            unbound(value.elementCount / ELEMENTS), 1, 1)) {
+          KJ_IF_MAYBE(result, setListPointerParallel(
+              segment, capTable, ref, value, *plan, totalSize, orphanArena)) {
+            ref->listRef.set(ElementSize::POINTER, value.elementCount);
+            return *result;
+          }
+        }
+      }
+
       word* ptr = allocate(ref, segment, capTable, totalSize, WirePointer::LIST, orphanArena);
 
       if (value.elementSize == ElementSize::POINTER) {
@@ -1855,7 +2123,7 @@ struct WireHelpers {
           copyPointer(segment, capTable, reinterpret_cast<WirePointer*>(ptr) + i,
                       value.segment, value.capTable,
                       reinterpret_cast<const WirePointer*>(value.ptr) + i,
-                      value.nestingLimit, nullptr, canonical);
+                      value.nestingLimit, nullptr, canonical, parallel);
         }
       } else {
         // List of data.
@@ -1911,6 +2179,23 @@ struct WireHelpers {
       }
 
       KJ_DASSERT(value.structDataSize % BITS_PER_WORD == ZERO * BITS);
+
+      if (!canonical) {
+        KJ_IF_MAYBE(plan, planParallel(value.segment, parallel,
+            reinterpret_cast<const WirePointer*>(
+                reinterpret_cast<const word*>(value.ptr) + declDataSize),
+            unbound(value.elementCount / ELEMENTS),
+            unbound(value.step * ELEMENTS / BITS_PER_WORD / WORDS),
+            unbound(declPointerCount / POINTERS))) {
+          KJ_IF_MAYBE(result, setListPointerParallel(segment, capTable, ref, value, *plan,
+                                                     totalSize + POINTER_SIZE_IN_WORDS,
+                                                     orphanArena)) {
+            ref->listRef.setInlineComposite(totalSize);
+            return *result;
+          }
+        }
+      }
+
       word* ptr = allocate(ref, segment, capTable, totalSize + POINTER_SIZE_IN_WORDS,
                            WirePointer::LIST, orphanArena);
       ref->listRef.setInlineComposite(totalSize);
@@ -1929,7 +2214,7 @@ struct WireHelpers {
         for (auto j: kj::zeroTo(ptrCount)) {
           copyPointer(segment, capTable, reinterpret_cast<WirePointer*>(dst) + j,
               value.segment, value.capTable, reinterpret_cast<const WirePointer*>(src) + j,
-              value.nestingLimit, nullptr, canonical);
+              value.nestingLimit, nullptr, canonical, parallel);
         }
         dst += ptrCount * WORDS_PER_POINTER;
         src += declPointerCount * WORDS_PER_POINTER;
@@ -1939,21 +2224,93 @@ struct WireHelpers {
     }
   }
 
+  static kj::Maybe<SegmentAnd<word*>> setListPointerParallel(
+      SegmentBuilder*& segment, CapTableBuilder* capTable, WirePointer*& ref,
+      const ListReader& value, const ParallelPlan& plan, SegmentWordCount listWords,
+      BuilderArena* orphanArena) {
+    // Parallel version of the non-canonical copy in setListPointer(), for lists of pointers or
+    // structs.  Sizing each chunk's children first lets us allocate the list together with all
+    // of its children, then give each chunk its own slice of that space to copy into, so that
+    // the threads never allocate from the message concurrently.  The caller must fill in the
+    // upper half of `ref`.  Returns null without having written anything if the children contain
+    // capabilities or won't fit in one segment; the caller should then copy sequentially.
+
+    auto sizes = childSizes(value.segment, plan, value.nestingLimit, false);
+
+    auto starts = kj::heapArray<uint64_t>(plan.chunkCount + 1);
+    starts[0] = unbound(listWords / WORDS);
+    for (auto i: kj::zeroTo(plan.chunkCount)) {
+      if (sizes[i].capCount > 0) return nullptr;
+      starts[i + 1] = starts[i] + unbound(sizes[i].wordCount / WORDS);
+    }
+    uint64_t totalWords = starts[plan.chunkCount];
+    if (totalWords >= kj::maxValueForBits<SEGMENT_WORD_COUNT_BITS>()) {
+      // Leave room for a far pointer landing pad.
+      return nullptr;
+    }
+
+    word* ptr = allocate(ref, segment, capTable,
+        assumeBits<SEGMENT_WORD_COUNT_BITS>(totalWords) * WORDS, WirePointer::LIST, orphanArena);
+
+    word* elements = ptr;
+    if (value.elementSize == ElementSize::INLINE_COMPOSITE) {
+      WirePointer* tag = reinterpret_cast<WirePointer*>(ptr);
+      tag->setKindAndInlineCompositeListElementCount(WirePointer::STRUCT, value.elementCount);
+      tag->structRef.set(value.structDataSize / BITS_PER_WORD, value.structPointerCount);
+      elements += POINTER_SIZE_IN_WORDS;
+    }
+    uint64_t dataWords = plan.stride - plan.pointersPerElement;
+    word* segmentStart = segment->getPtrUnchecked(ZERO * WORDS);
+
+    runParallel(value.segment, plan.threadCount, plan.chunkCount,
+        [&](size_t chunk, SegmentReader* shadow) {
+      // A view of the segment which ends at the end of this chunk's slice and has already
+      // allocated everything before it.
+      word* regionBegin = ptr + starts[chunk];
+      word* regionEnd = ptr + starts[chunk + 1];
+      SegmentBuilder region(segment->getArena(), segment->getSegmentId(), segmentStart,
+          assumeBits<SEGMENT_WORD_COUNT_BITS>(regionEnd - segmentStart) * WORDS,
+          segment->getReadLimiter(),
+          assumeBits<SEGMENT_WORD_COUNT_BITS>(regionBegin - segmentStart) * WORDS);
+
+      const word* src = reinterpret_cast<const word*>(value.ptr);
+      for (uint64_t i = plan.chunkBegin(chunk); i < plan.chunkBegin(chunk + 1); i++) {
+        word* dstElement = elements + i * plan.stride;
+        const word* srcElement = src + i * plan.stride;
+        memcpy(dstElement, srcElement, dataWords * sizeof(word));
+
+        for (uint j = 0; j < plan.pointersPerElement; j++) {
+          copyPointer(&region, capTable,
+              reinterpret_cast<WirePointer*>(dstElement + dataWords) + j,
+              shadow, value.capTable,
+              reinterpret_cast<const WirePointer*>(srcElement + dataWords) + j,
+              value.nestingLimit);
+        }
+      }
+
+      KJ_ASSERT(region.currentlyAllocated().end() == regionEnd,
+                "parallel copy used a different amount of space than expected");
+    });
+
+    return SegmentAnd<word*> { segment, ptr };
+  }
+
   static KJ_ALWAYS_INLINE(SegmentAnd<word*> copyPointer(
       SegmentBuilder* dstSegment, CapTableBuilder* dstCapTable, WirePointer* dst,
       SegmentReader* srcSegment, CapTableReader* srcCapTable, const WirePointer* src,
       int nestingLimit, BuilderArena* orphanArena = nullptr,
-      bool canonical = false)) {
+      bool canonical = false, const ParallelOptions* parallel = nullptr)) {
     return copyPointer(dstSegment, dstCapTable, dst,
                        srcSegment, srcCapTable, src, src->target(srcSegment),
-                       nestingLimit, orphanArena, canonical);
+                       nestingLimit, orphanArena, canonical, parallel);
   }
 
   static SegmentAnd<word*> copyPointer(
       SegmentBuilder* dstSegment, CapTableBuilder* dstCapTable, WirePointer* dst,
       SegmentReader* srcSegment, CapTableReader* srcCapTable, const WirePointer* src,
       const word* srcTarget, int nestingLimit,
-      BuilderArena* orphanArena = nullptr, bool canonical = false) {
+      BuilderArena* orphanArena = nullptr, bool canonical = false,
+      const ParallelOptions* parallel = nullptr) {
     // Deep-copy the object pointed to by src into dst.  It turns out we can't reuse
     // readStructPointer(), etc. because they do type checking whereas here we want to accept any
     // valid pointer.
@@ -1992,7 +2349,7 @@ struct WireHelpers {
                          src->structRef.dataSize.get() * BITS_PER_WORD,
                          src->structRef.ptrCount.get(),
                          nestingLimit - 1),
-            orphanArena, canonical);
+            orphanArena, canonical, parallel);
 
       case WirePointer::LIST: {
         ElementSize elementSize = src->listRef.elementSize();
@@ -2042,7 +2399,7 @@ struct WireHelpers {
                          tag->structRef.dataSize.get() * BITS_PER_WORD,
                          tag->structRef.ptrCount.get(), ElementSize::INLINE_COMPOSITE,
                          nestingLimit - 1),
-              orphanArena, canonical);
+              orphanArena, canonical, parallel);
         } else {
           auto dataSize = dataBitsPerElement(elementSize) * ELEMENTS;
           auto pointerCount = pointersPerElement(elementSize) * ELEMENTS;
@@ -2068,7 +2425,7 @@ struct WireHelpers {
           return setListPointer(dstSegment, dstCapTable, dst,
               ListReader(srcSegment, srcCapTable, ptr, elementCount, step, dataSize, pointerCount,
                          elementSize, nestingLimit - 1),
-              orphanArena, canonical);
+              orphanArena, canonical, parallel);
         }
       }
 
@@ -2604,12 +2961,14 @@ Data::Builder PointerBuilder::getBlob<Data>(const void* defaultValue, ByteCount
       assertMaxBits<BLOB_SIZE_BITS>(defaultSize, ThrowOverflow()));
 }
 
-void PointerBuilder::setStruct(const StructReader& value, bool canonical) {
-  WireHelpers::setStructPointer(segment, capTable, pointer, value, nullptr, canonical);
+void PointerBuilder::setStruct(const StructReader& value, bool canonical,
+                               const ParallelOptions* parallel) {
+  WireHelpers::setStructPointer(segment, capTable, pointer, value, nullptr, canonical, parallel);
 }
 
-void PointerBuilder::setList(const ListReader& value, bool canonical) {
-  WireHelpers::setListPointer(segment, capTable, pointer, value, nullptr, canonical);
+void PointerBuilder::setList(const ListReader& value, bool canonical,
+                             const ParallelOptions* parallel) {
+  WireHelpers::setListPointer(segment, capTable, pointer, value, nullptr, canonical, parallel);
 }
 
 #if !CAPNP_LITE
@@ -2797,7 +3156,7 @@ PointerReader PointerReader::imbue(CapTableReader* capTable) const {
   return result;
 }
 
-bool PointerReader::isCanonical(const word **readHead) {
+bool PointerReader::isCanonical(const word **readHead, const ParallelOptions* parallel) {
   if (!this->pointer) {
     // The pointer is null, so we are canonical and do not read
     return true;
@@ -2830,11 +3189,12 @@ bool PointerReader::isCanonical(const word **readHead) {
         //   that we don't read `dataTrunc` in that case, except Clang's optimizations. Ultimately
         //   the uninitialized read is fine because eventually the whole expression evaluates false
         //   either way. But, to make valgrind happy, we initialize the bools above...
-        return structReader.isCanonical(readHead, readHead, &dataTrunc, &ptrTrunc) && dataTrunc && ptrTrunc;
+        return structReader.isCanonical(readHead, readHead, &dataTrunc, &ptrTrunc, parallel) &&
+            dataTrunc && ptrTrunc;
       }
     }
     case PointerType::LIST:
-      return this->getListAnySize(nullptr).isCanonical(readHead, pointer);
+      return this->getListAnySize(nullptr).isCanonical(readHead, pointer, parallel);
     case PointerType::CAPABILITY:
       KJ_FAIL_ASSERT("Capabilities are not positional");
   }
@@ -2972,12 +3332,12 @@ StructBuilder StructBuilder::imbue(CapTableBuilder* capTable) {
 // =======================================================================================
 // StructReader
 
-MessageSizeCounts StructReader::totalSize() const {
+MessageSizeCounts StructReader::totalSize(const ParallelOptions* parallel) const {
   MessageSizeCounts result = {
     WireHelpers::roundBitsUpToWords(dataSize) + pointerCount * WORDS_PER_POINTER, 0 };
 
   for (auto i: kj::zeroTo(pointerCount)) {
-    result += WireHelpers::totalSize(segment, pointers + i, nestingLimit);
+    result += WireHelpers::totalSize(segment, pointers + i, nestingLimit, parallel);
   }
 
   if (segment != nullptr) {
@@ -3015,7 +3375,8 @@ StructReader StructReader::imbue(CapTableReader* capTable) const {
 bool StructReader::isCanonical(const word **readHead,
                                const word **ptrHead,
                                bool *dataTrunc,
-                               bool *ptrTrunc) {
+                               bool *ptrTrunc,
+                               const ParallelOptions* parallel) {
   if (this->getLocation() != *readHead) {
     // Our target area is not at the readHead, preorder fails
     return false;
@@ -3046,7 +3407,7 @@ bool StructReader::isCanonical(const word **readHead,
 
   // Check each pointer field for canonicity
   for (auto ptrIndex: kj::zeroTo(this->pointerCount)) {
-    if (!this->getPointerField(ptrIndex).isCanonical(ptrHead)) {
+    if (!this->getPointerField(ptrIndex).isCanonical(ptrHead, parallel)) {
       return false;
     }
   }
@@ -3179,7 +3540,7 @@ StructReader ListReader::getStructElement(ElementCount index) const {
       nestingLimit - 1);
 }
 
-MessageSizeCounts ListReader::totalSize() const {
+MessageSizeCounts ListReader::totalSize(const ParallelOptions* parallel) const {
   // TODO(cleanup): This is kind of a lot of logic duplicated from WireHelpers::totalSize(), but
   //   it's unclear how to share it effectively.
 
@@ -3201,9 +3562,17 @@ MessageSizeCounts ListReader::totalSize() const {
       auto count = elementCount * (POINTERS / ELEMENTS);
       result.addWords(count * WORDS_PER_POINTER);
 
+      KJ_IF_MAYBE(plan, WireHelpers::planParallel(segment, parallel,
+          reinterpret_cast<const WirePointer*>(ptr), unbound(count / POINTERS), 1, 1)) {
+        for (auto& size: WireHelpers::childSizes(segment, *plan, nestingLimit, true)) {
+          result += size;
+        }
+        break;
+      }
+
       for (auto i: kj::zeroTo(count)) {
         result += WireHelpers::totalSize(segment, reinterpret_cast<const WirePointer*>(ptr) + i,
-                                         nestingLimit);
+                                         nestingLimit, parallel);
       }
       break;
     }
@@ -3214,13 +3583,23 @@ MessageSizeCounts ListReader::totalSize() const {
 
       if (structPointerCount > ZERO * POINTERS) {
         const word* pos = reinterpret_cast<const word*>(ptr);
-        for (auto i KJ_UNUSED: kj::zeroTo(elementCount)) {
-          pos += structDataSize / BITS_PER_WORD;
 
-          for (auto j KJ_UNUSED: kj::zeroTo(structPointerCount)) {
-            result += WireHelpers::totalSize(segment, reinterpret_cast<const WirePointer*>(pos),
-                                             nestingLimit);
-            pos += POINTER_SIZE_IN_WORDS;
+        KJ_IF_MAYBE(plan, WireHelpers::planParallel(segment, parallel,
+            reinterpret_cast<const WirePointer*>(pos + structDataSize / BITS_PER_WORD),
+            unbound(elementCount / ELEMENTS), unbound(step * ELEMENTS / BITS_PER_WORD / WORDS),
+            unbound(structPointerCount / POINTERS))) {
+          for (auto& size: WireHelpers::childSizes(segment, *plan, nestingLimit, true)) {
+            result += size;
+          }
+        } else {
+          for (auto i KJ_UNUSED: kj::zeroTo(elementCount)) {
+            pos += structDataSize / BITS_PER_WORD;
+
+            for (auto j KJ_UNUSED: kj::zeroTo(structPointerCount)) {
+              result += WireHelpers::totalSize(segment, reinterpret_cast<const WirePointer*>(pos),
+                                               nestingLimit, parallel);
+              pos += POINTER_SIZE_IN_WORDS;
+            }
           }
         }
       }
@@ -3247,7 +3626,8 @@ ListReader ListReader::imbue(CapTableReader* capTable) const {
   return result;
 }
 
-bool ListReader::isCanonical(const word **readHead, const WirePointer *ref) {
+bool ListReader::isCanonical(const word **readHead, const WirePointer *ref,
+                             const ParallelOptions* parallel) {
   switch (this->getElementSize()) {
     case ElementSize::INLINE_COMPOSITE: {
       *readHead += 1;
@@ -3272,12 +3652,25 @@ bool ListReader::isCanonical(const word **readHead, const WirePointer *ref) {
       auto pointerHead = listEnd;
       bool listDataTrunc = false;
       bool listPtrTrunc = false;
+
+      KJ_IF_MAYBE(plan, WireHelpers::planParallel(segment, parallel,
+          reinterpret_cast<const WirePointer*>(*readHead + structDataSize / BITS_PER_WORD),
+          unbound(elementCount / ELEMENTS), unbound(elementSize * ELEMENTS / WORDS),
+          unbound(structPointerCount / POINTERS))) {
+        if (!WireHelpers::isCanonicalParallel(*this, *plan, listEnd, readHead,
+                                              &listDataTrunc, &listPtrTrunc)) {
+          return false;
+        }
+        return listDataTrunc && listPtrTrunc;
+      }
+
       for (auto ec: kj::zeroTo(this->elementCount)) {
         bool dataTrunc, ptrTrunc;
         if (!this->getStructElement(ec).isCanonical(readHead,
                                                     &pointerHead,
                                                     &dataTrunc,
-                                                    &ptrTrunc)) {
+                                                    &ptrTrunc,
+                                                    parallel)) {
           return false;
         }
         listDataTrunc |= dataTrunc;
@@ -3292,8 +3685,16 @@ bool ListReader::isCanonical(const word **readHead, const WirePointer *ref) {
         return false;
       }
       *readHead += this->elementCount * (POINTERS / ELEMENTS) * WORDS_PER_POINTER;
+
+      KJ_IF_MAYBE(plan, WireHelpers::planParallel(segment, parallel,
+          reinterpret_cast<const WirePointer*>(ptr), unbound(elementCount / ELEMENTS), 1, 1)) {
+        bool unused = false;
+        return WireHelpers::isCanonicalParallel(*this, *plan, *readHead, readHead,
+                                                &unused, &unused);
+      }
+
       for (auto ec: kj::zeroTo(this->elementCount)) {
-        if (!this->getPointerElement(ec).isCanonical(readHead)) {
+        if (!this->getPointerElement(ec).isCanonical(readHead, parallel)) {
           return false;
         }
       }
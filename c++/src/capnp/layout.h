@@ -59,6 +59,7 @@ CAPNP_BEGIN_HEADER
 namespace capnp {
 
 class ClientHook;
+struct ParallelOptions;
 
 namespace _ {  // private
 
@@ -361,14 +362,17 @@ public:
   // Init methods:  Initialize the pointer to a newly-allocated object, discarding the existing
   // object.
 
-  void setStruct(const StructReader& value, bool canonical = false);
-  void setList(const ListReader& value, bool canonical = false);
+  void setStruct(const StructReader& value, bool canonical = false,
+                 const ParallelOptions* parallel = nullptr);
+  void setList(const ListReader& value, bool canonical = false,
+               const ParallelOptions* parallel = nullptr);
   template <typename T> void setBlob(typename T::Reader value);
 #if !CAPNP_LITE
   void setCapability(kj::Own<ClientHook>&& cap);
 #endif  // !CAPNP_LITE
   // Set methods:  Initialize the pointer to a newly-allocated copy of the given value, discarding
-  // the existing object.
+  // the existing object.  If `parallel` is non-null, large lists found in a non-canonical copy
+  // may be copied by multiple threads; see ParallelOptions.
 
   void adopt(OrphanBuilder&& orphan);
   // Set the pointer to point at the given orphaned value.
@@ -460,7 +464,7 @@ public:
   PointerReader imbue(CapTableReader* capTable) const;
   // Return a copy of this reader except using the given capability context.
 
-  bool isCanonical(const word **readHead);
+  bool isCanonical(const word **readHead, const ParallelOptions* parallel = nullptr);
   // Validate this pointer's canonicity, subject to the conditions:
   // * All data to the left of readHead has been read thus far (for pointer
   //   ordering)
@@ -614,10 +618,11 @@ public:
   // Get a reader for a pointer field given the index within the pointer section.  If the index
   // is out-of-bounds, returns a null pointer.
 
-  MessageSizeCounts totalSize() const;
+  MessageSizeCounts totalSize(const ParallelOptions* parallel = nullptr) const;
   // Return the total size of the struct and everything to which it points.  Does not count far
   // pointer overhead.  This is useful for deciding how much space is needed to copy the struct
-  // into a flat array.
+  // into a flat array.  If `parallel` is non-null, large lists may be traversed by multiple
+  // threads.
 
   CapTableReader* getCapTable();
   // Gets the capability context in which this object is operating.
@@ -626,7 +631,8 @@ public:
   // Return a copy of this reader except using the given capability context.
 
   bool isCanonical(const word **readHead, const word **ptrHead,
-                   bool *dataTrunc, bool *ptrTrunc);
+                   bool *dataTrunc, bool *ptrTrunc,
+                   const ParallelOptions* parallel = nullptr);
   // Validate this pointer's canonicity, subject to the conditions:
   // * All data to the left of readHead has been read thus far (for pointer
   //   ordering)
@@ -783,7 +789,7 @@ public:
 
   StructReader getStructElement(ElementCount index) const;
 
-  MessageSizeCounts totalSize() const;
+  MessageSizeCounts totalSize(const ParallelOptions* parallel = nullptr) const;
   // Like StructReader::totalSize(). Note that for struct lists, the size includes the list tag.
 
   CapTableReader* getCapTable();
@@ -792,7 +798,8 @@ public:
   ListReader imbue(CapTableReader* capTable) const;
   // Return a copy of this reader except using the given capability context.
 
-  bool isCanonical(const word **readHead, const WirePointer* ref);
+  bool isCanonical(const word **readHead, const WirePointer* ref,
+                   const ParallelOptions* parallel = nullptr);
   // Validate this pointer's canonicity, subject to the conditions:
   // * All data to the left of readHead has been read thus far (for pointer
   //   ordering)
@@ -312,6 +312,10 @@ public:
     return kj::addRef(*this);
   }
 
+  void delivered() override {
+    inner->delivered();
+  }
+
 private:
   kj::Own<CallContextHook> inner;
   kj::Own<MembranePolicy> policy;
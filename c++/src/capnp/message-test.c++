@@ -213,6 +213,344 @@ KJ_TEST("MessageBuilder::sizeInWords()") {
   KJ_EXPECT(reader.sizeInWords() == expected);
 }
 
+KJ_TEST("PooledMessageBuilder reuses zeroed segments") {
+  auto pool = kj::refcounted<MessageBuilderPool>();
+
+  word* firstSegment;
+  {
+    PooledMessageBuilder builder(kj::addRef(*pool));
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+    firstSegment = const_cast<word*>(builder.getSegmentsForOutput()[0].begin());
+  }
+
+  KJ_EXPECT(pool->getStats().misses == 1);
+  KJ_EXPECT(pool->getStats().hits == 0);
+  KJ_EXPECT(pool->getStats().cachedWords == 1024);
+
+  {
+    PooledMessageBuilder builder(kj::addRef(*pool));
+    auto segment = builder.allocateSegment(1);
+    KJ_EXPECT(segment.begin() == firstSegment);
+
+    // The segment must have been fully re-zeroed.
+    for (auto& w: segment) {
+      KJ_ASSERT(*reinterpret_cast<uint64_t*>(&w) == 0);
+    }
+  }
+
+  KJ_EXPECT(pool->getStats().hits == 1);
+
+  {
+    PooledMessageBuilder builder(kj::addRef(*pool));
+    checkTestMessageAllZero(builder.initRoot<TestAllTypes>());
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+  }
+
+  KJ_EXPECT(pool->getStats().hits == 2);
+  KJ_EXPECT(pool->getStats().misses == 1);
+}
+
+KJ_TEST("PooledMessageBuilder multi-segment and limits") {
+  // A pool which can only hold 100 words caches a 64-word segment but not a 128-word one.
+  auto pool = kj::refcounted<MessageBuilderPool>(100);
+
+  {
+    PooledMessageBuilder builder(kj::addRef(*pool), 0, AllocationStrategy::FIXED_SIZE);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    KJ_EXPECT(builder.getSegmentsForOutput().size() > 1);
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+  }
+
+  KJ_EXPECT(pool->getStats().cachedWords == 64);
+
+  {
+    PooledMessageBuilder builder(kj::addRef(*pool), 0, AllocationStrategy::FIXED_SIZE);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+  }
+
+  KJ_EXPECT(pool->getStats().hits > 0);
+  KJ_EXPECT(pool->getStats().cachedWords == 64);
+
+  // Disabled pools never cache.
+  auto disabled = kj::refcounted<MessageBuilderPool>(0);
+  {
+    PooledMessageBuilder builder(kj::addRef(*disabled));
+    initTestMessage(builder.initRoot<TestAllTypes>());
+  }
+  KJ_EXPECT(disabled->getStats().cachedWords == 0);
+}
+
+KJ_TEST("PooledMessageBuilder with a caller-provided first segment") {
+  auto pool = kj::refcounted<MessageBuilderPool>();
+
+  word scratch[16];
+  memset(scratch, 0, sizeof(scratch));
+  {
+    PooledMessageBuilder builder(kj::addRef(*pool), scratch);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+
+    auto segments = builder.getSegmentsForOutput();
+    KJ_EXPECT(segments.size() > 1);
+    KJ_EXPECT(segments[0].begin() == scratch);
+  }
+
+  // Only the segments after the first came from, and went back to, the pool.
+  KJ_EXPECT(pool->getStats().misses > 0);
+  KJ_EXPECT(pool->getStats().cachedWords > 0);
+  size_t cachedWords = pool->getStats().cachedWords;
+
+  // A one-word scratch segment holds just the root pointer.
+  word tiny[1];
+  memset(tiny, 0, sizeof(tiny));
+  {
+    PooledMessageBuilder builder(kj::addRef(*pool), tiny);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    KJ_EXPECT(builder.getSegmentsForOutput()[0].begin() == tiny);
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+  }
+  KJ_EXPECT(pool->getStats().cachedWords >= cachedWords);
+}
+
+class DirtyMessageBuilder final: public MessageBuilder {
+  // Hands out segments full of garbage, relying on lazy zeroing.
+
+public:
+  DirtyMessageBuilder(uint segmentWords)
+      : MessageBuilder(SegmentZeroing::LAZY), segmentWords(segmentWords) {}
+
+  kj::ArrayPtr<word> allocateSegment(uint minimumSize) override {
+    auto segment = kj::heapArray<word>(kj::max(minimumSize, segmentWords));
+    memset(segment.asBytes().begin(), 0xff, segment.asBytes().size());
+    auto result = segment.asPtr();
+    segments.add(kj::mv(segment));
+    return result;
+  }
+
+  kj::Vector<kj::Array<word>> segments;
+
+private:
+  uint segmentWords;
+};
+
+KJ_TEST("lazily-zeroed MessageBuilder") {
+  {
+    DirtyMessageBuilder builder(8192);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+    checkTestMessage(readMessageUnchecked<TestAllTypes>(builder.getSegmentsForOutput()[0].begin()));
+
+    // Space well past the end of the message was never touched.
+    KJ_ASSERT(builder.segments.size() == 1);
+    auto segment = builder.segments[0].asPtr();
+    size_t used = builder.getSegmentsForOutput()[0].size();
+    KJ_ASSERT(used + 1024 < segment.size());
+    for (auto& w: segment.slice(used + 1024, segment.size())) {
+      KJ_ASSERT(*reinterpret_cast<uint64_t*>(&w) == ~uint64_t(0));
+    }
+  }
+
+  {
+    // Lots of tiny segments.
+    DirtyMessageBuilder builder(1);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    KJ_EXPECT(builder.getSegmentsForOutput().size() > 1);
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+  }
+
+  {
+    // Growing a list in place extends into garbage, which must come back zero'd.
+    DirtyMessageBuilder builder(8192);
+    auto orphan = builder.getOrphanage().newOrphan<List<uint64_t>>(4);
+    orphan.truncate(400);
+    for (auto value: orphan.getReader()) {
+      KJ_EXPECT(value == 0);
+    }
+  }
+
+  {
+    MallocMessageBuilder builder(
+        SUGGESTED_FIRST_SEGMENT_WORDS, SUGGESTED_ALLOCATION_STRATEGY, SegmentZeroing::LAZY);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+  }
+}
+
+KJ_TEST("MessageSizePredictor") {
+  MessageSizePredictor predictor(0.9, 10, 100);
+  KJ_EXPECT(predictor.predictFirstSegmentWords() == 100);
+
+  // Nine small messages and one big one: the 90th percentile is the big one.
+  for (uint i = 0; i < 9; i++) predictor.record(10 + i);
+  KJ_EXPECT(predictor.predictFirstSegmentWords() == 18);
+  predictor.record(1000);
+  KJ_EXPECT(predictor.predictFirstSegmentWords() == 1000);
+
+  // Old samples fall out of the window.
+  for (uint i = 0; i < 10; i++) predictor.record(50);
+  KJ_EXPECT(predictor.predictFirstSegmentWords() == 50);
+
+  predictor.record(40, 50);
+  predictor.record(60, 50);
+  auto stats = predictor.getStats();
+  KJ_EXPECT(stats.hits == 1);
+  KJ_EXPECT(stats.misses == 1);
+  KJ_EXPECT(stats.unusedWords == 10);
+}
+
+KJ_TEST("MallocMessageBuilder learns first segment size") {
+  MessageSizePredictor predictor(1.0, 8, 1);
+
+  size_t size;
+  {
+    MallocMessageBuilder builder(predictor);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    KJ_EXPECT(builder.getSegmentsForOutput().size() > 1);
+    size = builder.sizeInWords();
+  }
+
+  // Having seen one message, the predictor's first segment fits the next one.
+  KJ_EXPECT(predictor.predictFirstSegmentWords() >= size);
+  {
+    MallocMessageBuilder builder(predictor);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    KJ_EXPECT(builder.getSegmentsForOutput().size() == 1);
+  }
+
+  auto stats = predictor.getStats();
+  KJ_EXPECT(stats.misses == 1);
+  KJ_EXPECT(stats.hits == 1);
+}
+
+void initBigMessage(TestAllTypes::Builder root, uint count) {
+  auto structs = root.initStructList(count);
+  auto texts = root.initTextList(count);
+  for (uint i = 0; i < count; i++) {
+    auto element = structs[i];
+    element.setUInt32Field(i);
+    element.setTextField(kj::str("element ", i));
+    if (i % 7 == 0) {
+      element.initInt32List(i % 5);
+      element.initStructField().setTextField("nested");
+    }
+    texts.set(i, kj::str(i));
+  }
+}
+
+ParallelOptions testParallelOptions() {
+  ParallelOptions result;
+  result.threadCount = 4;
+  result.minListElements = 100;
+  return result;
+}
+
+KJ_TEST("parallel totalSize()") {
+  // Use lots of small segments so that the traversal follows far pointers.
+  MallocMessageBuilder builder(1024, AllocationStrategy::FIXED_SIZE);
+  initBigMessage(builder.initRoot<TestAllTypes>(), 5000);
+  KJ_ASSERT(builder.getSegmentsForOutput().size() > 1);
+
+  auto root = builder.getRoot<TestAllTypes>().asReader();
+  auto expected = root.totalSize();
+  auto actual = totalSize(root, testParallelOptions());
+  KJ_EXPECT(actual.wordCount == expected.wordCount);
+  KJ_EXPECT(actual.capCount == expected.capCount);
+
+  SegmentArrayMessageReader reader(builder.getSegmentsForOutput());
+  auto list = reader.getRoot<TestAllTypes>().getTextList();
+  KJ_EXPECT(totalSize(list, testParallelOptions()).wordCount == list.totalSize().wordCount);
+}
+
+KJ_TEST("parallel isCanonical()") {
+  MallocMessageBuilder builder;
+  initBigMessage(builder.initRoot<TestAllTypes>(), 5000);
+
+  // The builder's own layout doesn't truncate struct data sections, so isn't canonical.
+  {
+    SegmentArrayMessageReader reader(builder.getSegmentsForOutput());
+    KJ_EXPECT(!reader.isCanonical());
+    KJ_EXPECT(!reader.isCanonical(testParallelOptions()));
+  }
+
+  auto canonical = canonicalize(builder.getRoot<TestAllTypes>().asReader());
+  kj::ArrayPtr<const word> segments[1] = { canonical };
+  {
+    SegmentArrayMessageReader reader(segments);
+    KJ_EXPECT(reader.isCanonical());
+    KJ_EXPECT(reader.isCanonical(testParallelOptions()));
+  }
+
+
+  // A list of texts is canonical if the texts are laid out in order.  Swapping two of them keeps
+  // every chunk's size the same, but must still be detected.
+  for (bool swap: {false, true}) {
+    MallocMessageBuilder texts(100000);
+    auto list = texts.getRoot<AnyPointer>().initAs<List<Text>>(5000);
+    for (uint i = 0; i < 5000; i++) {
+      uint j = swap && i == 1000 ? 1001 : swap && i == 1001 ? 1000 : i;
+      list.set(j, kj::str(j));
+    }
+    KJ_ASSERT(texts.getSegmentsForOutput().size() == 1);
+
+    SegmentArrayMessageReader reader(texts.getSegmentsForOutput());
+    KJ_EXPECT(reader.isCanonical() == !swap);
+    KJ_EXPECT(reader.isCanonical(testParallelOptions()) == !swap);
+  }
+}
+
+KJ_TEST("parallel setRoot()") {
+  MallocMessageBuilder source(1024, AllocationStrategy::FIXED_SIZE);
+  initBigMessage(source.initRoot<TestAllTypes>(), 5000);
+  auto root = source.getRoot<TestAllTypes>().asReader();
+  uint size = root.totalSize().wordCount + 1;
+
+  MallocMessageBuilder sequential(size);
+  sequential.setRoot(root);
+  MallocMessageBuilder parallel(size);
+  parallel.setRoot(root, testParallelOptions());
+
+  // The parallel copy lays everything out in the same order as the sequential one.
+  auto expected = sequential.getSegmentsForOutput();
+  auto actual = parallel.getSegmentsForOutput();
+  KJ_ASSERT(expected.size() == 1);
+  KJ_ASSERT(actual.size() == 1);
+  KJ_EXPECT(expected[0].asBytes() == actual[0].asBytes());
+
+  // Copying into a segment too small for the whole list still works, via far pointers.
+  MallocMessageBuilder small(1024, AllocationStrategy::FIXED_SIZE);
+  small.setRoot(root, testParallelOptions());
+  auto list = small.getRoot<TestAllTypes>().getStructList();
+  KJ_ASSERT(list.size() == 5000);
+  KJ_EXPECT(list[4321].asReader().getTextField() == "element 4321");
+}
+
+KJ_TEST("parallel traversal honors the traversal limit") {
+  MallocMessageBuilder builder;
+  initBigMessage(builder.initRoot<TestAllTypes>(), 5000);
+  auto canonical = canonicalize(builder.getRoot<TestAllTypes>().asReader());
+  kj::ArrayPtr<const word> segments[1] = { canonical };
+
+  ReaderOptions options;
+  options.traversalLimitInWords = canonical.size() * 3 / 2;
+
+  // Reads by all threads count against the one limit, so the second traversal exceeds it.
+  for (bool useThreads: {false, true}) {
+    SegmentArrayMessageReader reader(segments, options);
+    auto parallel = testParallelOptions();
+    if (!useThreads) parallel.threadCount = 1;
+    KJ_EXPECT(reader.isCanonical(parallel));
+    KJ_EXPECT_THROW_MESSAGE("traversal limit", reader.isCanonical(parallel));
+  }
+
+  options.traversalLimitInWords = canonical.size() / 2;
+  SegmentArrayMessageReader reader(segments, options);
+  KJ_EXPECT_THROW_MESSAGE("traversal limit",
+      totalSize(reader.getRoot<TestAllTypes>(), testParallelOptions()));
+}
+
 // TODO(test):  More tests.
 
 }  // namespace
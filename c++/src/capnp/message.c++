@@ -26,6 +26,7 @@
 #include <kj/debug.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <algorithm>
 
 namespace capnp {
 
@@ -53,6 +54,10 @@ MessageReader::~MessageReader() noexcept(false) {
 }
 
 bool MessageReader::isCanonical() {
+  return isCanonical(ParallelOptions { 1 });
+}
+
+bool MessageReader::isCanonical(const ParallelOptions& parallel) {
   if (!allocatedArena) {
     static_assert(sizeof(_::ReaderArena) <= sizeof(arenaSpace),
         "arenaSpace is too small to hold a ReaderArena.  Please increase it.  This will break "
@@ -77,7 +82,7 @@ bool MessageReader::isCanonical() {
   bool rootIsCanonical = _::PointerReader::getRoot(segment, nullptr,
                                                    segment->getStartPtr(),
                                                    this->getOptions().nestingLimit)
-                                                  .isCanonical(&readHead);
+                                                  .isCanonical(&readHead, &parallel);
   bool allWordsConsumed = segment->getOffsetTo(readHead) == segment->getSize();
   return rootIsCanonical && allWordsConsumed;
 }
@@ -112,6 +117,9 @@ AnyPointer::Reader MessageReader::getRootInternal() {
 
 MessageBuilder::MessageBuilder(): allocatedArena(false) {}
 
+MessageBuilder::MessageBuilder(SegmentZeroing segmentZeroing)
+    : allocatedArena(false), segmentZeroing(segmentZeroing) {}
+
 MessageBuilder::~MessageBuilder() noexcept(false) {
   if (allocatedArena) {
     kj::dtor(*arena());
@@ -210,14 +218,23 @@ kj::ArrayPtr<const word> SegmentArrayMessageReader::getSegment(uint id) {
 // -------------------------------------------------------------------
 
 MallocMessageBuilder::MallocMessageBuilder(
-    uint firstSegmentWords, AllocationStrategy allocationStrategy)
-    : nextSize(firstSegmentWords), allocationStrategy(allocationStrategy),
-      ownFirstSegment(true), returnedFirstSegment(false), firstSegment(nullptr) {}
+    uint firstSegmentWords, AllocationStrategy allocationStrategy, SegmentZeroing segmentZeroing)
+    : MessageBuilder(segmentZeroing), nextSize(firstSegmentWords),
+      allocationStrategy(allocationStrategy), ownFirstSegment(true), returnedFirstSegment(false), firstSegment(nullptr) {}
+
+MallocMessageBuilder::MallocMessageBuilder(
+    MessageSizePredictor& predictor, AllocationStrategy allocationStrategy,
+    SegmentZeroing segmentZeroing)
+    : MallocMessageBuilder(predictor.predictFirstSegmentWords(), allocationStrategy,
+                           segmentZeroing) {
+  this->predictor = &predictor;
+}
 
 MallocMessageBuilder::MallocMessageBuilder(
     kj::ArrayPtr<word> firstSegment, AllocationStrategy allocationStrategy)
     : nextSize(firstSegment.size()), allocationStrategy(allocationStrategy),
-      ownFirstSegment(false), returnedFirstSegment(false), firstSegment(firstSegment.begin()) {
+      ownFirstSegment(false), returnedFirstSegment(false), firstSegment(firstSegment.begin()),
+      firstSegmentSize(firstSegment.size()) {
   KJ_REQUIRE(firstSegment.size() > 0, "First segment size must be non-zero.");
 
   // Checking just the first word should catch most cases of failing to zero the segment.
@@ -227,6 +244,10 @@ MallocMessageBuilder::MallocMessageBuilder(
 
 MallocMessageBuilder::~MallocMessageBuilder() noexcept(false) {
   if (returnedFirstSegment) {
+    KJ_IF_MAYBE(p, predictor) {
+      p->record(sizeInWords(), firstSegmentSize);
+    }
+
     if (ownFirstSegment) {
       free(firstSegment);
     } else {
@@ -265,13 +286,23 @@ kj::ArrayPtr<word> MallocMessageBuilder::allocateSegment(uint minimumSize) {
 
   uint size = kj::max(minimumSize, nextSize);
 
-  void* result = calloc(size, sizeof(word));
-  if (result == nullptr) {
-    KJ_FAIL_SYSCALL("calloc(size, sizeof(word))", ENOMEM, size);
+  void* result;
+  if (getSegmentZeroing() == SegmentZeroing::LAZY) {
+    // The arena zeroes space as it hands it out, so there's no need to touch it here.
+    result = malloc(size * sizeof(word));
+    if (result == nullptr) {
+      KJ_FAIL_SYSCALL("malloc(size * sizeof(word))", ENOMEM, size);
+    }
+  } else {
+    result = calloc(size, sizeof(word));
+    if (result == nullptr) {
+      KJ_FAIL_SYSCALL("calloc(size, sizeof(word))", ENOMEM, size);
+    }
   }
 
   if (!returnedFirstSegment) {
     firstSegment = result;
+    firstSegmentSize = size;
     returnedFirstSegment = true;
 
     // After the first segment, we want nextSize to equal the total size allocated so far.
@@ -291,6 +322,188 @@ kj::ArrayPtr<word> MallocMessageBuilder::allocateSegment(uint minimumSize) {
 
 // -------------------------------------------------------------------
 
+MessageSizePredictor::MessageSizePredictor(double percentile, uint windowSize, uint initialWords)
+    : percentile(percentile),
+      samples(kj::heapArray<uint>(windowSize)),
+      scratch(kj::heapArray<uint>(windowSize)),
+      prediction(initialWords) {
+  KJ_REQUIRE(percentile >= 0 && percentile <= 1, "percentile must be between 0 and 1",
+             percentile);
+  KJ_REQUIRE(windowSize > 0, "windowSize must be non-zero");
+}
+
+MessageSizePredictor::~MessageSizePredictor() noexcept(false) {}
+
+uint MessageSizePredictor::predictFirstSegmentWords() {
+  if (predictionStale) {
+    auto recent = scratch.slice(0, sampleCount);
+    memcpy(recent.begin(), samples.begin(), recent.size() * sizeof(uint));
+
+    auto nth = recent.begin() + kj::min(
+        static_cast<size_t>(percentile * recent.size()), recent.size() - 1);
+    std::nth_element(recent.begin(), nth, recent.end());
+    prediction = kj::max(*nth, 1u);
+    predictionStale = false;
+  }
+  return prediction;
+}
+
+void MessageSizePredictor::record(size_t messageWords) {
+  // A first segment can't exceed MAX_SEGMENT_WORDS anyway, so clamp there.
+  samples[nextSample] = kj::min(messageWords, unbound(MAX_SEGMENT_WORDS / WORDS));
+  nextSample = (nextSample + 1) % samples.size();
+  if (sampleCount < samples.size()) ++sampleCount;
+  predictionStale = true;
+}
+
+void MessageSizePredictor::record(size_t messageWords, uint firstSegmentWords) {
+  if (messageWords <= firstSegmentWords) {
+    ++hits;
+    unusedWords += firstSegmentWords - messageWords;
+  } else {
+    ++misses;
+  }
+  record(messageWords);
+}
+
+MessageSizePredictor::Stats MessageSizePredictor::getStats() {
+  return { hits, misses, unusedWords, predictFirstSegmentWords() };
+}
+
+// -------------------------------------------------------------------
+
+MessageBuilderPool::MessageBuilderPool(size_t maxCachedWords, uint maxSegmentWords)
+    : maxCachedWords(maxCachedWords),
+      maxSegmentWords(kj::min(maxSegmentWords, MIN_POOLED_WORDS << (SIZE_CLASS_COUNT - 1))),
+      stats { 0, 0, 0 } {}
+
+MessageBuilderPool::~MessageBuilderPool() noexcept(false) {
+  for (auto& freeList: freeLists) {
+    for (word* segment: freeList) {
+      free(segment);
+    }
+  }
+}
+
+kj::ArrayPtr<word> MessageBuilderPool::allocate(uint minimumSize) {
+  uint size = minimumSize;
+
+  if (maxCachedWords > 0 && minimumSize <= maxSegmentWords) {
+    // Round up to a size class.
+    uint sizeClass = 0;
+    size = MIN_POOLED_WORDS;
+    while (size < minimumSize) {
+      size <<= 1;
+      ++sizeClass;
+    }
+
+    auto& freeList = freeLists[sizeClass];
+    if (!freeList.empty()) {
+      word* result = freeList.back();
+      freeList.removeLast();
+      stats.cachedWords -= size;
+      ++stats.hits;
+      return kj::arrayPtr(result, size);
+    }
+  }
+
+  ++stats.misses;
+  void* result = calloc(size, sizeof(word));
+  if (result == nullptr) {
+    KJ_FAIL_SYSCALL("calloc(size, sizeof(word))", ENOMEM, size);
+  }
+  return kj::arrayPtr(reinterpret_cast<word*>(result), size);
+}
+
+void MessageBuilderPool::release(kj::ArrayPtr<word> segment, size_t usedWords) {
+  size_t size = segment.size();
+
+  // Only power-of-two sizes in range can have come from a free list. Anything else was allocated
+  // with an exact size because it didn't fit any size class.
+  bool poolable = size >= MIN_POOLED_WORDS && size <= maxSegmentWords && (size & (size - 1)) == 0;
+
+  if (poolable && stats.cachedWords + size <= maxCachedWords) {
+    uint sizeClass = 0;
+    while ((size_t(MIN_POOLED_WORDS) << sizeClass) < size) ++sizeClass;
+
+    memset(segment.begin(), 0, usedWords * sizeof(word));
+    freeLists[sizeClass].add(segment.begin());
+    stats.cachedWords += size;
+  } else {
+    free(segment.begin());
+  }
+}
+
+PooledMessageBuilder::PooledMessageBuilder(
+    kj::Own<MessageBuilderPool> pool, uint firstSegmentWords, AllocationStrategy allocationStrategy)
+    : pool(kj::mv(pool)), nextSize(firstSegmentWords), allocationStrategy(allocationStrategy) {}
+
+PooledMessageBuilder::PooledMessageBuilder(
+    kj::Own<MessageBuilderPool> pool, kj::ArrayPtr<word> firstSegment,
+    AllocationStrategy allocationStrategy)
+    : pool(kj::mv(pool)), nextSize(firstSegment.size()), allocationStrategy(allocationStrategy),
+      scratch(firstSegment) {}
+
+PooledMessageBuilder::~PooledMessageBuilder() noexcept(false) {
+  if (firstSegment == nullptr) return;
+
+  // Each segment in the arena starts at the beginning of one of our allocations, and its size in
+  // getSegmentsForOutput() is exactly the portion that may have been written to.
+  auto used = getSegmentsForOutput();
+  auto usedWordsOf = [&](kj::ArrayPtr<word> segment) -> size_t {
+    for (auto& s: used) {
+      if (s.begin() == segment.begin()) return s.size();
+    }
+    // Shouldn't happen, but be conservative.
+    return segment.size();
+  };
+
+  if (!firstSegmentIsScratch) {
+    pool->release(firstSegment, usedWordsOf(firstSegment));
+  }
+  for (auto segment: moreSegments) {
+    pool->release(segment, usedWordsOf(segment));
+  }
+}
+
+kj::ArrayPtr<word> PooledMessageBuilder::allocateSegment(uint minimumSize) {
+  KJ_REQUIRE(bounded(minimumSize) * WORDS <= MAX_SEGMENT_WORDS,
+      "PooledMessageBuilder asked to allocate segment above maximum serializable size.");
+  KJ_ASSERT(bounded(nextSize) * WORDS <= MAX_SEGMENT_WORDS,
+      "PooledMessageBuilder nextSize out of bounds.");
+
+  kj::ArrayPtr<word> result;
+  if (firstSegment == nullptr && scratch != nullptr && minimumSize <= scratch.size()) {
+    result = scratch;
+    firstSegmentIsScratch = true;
+  } else {
+    result = pool->allocate(kj::max(minimumSize, nextSize));
+  }
+  scratch = nullptr;
+
+  // Size classes may have rounded the segment past the maximum segment size; trim it if so.
+  uint size = kj::min(result.size(), unbound(MAX_SEGMENT_WORDS / WORDS));
+
+  if (firstSegment == nullptr) {
+    firstSegment = result;
+
+    // After the first segment, we want nextSize to equal the total size allocated so far.
+    if (allocationStrategy == AllocationStrategy::GROW_HEURISTICALLY) nextSize = size;
+  } else {
+    moreSegments.add(result);
+    if (allocationStrategy == AllocationStrategy::GROW_HEURISTICALLY) {
+      // set nextSize = min(nextSize+size, MAX_SEGMENT_WORDS)
+      // while protecting against possible overflow of (nextSize+size)
+      nextSize = (size <= unbound(MAX_SEGMENT_WORDS / WORDS) - nextSize)
+          ? nextSize + size : unbound(MAX_SEGMENT_WORDS / WORDS);
+    }
+  }
+
+  return result.slice(0, size);
+}
+
+// -------------------------------------------------------------------
+
 FlatMessageBuilder::FlatMessageBuilder(kj::ArrayPtr<word> array): array(array), allocated(false) {}
 FlatMessageBuilder::~FlatMessageBuilder() noexcept(false) {}
 
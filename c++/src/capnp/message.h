@@ -24,6 +24,7 @@
 #include <kj/common.h>
 #include <kj/memory.h>
 #include <kj/mutex.h>
+#include <kj/refcount.h>
 #include <kj/debug.h>
 #include <kj/vector.h>
 #include "capnp/common.h"
@@ -82,6 +83,28 @@ struct ReaderOptions {
   // stack overflow, yet high enough that it is never a problem in practice.
 };
 
+struct ParallelOptions {
+  // Options controlling multi-threaded traversal of very large messages, used by the overloads
+  // of totalSize(), MessageReader::isCanonical() and MessageBuilder::setRoot() which accept them.
+  //
+  // Only lists are split up:  when the traversal reaches a list of pointers or structs with at
+  // least `minListElements` elements, the elements are divided into chunks which are processed by
+  // `threadCount` threads (including the calling thread), each claiming the next unprocessed chunk
+  // when it finishes one.  Everything else, including the contents of each element, is traversed
+  // sequentially as usual.  The results are identical to the single-threaded versions, and reads
+  // are charged to the message's traversal limit exactly as if a single thread had done them.
+  //
+  // Threads are started for each parallel list and joined before returning, so this only pays off
+  // for lists with a lot of content; for anything smaller, use the plain versions.
+
+  uint threadCount = 0;
+  // Number of threads to use, including the calling thread.  Zero means one per hardware thread.
+  // One disables parallelism.
+
+  uint minListElements = 16384;
+  // Lists with fewer elements than this are processed sequentially.
+};
+
 class MessageReader {
   // Abstract interface for an object used to read a Cap'n Proto message.  Subclasses of
   // MessageReader are responsible for reading the raw, flat message content.  Callers should
@@ -119,6 +142,7 @@ public:
   // use this.
 
   bool isCanonical();
+  bool isCanonical(const ParallelOptions& parallel);
   // Returns whether the message encoded in the reader is in canonical form.
 
   size_t sizeInWords();
@@ -144,6 +168,19 @@ private:
   AnyPointer::Reader getRootInternal();
 };
 
+enum class SegmentZeroing: uint8_t {
+  EAGER,
+  // The MessageBuilder's allocateSegment() returns memory that is already zero'd.  This is the
+  // default, and lets the builder hand out space without touching it first.
+
+  LAZY
+  // The MessageBuilder's allocateSegment() may return uninitialized memory.  Each segment tracks
+  // the high-water mark of the space zero'd so far, and the builder zeroes memory in small chunks
+  // only as objects are actually allocated in it.  This avoids paying for zeroing (or for
+  // calloc() faulting in fresh pages) across a large segment when only a small message is built
+  // in it.
+};
+
 class MessageBuilder {
   // Abstract interface for an object used to allocate and build a message.  Subclasses of
   // MessageBuilder are responsible for allocating the space in which the message will be written.
@@ -199,7 +236,11 @@ public:
   //
   // allocateSegment() is responsible for zeroing the memory before returning. This is required
   // because otherwise the Cap'n Proto implementation would have to zero the memory anyway, and
-  // many allocators are able to provide already-zero'd memory more efficiently.
+  // many allocators are able to provide already-zero'd memory more efficiently.  The exception is
+  // a builder constructed with `SegmentZeroing::LAZY`, whose segments may be uninitialized.
+
+  inline SegmentZeroing getSegmentZeroing() { return segmentZeroing; }
+  // Whether segments returned by allocateSegment() are already zero'd.
 
   template <typename RootType>
   typename RootType::Builder initRoot();
@@ -209,6 +250,11 @@ public:
   void setRoot(Reader&& value);
   // Set the root struct to a deep copy of the given struct.
 
+  template <typename Reader>
+  void setRoot(Reader&& value, const ParallelOptions& parallel);
+  // Like setRoot(), but large lists within `value` may be copied by multiple threads.  Falls back
+  // to a single thread for lists containing capabilities.
+
   template <typename RootType>
   typename RootType::Builder getRoot();
   // Get the root struct of the message, interpreting it as the given struct type.
@@ -240,6 +286,10 @@ public:
   size_t sizeInWords();
   // Add up the allocated space from all segments.
 
+protected:
+  explicit MessageBuilder(SegmentZeroing segmentZeroing);
+  // For subclasses whose allocateSegment() does not zero its result; see `SegmentZeroing`.
+
 private:
   alignas(8) void* arenaSpace[22];
   // Space in which we can construct a BuilderArena.  We don't use BuilderArena directly here
@@ -254,6 +304,8 @@ private:
   // isn't constructed yet.  This is kind of annoying because it means that getOrphanage() is
   // not thread-safe, but that shouldn't be a huge deal...
 
+  SegmentZeroing segmentZeroing = SegmentZeroing::EAGER;
+
   _::BuilderArena* arena() { return reinterpret_cast<_::BuilderArena*>(arenaSpace); }
   _::SegmentBuilder* getRootSegment();
   AnyPointer::Builder getRootInternal();
@@ -371,6 +423,71 @@ enum class AllocationStrategy: uint8_t {
 constexpr uint SUGGESTED_FIRST_SEGMENT_WORDS = 1024;
 constexpr AllocationStrategy SUGGESTED_ALLOCATION_STRATEGY = AllocationStrategy::GROW_HEURISTICALLY;
 
+class MessageSizePredictor {
+  // Learns a good first segment size from the sizes of messages actually built.
+  //
+  // SUGGESTED_FIRST_SEGMENT_WORDS is a one-size-fits-all guess.  When a particular call site (or
+  // a particular message type) consistently builds much smaller messages, the first segment
+  // wastes memory; when it builds much larger ones, the message spills into many segments and
+  // needs far pointers.  A MessageSizePredictor keeps a window of recent message sizes and
+  // suggests the given percentile of them for the next message.
+  //
+  // Typically you keep one predictor per call site or per root type, and pass it to
+  // MallocMessageBuilder, which records the final size of each message when it is destroyed.  You
+  // can also call record() yourself, e.g. with computeSerializedSizeInWords() after writing.
+  //
+  // A MessageSizePredictor is not thread-safe.
+
+public:
+  explicit MessageSizePredictor(double percentile = 0.9, uint windowSize = 64,
+                                uint initialWords = SUGGESTED_FIRST_SEGMENT_WORDS);
+  // `percentile` (between 0 and 1) is the fraction of recent messages that the prediction should
+  // fit in one segment.  `windowSize` is how many recent sizes are considered.  `initialWords` is
+  // used until the first size is recorded.
+
+  KJ_DISALLOW_COPY_AND_MOVE(MessageSizePredictor);
+  ~MessageSizePredictor() noexcept(false);
+
+  uint predictFirstSegmentWords();
+  // Returns the suggested firstSegmentWords for the next message.
+
+  void record(size_t messageWords);
+  // Records the size of a message.  Updates the sample window but not the hit / miss stats.
+
+  void record(size_t messageWords, uint firstSegmentWords);
+  // Records the size of a message built with the given first segment size, and updates the
+  // stats according to whether it fit.
+
+  struct Stats {
+    uint64_t hits;
+    // Messages which fit entirely in the predicted first segment.
+
+    uint64_t misses;
+    // Messages which needed additional segments.
+
+    uint64_t unusedWords;
+    // Total words allocated to first segments of hits but not used by the message.
+
+    uint currentPrediction;
+    // What predictFirstSegmentWords() would currently return.
+  };
+
+  Stats getStats();
+
+private:
+  double percentile;
+  kj::Array<uint> samples;
+  kj::Array<uint> scratch;
+  uint sampleCount = 0;
+  uint nextSample = 0;
+  uint prediction;
+  bool predictionStale = false;
+
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t unusedWords = 0;
+};
+
 class MallocMessageBuilder: public MessageBuilder {
   // A simple MessageBuilder that uses malloc() (actually, calloc()) to allocate segments.  This
   // implementation should be reasonable for any case that doesn't require writing the message to
@@ -378,7 +495,8 @@ class MallocMessageBuilder: public MessageBuilder {
 
 public:
   explicit MallocMessageBuilder(uint firstSegmentWords = SUGGESTED_FIRST_SEGMENT_WORDS,
-      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY,
+      SegmentZeroing segmentZeroing = SegmentZeroing::EAGER);
   // Creates a BuilderContext which allocates at least the given number of words for the first
   // segment, and then uses the given strategy to decide how much to allocate for subsequent
   // segments.  When choosing a value for firstSegmentWords, consider that:
@@ -390,6 +508,16 @@ public:
   //    zeroing it out becomes a bottleneck.
   // The defaults have been chosen to be reasonable for most people, so don't change them unless you
   // have reason to believe you need to.
+  //
+  // With `SegmentZeroing::LAZY`, segments are allocated with malloc() rather than calloc(), and
+  // only the space actually used by the message is ever zero'd.  This helps when a large
+  // firstSegmentWords is chosen to keep big messages in one segment, but most messages are small.
+
+  explicit MallocMessageBuilder(MessageSizePredictor& predictor,
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY,
+      SegmentZeroing segmentZeroing = SegmentZeroing::EAGER);
+  // Like above, but asks the predictor for firstSegmentWords, and records the final message size
+  // back to the predictor when the builder is destroyed.  The predictor must outlive the builder.
 
   explicit MallocMessageBuilder(kj::ArrayPtr<word> firstSegment,
       AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
@@ -413,9 +541,103 @@ private:
   bool returnedFirstSegment;
 
   void* firstSegment;
+  uint firstSegmentSize = 0;
+  MessageSizePredictor* predictor = nullptr;
+
   kj::Vector<void*> moreSegments;
 };
 
+class MessageBuilderPool: public kj::Refcounted {
+  // A cache of zeroed segments which can be shared by many `PooledMessageBuilder`s, so that
+  // building messages in a loop does not need to call calloc() and free() for every message.
+  //
+  // Segments are kept in free lists by size class (powers of two). When a builder is destroyed,
+  // it zeroes only the words it actually used, then hands its segments back to the pool.
+  // Segments larger than `maxSegmentWords`, and segments that would push the total cached space
+  // above `maxCachedWords`, are freed instead.
+  //
+  // A MessageBuilderPool is not thread-safe. Typically each thread (or each event loop) has its
+  // own pool. Builders hold a reference to their pool, so the pool lives until the last builder
+  // using it is destroyed.
+
+public:
+  explicit MessageBuilderPool(size_t maxCachedWords = 1u << 17,
+                              uint maxSegmentWords = 1u << 16);
+  // `maxCachedWords` bounds the total size of the segments held in the free lists, and
+  // `maxSegmentWords` bounds the size of any single pooled segment. Passing zero for
+  // `maxCachedWords` disables caching, making the pool equivalent to plain calloc() / free().
+
+  KJ_DISALLOW_COPY_AND_MOVE(MessageBuilderPool);
+  ~MessageBuilderPool() noexcept(false);
+
+  struct Stats {
+    uint64_t hits;
+    // Number of segment allocations satisfied from a free list.
+
+    uint64_t misses;
+    // Number of segment allocations that had to call calloc().
+
+    size_t cachedWords;
+    // Total size of the segments currently held in the free lists.
+  };
+
+  Stats getStats() const { return stats; }
+
+private:
+  static constexpr uint MIN_POOLED_WORDS = 64;
+  static constexpr uint SIZE_CLASS_COUNT = 24;
+
+  size_t maxCachedWords;
+  uint maxSegmentWords;
+  Stats stats;
+  kj::Vector<word*> freeLists[SIZE_CLASS_COUNT];
+  // freeLists[i] holds zeroed segments of exactly `MIN_POOLED_WORDS << i` words.
+
+  kj::ArrayPtr<word> allocate(uint minimumSize);
+  // Returns a zeroed segment of at least `minimumSize` words.
+
+  void release(kj::ArrayPtr<word> segment, size_t usedWords);
+  // Takes back a segment previously returned by `allocate()`. Only the first `usedWords` words
+  // may be non-zero.
+
+  friend class PooledMessageBuilder;
+};
+
+class PooledMessageBuilder: public MessageBuilder {
+  // A MessageBuilder which allocates its segments from a `MessageBuilderPool`, and returns them
+  // to the pool when destroyed. Once the pool has warmed up, building a message performs no
+  // heap allocations for its segments.
+
+public:
+  explicit PooledMessageBuilder(kj::Own<MessageBuilderPool> pool,
+      uint firstSegmentWords = SUGGESTED_FIRST_SEGMENT_WORDS,
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
+  // `firstSegmentWords` and `allocationStrategy` have the same meaning as for
+  // `MallocMessageBuilder`. Segment sizes are rounded up to the pool's size classes.
+
+  PooledMessageBuilder(kj::Own<MessageBuilderPool> pool, kj::ArrayPtr<word> firstSegment,
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
+  // Build the message in `firstSegment`, which must be zeroed and must outlive the builder, going
+  // to the pool only for further segments. `firstSegment` is not given to the pool afterwards.
+
+  KJ_DISALLOW_COPY_AND_MOVE(PooledMessageBuilder);
+  virtual ~PooledMessageBuilder() noexcept(false);
+
+  virtual kj::ArrayPtr<word> allocateSegment(uint minimumSize) override;
+
+private:
+  kj::Own<MessageBuilderPool> pool;
+  uint nextSize;
+  AllocationStrategy allocationStrategy;
+
+  kj::ArrayPtr<word> firstSegment;
+  kj::Vector<kj::ArrayPtr<word>> moreSegments;
+
+  kj::ArrayPtr<word> scratch;
+  // Caller-provided space for the first segment, if any; null once handed out.
+  bool firstSegmentIsScratch = false;
+};
+
 class FlatMessageBuilder: public MessageBuilder {
   // THIS IS NOT THE CLASS YOU'RE LOOKING FOR.
   //
@@ -466,6 +688,12 @@ inline void MessageBuilder::setRoot(Reader&& value) {
   getRootInternal().setAs<FromReader<Reader>>(value);
 }
 
+template <typename Reader>
+void MessageBuilder::setRoot(Reader&& value, const ParallelOptions& parallel) {
+  _::PointerHelpers<AnyPointer>::getInternalBuilder(getRootInternal()).setStruct(
+      _::PointerHelpers<FromReader<Reader>>::getInternalReader(value), false, &parallel);
+}
+
 template <typename RootType>
 inline typename RootType::Builder MessageBuilder::getRoot() {
   return getRootInternal().getAs<RootType>();
@@ -553,6 +781,14 @@ kj::Array<word> canonicalize(T&& reader) {
     return _::PointerHelpers<FromReader<T>>::getInternalReader(reader).canonicalize();
 }
 
+template <typename T>
+MessageSize totalSize(T&& reader, const ParallelOptions& parallel) {
+  // Like `reader.totalSize()`, but large lists may be traversed by multiple threads.  `reader`
+  // may be a struct or list reader.
+  return _::PointerHelpers<FromReader<T>>::getInternalReader(reader).totalSize(&parallel)
+      .asPublic();
+}
+
 }  // namespace capnp
 
 CAPNP_END_HEADER
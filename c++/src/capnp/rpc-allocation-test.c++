@@ -0,0 +1,169 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Tests which count the heap allocations made by the RPC system. This replaces the global
+// operator new, so it's built as its own test binary rather than being part of capnp-heavy-tests.
+
+#define CAPNP_TESTING_CAPNP 1
+
+#include "rpc-twoparty.h"
+#include "test-util.h"
+#include <kj/debug.h>
+#include <kj/test.h>
+#include <stdlib.h>
+#include <new>
+
+static thread_local uint64_t allocationCount = 0;
+// Heap allocations made by the current thread.
+
+void* operator new(size_t size) {
+  ++allocationCount;
+  void* result = malloc(size == 0 ? 1 : size);
+  if (result == nullptr) throw std::bad_alloc();
+  return result;
+}
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+namespace capnp {
+namespace _ {
+namespace {
+
+class AllocationCountingClock final: public kj::MonotonicClock {
+  // A "clock" which reads the current thread's allocation count, so that RpcCallObserver
+  // timestamps tell us how many allocations were made in between.
+public:
+  kj::TimePoint now() const override {
+    return kj::origin<kj::TimePoint>() + allocationCount * kj::NANOSECONDS;
+  }
+};
+
+class CallAllocationObserver final: public RpcCallObserver {
+public:
+  using RpcCallObserver::RpcCallObserver;
+
+  kj::Vector<uint64_t> callAllocations;
+  // For each call, allocations made between reading the `Call` and sending the `Return`, i.e.
+  // through delivery, the server method, and building the response.
+
+  kj::Vector<uint64_t> dispatchAllocations;
+  // For each call, allocations made between reading the `Call` and delivering it to the server.
+
+  void callCompleted(const CallInfo& info) override {
+    callAllocations.add((info.returnSent - info.received) / kj::NANOSECONDS);
+    dispatchAllocations.add((info.dispatched - info.received) / kj::NANOSECONDS);
+  }
+};
+
+class AllocationCountingServer final: public test::TestInterface::Server {
+public:
+  kj::Vector<uint64_t> getResultsAllocations;
+  // For each call, allocations made by getResults().
+
+protected:
+  kj::Promise<void> foo(FooContext context) override {
+    uint64_t before = allocationCount;
+    auto results = context.getResults();
+    getResultsAllocations.add(allocationCount - before);
+    results.setX("foo");
+    return kj::READY_NOW;
+  }
+};
+
+struct CallAllocations {
+  kj::Array<uint64_t> perCall;
+  kj::Array<uint64_t> dispatch;
+  kj::Array<uint64_t> getResults;
+};
+
+constexpr uint CALL_COUNT = 20;
+constexpr uint WARMUP_CALLS = 10;
+
+CallAllocations countCallAllocations(kj::AsyncIoContext& io, bool useArena) {
+  AllocationCountingClock clock;
+  CallAllocationObserver observer(clock);
+
+  auto serverImpl = kj::heap<AllocationCountingServer>();
+  auto& server = *serverImpl;
+
+  // Don't let the vectors that collect the counts grow in the middle of a call.
+  observer.callAllocations.reserve(CALL_COUNT);
+  observer.dispatchAllocations.reserve(CALL_COUNT);
+  server.getResultsAllocations.reserve(CALL_COUNT);
+
+  TwoPartyServer twoPartyServer(kj::mv(serverImpl));
+  twoPartyServer.setMessageBuilderPool(kj::refcounted<MessageBuilderPool>());
+  twoPartyServer.setCallObserver(observer);
+  if (useArena) twoPartyServer.setCallArenaSize(4096);
+  auto pipe = io.provider->newTwoWayPipe();
+  twoPartyServer.accept(kj::mv(pipe.ends[0]));
+
+  TwoPartyClient client(*pipe.ends[1]);
+  auto cap = client.bootstrap().castAs<test::TestInterface>();
+
+  for (uint i = 0; i < CALL_COUNT; i++) {
+    auto request = cap.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    KJ_EXPECT(request.send().wait(io.waitScope).getX() == "foo");
+  }
+
+  // Skip the first calls, which warm up the connection's tables and the message pool.
+  KJ_ASSERT(observer.callAllocations.size() == CALL_COUNT);
+  KJ_ASSERT(server.getResultsAllocations.size() == CALL_COUNT);
+  return {
+    kj::heapArray(observer.callAllocations.slice(WARMUP_CALLS, CALL_COUNT)),
+    kj::heapArray(observer.dispatchAllocations.slice(WARMUP_CALLS, CALL_COUNT)),
+    kj::heapArray(server.getResultsAllocations.slice(WARMUP_CALLS, CALL_COUNT))
+  };
+}
+
+KJ_TEST("per-call arena saves allocations when handling calls") {
+  auto io = kj::setupAsyncIo();
+
+  auto baseline = countCallAllocations(io, false);
+  auto arena = countCallAllocations(io, true);
+
+  for (auto i: kj::indices(baseline.perCall)) {
+    // The arena replaces the context, the response, and the `Return` message's first segment
+    // with one allocation.
+    KJ_EXPECT(arena.perCall[i] + 2 <= baseline.perCall[i], arena.perCall[i], baseline.perCall[i]);
+
+    // What's left is mostly promise nodes, which kj allocates in its own arenas: with the call
+    // arena, reading a `Call` through sending its `Return` takes 12 allocations, not one. Of
+    // those, three are this call's own (the call arena, LocalClient::call()'s promise chain, and
+    // the RpcSystem's wait for the call to finish); four come from LocalClient forking calls which
+    // don't allow cancellation; and the rest are the connection reading its next message and
+    // queuing the `Return` for writing.
+    KJ_EXPECT(arena.perCall[i] <= 12, arena.perCall[i]);
+
+    // Up to delivery, that's the call arena, LocalClient::call()'s promise chain, the RpcSystem's
+    // wait for the call to finish, and the message loop's next turn.
+    KJ_EXPECT(arena.dispatch[i] <= 4, arena.dispatch[i]);
+
+    KJ_EXPECT(arena.getResults[i] == 0, arena.getResults[i]);
+    KJ_EXPECT(baseline.getResults[i] > 0, baseline.getResults[i]);
+  }
+}
+
+}  // namespace
+}  // namespace _
+}  // namespace capnp
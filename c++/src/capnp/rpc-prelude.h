@@ -32,8 +32,10 @@ CAPNP_BEGIN_HEADER
 namespace capnp {
 
 class OutgoingRpcMessage;
+class RpcMessageArena;
 class IncomingRpcMessage;
 class RpcFlowController;
+class RpcCallObserver;
 
 template <typename SturdyRefHostId>
 class RpcSystem;
@@ -59,6 +61,8 @@ public:
     virtual kj::Promise<void> shutdown() = 0;
     virtual AnyStruct::Reader baseGetPeerVatId() = 0;
     virtual kj::Own<RpcFlowController> newStream() = 0;
+    virtual kj::Own<OutgoingRpcMessage> newOutgoingMessageInArena(
+        uint firstSegmentWordSize, RpcMessageArena& arena);
   };
   virtual kj::Maybe<kj::Own<Connection>> baseConnect(AnyStruct::Reader vatId) = 0;
   virtual kj::Promise<kj::Own<Connection>> baseAccept() = 0;
@@ -86,6 +90,8 @@ public:
   ~RpcSystemBase() noexcept(false);
 
   void setTraceEncoder(kj::Function<kj::String(const kj::Exception&)> func);
+  void setCallObserver(kj::Maybe<RpcCallObserver&> observer);
+  void setCallArenaSize(size_t bytes);
 
   kj::Promise<void> run();
 
@@ -0,0 +1,171 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#if __linux__
+
+#define CAPNP_TESTING_CAPNP 1
+
+#include "rpc-shared-memory.h"
+#include "test-util.h"
+#include <kj/debug.h>
+#include <kj/test.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace capnp {
+namespace _ {
+namespace {
+
+void waitForReleases(kj::AsyncIoContext& io, SharedMemoryClient& client) {
+  // Release records are sent asynchronously, so give them a moment to arrive.
+  for (uint i = 0; i < 1000 && client.getStats().ringWordsInUse > 0; i++) {
+    io.provider->getTimer().afterDelay(1 * kj::MILLISECONDS).wait(io.waitScope);
+  }
+}
+
+KJ_TEST("SharedMemoryClient/Server basic calls") {
+  auto io = kj::setupAsyncIo();
+
+  int callCount = 0;
+  SharedMemoryServer server(kj::heap<TestInterfaceImpl>(callCount));
+  auto pipe = io.provider->newCapabilityPipe();
+  server.accept(kj::mv(pipe.ends[0]));
+
+  SharedMemoryClient client(*pipe.ends[1]);
+  auto cap = client.bootstrap().castAs<test::TestInterface>();
+
+  for (int i = 0; i < 10; i++) {
+    auto request = cap.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    auto response = request.send().wait(io.waitScope);
+    KJ_EXPECT(response.getX() == "foo");
+  }
+
+  for (int i = 0; i < 10; i++) {
+    auto request = cap.bazRequest();
+    initTestMessage(request.initS());
+    request.send().wait(io.waitScope);
+  }
+  KJ_EXPECT(callCount == 20);
+
+  auto stats = client.getStats();
+  KJ_EXPECT(stats.sharedMessages >= 20, stats.sharedMessages);
+  KJ_EXPECT(stats.inlineMessages == 0, stats.inlineMessages);
+
+  // Once the server has dropped our messages, their space is reclaimed.
+  waitForReleases(io, client);
+  KJ_EXPECT(client.getStats().ringWordsInUse == 0, client.getStats().ringWordsInUse);
+}
+
+KJ_TEST("SharedMemoryVatNetwork falls back to inline messages when the ring is full") {
+  auto io = kj::setupAsyncIo();
+
+  int callCount = 0;
+  SharedMemoryServer server(kj::heap<TestInterfaceImpl>(callCount), 4096);
+  auto pipe = io.provider->newCapabilityPipe();
+  server.accept(kj::mv(pipe.ends[0]));
+
+  SharedMemoryClient client(*pipe.ends[1], 4096);
+  auto cap = client.bootstrap().castAs<test::TestInterface>();
+
+  // Send several large calls at once so that they can't all fit in the ring.
+  kj::Vector<kj::Promise<void>> promises;
+  for (int i = 0; i < 10; i++) {
+    auto request = cap.bazRequest();
+    initTestMessage(request.initS());
+    promises.add(request.send().ignoreResult());
+  }
+  kj::joinPromises(promises.releaseAsArray()).wait(io.waitScope);
+  KJ_EXPECT(callCount == 10);
+
+  auto stats = client.getStats();
+  KJ_EXPECT(stats.inlineMessages > 0, stats.inlineMessages);
+
+  // Small messages still go through the ring.
+  auto request = cap.fooRequest();
+  request.setI(123);
+  request.setJ(true);
+  KJ_EXPECT(request.send().wait(io.waitScope).getX() == "foo");
+  KJ_EXPECT(client.getStats().sharedMessages > stats.sharedMessages);
+
+  waitForReleases(io, client);
+  KJ_EXPECT(client.getStats().ringWordsInUse == 0, client.getStats().ringWordsInUse);
+}
+
+KJ_TEST("SharedMemoryClient sees server disconnect") {
+  auto io = kj::setupAsyncIo();
+
+  int callCount = 0;
+  auto server = kj::heap<SharedMemoryServer>(kj::heap<TestInterfaceImpl>(callCount));
+  auto pipe = io.provider->newCapabilityPipe();
+  server->accept(kj::mv(pipe.ends[0]));
+
+  SharedMemoryClient client(*pipe.ends[1]);
+  auto cap = client.bootstrap().castAs<test::TestInterface>();
+  auto request = cap.fooRequest();
+  request.setI(123);
+  request.setJ(true);
+  request.send().wait(io.waitScope);
+
+  server = nullptr;
+  auto promise = cap.fooRequest().send();
+  KJ_EXPECT_THROW(DISCONNECTED, promise.wait(io.waitScope));
+}
+
+KJ_TEST("SharedMemoryVatNetwork disconnects a peer which releases messages it wasn't sent") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newCapabilityPipe();
+
+  SharedMemoryVatNetwork network(*pipe.ends[0], rpc::twoparty::Side::SERVER);
+  auto connection = network.accept().wait(io.waitScope);
+
+  // Play the peer by hand: say hello with a ring of our own, then release a message ID that
+  // the network never sent us.
+  constexpr size_t RING_SIZE = 4096;
+  int fd;
+  KJ_SYSCALL(fd = memfd_create("test-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+  kj::AutoCloseFd ownFd(fd);
+  KJ_SYSCALL(ftruncate(fd, RING_SIZE));
+  KJ_SYSCALL(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL));
+
+  word records[4];
+  auto header = reinterpret_cast<WireValue<uint32_t>*>(records);
+  header[0].set(1);  // HELLO
+  header[1].set(1);
+  reinterpret_cast<WireValue<uint64_t>*>(&records[1])->set(RING_SIZE);
+  header[4].set(4);  // RELEASE
+  header[5].set(1);
+  reinterpret_cast<WireValue<uint64_t>*>(&records[3])->set(12345);
+  int fds[1] = { fd };
+  pipe.ends[1]->writeWithFds(kj::arrayPtr(records, 4).asBytes(), nullptr, fds)
+      .wait(io.waitScope);
+
+  KJ_EXPECT_THROW_MESSAGE("peer released a message that we didn't send",
+      connection->receiveIncomingMessage().wait(io.waitScope));
+}
+
+}  // namespace
+}  // namespace _
+}  // namespace capnp
+
+#endif  // __linux__
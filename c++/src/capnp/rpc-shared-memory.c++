@@ -0,0 +1,727 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "capnp/rpc-shared-memory.h"
+#include "capnp/serialize.h"
+#include <kj/debug.h>
+
+#if __linux__
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace capnp {
+
+namespace {
+
+// Everything sent over the socket is a sequence of records.  Each record is one header word --
+// a 32-bit type followed by a 32-bit payload size in words -- followed by the payload.  All
+// integers are little-endian.
+
+enum RecordType: uint32_t {
+  HELLO = 1,
+  // First record in each direction, sent with the sender's ring attached as a file descriptor.
+  // Payload:  one word, the size of the ring in bytes.
+
+  MESSAGE = 2,
+  // A message in the sender's ring.  Payload:  the message ID (a 64-bit integer chosen by the
+  // sender), then one word per segment giving its offset and size in words (32 bits each).
+
+  INLINE = 3,
+  // A message which didn't fit in the ring.  Payload:  the message in standard stream format.
+
+  RELEASE = 4
+  // The receiver has dropped some messages, so the sender may reuse their space.  Payload:  the
+  // IDs of the released messages, one per word.
+};
+
+constexpr uint MAX_SEGMENTS = 512;
+constexpr uint MAX_RELEASES_PER_RECORD = 8192;
+
+}  // namespace
+
+// =======================================================================================
+
+class SharedMemoryVatNetwork::SendRing {
+  // The ring in which we build outgoing messages.  Space is handed out in allocation order and
+  // reclaimed from the oldest end as messages are released.  A message released out of order
+  // holds up reclamation of the space after it until everything older has been released, too.
+
+public:
+  explicit SendRing(size_t size) {
+#if __linux__
+    size = size / sizeof(word) * sizeof(word);
+    KJ_REQUIRE(size >= 4096 && size / sizeof(word) <= 0xffffffffu, "bad ring size", size);
+
+    int fd;
+    KJ_SYSCALL(fd = memfd_create("capnp-rpc-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    kj::AutoCloseFd ownFd(fd);
+    KJ_SYSCALL(ftruncate(fd, size));
+
+    // The peer refuses rings which could be shrunk out from under it.
+    KJ_SYSCALL(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL));
+
+    file = kj::newDiskFile(kj::mv(ownFd));
+    mapping = file->mmapWritable(0, size);
+    auto bytes = mapping->get();
+    space = kj::arrayPtr(reinterpret_cast<word*>(bytes.begin()), bytes.size() / sizeof(word));
+#else
+    KJ_UNIMPLEMENTED("SharedMemoryVatNetwork is only implemented on Linux.");
+#endif
+  }
+
+  int getFd() { return KJ_ASSERT_NONNULL(file->getFd()); }
+  size_t size() { return space.size() * sizeof(word); }
+  size_t getWordsInUse() { return wordsInUse; }
+
+  kj::Maybe<kj::ArrayPtr<word>> allocate(size_t words, uint64_t owner) {
+    // Returns uninitialized space, or null if there isn't enough contiguous free space.
+
+    size_t offset;
+    if (firstLive == blocks.size()) {
+      if (words > space.size()) return nullptr;
+      offset = 0;
+    } else {
+      size_t head = blocks[firstLive].offset;
+      auto& last = blocks.back();
+      size_t tail = last.offset + last.size;
+      if (last.offset >= head) {
+        // Live space doesn't wrap around; we can use the end of the ring or the beginning.
+        if (space.size() - tail >= words) {
+          offset = tail;
+        } else if (head >= words) {
+          offset = 0;
+        } else {
+          return nullptr;
+        }
+      } else {
+        // Live space wraps around, so the free space is between the tail and the head.
+        if (head - tail >= words) {
+          offset = tail;
+        } else {
+          return nullptr;
+        }
+      }
+    }
+
+    blocksByOwner.findOrCreate(owner, [&]() {
+      return kj::HashMap<uint64_t, Owner>::Entry { owner, {} };
+    }).blocks.add(droppedBlocks + blocks.size());
+    blocks.add(Block { offset, words, false });
+    wordsInUse += words;
+    return space.slice(offset, offset + words);
+  }
+
+  kj::Maybe<uint32_t> offsetOf(kj::ArrayPtr<const word> segment) {
+    // Returns the offset of `segment` within the ring, or null if it's not in the ring.
+    if (segment.begin() >= space.begin() && segment.end() <= space.end()) {
+      return segment.begin() - space.begin();
+    } else {
+      return nullptr;
+    }
+  }
+
+  void markSent(uint64_t owner) {
+    // Notes that the space allocated to `owner` has been handed to the peer, so that only the
+    // peer may release it.
+    KJ_ASSERT_NONNULL(blocksByOwner.find(owner)).sent = true;
+  }
+
+  void release(uint64_t owner) {
+    // Releases all space allocated to `owner`, which was never handed to the peer.  Unknown
+    // owners are ignored.
+
+    KJ_IF_MAYBE(entry, blocksByOwner.find(owner)) {
+      KJ_ASSERT(!entry->sent);
+      releaseBlocks(owner, *entry);
+    }
+  }
+
+  void releaseFromPeer(uint64_t owner) {
+    // Releases space that the peer says it's done with.  The peer may only release messages we
+    // sent it through the ring, each only once.
+
+    auto& entry = KJ_REQUIRE_NONNULL(blocksByOwner.find(owner),
+        "peer released a message that we didn't send or that it already released", owner);
+    KJ_REQUIRE(entry.sent, "peer released a message that we haven't sent yet", owner);
+    releaseBlocks(owner, entry);
+  }
+
+private:
+  kj::Own<kj::File> file;
+  kj::Own<const kj::WritableFileMapping> mapping;
+  kj::ArrayPtr<word> space;
+
+  struct Block {
+    size_t offset;
+    size_t size;
+    bool released;
+  };
+
+  kj::Vector<Block> blocks;
+  // Allocations in order.  Those before `firstLive` have been released and reclaimed.
+
+  size_t firstLive = 0;
+  uint64_t droppedBlocks = 0;
+  // Number of blocks removed from the front of `blocks`, so that `droppedBlocks + i` is a stable
+  // sequence number for `blocks[i]`.
+
+  struct Owner {
+    kj::Vector<uint64_t> blocks;
+    // Sequence numbers of the blocks allocated to this message.
+
+    bool sent = false;
+    // Whether the message was sent to the peer through the ring.
+  };
+
+  kj::HashMap<uint64_t, Owner> blocksByOwner;
+  size_t wordsInUse = 0;
+
+  void releaseBlocks(uint64_t owner, Owner& entry) {
+    for (uint64_t seq: entry.blocks) {
+      auto& block = blocks[seq - droppedBlocks];
+      block.released = true;
+      wordsInUse -= block.size;
+    }
+    blocksByOwner.erase(owner);
+
+    while (firstLive < blocks.size() && blocks[firstLive].released) {
+      ++firstLive;
+    }
+
+    if (firstLive == blocks.size()) {
+      droppedBlocks += blocks.size();
+      blocks.clear();
+      firstLive = 0;
+    } else if (firstLive >= 64 && firstLive * 2 >= blocks.size()) {
+      kj::Vector<Block> remaining(blocks.size() - firstLive);
+      remaining.addAll(blocks.begin() + firstLive, blocks.end());
+      droppedBlocks += firstLive;
+      blocks = kj::mv(remaining);
+      firstLive = 0;
+    }
+  }
+};
+
+class SharedMemoryVatNetwork::PeerRing: public kj::Refcounted {
+  // The peer's ring, mapped read-only.  Refcounted because incoming messages may outlive the
+  // network.
+
+public:
+  PeerRing(kj::AutoCloseFd fd, uint64_t expectedSize, SharedMemoryVatNetwork& network)
+      : network(network) {
+#if __linux__
+    int seals;
+    KJ_SYSCALL(seals = fcntl(fd, F_GET_SEALS));
+    KJ_REQUIRE((seals & F_SEAL_SHRINK) != 0,
+               "peer's shared memory ring is not sealed against shrinking");
+#endif
+
+    auto file = kj::newDiskReadableFile(kj::mv(fd));
+    uint64_t size = file->stat().size;
+    KJ_REQUIRE(size == expectedSize && size % sizeof(word) == 0 && size > 0,
+               "peer's shared memory ring has unexpected size", size, expectedSize);
+
+    mapping = file->mmap(0, size);
+    words = kj::arrayPtr(reinterpret_cast<const word*>(mapping.begin()), size / sizeof(word));
+  }
+
+  kj::Array<const byte> mapping;
+  kj::ArrayPtr<const word> words;
+
+  kj::Maybe<SharedMemoryVatNetwork&> network;
+  // Null once the network has been destroyed.
+};
+
+class SharedMemoryVatNetwork::RingMessageBuilder final: public MessageBuilder {
+  // Builds a message in the send ring.  If the ring fills up, further segments come from the heap
+  // and the message will have to be sent inline.
+
+public:
+  RingMessageBuilder(SendRing& ring, uint64_t id, uint firstSegmentWords)
+      : MessageBuilder(SegmentZeroing::LAZY), ring(ring), id(id),
+        nextSize(kj::min(firstSegmentWords, maxSegmentWords())) {}
+
+  kj::ArrayPtr<word> allocateSegment(uint minimumSize) override {
+    uint size = kj::max(minimumSize, nextSize);
+    nextSize = kj::min(size * 2, kj::max(size, maxSegmentWords()));
+
+    KJ_IF_MAYBE(space, ring.allocate(size, id)) {
+      return *space;
+    }
+
+    auto space = kj::heapArray<word>(size);
+    auto result = space.asPtr();
+    heapSegments.add(kj::mv(space));
+    return result;
+  }
+
+  bool isInRing() { return heapSegments.empty(); }
+
+private:
+  uint maxSegmentWords() {
+    // Segments grow no larger than an eighth of the ring, so that a few large messages in flight
+    // don't crowd out everything else.
+    return ring.size() / sizeof(word) / 8;
+  }
+
+  SendRing& ring;
+  uint64_t id;
+  uint nextSize;
+  kj::Vector<kj::Array<word>> heapSegments;
+};
+
+class SharedMemoryVatNetwork::OutgoingMessageImpl final: public OutgoingRpcMessage {
+public:
+  OutgoingMessageImpl(SharedMemoryVatNetwork& network, uint firstSegmentWordSize)
+      : network(network),
+        id(network.nextMessageId++),
+        message(*network.sendRing, id,
+                firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS : firstSegmentWordSize) {}
+
+  ~OutgoingMessageImpl() noexcept(false) {
+    if (!sentInRing) {
+      // Either never sent or sent inline; either way the peer never saw the ring space.
+      network.sendRing->release(id);
+    }
+  }
+
+  AnyPointer::Builder getBody() override {
+    return message.getRoot<AnyPointer>();
+  }
+
+  void send() override {
+    KJ_REQUIRE(network.previousWrite != nullptr, "already shut down");
+
+    auto segments = message.getSegmentsForOutput();
+    size_t size = 0;
+    for (auto& segment: segments) {
+      size += segment.size();
+    }
+    KJ_REQUIRE(size < network.receiveOptions.traversalLimitInWords, size,
+               "Trying to send Cap'n Proto message larger than our single-message size limit. The "
+               "other side probably won't accept it (assuming its traversalLimitInWords matches "
+               "ours) and would abort the connection, so I won't send it.") {
+      return;
+    }
+
+    if (message.isInRing() && segments.size() < MAX_SEGMENTS) {
+      auto payload = network.addRecord(MESSAGE, 1 + segments.size());
+      reinterpret_cast<_::WireValue<uint64_t>*>(payload.begin())->set(id);
+      for (auto i: kj::indices(segments)) {
+        auto entry = reinterpret_cast<_::WireValue<uint32_t>*>(&payload[i + 1]);
+        entry[0].set(KJ_ASSERT_NONNULL(network.sendRing->offsetOf(segments[i])));
+        entry[1].set(segments[i].size());
+      }
+      network.sendRing->markSent(id);
+      sentInRing = true;
+      ++network.sharedMessageCount;
+    } else {
+      auto payload = network.addRecord(INLINE, computeSerializedSizeInWords(segments));
+      kj::ArrayOutputStream output(payload.asBytes());
+      writeMessage(output, segments);
+      ++network.inlineMessageCount;
+    }
+  }
+
+  size_t sizeInWords() override {
+    return message.sizeInWords();
+  }
+
+private:
+  SharedMemoryVatNetwork& network;
+  uint64_t id;
+  RingMessageBuilder message;
+  bool sentInRing = false;
+};
+
+class SharedMemoryVatNetwork::IncomingMessageImpl final: public IncomingRpcMessage {
+public:
+  explicit IncomingMessageImpl(kj::Own<MessageReader> message): message(kj::mv(message)) {}
+
+  IncomingMessageImpl(kj::Own<MessageReader> message, kj::Own<PeerRing> ring, uint64_t id)
+      : message(kj::mv(message)), ring(kj::mv(ring)), id(id) {}
+
+  ~IncomingMessageImpl() noexcept(false) {
+    KJ_IF_MAYBE(r, ring) {
+      KJ_IF_MAYBE(network, (*r)->network) {
+        network->releaseFromPeer(id);
+      }
+    }
+  }
+
+  AnyPointer::Reader getBody() override {
+    return message->getRoot<AnyPointer>();
+  }
+
+  size_t sizeInWords() override {
+    return message->sizeInWords();
+  }
+
+private:
+  kj::Own<MessageReader> message;
+  kj::Maybe<kj::Own<PeerRing>> ring;
+  uint64_t id = 0;
+};
+
+// =======================================================================================
+
+SharedMemoryVatNetwork::SharedMemoryVatNetwork(
+    kj::AsyncCapabilityStream& stream, rpc::twoparty::Side side, size_t ringSize,
+    ReaderOptions receiveOptions)
+    : stream(stream),
+      side(side),
+      peerVatId(4),
+      receiveOptions(receiveOptions),
+      sendRing(kj::heap<SendRing>(ringSize)) {
+  peerVatId.initRoot<rpc::twoparty::VatId>().setSide(
+      side == rpc::twoparty::Side::CLIENT ? rpc::twoparty::Side::SERVER
+                                          : rpc::twoparty::Side::CLIENT);
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  disconnectPromise = paf.promise.fork();
+  disconnectFulfiller.fulfiller = kj::mv(paf.fulfiller);
+
+  // Send our ring to the peer.
+  auto hello = kj::heapArray<word>(2);
+  auto header = reinterpret_cast<_::WireValue<uint32_t>*>(&hello[0]);
+  header[0].set(HELLO);
+  header[1].set(1);
+  reinterpret_cast<_::WireValue<uint64_t>*>(&hello[1])->set(sendRing->size());
+  auto fds = kj::heapArray<int>({ sendRing->getFd() });
+  auto promise = stream.writeWithFds(hello.asBytes(), nullptr, fds);
+  queueWrite(promise.attach(kj::mv(hello), kj::mv(fds)));
+}
+
+SharedMemoryVatNetwork::~SharedMemoryVatNetwork() noexcept(false) {
+  KJ_IF_MAYBE(r, peerRing) {
+    (*r)->network = nullptr;
+  }
+}
+
+SharedMemoryVatNetwork::Stats SharedMemoryVatNetwork::getStats() {
+  return { sharedMessageCount, inlineMessageCount, sendRing->getWordsInUse() };
+}
+
+void SharedMemoryVatNetwork::FulfillerDisposer::disposeImpl(void* pointer) const {
+  if (--refcount == 0) {
+    fulfiller->fulfill();
+  }
+}
+
+kj::Own<TwoPartyVatNetworkBase::Connection> SharedMemoryVatNetwork::asConnection() {
+  ++disconnectFulfiller.refcount;
+  return kj::Own<TwoPartyVatNetworkBase::Connection>(this, disconnectFulfiller);
+}
+
+kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> SharedMemoryVatNetwork::connect(
+    rpc::twoparty::VatId::Reader ref) {
+  if (ref.getSide() == side) {
+    return nullptr;
+  } else {
+    return asConnection();
+  }
+}
+
+kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> SharedMemoryVatNetwork::accept() {
+  if (side == rpc::twoparty::Side::SERVER && !accepted) {
+    accepted = true;
+    return asConnection();
+  } else {
+    // Create a promise that will never be fulfilled.
+    auto paf = kj::newPromiseAndFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>();
+    acceptFulfiller = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  }
+}
+
+kj::ArrayPtr<word> SharedMemoryVatNetwork::addRecord(uint type, size_t payloadWords) {
+  size_t pos = pendingOutput.size();
+  pendingOutput.resize(pos + 1 + payloadWords);
+  auto header = reinterpret_cast<_::WireValue<uint32_t>*>(&pendingOutput[pos]);
+  header[0].set(type);
+  header[1].set(payloadWords);
+  openRelease = type == RELEASE ? kj::Maybe<size_t>(pos) : nullptr;
+  scheduleFlush();
+  return pendingOutput.slice(pos + 1, pos + 1 + payloadWords);
+}
+
+void SharedMemoryVatNetwork::queueWrite(kj::Promise<void> promise) {
+  previousWrite = promise.catch_([this](kj::Exception&& e) {
+    // Since no one checks write failures, we need to propagate them into read failures,
+    // otherwise we might get stuck sending all messages into a black hole and wondering why
+    // the peer never replies.
+    readCancelReason = kj::cp(e);
+    if (!readCanceler.isEmpty()) {
+      readCanceler.cancel(kj::cp(e));
+    }
+    kj::throwRecoverableException(kj::mv(e));
+  }).eagerlyEvaluate(nullptr);
+}
+
+void SharedMemoryVatNetwork::scheduleFlush() {
+  if (flushScheduled) return;
+
+  KJ_IF_MAYBE(previous, previousWrite) {
+    // Like TwoPartyVatNetwork, delay the write until the end of the turn so that records queued
+    // together go out in one system call.
+    flushScheduled = true;
+    queueWrite(previous->then([this]() {
+      return kj::evalLast([this]() -> kj::Promise<void> {
+        flushScheduled = false;
+        openRelease = nullptr;
+        auto data = kj::mv(pendingOutput);
+        auto bytes = data.asPtr().asBytes();
+        return stream.write(bytes.begin(), bytes.size()).attach(kj::mv(data));
+      });
+    }));
+  } else {
+    // Shut down; nothing more will be written.
+    pendingOutput.clear();
+    openRelease = nullptr;
+  }
+}
+
+void SharedMemoryVatNetwork::releaseFromPeer(uint64_t messageId) {
+  if (previousWrite == nullptr) return;
+
+  // Releases are batched into a single record when possible.
+  KJ_IF_MAYBE(pos, openRelease) {
+    auto header = reinterpret_cast<_::WireValue<uint32_t>*>(&pendingOutput[*pos]);
+    uint32_t count = header[1].get();
+    if (count < MAX_RELEASES_PER_RECORD) {
+      header[1].set(count + 1);
+      pendingOutput.add();
+      reinterpret_cast<_::WireValue<uint64_t>*>(&pendingOutput.back())->set(messageId);
+      return;
+    }
+  }
+
+  auto payload = addRecord(RELEASE, 1);
+  reinterpret_cast<_::WireValue<uint64_t>*>(payload.begin())->set(messageId);
+}
+
+kj::Own<RpcFlowController> SharedMemoryVatNetwork::newStream() {
+  return RpcFlowController::newFixedWindowController(
+      kj::max(RpcFlowController::DEFAULT_WINDOW_SIZE, sendRing->size() / 4));
+}
+
+rpc::twoparty::VatId::Reader SharedMemoryVatNetwork::getPeerVatId() {
+  return peerVatId.getRoot<rpc::twoparty::VatId>();
+}
+
+kj::Own<OutgoingRpcMessage> SharedMemoryVatNetwork::newOutgoingMessage(
+    uint firstSegmentWordSize) {
+  return kj::heap<OutgoingMessageImpl>(*this, firstSegmentWordSize);
+}
+
+kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>>
+    SharedMemoryVatNetwork::receiveIncomingMessage() {
+  return kj::evalLater([this]() -> kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> {
+    KJ_IF_MAYBE(e, readCancelReason) {
+      // A previous write failed; propagate the failure to reads, too.
+      return kj::cp(*e);
+    }
+
+    if (peerRing == nullptr) {
+      return readCanceler.wrap(receiveHandshake())
+          .then([this]() -> kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> {
+        if (peerRing == nullptr) {
+          // Peer disconnected before saying hello.
+          return kj::Maybe<kj::Own<IncomingRpcMessage>>(nullptr);
+        }
+        return readCanceler.wrap(receiveRecord());
+      });
+    }
+
+    return readCanceler.wrap(receiveRecord());
+  });
+}
+
+kj::Promise<void> SharedMemoryVatNetwork::receiveHandshake() {
+  struct Hello {
+    _::WireValue<uint32_t> header[2];
+    _::WireValue<uint64_t> ringSize;
+    kj::AutoCloseFd fd;
+  };
+  auto hello = kj::heap<Hello>();
+  auto promise = stream.tryReadWithFds(hello->header, sizeof(word) * 2, sizeof(word) * 2,
+                                       &hello->fd, 1);
+  return promise.then([this,hello=kj::mv(hello)](kj::AsyncCapabilityStream::ReadResult result) mutable {
+    if (result.byteCount == 0) return;
+
+    KJ_REQUIRE(result.byteCount == sizeof(word) * 2 &&
+               hello->header[0].get() == HELLO && hello->header[1].get() == 1,
+               "bad handshake from peer; is it using SharedMemoryVatNetwork?");
+    KJ_REQUIRE(result.capCount == 1, "peer did not send its shared memory ring");
+
+    peerRing = kj::refcounted<PeerRing>(kj::mv(hello->fd), hello->ringSize.get(), *this);
+  });
+}
+
+kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> SharedMemoryVatNetwork::receiveRecord() {
+  auto header = kj::heapArray<_::WireValue<uint32_t>>(2);
+  auto promise = stream.tryRead(header.begin(), sizeof(word), sizeof(word));
+  return promise.then([this,header=kj::mv(header)](size_t n) mutable
+                      -> kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> {
+    if (n == 0) {
+      return kj::Maybe<kj::Own<IncomingRpcMessage>>(nullptr);
+    } else if (n < sizeof(word)) {
+      kj::throwRecoverableException(KJ_EXCEPTION(DISCONNECTED, "Premature EOF."));
+      return kj::Maybe<kj::Own<IncomingRpcMessage>>(nullptr);
+    }
+
+    uint type = header[0].get();
+    size_t count = header[1].get();
+    switch (type) {
+      case MESSAGE:
+        KJ_REQUIRE(count >= 2 && count <= MAX_SEGMENTS, "bad message descriptor from peer", count);
+        break;
+      case INLINE:
+        KJ_REQUIRE(count <= receiveOptions.traversalLimitInWords,
+                   "Message is too large.  To increase the limit on the receiving end, see "
+                   "capnp::ReaderOptions.");
+        break;
+      case RELEASE:
+        KJ_REQUIRE(count >= 1 && count <= MAX_RELEASES_PER_RECORD,
+                   "bad release record from peer", count);
+        break;
+      default:
+        KJ_FAIL_REQUIRE("unknown record type from peer", type);
+    }
+
+    auto payload = kj::heapArray<word>(count);
+    auto promise = stream.read(payload.begin(), payload.asBytes().size());
+    return promise.then([this,type,payload=kj::mv(payload)]() mutable
+                        -> kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> {
+      switch (type) {
+        case RELEASE:
+          for (auto& entry: payload) {
+            sendRing->releaseFromPeer(reinterpret_cast<_::WireValue<uint64_t>&>(entry).get());
+          }
+          return receiveRecord();
+
+        case INLINE: {
+          auto reader = kj::heap<FlatArrayMessageReader>(payload, receiveOptions)
+              .attach(kj::mv(payload));
+          return kj::Maybe<kj::Own<IncomingRpcMessage>>(
+              kj::heap<IncomingMessageImpl>(kj::mv(reader)));
+        }
+
+        case MESSAGE: {
+          auto& ring = *KJ_ASSERT_NONNULL(peerRing);
+          uint64_t id = reinterpret_cast<_::WireValue<uint64_t>&>(payload[0]).get();
+          auto segments = kj::heapArray<kj::ArrayPtr<const word>>(payload.size() - 1);
+          for (auto i: kj::indices(segments)) {
+            auto entry = reinterpret_cast<_::WireValue<uint32_t>*>(&payload[i + 1]);
+            uint64_t offset = entry[0].get();
+            uint64_t size = entry[1].get();
+            KJ_REQUIRE(offset + size <= ring.words.size(),
+                       "message descriptor from peer is outside its ring", offset, size);
+            segments[i] = ring.words.slice(offset, offset + size);
+          }
+
+          auto reader = kj::heap<SegmentArrayMessageReader>(segments, receiveOptions)
+              .attach(kj::mv(segments));
+          return kj::Maybe<kj::Own<IncomingRpcMessage>>(
+              kj::heap<IncomingMessageImpl>(kj::mv(reader), kj::addRef(ring), id));
+        }
+      }
+      KJ_UNREACHABLE;
+    });
+  });
+}
+
+kj::Promise<void> SharedMemoryVatNetwork::shutdown() {
+  kj::Promise<void> result = KJ_ASSERT_NONNULL(previousWrite, "already shut down").then([this]() {
+    stream.shutdownWrite();
+  });
+  previousWrite = nullptr;
+  return kj::mv(result);
+}
+
+// =======================================================================================
+
+SharedMemoryServer::SharedMemoryServer(Capability::Client bootstrapInterface, size_t ringSize)
+    : bootstrapInterface(kj::mv(bootstrapInterface)), ringSize(ringSize), tasks(*this) {}
+
+struct SharedMemoryServer::AcceptedConnection {
+  kj::Own<kj::AsyncCapabilityStream> connection;
+  SharedMemoryVatNetwork network;
+  RpcSystem<rpc::twoparty::VatId> rpcSystem;
+
+  explicit AcceptedConnection(SharedMemoryServer& parent,
+                              kj::Own<kj::AsyncCapabilityStream>&& connectionParam)
+      : connection(kj::mv(connectionParam)),
+        network(*connection, rpc::twoparty::Side::SERVER, parent.ringSize),
+        rpcSystem(makeRpcServer(network, kj::cp(parent.bootstrapInterface))) {}
+};
+
+void SharedMemoryServer::accept(kj::Own<kj::AsyncCapabilityStream>&& connection) {
+  auto connectionState = kj::heap<AcceptedConnection>(*this, kj::mv(connection));
+
+  // Run the connection until disconnect.
+  auto promise = connectionState->network.onDisconnect();
+  tasks.add(promise.attach(kj::mv(connectionState)));
+}
+
+kj::Promise<void> SharedMemoryServer::accept(kj::AsyncCapabilityStream& connection) {
+  auto connectionState = kj::heap<AcceptedConnection>(*this,
+      kj::Own<kj::AsyncCapabilityStream>(&connection, kj::NullDisposer::instance));
+
+  // Run the connection until disconnect.
+  auto promise = connectionState->network.onDisconnect();
+  return promise.attach(kj::mv(connectionState));
+}
+
+kj::Promise<void> SharedMemoryServer::listen(kj::ConnectionReceiver& listener) {
+  return listener.accept()
+      .then([this,&listener](kj::Own<kj::AsyncIoStream>&& connection) mutable {
+    accept(connection.downcast<kj::AsyncCapabilityStream>());
+    return listen(listener);
+  });
+}
+
+void SharedMemoryServer::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+SharedMemoryClient::SharedMemoryClient(kj::AsyncCapabilityStream& connection, size_t ringSize)
+    : network(connection, rpc::twoparty::Side::CLIENT, ringSize),
+      rpcSystem(makeRpcClient(network)) {}
+
+Capability::Client SharedMemoryClient::bootstrap() {
+  capnp::word scratch[4];
+  memset(&scratch, 0, sizeof(scratch));
+  capnp::MallocMessageBuilder message(scratch);
+  auto vatId = message.getRoot<rpc::twoparty::VatId>();
+  vatId.setSide(network.getSide() == rpc::twoparty::Side::CLIENT
+                ? rpc::twoparty::Side::SERVER
+                : rpc::twoparty::Side::CLIENT);
+  return rpcSystem.bootstrap(vatId);
+}
+
+}  // namespace capnp
@@ -0,0 +1,209 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include "capnp/rpc-twoparty.h"
+#include <kj/filesystem.h>
+#include <kj/map.h>
+
+CAPNP_BEGIN_HEADER
+
+namespace capnp {
+
+class SharedMemoryVatNetwork: public TwoPartyVatNetworkBase,
+                              private TwoPartyVatNetworkBase::Connection {
+  // A two-party `VatNetwork` for peers on the same machine, which passes messages through shared
+  // memory rather than copying them through a socket.
+  //
+  // Each side allocates a ring of shared memory (a memfd, on Linux) and builds its outgoing
+  // messages directly in it.  Sending a message writes only a short descriptor -- the offset and
+  // size of each segment -- to a Unix socket, which also serves as the doorbell that wakes the
+  // peer.  The peer maps the sender's ring read-only and reads the message in place, then sends
+  // back a release notice once it has dropped the message, at which point the sender may reuse
+  // the space.  Messages which don't fit in the free part of the ring are sent through the socket
+  // in the usual way instead.
+  //
+  // This class is a drop-in replacement for `TwoPartyVatNetwork`: pass it to `makeRpcClient()` or
+  // `makeRpcServer()`, or use `SharedMemoryClient` / `SharedMemoryServer` below.  Both ends of the
+  // connection must use it.
+  //
+  // Incoming messages are bounds-checked as usual, so a misbehaving peer can't cause reads outside
+  // its ring, but the peer can modify a message while we're reading it.  Use this only between
+  // processes which trust each other at least as much as they'd trust the same code in-process.
+  //
+  // Currently only implemented on Linux.
+
+public:
+  SharedMemoryVatNetwork(kj::AsyncCapabilityStream& stream, rpc::twoparty::Side side,
+                         size_t ringSize = 16 << 20,
+                         ReaderOptions receiveOptions = ReaderOptions());
+  // `stream` must be a Unix socket (or another stream which can pass file descriptors) connected
+  // to a peer which is also using SharedMemoryVatNetwork.  `ringSize` is the size in bytes of the
+  // ring in which this side builds its outgoing messages.
+
+  ~SharedMemoryVatNetwork() noexcept(false);
+  KJ_DISALLOW_COPY_AND_MOVE(SharedMemoryVatNetwork);
+
+  kj::Promise<void> onDisconnect() { return disconnectPromise.addBranch(); }
+  // Returns a promise that resolves when the peer disconnects.
+
+  rpc::twoparty::Side getSide() { return side; }
+
+  struct Stats {
+    uint64_t sharedMessages;
+    // Messages sent by passing their location in the ring.
+
+    uint64_t inlineMessages;
+    // Messages sent through the socket because the ring was full.
+
+    size_t ringWordsInUse;
+    // Space in the ring currently held by messages being built or not yet released by the peer.
+  };
+
+  Stats getStats();
+
+  // implements VatNetwork -----------------------------------------------------
+
+  kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> connect(
+      rpc::twoparty::VatId::Reader ref) override;
+  kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> accept() override;
+
+private:
+  class SendRing;
+  class PeerRing;
+  class RingMessageBuilder;
+  class OutgoingMessageImpl;
+  class IncomingMessageImpl;
+
+  kj::AsyncCapabilityStream& stream;
+  rpc::twoparty::Side side;
+  MallocMessageBuilder peerVatId;
+  ReaderOptions receiveOptions;
+  bool accepted = false;
+
+  kj::Own<SendRing> sendRing;
+  kj::Maybe<kj::Own<PeerRing>> peerRing;
+  // The peer's ring, mapped once we've received its handshake.
+
+  uint64_t nextMessageId = 0;
+  uint64_t sharedMessageCount = 0;
+  uint64_t inlineMessageCount = 0;
+
+  kj::Vector<word> pendingOutput;
+  // Records not yet written to the socket.  Records queued in the same turn of the event loop are
+  // written together.
+
+  kj::Maybe<size_t> openRelease;
+  // Position in `pendingOutput` of the header of its last record, if that record is a release
+  // which more message IDs can be appended to.
+
+  bool flushScheduled = false;
+
+  kj::Canceler readCanceler;
+  kj::Maybe<kj::Exception> readCancelReason;
+  // Used to propagate write errors into (permanent) read errors.
+
+  kj::Maybe<kj::Promise<void>> previousWrite;
+  // Resolves when the previous write completes.  Becomes null when shutdown() is called.
+
+  kj::Own<kj::PromiseFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>> acceptFulfiller;
+  kj::ForkedPromise<void> disconnectPromise = nullptr;
+
+  class FulfillerDisposer: public kj::Disposer {
+    // See the same-named class in TwoPartyVatNetwork.
+
+  public:
+    mutable kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    mutable uint refcount = 0;
+
+    void disposeImpl(void* pointer) const override;
+  };
+  FulfillerDisposer disconnectFulfiller;
+
+  kj::Own<TwoPartyVatNetworkBase::Connection> asConnection();
+
+  kj::ArrayPtr<word> addRecord(uint type, size_t payloadWords);
+  // Appends a record to `pendingOutput` and schedules a flush, returning the space for its payload.
+
+  void queueWrite(kj::Promise<void> promise);
+  void scheduleFlush();
+  void releaseFromPeer(uint64_t messageId);
+
+  kj::Promise<void> receiveHandshake();
+  kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveRecord();
+
+  // implements Connection -----------------------------------------------------
+
+  kj::Own<RpcFlowController> newStream() override;
+  rpc::twoparty::VatId::Reader getPeerVatId() override;
+  kj::Own<OutgoingRpcMessage> newOutgoingMessage(uint firstSegmentWordSize) override;
+  kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveIncomingMessage() override;
+  kj::Promise<void> shutdown() override;
+};
+
+class SharedMemoryServer final: private kj::TaskSet::ErrorHandler {
+  // Like TwoPartyServer, but using SharedMemoryVatNetwork.
+
+public:
+  explicit SharedMemoryServer(Capability::Client bootstrapInterface, size_t ringSize = 16 << 20);
+
+  void accept(kj::Own<kj::AsyncCapabilityStream>&& connection);
+  kj::Promise<void> accept(kj::AsyncCapabilityStream& connection) KJ_WARN_UNUSED_RESULT;
+  // Accepts the connection for servicing.  See TwoPartyServer::accept().
+
+  kj::Promise<void> listen(kj::ConnectionReceiver& listener);
+  // Listens for connections on the given listener, which must produce Unix sockets.
+
+  kj::Promise<void> drain() { return tasks.onEmpty(); }
+  // Resolves when all clients have disconnected.
+
+private:
+  Capability::Client bootstrapInterface;
+  size_t ringSize;
+  kj::TaskSet tasks;
+
+  struct AcceptedConnection;
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+class SharedMemoryClient {
+  // Like TwoPartyClient, but using SharedMemoryVatNetwork.
+
+public:
+  explicit SharedMemoryClient(kj::AsyncCapabilityStream& connection, size_t ringSize = 16 << 20);
+
+  Capability::Client bootstrap();
+  // Get the server's bootstrap interface.
+
+  inline kj::Promise<void> onDisconnect() { return network.onDisconnect(); }
+
+  SharedMemoryVatNetwork::Stats getStats() { return network.getStats(); }
+
+private:
+  SharedMemoryVatNetwork network;
+  RpcSystem<rpc::twoparty::VatId> rpcSystem;
+};
+
+}  // namespace capnp
+
+CAPNP_END_HEADER
@@ -31,6 +31,7 @@
 #include "capnp/rpc.capnp.h"
 #include <map>
 #include <queue>
+#include <deque>
 
 // TODO(cleanup): Auto-generate stringification functions for union discriminants.
 namespace capnp {
@@ -530,6 +531,27 @@ TEST(Rpc, Basic) {
   EXPECT_TRUE(barFailed);
 }
 
+KJ_TEST("RPC request batch") {
+  TestContext context;
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_INTERFACE)
+      .castAs<test::TestInterface>();
+
+  auto batch = client.batch(&test::TestInterface::Client::fooRequest);
+  for (auto i KJ_UNUSED: kj::zeroTo(50)) {
+    auto params = batch.add();
+    params.setI(123);
+    params.setJ(true);
+  }
+
+  auto responses = batch.send().wait(context.waitScope);
+  KJ_ASSERT(responses.size() == 50);
+  for (auto& response: responses) {
+    KJ_EXPECT(response.getX() == "foo");
+  }
+  KJ_EXPECT(context.restorer.callCount == 50);
+}
+
 TEST(Rpc, Pipelining) {
   TestContext context;
 
@@ -659,6 +681,44 @@ TEST(Rpc, Release) {
   EXPECT_EQ(0, context.restorer.handleCount);
 }
 
+KJ_TEST("RPC release with many live capabilities") {
+  // Enough capabilities to span several chunks of the export and import tables, released out of
+  // order so that IDs are reused.
+
+  TestContext context;
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_MORE_STUFF)
+      .castAs<test::TestMoreStuff>();
+
+  auto getHandles = [&](kj::ArrayPtr<kj::Maybe<test::TestHandle::Client>> handles) {
+    kj::Vector<RemotePromise<test::TestMoreStuff::GetHandleResults>> promises;
+    for (auto& handle: handles) {
+      if (handle == nullptr) promises.add(client.getHandleRequest().send());
+    }
+    auto iter = promises.begin();
+    for (auto& handle: handles) {
+      if (handle == nullptr) handle = (iter++)->wait(context.waitScope).getHandle();
+    }
+  };
+
+  auto handles = kj::heapArray<kj::Maybe<test::TestHandle::Client>>(1000);
+  getHandles(handles);
+  KJ_EXPECT(context.restorer.handleCount == 1000);
+
+  for (auto i: kj::indices(handles)) {
+    if (i % 3 != 0) handles[i] = nullptr;
+  }
+  client.getCallSequenceRequest().send().wait(context.waitScope);  // flush `Release`s
+  KJ_EXPECT(context.restorer.handleCount == 334);
+
+  getHandles(handles);
+  KJ_EXPECT(context.restorer.handleCount == 1000);
+
+  handles = nullptr;
+  client.getCallSequenceRequest().send().wait(context.waitScope);  // flush `Release`s
+  KJ_EXPECT(context.restorer.handleCount == 0);
+}
+
 TEST(Rpc, ReleaseOnCancel) {
   // At one time, there was a bug where if a Return contained capabilities, but the client had
   // canceled the request and already send a Finish (which presumably didn't reach the server before
@@ -1577,6 +1637,100 @@ KJ_TEST("export the same promise twice") {
   KJ_EXPECT(callCount == 3);
 }
 
+class FakeFlowClock final: public kj::MonotonicClock {
+public:
+  kj::TimePoint now() const override { return time; }
+  kj::TimePoint time = kj::origin<kj::TimePoint>();
+};
+
+class FakeFlowMessage final: public OutgoingRpcMessage {
+public:
+  AnyPointer::Builder getBody() override { KJ_UNIMPLEMENTED("not used"); }
+  void send() override {}
+  size_t sizeInWords() override { return 1024 / sizeof(word); }
+};
+
+struct PendingAck {
+  kj::TimePoint time;
+  kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+};
+
+void runFlowSimulation(RpcFlowController& controller, FakeFlowClock& clock,
+                       kj::Duration latency, kj::Duration serviceTime, uint messageCount,
+                       kj::WaitScope& waitScope) {
+  // Streams `messageCount` 1KiB messages to a consumer which handles one message per
+  // `serviceTime`, over a link with one-way delay `latency`. Each send waits for the
+  // controller to be ready, just like a streaming call would.
+
+  std::deque<PendingAck> pending;
+  kj::TimePoint consumerFree = clock.time;
+  uint sent = 0;
+  kj::Promise<void> ready = kj::READY_NOW;
+  while (sent < messageCount || !pending.empty()) {
+    while (sent < messageCount && ready.poll(waitScope)) {
+      ready.wait(waitScope);
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      auto start = kj::max(clock.time + latency, consumerFree);
+      consumerFree = start + serviceTime;
+      pending.push_back({ consumerFree + latency, kj::mv(paf.fulfiller) });
+      ready = controller.send(kj::heap<FakeFlowMessage>(), kj::mv(paf.promise));
+      ++sent;
+    }
+
+    if (!pending.empty()) {
+      auto& next = pending.front();
+      clock.time = kj::max(clock.time, next.time);
+      next.fulfiller->fulfill();
+      pending.pop_front();
+      waitScope.poll();
+    }
+  }
+  controller.waitAllAcked().wait(waitScope);
+}
+
+KJ_TEST("adaptive flow control opens the window on a fast, high-latency stream") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  FakeFlowClock clock;
+
+  RpcFlowController::AdaptiveWindowOptions options;
+  options.maxWindow = 1 << 20;
+  auto controller = RpcFlowController::newAdaptiveWindowController(options, clock);
+
+  // 1ms per 64 messages is 64MB/s, with a 20ms RTT: BDP is over 1MB.
+  runFlowSimulation(*controller, clock, 10 * kj::MILLISECONDS,
+                    kj::MILLISECONDS / 64, 5000, waitScope);
+
+  auto stats = controller->getStats();
+  KJ_EXPECT(stats.window == options.maxWindow, stats.window);
+  KJ_EXPECT(stats.inFlight == 0, stats.inFlight);
+  KJ_EXPECT(stats.messagesAcked == 5000, stats.messagesAcked);
+  KJ_EXPECT(stats.minRtt >= 20 * kj::MILLISECONDS, stats.minRtt);
+  KJ_EXPECT(stats.minRtt < 21 * kj::MILLISECONDS, stats.minRtt);
+}
+
+KJ_TEST("adaptive flow control shrinks the window for a slow consumer") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  FakeFlowClock clock;
+
+  RpcFlowController::AdaptiveWindowOptions options;
+  auto controller = RpcFlowController::newAdaptiveWindowController(options, clock);
+
+  // One 1KiB message per millisecond with no link delay: 1MB/s, and the BDP is a single message.
+  runFlowSimulation(*controller, clock, 0 * kj::MILLISECONDS, kj::MILLISECONDS, 1000, waitScope);
+
+  auto stats = controller->getStats();
+  KJ_EXPECT(!stats.startup);
+  KJ_EXPECT(stats.window == options.minWindow, stats.window);
+  KJ_EXPECT(stats.minRtt == kj::MILLISECONDS, stats.minRtt);
+  KJ_EXPECT(stats.bandwidth > 900 * 1024, stats.bandwidth);
+  KJ_EXPECT(stats.bandwidth < 1100 * 1024, stats.bandwidth);
+
+  // Once settled, messages no longer pile up at the consumer: RTT stays near the minimum.
+  KJ_EXPECT(stats.smoothedRtt < 10 * kj::MILLISECONDS, stats.smoothedRtt);
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
@@ -43,6 +43,7 @@
 #include <mswsock.h>
 #include <kj/windows-sanity.h>
 #else
+#include <fcntl.h>
 #include <sys/socket.h>
 #endif
 
@@ -442,6 +443,139 @@ TEST(TwoPartyNetwork, ConvenienceClasses) {
   EXPECT_EQ(1, callCount);
 }
 
+#if !_WIN32
+KJ_TEST("ShardedTwoPartyServer spreads connections across threads") {
+  auto ioContext = kj::setupAsyncIo();
+
+  int callCounts[3] = { 0, 0, 0 };
+  uint nextCounter = 0;
+  ShardedTwoPartyServer server(3, [&]() -> Capability::Client {
+    uint i = __atomic_fetch_add(&nextCounter, 1, __ATOMIC_RELAXED);
+    return kj::heap<TestInterfaceImpl>(callCounts[i]);
+  });
+  KJ_EXPECT(server.getThreadCount() == 3);
+
+  auto address = ioContext.provider->getNetwork()
+      .parseAddress("127.0.0.1").wait(ioContext.waitScope);
+  auto listener = address->listen();
+  auto listenPromise = server.listen(*listener);
+
+  address = ioContext.provider->getNetwork()
+      .parseAddress("127.0.0.1", listener->getPort()).wait(ioContext.waitScope);
+
+  kj::Vector<kj::Own<kj::AsyncIoStream>> connections;
+  kj::Vector<kj::Own<TwoPartyClient>> clients;
+  for (uint i = 0; i < 6; i++) {
+    connections.add(address->connect().wait(ioContext.waitScope));
+    clients.add(kj::heap<TwoPartyClient>(*connections.back()));
+
+    auto request = clients.back()->bootstrap().castAs<test::TestInterface>().fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    KJ_EXPECT(request.send().wait(ioContext.waitScope).getX() == "foo");
+  }
+
+  // Each thread got two of the connections, and served their calls.
+  for (uint count: server.getConnectionCounts()) {
+    KJ_EXPECT(count == 2, count);
+  }
+  for (int count: callCounts) {
+    KJ_EXPECT(count == 2, count);
+  }
+}
+
+KJ_TEST("ShardedTwoPartyServer uncounts connections that fail to start") {
+  auto ioContext = kj::setupAsyncIo();
+
+  int callCount = 0;
+  ShardedTwoPartyServer server(1, [&]() -> Capability::Client {
+    return kj::heap<TestInterfaceImpl>(callCount);
+  });
+
+  // epoll refuses to watch /dev/null, so the worker fails to wrap it.
+  int fd;
+  KJ_SYSCALL(fd = open("/dev/null", O_RDWR | O_CLOEXEC));
+  kj::AutoCloseFd ownFd(fd);
+
+  {
+    KJ_EXPECT_LOG(ERROR, "epoll_ctl");
+    server.accept(kj::mv(ownFd));
+    KJ_EXPECT(server.getConnectionCounts()[0] == 1);
+
+    for (uint i = 0; i < 1000 && server.getConnectionCounts()[0] > 0; i++) {
+      ioContext.provider->getTimer().afterDelay(1 * kj::MILLISECONDS).wait(ioContext.waitScope);
+    }
+    KJ_EXPECT(server.getConnectionCounts()[0] == 0);
+
+    // Let the failure reach the server's error handler.
+    ioContext.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(ioContext.waitScope);
+  }
+}
+#endif
+
+KJ_TEST("TwoPartyClient/Server with MessageBuilderPool") {
+  auto io = kj::setupAsyncIo();
+
+  auto serverPool = kj::refcounted<MessageBuilderPool>();
+  auto clientPool = kj::refcounted<MessageBuilderPool>();
+
+  int callCount = 0;
+  TwoPartyServer server(kj::heap<TestInterfaceImpl>(callCount));
+  server.setMessageBuilderPool(kj::addRef(*serverPool));
+  auto pipe = io.provider->newTwoWayPipe();
+  server.accept(kj::mv(pipe.ends[0]));
+
+  TwoPartyClient client(*pipe.ends[1]);
+  client.setMessageBuilderPool(kj::addRef(*clientPool));
+  auto cap = client.bootstrap().castAs<test::TestInterface>();
+
+  for (int i = 0; i < 10; i++) {
+    auto request = cap.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    auto response = request.send().wait(io.waitScope);
+    KJ_EXPECT(response.getX() == "foo");
+  }
+  KJ_EXPECT(callCount == 10);
+
+  // After the first few messages, segments should be coming out of the pools.
+  KJ_EXPECT(clientPool->getStats().hits >= 8, clientPool->getStats().hits);
+  KJ_EXPECT(serverPool->getStats().hits >= 8, serverPool->getStats().hits);
+}
+
+KJ_TEST("RPC request batch over a two-party connection") {
+  auto io = kj::setupAsyncIo();
+
+  int callCount = 0;
+  TwoPartyServer server(kj::heap<TestInterfaceImpl>(callCount));
+  auto pipe = io.provider->newTwoWayPipe();
+  server.accept(kj::mv(pipe.ends[0]));
+
+  TwoPartyClient client(*pipe.ends[1]);
+  auto cap = client.bootstrap().castAs<test::TestInterface>();
+
+  {
+    // A batch that is never sent sends nothing.
+    auto batch = cap.batch(&test::TestInterface::Client::fooRequest);
+    batch.add().setI(123);
+  }
+
+  // Enough calls that their messages fill several of the batch's arena chunks.
+  auto batch = cap.batch(&test::TestInterface::Client::fooRequest);
+  for (auto i KJ_UNUSED: kj::zeroTo(200)) {
+    auto params = batch.add();
+    params.setI(123);
+    params.setJ(true);
+  }
+
+  auto responses = batch.send().wait(io.waitScope);
+  KJ_ASSERT(responses.size() == 200);
+  for (auto& response: responses) {
+    KJ_EXPECT(response.getX() == "foo");
+  }
+  KJ_EXPECT(callCount == 200);
+}
+
 TEST(TwoPartyNetwork, HugeMessage) {
   auto ioContext = kj::setupAsyncIo();
   int callCount = 0;
@@ -620,6 +754,99 @@ KJ_TEST("FD per message limit") {
   KJ_EXPECT(io.lowLevelProvider->wrapInputFd(kj::mv(in2))->readAllText().wait(io.waitScope)
             == "foo");
 }
+
+#if __linux__
+bool isInMemfdSegment(const void* ptr) {
+  // Files in /proc report a size of zero, so they have to be read as streams.
+  int fd;
+  KJ_SYSCALL(fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC));
+  auto maps = kj::FdInputStream(kj::AutoCloseFd(fd)).readAllText();
+  auto addr = reinterpret_cast<uintptr_t>(ptr);
+  const char* pos = maps.begin();
+  while (pos < maps.end()) {
+    const char* eol = strchr(pos, '\n');
+    if (eol == nullptr) eol = maps.end();
+    auto line = kj::heapString(pos, eol - pos);
+    pos = eol + 1;
+    if (!kj::_::hasSubstring(line, "capnp-rpc-segment")) continue;
+
+    char* end;
+    uintptr_t begin = strtoull(line.begin(), &end, 16);
+    uintptr_t limit = strtoull(end + 1, nullptr, 16);
+    if (begin <= addr && addr < limit) return true;
+  }
+  return false;
+}
+
+KJ_TEST("large segments travel as memfds") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newCapabilityPipe();
+
+  TwoPartyVatNetwork serverNetwork(*pipe.ends[0], 2, rpc::twoparty::Side::SERVER);
+  TwoPartyVatNetwork clientNetwork(*pipe.ends[1], 2, rpc::twoparty::Side::CLIENT);
+  serverNetwork.setMemfdSegmentThreshold(65536);
+  clientNetwork.setMemfdSegmentThreshold(65536);
+
+  MallocMessageBuilder serverId;
+  serverId.initRoot<rpc::twoparty::VatId>().setSide(rpc::twoparty::Side::SERVER);
+  auto clientConnection = KJ_ASSERT_NONNULL(
+      clientNetwork.connect(serverId.getRoot<rpc::twoparty::VatId>()));
+  auto serverConnection = serverNetwork.accept().wait(io.waitScope);
+
+  int pipeFds[2];
+  KJ_SYSCALL(kj::miniposix::pipe(pipeFds));
+  kj::AutoCloseFd in(pipeFds[0]);
+  kj::AutoCloseFd out(pipeFds[1]);
+
+  constexpr size_t SIZE = 4 << 20;
+  {
+    auto message = clientConnection->newOutgoingMessage(0);
+    auto root = message->getBody().initAs<test::TestAllTypes>();
+    auto data = root.initDataField(SIZE);
+    for (auto i: kj::indices(data)) data[i] = i * 7;
+    auto text = root.initTextField(SIZE);
+    memset(text.begin(), 'x', text.size());
+
+    // The message's own FDs don't use up the memfds' share of the FD limit.
+    message->setFds(kj::arr(out.get(), out.get()));
+    message->send();
+  }
+  {
+    auto message = clientConnection->newOutgoingMessage(0);
+    message->getBody().initAs<test::TestAllTypes>().setTextField("small");
+    message->send();
+  }
+
+  {
+    auto message = KJ_ASSERT_NONNULL(serverConnection->receiveIncomingMessage().wait(io.waitScope));
+    auto root = message->getBody().getAs<test::TestAllTypes>();
+    auto data = root.getDataField();
+    KJ_ASSERT(data.size() == SIZE);
+    for (auto i: kj::indices(data)) KJ_ASSERT(data[i] == byte(i * 7), i);
+    auto text = root.getTextField();
+    KJ_ASSERT(text.size() == SIZE);
+    KJ_EXPECT(text[0] == 'x' && text[SIZE - 1] == 'x');
+
+    // The data was read straight out of mappings of the sender's memfds.
+    KJ_EXPECT(isInMemfdSegment(data.begin()));
+    KJ_EXPECT(isInMemfdSegment(text.begin()));
+
+    // Only the FDs we attached ourselves are visible, not the memfds.
+    auto fds = message->getAttachedFds();
+    KJ_ASSERT(fds.size() == 2);
+    KJ_SYSCALL(write(fds[0], "foo", 3));
+  }
+  {
+    auto message = KJ_ASSERT_NONNULL(serverConnection->receiveIncomingMessage().wait(io.waitScope));
+    KJ_EXPECT(message->getBody().getAs<test::TestAllTypes>().getTextField() == "small");
+    KJ_EXPECT(message->getAttachedFds().size() == 0);
+  }
+
+  out = nullptr;
+  KJ_EXPECT(io.lowLevelProvider->wrapInputFd(kj::mv(in))->readAllText().wait(io.waitScope)
+            == "foo");
+}
+#endif  // __linux__
 #endif  // !_WIN32 && !__CYGWIN__
 
 // =======================================================================================
@@ -738,6 +965,65 @@ KJ_TEST("Streaming over RPC") {
   }
 }
 
+class FastStreamingServer final: public test::TestStreaming::Server {
+  // Handles each streaming call as soon as it arrives.
+
+public:
+  uint iSum = 0;
+
+protected:
+  kj::Promise<void> doStreamI(DoStreamIContext context) override {
+    iSum += context.getParams().getI();
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> finishStream(FinishStreamContext context) override {
+    context.getResults().setTotalI(iSum);
+    return kj::READY_NOW;
+  }
+};
+
+KJ_TEST("Streaming over RPC with adaptive flow control") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  TwoPartyClient tpClient(*pipe.ends[0]);
+  TwoPartyClient tpServer(*pipe.ends[1], kj::heap<FastStreamingServer>(),
+                          rpc::twoparty::Side::SERVER);
+
+  RpcFlowController::AdaptiveWindowOptions options;
+  options.initialWindow = 4096;
+  options.minWindow = 4096;
+  tpClient.setAdaptiveFlowControl(options);
+  KJ_EXPECT(tpClient.getFlowControlStats().size() == 0);
+
+  auto cap = tpClient.bootstrap().castAs<test::TestStreaming>();
+
+  constexpr uint COUNT = 2000;
+  uint expectedSum = 0;
+  for (uint i = 0; i < COUNT; i++) {
+    auto req = cap.doStreamIRequest();
+    req.setI(i);
+    req.send().wait(io.waitScope);
+    expectedSum += i;
+  }
+  KJ_EXPECT(cap.finishStreamRequest().send().wait(io.waitScope).getTotalI() == expectedSum);
+
+  // The stream's controller saw every ack, and the window stayed in bounds.
+  auto stats = tpClient.getFlowControlStats();
+  KJ_ASSERT(stats.size() == 1);
+  KJ_EXPECT(stats[0].messagesAcked == COUNT, stats[0].messagesAcked);
+  KJ_EXPECT(stats[0].inFlight == 0, stats[0].inFlight);
+  KJ_EXPECT(stats[0].minRtt > 0 * kj::NANOSECONDS);
+  KJ_EXPECT(stats[0].window >= options.minWindow, stats[0].window);
+  KJ_EXPECT(stats[0].window <= options.maxWindow, stats[0].window);
+
+  // Once the capability is dropped, so is its stream.
+  cap = nullptr;
+  io.waitScope.poll();
+  KJ_EXPECT(tpClient.getFlowControlStats().size() == 0);
+}
+
 KJ_TEST("Streaming over a chain of local and remote RPC calls") {
   // This test verifies that a local RPC call that eventually resolves to a remote RPC call will
   // still support streaming calls over the remote connection.
@@ -1266,6 +1552,182 @@ KJ_TEST("Two-hop embargo") {
   EXPECT_EQ(5, call5.wait(waitScope).getN());
 }
 
+KJ_TEST("RpcLatencyHistogram records incoming calls") {
+  auto io = kj::setupAsyncIo();
+
+  int callCount = 0;
+  RpcLatencyHistogram histogram;
+  TwoPartyServer server(kj::heap<TestInterfaceImpl>(callCount));
+  server.setCallObserver(histogram);
+  auto pipe = io.provider->newTwoWayPipe();
+  server.accept(kj::mv(pipe.ends[0]));
+
+  TwoPartyClient client(*pipe.ends[1]);
+  auto cap = client.bootstrap().castAs<test::TestInterface>();
+
+  for (int i = 0; i < 5; i++) {
+    auto request = cap.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    request.send().wait(io.waitScope);
+  }
+  KJ_EXPECT_THROW_MESSAGE("not implemented", cap.barRequest().send().wait(io.waitScope));
+
+  auto stats = histogram.getStats();
+  KJ_ASSERT(stats.size() == 2);
+
+  auto& foo = stats[0];
+  KJ_EXPECT(foo.interfaceId == typeId<test::TestInterface>());
+  KJ_EXPECT(foo.methodId == 0);
+  KJ_EXPECT(foo.calls == 5);
+  KJ_EXPECT(foo.exceptions == 0);
+  KJ_EXPECT(foo.requestWords > 0);
+  KJ_EXPECT(foo.responseWords > 0);
+  KJ_EXPECT(foo.total.count == 5);
+  KJ_EXPECT(foo.total.sum >= foo.processing.sum);
+  KJ_EXPECT(foo.total.percentile(0.5) <= foo.total.percentile(1.0));
+
+  auto& bar = stats[1];
+  KJ_EXPECT(bar.methodId == 1);
+  KJ_EXPECT(bar.calls == 1);
+  KJ_EXPECT(bar.exceptions == 1);
+
+  auto text = histogram.toString();
+  KJ_EXPECT(kj::_::hasSubstring(text, kj::str(
+      "capnp_rpc_calls_total{interface=\"0x", kj::hex(typeId<test::TestInterface>()),
+      "\",method=\"0\"} 5\n")), text);
+  KJ_EXPECT(kj::_::hasSubstring(text, kj::str(
+      "capnp_rpc_call_seconds_count{interface=\"0x", kj::hex(typeId<test::TestInterface>()),
+      "\",method=\"1\",phase=\"total\"} 1\n")), text);
+
+  histogram.reset();
+  KJ_EXPECT(histogram.getStats().size() == 0);
+}
+
+KJ_TEST("RpcLatencyHistogram counts time waiting for a promised target as queueing") {
+  auto io = kj::setupAsyncIo();
+
+  TestMonotonicClock clock;
+  RpcLatencyHistogram histogram(clock);
+  auto paf = kj::newPromiseAndFulfiller<Capability::Client>();
+  TwoPartyServer server(Capability::Client(kj::mv(paf.promise)));
+  server.setCallObserver(histogram);
+  auto pipe = io.provider->newTwoWayPipe();
+  server.accept(kj::mv(pipe.ends[0]));
+
+  TwoPartyClient client(*pipe.ends[1]);
+  auto cap = client.bootstrap().castAs<test::TestInterface>();
+
+  auto request = cap.fooRequest();
+  request.setI(123);
+  request.setJ(true);
+  auto promise = request.send();
+  promise.poll(io.waitScope);
+
+  clock.increment(100 * kj::MICROSECONDS);
+  int callCount = 0;
+  paf.fulfiller->fulfill(kj::heap<TestInterfaceImpl>(callCount));
+  promise.wait(io.waitScope);
+
+  auto stats = histogram.getStats();
+  KJ_ASSERT(stats.size() == 1);
+  KJ_EXPECT(stats[0].queued.sum == 100 * kj::MICROSECONDS, stats[0].queued.sum);
+  KJ_EXPECT(stats[0].processing.sum == 0 * kj::NANOSECONDS, stats[0].processing.sum);
+}
+
+KJ_TEST("RpcLatencyHistogram buckets are bounded above") {
+  RpcLatencyHistogram::Histogram histogram;
+  histogram.add(0 * kj::NANOSECONDS);
+  histogram.add(1 * kj::MICROSECONDS);
+  histogram.add(1 * kj::MICROSECONDS + 1 * kj::NANOSECONDS);
+  histogram.add(2 * kj::MICROSECONDS);
+  histogram.add(3 * kj::MICROSECONDS);
+
+  KJ_EXPECT(histogram.buckets[0] == 2);
+  KJ_EXPECT(histogram.buckets[1] == 2);
+  KJ_EXPECT(histogram.buckets[2] == 1);
+  KJ_EXPECT(histogram.percentile(0.4) == 1 * kj::MICROSECONDS);
+  KJ_EXPECT(histogram.percentile(0.8) == 2 * kj::MICROSECONDS);
+}
+
+class LargeResultServer final: public test::TestInterface::Server {
+protected:
+  kj::Promise<void> foo(FooContext context) override {
+    context.getResults().setX(kj::str(kj::repeat('x', 10000)));
+    return kj::READY_NOW;
+  }
+};
+
+KJ_TEST("per-call arena handles large results, caps, and tail calls") {
+  auto io = kj::setupAsyncIo();
+
+  {
+    // Results overflow the arena into the pool.
+    TwoPartyServer server(kj::heap<LargeResultServer>());
+    server.setCallArenaSize(256);
+    auto pipe = io.provider->newTwoWayPipe();
+    server.accept(kj::mv(pipe.ends[0]));
+
+    TwoPartyClient client(*pipe.ends[1]);
+    auto cap = client.bootstrap().castAs<test::TestInterface>();
+    for (int i = 0; i < 3; i++) {
+      auto response = cap.fooRequest().send().wait(io.waitScope);
+      KJ_EXPECT(response.getX() == kj::str(kj::repeat('x', 10000)));
+    }
+  }
+
+  {
+    int callCount = 0;
+    int handleCount = 0;
+    TwoPartyServer server(kj::heap<TestMoreStuffImpl>(callCount, handleCount));
+    server.setCallArenaSize(256);
+    auto pipe = io.provider->newTwoWayPipe();
+    server.accept(kj::mv(pipe.ends[0]));
+
+    TwoPartyClient client(*pipe.ends[1]);
+    auto cap = client.bootstrap().castAs<test::TestMoreStuff>();
+
+    // A capability in the results keeps the call's context, and so its arena, alive until the
+    // caller is done with it.
+    auto handle = cap.getHandleRequest().send().wait(io.waitScope).getHandle();
+    KJ_EXPECT(handleCount == 1);
+    handle = nullptr;
+    cap.getCallSequenceRequest().send().wait(io.waitScope);
+    KJ_EXPECT(handleCount == 0);
+
+    // Pipelined calls on a returned capability.
+    auto request = cap.echoRequest();
+    request.setCap(kj::heap<TestCallOrderImpl>());
+    auto promise = request.send();
+    auto pipelined = promise.getCap().getCallSequenceRequest();
+    pipelined.setExpected(0);
+    KJ_EXPECT(pipelined.send().wait(io.waitScope).getN() == 0);
+    promise.wait(io.waitScope);
+  }
+
+  {
+    // A tail call back to the caller.
+    int callCount = 0;
+    TwoPartyServer server(kj::heap<TestTailCallerImpl>(callCount));
+    server.setCallArenaSize(256);
+    auto pipe = io.provider->newTwoWayPipe();
+    server.accept(kj::mv(pipe.ends[0]));
+
+    TwoPartyClient client(*pipe.ends[1]);
+    auto cap = client.bootstrap().castAs<test::TestTailCaller>();
+
+    int calleeCallCount = 0;
+    test::TestTailCallee::Client callee(kj::heap<TestTailCalleeImpl>(calleeCallCount));
+    auto request = cap.fooRequest();
+    request.setI(456);
+    request.setCallee(callee);
+    auto response = request.send().wait(io.waitScope);
+    KJ_EXPECT(response.getI() == 456);
+    KJ_EXPECT(response.getT() == "from TestTailCaller");
+    KJ_EXPECT(calleeCallCount == 1);
+  }
+}
+
 }  // namespace
 }  // namespace _
 }  // namespace capnp
@@ -19,13 +19,104 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // for memfd_create()
+#endif
+
 #include "capnp/rpc-twoparty.h"
 #include "capnp/serialize-async.h"
 #include <kj/debug.h>
+#include <kj/filesystem.h>
 #include <kj/io.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
+
+#if !_WIN32
+#include <fcntl.h>
+#endif
+
+#if __linux__
+#include <sys/mman.h>
+#endif
 
 namespace capnp {
 
+namespace {
+
+#if __linux__
+kj::AutoCloseFd newSealedMemfd(kj::ArrayPtr<const byte> bytes) {
+  int fd;
+  KJ_SYSCALL(fd = memfd_create("capnp-rpc-segment", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+  kj::AutoCloseFd result(fd);
+  kj::FdOutputStream(fd).write(bytes.begin(), bytes.size());
+
+  // The peer refuses segments which we could still modify or truncate after it maps them.
+  KJ_SYSCALL(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL));
+  return result;
+}
+
+bool isMemfdManifest(MessageReader& reader) {
+  // A message with segments sent as memfds (see TwoPartyVatNetwork::setMemfdSegmentThreshold())
+  // is preceded on the stream by a manifest: a message of its own, whose root is a List(UInt64)
+  // rather than an rpc::Message struct, so that it can't be mistaken for an RPC message. The
+  // manifest's FDs are the memfds, and its elements are:
+  // - The number of segments in the message which follows.
+  // - For each memfd in order, the index of the segment it holds in the low 32 bits and the
+  //   segment's size in words in the high 32 bits. Inline, each such segment is sent empty.
+
+  return reader.getRoot<AnyPointer>().getPointerType() == PointerType::LIST;
+}
+
+kj::Own<MessageReader> mapMemfdSegments(kj::Own<MessageReader> message,
+                                        MessageReader& manifestMessage,
+                                        kj::Array<kj::AutoCloseFd> segmentFds,
+                                        ReaderOptions options) {
+  // Returns a reader for `message` which reads the segments listed in the manifest from
+  // read-only mappings of their memfds.
+
+  auto manifest = manifestMessage.getRoot<AnyPointer>().getAs<List<uint64_t>>();
+  KJ_REQUIRE(manifest.size() >= 2 && manifest.size() - 1 == segmentFds.size(),
+             "malformed memfd segment manifest", manifest.size(), segmentFds.size());
+
+  uint64_t segmentCount = manifest[0];
+  KJ_REQUIRE(segmentCount > 0 && segmentCount < 512, "malformed memfd segment manifest",
+             segmentCount);
+
+  auto segments = kj::heapArray<kj::ArrayPtr<const word>>(segmentCount);
+  for (auto i: kj::indices(segments)) {
+    segments[i] = message->getSegment(i);
+  }
+
+  auto mappings = kj::heapArrayBuilder<kj::Array<const byte>>(segmentFds.size());
+  for (auto i: kj::indices(segmentFds)) {
+    uint64_t entry = manifest[i + 1];
+    uint index = entry & 0xffffffffu;
+    size_t words = entry >> 32;
+    KJ_REQUIRE(index < segments.size() && segments[index].size() == 0 && words > 0,
+               "malformed memfd segment manifest entry", index, words);
+
+    int seals;
+    KJ_SYSCALL(seals = fcntl(segmentFds[i], F_GET_SEALS));
+    KJ_REQUIRE((seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) == (F_SEAL_SHRINK | F_SEAL_WRITE),
+               "peer's segment memfd is not sealed against writes");
+
+    auto file = kj::newDiskReadableFile(kj::mv(segmentFds[i]));
+    KJ_REQUIRE(file->stat().size >= words * sizeof(word),
+               "peer's segment memfd is smaller than the segment", words);
+
+    auto mapping = file->mmap(0, words * sizeof(word));
+    segments[index] = kj::arrayPtr(reinterpret_cast<const word*>(mapping.begin()), words);
+    mappings.add(kj::mv(mapping));
+  }
+
+  kj::ArrayPtr<const kj::ArrayPtr<const word>> segmentsPtr = segments;
+  return kj::heap<SegmentArrayMessageReader>(segmentsPtr, options)
+      .attach(kj::mv(segments), mappings.finish(), kj::mv(message));
+}
+#endif  // __linux__
+
+}  // namespace
+
 TwoPartyVatNetwork::TwoPartyVatNetwork(
     kj::OneOf<MessageStream*, kj::Own<MessageStream>>&& stream,
     uint maxFdsPerMessage,
@@ -38,6 +129,7 @@ TwoPartyVatNetwork::TwoPartyVatNetwork(
       side(side),
       peerVatId(4),
       receiveOptions(receiveOptions),
+      messageBuilderPool(kj::refcounted<MessageBuilderPool>(0)),
       previousWrite(kj::READY_NOW),
       clock(clock),
       currentOutgoingMessageSendTime(clock.now()) {
@@ -126,11 +218,45 @@ kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> TwoPartyVatNetwork::acc
 }
 
 class TwoPartyVatNetwork::OutgoingMessageImpl final
-    : public OutgoingRpcMessage, public kj::Refcounted {
+    : public OutgoingRpcMessage, private kj::Disposer {
+  // Reference-counted by hand, rather than via kj::Refcounted, so that it can live in an
+  // RpcMessageArena.
+
 public:
-  OutgoingMessageImpl(TwoPartyVatNetwork& network, uint firstSegmentWordSize)
-      : network(network),
-        message(firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS : firstSegmentWordSize) {}
+  static kj::Own<OutgoingMessageImpl> make(TwoPartyVatNetwork& network,
+                                           uint firstSegmentWordSize) {
+    auto result = new OutgoingMessageImpl(network, firstSegmentWordSize, kj::Own<void>());
+    return kj::Own<OutgoingMessageImpl>(result, *result);
+  }
+
+  static kj::Own<OutgoingMessageImpl> make(TwoPartyVatNetwork& network,
+                                           uint firstSegmentWordSize, RpcMessageArena& arena) {
+    // Place the message in `arena`, along with its first segment if there's room for it.
+
+    void* memory = arena.allocate(sizeof(OutgoingMessageImpl), alignof(OutgoingMessageImpl));
+    size_t available = arena.remaining() / sizeof(word);
+    size_t segmentWords = firstSegmentWordSize == 0
+        ? kj::min(available, size_t(SUGGESTED_FIRST_SEGMENT_WORDS))
+        : firstSegmentWordSize;
+
+    OutgoingMessageImpl* result;
+    if (segmentWords > 0 && segmentWords <= available) {
+      auto segment = kj::arrayPtr(reinterpret_cast<word*>(
+          arena.allocate(segmentWords * sizeof(word), alignof(word))), segmentWords);
+      memset(segment.begin(), 0, segment.asBytes().size());
+      result = new (kj::_::PlacementNew(), memory)
+          OutgoingMessageImpl(network, segment, arena.addRef());
+    } else {
+      result = new (kj::_::PlacementNew(), memory)
+          OutgoingMessageImpl(network, firstSegmentWordSize, arena.addRef());
+    }
+    return kj::Own<OutgoingMessageImpl>(result, *result);
+  }
+
+  kj::Own<OutgoingMessageImpl> addRef() {
+    ++refcount;
+    return kj::Own<OutgoingMessageImpl>(this, *this);
+  }
 
   AnyPointer::Builder getBody() override {
     return message.getRoot<AnyPointer>();
@@ -164,13 +290,19 @@ public:
       network.currentOutgoingMessageSendTime = sendTime;
     }
 
+#if __linux__
+    if (network.memfdSegmentThreshold > 0) {
+      offloadLargeSegments();
+    }
+#endif
+
     // Instead of sending each new message as soon as possible, we attempt to batch together small
     // messages by delaying when we send them using evalLast. This allows us to group together
     // related small messages, reducing the number of syscalls we make.
     auto& previousWrite = KJ_ASSERT_NONNULL(network.previousWrite, "already shut down");
     bool alreadyPendingSend = !network.queuedMessages.empty();
     network.currentQueueSize += message.sizeInWords() * sizeof(word);
-    network.queuedMessages.add(kj::addRef(*this));
+    network.queuedMessages.add(addRef());
     if (alreadyPendingSend) {
       // The first send sets up an evalLast that will clear out pendingMessages when it's sent.
       // If pendingMessages is non-empty, then there must already be a callback waiting to send
@@ -185,13 +317,21 @@ public:
         // Swap out the connection's pending messages and write all of them together.
         auto ownMessages = kj::mv(network.queuedMessages);
         network.currentQueueSize = 0;
-        auto messages =
-          kj::heapArray<MessageAndFds>(ownMessages.size());
-        for (int i = 0; i < messages.size(); ++i) {
-          messages[i].segments = ownMessages[i]->message.getSegmentsForOutput();
-          messages[i].fds = ownMessages[i]->fds;
+        size_t frameCount = 0;
+        for (auto& message: ownMessages) {
+          frameCount += message->offloadManifest == nullptr ? 1 : 2;
         }
-        return network.getStream().writeMessages(messages).attach(kj::mv(ownMessages), kj::mv(messages));
+        auto messages = kj::heapArrayBuilder<MessageAndFds>(frameCount);
+        for (auto& message: ownMessages) {
+          KJ_IF_MAYBE(manifest, message->offloadManifest) {
+            messages.add(MessageAndFds {
+              manifest->get()->getSegmentsForOutput(), message->offloadFdsForOutput });
+          }
+          messages.add(MessageAndFds { message->getSegmentsForOutput(), message->fds });
+        }
+        auto messagesArray = messages.finish();
+        return network.getStream().writeMessages(messagesArray)
+            .attach(kj::mv(ownMessages), kj::mv(messagesArray));
       }).catch_([this](kj::Exception&& e) {
         // Since no one checks write failures, we need to propagate them into read failures,
         // otherwise we might get stuck sending all messages into a black hole and wondering why
@@ -202,7 +342,7 @@ public:
         }
         kj::throwRecoverableException(kj::mv(e));
       });
-    }).attach(kj::addRef(*this))
+    }).attach(addRef())
       // Note that it's important that the eagerlyEvaluate() come *after* the attach() because
       // otherwise the message (and any capabilities in it) will not be released until a new
       // message is written! (Kenton once spent all afternoon tracking this down...)
@@ -214,11 +354,117 @@ public:
   }
 
 private:
+  mutable uint refcount = 1;
+
+  kj::Own<void> arenaRef;
+  // If the message was placed in an RpcMessageArena, keeps it alive.
+
   TwoPartyVatNetwork& network;
-  MallocMessageBuilder message;
+  PooledMessageBuilder message;
   kj::Array<int> fds;
+
+  kj::Array<kj::ArrayPtr<const word>> offloadedSegmentsForOutput;
+  kj::Maybe<kj::Own<MallocMessageBuilder>> offloadManifest;
+  kj::Array<kj::AutoCloseFd> offloadFds;
+  kj::Array<int> offloadFdsForOutput;
+  // Set by offloadLargeSegments() if any segments were moved into memfds.
+
+  kj::ArrayPtr<const kj::ArrayPtr<const word>> getSegmentsForOutput() {
+    if (offloadedSegmentsForOutput == nullptr) {
+      return message.getSegmentsForOutput();
+    } else {
+      return offloadedSegmentsForOutput;
+    }
+  }
+
+#if __linux__
+  void offloadLargeSegments() {
+    // Moves each segment of at least `memfdSegmentThreshold` bytes into a sealed memfd, as long
+    // as the peer's FD limit allows, and builds the manifest to send ahead of the message. See
+    // isMemfdManifest() for the format.
+
+    auto segments = message.getSegmentsForOutput();
+
+    kj::Vector<uint> offloaded;
+    for (auto i: kj::indices(segments)) {
+      if (offloaded.size() == network.maxFdsPerMessage) break;
+      if (segments[i].size() * sizeof(word) >= network.memfdSegmentThreshold) {
+        offloaded.add(i);
+      }
+    }
+    if (offloaded.empty()) return;
+
+    auto manifestBuilder = kj::heap<MallocMessageBuilder>(offloaded.size() + 3);
+    auto manifest = manifestBuilder->initRoot<AnyPointer>()
+        .initAs<List<uint64_t>>(offloaded.size() + 1);
+    manifest.set(0, segments.size());
+
+    auto output = kj::heapArray<kj::ArrayPtr<const word>>(segments);
+    auto memfds = kj::heapArrayBuilder<kj::AutoCloseFd>(offloaded.size());
+    for (auto i: kj::indices(offloaded)) {
+      auto segment = segments[offloaded[i]];
+      memfds.add(newSealedMemfd(segment.asBytes()));
+      manifest.set(i + 1, uint64_t(offloaded[i]) | (uint64_t(segment.size()) << 32));
+      output[offloaded[i]] = nullptr;
+    }
+
+    offloadFds = memfds.finish();
+    offloadFdsForOutput = KJ_MAP(fd, offloadFds) -> int { return fd; };
+    offloadManifest = kj::mv(manifestBuilder);
+    offloadedSegmentsForOutput = kj::mv(output);
+  }
+#endif
+
+  OutgoingMessageImpl(TwoPartyVatNetwork& network, uint firstSegmentWordSize,
+                      kj::Own<void> arenaRef)
+      : arenaRef(kj::mv(arenaRef)),
+        network(network),
+        message(kj::addRef(*network.messageBuilderPool),
+                firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS : firstSegmentWordSize) {}
+
+  OutgoingMessageImpl(TwoPartyVatNetwork& network, kj::ArrayPtr<word> firstSegment,
+                      kj::Own<void> arenaRef)
+      : arenaRef(kj::mv(arenaRef)),
+        network(network),
+        message(kj::addRef(*network.messageBuilderPool), firstSegment) {}
+
+  void disposeImpl(void* pointer) const override {
+    if (--refcount == 0) {
+      auto self = const_cast<OutgoingMessageImpl*>(this);
+      if (arenaRef == nullptr) {
+        delete self;
+      } else {
+        // The destructor must finish before the arena's memory, which we're in, may be freed.
+        auto ownArenaRef = kj::mv(self->arenaRef);
+        self->~OutgoingMessageImpl();
+      }
+    }
+  }
 };
 
+void TwoPartyVatNetwork::setMessageBuilderPool(kj::Own<MessageBuilderPool> pool) {
+  messageBuilderPool = kj::mv(pool);
+}
+
+void TwoPartyVatNetwork::setWriteCoalescing(
+    WriteCoalescingOptions options, kj::Maybe<kj::Timer&> timer) {
+  KJ_IF_MAYBE(s, stream.tryGet<kj::Own<MessageStream>>()) {
+    kj::downcast<BufferedMessageStream>(**s).setWriteCoalescing(options, timer);
+  } else {
+    KJ_FAIL_REQUIRE("setWriteCoalescing() requires a TwoPartyVatNetwork that owns its stream");
+  }
+}
+
+void TwoPartyVatNetwork::setMemfdSegmentThreshold(size_t thresholdBytes) {
+#if __linux__
+  KJ_REQUIRE(thresholdBytes == 0 || maxFdsPerMessage > 0,
+             "setMemfdSegmentThreshold() requires a network with FD passing enabled");
+  memfdSegmentThreshold = thresholdBytes;
+#else
+  KJ_REQUIRE(thresholdBytes == 0, "memfd segments are only implemented on Linux");
+#endif
+}
+
 kj::Duration TwoPartyVatNetwork::getOutgoingMessageWaitTime() {
   if (queuedMessages.size() > 0) {
     return clock.now() - currentOutgoingMessageSendTime;
@@ -250,14 +496,87 @@ public:
     return message->sizeInWords();
   }
 
+#if __linux__
+  void useMemfdSegments(MessageReader& manifest, kj::Array<kj::AutoCloseFd> segmentFds,
+                        ReaderOptions options) {
+    // Read the segments listed in `manifest`, which preceded this message, out of their memfds.
+    message = mapMemfdSegments(kj::mv(message), manifest, kj::mv(segmentFds), options);
+  }
+#endif
+
 private:
   kj::Own<MessageReader> message;
   kj::Array<kj::AutoCloseFd> fdSpace;
   kj::ArrayPtr<kj::AutoCloseFd> fds;
 };
 
+class TwoPartyVatNetwork::AdaptiveStreamList final: public kj::Refcounted {
+public:
+  kj::Vector<RpcFlowController::AdaptiveWindowController*> controllers;
+};
+
+class TwoPartyVatNetwork::AdaptiveStream final: public RpcFlowController {
+  // Wraps a stream's adaptive controller, keeping it in the network's list while it's in use.
+
+public:
+  AdaptiveStream(kj::Own<AdaptiveStreamList> list,
+                 kj::Own<RpcFlowController::AdaptiveWindowController> inner)
+      : list(kj::mv(list)), inner(kj::mv(inner)) {
+    this->list->controllers.add(this->inner.get());
+  }
+
+  ~AdaptiveStream() noexcept(false) {
+    auto& controllers = list->controllers;
+    for (auto i: kj::indices(controllers)) {
+      if (controllers[i] == inner.get()) {
+        for (auto j: kj::range(i + 1, controllers.size())) {
+          controllers[j - 1] = controllers[j];
+        }
+        controllers.removeLast();
+        break;
+      }
+    }
+  }
+
+  kj::Promise<void> send(kj::Own<OutgoingRpcMessage> message, kj::Promise<void> ack) override {
+    return inner->send(kj::mv(message), kj::mv(ack));
+  }
+
+  kj::Promise<void> waitAllAcked() override {
+    return inner->waitAllAcked();
+  }
+
+private:
+  kj::Own<AdaptiveStreamList> list;
+  kj::Own<RpcFlowController::AdaptiveWindowController> inner;
+};
+
+void TwoPartyVatNetwork::setAdaptiveFlowControl() {
+  setAdaptiveFlowControl(RpcFlowController::AdaptiveWindowOptions());
+}
+
+void TwoPartyVatNetwork::setAdaptiveFlowControl(RpcFlowController::AdaptiveWindowOptions options) {
+  adaptiveWindowOptions = options;
+  if (adaptiveStreams == nullptr) {
+    adaptiveStreams = kj::refcounted<AdaptiveStreamList>();
+  }
+}
+
+kj::Array<RpcFlowController::AdaptiveWindowStats> TwoPartyVatNetwork::getFlowControlStats() {
+  KJ_IF_MAYBE(list, adaptiveStreams) {
+    return KJ_MAP(controller, (*list)->controllers) { return controller->getStats(); };
+  } else {
+    return nullptr;
+  }
+}
+
 kj::Own<RpcFlowController> TwoPartyVatNetwork::newStream() {
-  return RpcFlowController::newVariableWindowController(*this);
+  KJ_IF_MAYBE(list, adaptiveStreams) {
+    return kj::heap<AdaptiveStream>(kj::addRef(**list),
+        RpcFlowController::newAdaptiveWindowController(adaptiveWindowOptions));
+  } else {
+    return RpcFlowController::newVariableWindowController(*this);
+  }
 }
 
 size_t TwoPartyVatNetwork::getWindow() {
@@ -299,7 +618,12 @@ rpc::twoparty::VatId::Reader TwoPartyVatNetwork::getPeerVatId() {
 }
 
 kj::Own<OutgoingRpcMessage> TwoPartyVatNetwork::newOutgoingMessage(uint firstSegmentWordSize) {
-  return kj::refcounted<OutgoingMessageImpl>(*this, firstSegmentWordSize);
+  return OutgoingMessageImpl::make(*this, firstSegmentWordSize);
+}
+
+kj::Own<OutgoingRpcMessage> TwoPartyVatNetwork::newOutgoingMessageInArena(
+    uint firstSegmentWordSize, RpcMessageArena& arena) {
+  return OutgoingMessageImpl::make(*this, firstSegmentWordSize, arena);
 }
 
 kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> TwoPartyVatNetwork::receiveIncomingMessage() {
@@ -314,18 +638,34 @@ kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> TwoPartyVatNetwork::receiveI
       fdSpace = kj::heapArray<kj::AutoCloseFd>(maxFdsPerMessage);
     }
     auto promise = readCanceler.wrap(getStream().tryReadMessage(fdSpace, receiveOptions));
-    return promise.then([fdSpace = kj::mv(fdSpace)]
+    return promise.then([this, fdSpace = kj::mv(fdSpace)]
                         (kj::Maybe<MessageReaderAndFds>&& messageAndFds) mutable
-                      -> kj::Maybe<kj::Own<IncomingRpcMessage>> {
+                      -> kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> {
       KJ_IF_MAYBE(m, messageAndFds) {
+#if __linux__
+        if (memfdSegmentThreshold > 0 && m->fds.size() > 0 && isMemfdManifest(*m->reader)) {
+          // The next message has segments in these memfds.
+          auto segmentFds = KJ_MAP(fd, m->fds) { return kj::mv(fd); };
+          return receiveIncomingMessage().then(
+              [this, manifest = kj::mv(m->reader), segmentFds = kj::mv(segmentFds)]
+              (kj::Maybe<kj::Own<IncomingRpcMessage>>&& next) mutable {
+            auto& message = KJ_REQUIRE_NONNULL(next,
+                "connection ended between a memfd segment manifest and its message");
+            kj::downcast<IncomingMessageImpl>(*message).useMemfdSegments(
+                *manifest, kj::mv(segmentFds), receiveOptions);
+            return kj::mv(next);
+          });
+        }
+#endif
+        kj::Own<IncomingRpcMessage> result;
         if (m->fds.size() > 0) {
-          return kj::Own<IncomingRpcMessage>(
-              kj::heap<IncomingMessageImpl>(kj::mv(*m), kj::mv(fdSpace)));
+          result = kj::heap<IncomingMessageImpl>(kj::mv(*m), kj::mv(fdSpace));
         } else {
-          return kj::Own<IncomingRpcMessage>(kj::heap<IncomingMessageImpl>(kj::mv(m->reader)));
+          result = kj::heap<IncomingMessageImpl>(kj::mv(m->reader));
         }
+        return kj::Maybe<kj::Own<IncomingRpcMessage>>(kj::mv(result));
       } else {
-        return nullptr;
+        return kj::Maybe<kj::Own<IncomingRpcMessage>>(nullptr);
       }
     });
   });
@@ -376,6 +716,11 @@ struct TwoPartyServer::AcceptedConnection {
         return func(e);
       });
     }
+    KJ_IF_MAYBE(pool, parent.messageBuilderPool) {
+      network.setMessageBuilderPool(kj::addRef(**pool));
+    }
+    rpcSystem.setCallObserver(parent.callObserver);
+    rpcSystem.setCallArenaSize(parent.callArenaSize);
   }
 };
 
@@ -417,6 +762,18 @@ kj::Promise<void> TwoPartyServer::accept(
   return promise.attach(kj::mv(connectionState));
 }
 
+void TwoPartyServer::setMessageBuilderPool(kj::Own<MessageBuilderPool> pool) {
+  messageBuilderPool = kj::mv(pool);
+}
+
+void TwoPartyServer::setCallObserver(kj::Maybe<RpcCallObserver&> observer) {
+  callObserver = observer;
+}
+
+void TwoPartyServer::setCallArenaSize(size_t bytes) {
+  callArenaSize = bytes;
+}
+
 kj::Promise<void> TwoPartyServer::listen(kj::ConnectionReceiver& listener) {
   return listener.accept()
       .then([this,&listener](kj::Own<kj::AsyncIoStream>&& connection) mutable {
@@ -438,6 +795,191 @@ void TwoPartyServer::taskFailed(kj::Exception&& exception) {
   KJ_LOG(ERROR, exception);
 }
 
+// =======================================================================================
+
+#if !_WIN32
+
+struct ShardedTwoPartyServer::Worker final: private kj::TaskSet::ErrorHandler {
+  struct Startup {
+    kj::Maybe<kj::Own<const kj::Executor>> executor;
+    kj::Maybe<kj::Exception> error;
+  };
+  kj::MutexGuarded<Startup> startup;
+  // Published by the worker thread once it is running (or has failed to start).
+
+  kj::Own<const kj::Executor> executor;
+  // Copied out of `startup` by the constructor. Used only by the owning thread.
+
+  uint connectionCount = 0;
+  // Incremented by the owning thread on dispatch, decremented by the worker on disconnect.
+  // Accessed atomically.
+
+  // The rest are used only on the worker thread.
+  kj::LowLevelAsyncIoProvider* lowLevel = nullptr;
+  TwoPartyServer* server = nullptr;
+  kj::TaskSet* connections = nullptr;
+  kj::Own<kj::PromiseFulfiller<void>> shutdownFulfiller;
+
+  kj::Own<kj::Thread> thread;
+  // Last, so that the thread is joined before anything else is destroyed.
+
+  void run(kj::Function<Capability::Client()>& bootstrapFactory) {
+    auto io = kj::setupAsyncIo();
+
+    kj::Maybe<TwoPartyServer> ownServer;
+    auto error = kj::runCatchingExceptions([&]() {
+      ownServer.emplace(bootstrapFactory());
+    });
+
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    kj::TaskSet connectionTasks(*this);
+    lowLevel = io.lowLevelProvider;
+    KJ_IF_MAYBE(s, ownServer) {
+      server = s;
+    }
+    connections = &connectionTasks;
+    shutdownFulfiller = kj::mv(paf.fulfiller);
+
+    {
+      auto lock = startup.lockExclusive();
+      lock->executor = kj::getCurrentThreadExecutor().addRef();
+      lock->error = kj::mv(error);
+    }
+
+    if (ownServer != nullptr) {
+      paf.promise.wait(io.waitScope);
+    }
+
+    shutdownFulfiller = nullptr;
+    connections = nullptr;
+    server = nullptr;
+    lowLevel = nullptr;
+  }
+
+  void startConnection(kj::AutoCloseFd fd, uint flags) {
+    // The connection was counted when it was dispatched. Uncount it when it ends, or now if we
+    // fail to start it.
+    auto uncount = kj::defer([this]() {
+      __atomic_sub_fetch(&connectionCount, 1, __ATOMIC_RELAXED);
+    });
+
+    auto stream = lowLevel->wrapSocketFd(kj::mv(fd), flags);
+    auto promise = server->accept(*stream);
+    connections->add(promise.attach(kj::mv(stream), kj::mv(uncount)));
+  }
+
+  void shutdown() {
+    if (shutdownFulfiller.get() != nullptr) {
+      shutdownFulfiller->fulfill();
+    }
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, exception);
+  }
+};
+
+ShardedTwoPartyServer::ShardedTwoPartyServer(
+    uint threadCount, kj::Function<Capability::Client()> bootstrapFactoryParam)
+    : bootstrapFactory(kj::mv(bootstrapFactoryParam)), tasks(*this) {
+  KJ_REQUIRE(threadCount > 0, "ShardedTwoPartyServer needs at least one thread");
+
+  auto builder = kj::heapArrayBuilder<kj::Own<Worker>>(threadCount);
+  for (uint i = 0; i < threadCount; i++) {
+    auto worker = kj::heap<Worker>();
+    auto& ref = *worker;
+    worker->thread = kj::heap<kj::Thread>([this,&ref]() { ref.run(bootstrapFactory); });
+    builder.add(kj::mv(worker));
+  }
+  workers = builder.finish();
+
+  kj::Maybe<kj::Exception> error;
+  for (auto& worker: workers) {
+    worker->startup.when([](const Worker::Startup& startup) {
+      return startup.executor != nullptr;
+    }, [&](Worker::Startup& startup) {
+      worker->executor = kj::mv(KJ_ASSERT_NONNULL(startup.executor));
+      KJ_IF_MAYBE(e, startup.error) {
+        if (error == nullptr) error = kj::mv(*e);
+      }
+    });
+  }
+
+  KJ_IF_MAYBE(e, error) {
+    stopWorkers();
+    kj::throwFatalException(kj::mv(*e));
+  }
+}
+
+ShardedTwoPartyServer::~ShardedTwoPartyServer() noexcept(false) {
+  stopWorkers();
+}
+
+void ShardedTwoPartyServer::stopWorkers() {
+  for (auto& worker: workers) {
+    if (worker->executor->isLive()) {
+      worker->executor->executeSync([&]() { worker->shutdown(); });
+    }
+  }
+  workers = nullptr;
+}
+
+void ShardedTwoPartyServer::accept(kj::Own<kj::AsyncIoStream>&& connection) {
+  // The stream belongs to this thread's event loop, so hand over a duplicate of its descriptor
+  // and let the worker wrap it in its own loop.
+  int fd = KJ_REQUIRE_NONNULL(connection->getFd(),
+      "ShardedTwoPartyServer can only accept streams backed by file descriptors");
+  int dupFd;
+  KJ_SYSCALL(dupFd = fcntl(fd, F_DUPFD_CLOEXEC, 0));
+  dispatch(kj::AutoCloseFd(dupFd), kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
+}
+
+void ShardedTwoPartyServer::accept(kj::AutoCloseFd fd) {
+  dispatch(kj::mv(fd), 0);
+}
+
+void ShardedTwoPartyServer::dispatch(kj::AutoCloseFd fd, uint flags) {
+  // Pick the worker with the fewest connections, rotating the starting point so that ties are
+  // broken round-robin.
+  Worker* best = nullptr;
+  uint bestCount = kj::maxValue;
+  for (auto i: kj::indices(workers)) {
+    auto& worker = *workers[(nextWorker + i) % workers.size()];
+    uint count = __atomic_load_n(&worker.connectionCount, __ATOMIC_RELAXED);
+    if (count < bestCount) {
+      best = &worker;
+      bestCount = count;
+    }
+  }
+  nextWorker = (nextWorker + 1) % workers.size();
+
+  auto& worker = *best;
+  __atomic_add_fetch(&worker.connectionCount, 1, __ATOMIC_RELAXED);
+  tasks.add(worker.executor->executeAsync([&worker,fd=kj::mv(fd),flags]() mutable {
+    worker.startConnection(kj::mv(fd), flags);
+  }));
+}
+
+kj::Promise<void> ShardedTwoPartyServer::listen(kj::ConnectionReceiver& listener) {
+  return listener.accept()
+      .then([this,&listener](kj::Own<kj::AsyncIoStream>&& connection) mutable {
+    accept(kj::mv(connection));
+    return listen(listener);
+  });
+}
+
+kj::Array<uint> ShardedTwoPartyServer::getConnectionCounts() {
+  return KJ_MAP(worker, workers) {
+    return __atomic_load_n(&worker->connectionCount, __ATOMIC_RELAXED);
+  };
+}
+
+void ShardedTwoPartyServer::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+#endif  // !_WIN32
+
 TwoPartyClient::TwoPartyClient(kj::AsyncIoStream& connection)
     : network(connection, rpc::twoparty::Side::CLIENT),
       rpcSystem(makeRpcClient(network)) {}
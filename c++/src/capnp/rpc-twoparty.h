@@ -99,6 +99,41 @@ public:
   // Get how long the current outgoing message has been waiting to be sent on this connection.
   // Returns 0 if the queue is empty. This may be useful for backpressure.
 
+  void setMessageBuilderPool(kj::Own<MessageBuilderPool> pool);
+  // Build outgoing messages in segments taken from `pool`, so that steady-state sending does not
+  // need to allocate. The same pool can be shared by all connections on a thread. By default,
+  // each message's segments are allocated with calloc() and freed once the message is written.
+
+  void setWriteCoalescing(WriteCoalescingOptions options, kj::Maybe<kj::Timer&> timer = nullptr);
+  // Coalesce outgoing messages; see `BufferedMessageStream::setWriteCoalescing()`. Only valid if
+  // this network was constructed from a raw stream; if you passed your own MessageStream,
+  // configure that instead. Must be called before any messages are sent.
+
+  void setMemfdSegmentThreshold(size_t thresholdBytes);
+  // Send each outgoing message segment of at least `thresholdBytes` as a sealed memfd rather than
+  // inline, and read such segments out of incoming messages through a
+  // read-only mapping rather than copying them through the socket. Large `Data` and `Text` fields
+  // end up in segments of their own, so this lets multi-megabyte payloads between local processes
+  // bypass the socket buffers entirely. The sender still copies each such segment into its memfd
+  // once, since the segment must be sealed against writes before the peer may map it.
+  //
+  // Both ends must enable this (the thresholds may differ), and the network must have been
+  // constructed with FD passing enabled. A message's memfds are sent in a small frame of their own
+  // just ahead of it, so up to `maxFdsPerMessage` of its segments can be offloaded regardless of
+  // how many FDs the message itself carries; we assume the peer's limit is the same as ours, and
+  // send any segments beyond it inline. Only implemented on Linux. Pass zero to disable (the
+  // default).
+
+  void setAdaptiveFlowControl();
+  void setAdaptiveFlowControl(RpcFlowController::AdaptiveWindowOptions options);
+  // Size the window of each stream (i.e. each capability that streaming calls are made on) with
+  // `RpcFlowController::newAdaptiveWindowController()`, rather than using the socket's send
+  // buffer size as the window. Affects streams started after this call.
+
+  kj::Array<RpcFlowController::AdaptiveWindowStats> getFlowControlStats();
+  // Get the stats of each adaptive flow controller still in use by this network's streams, in the
+  // order in which the streams started. Empty unless setAdaptiveFlowControl() was called.
+
   // implements VatNetwork -----------------------------------------------------
 
   kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> connect(
@@ -108,17 +143,26 @@ public:
 private:
   class OutgoingMessageImpl;
   class IncomingMessageImpl;
+  class AdaptiveStreamList;
+  class AdaptiveStream;
 
   kj::OneOf<MessageStream*, kj::Own<MessageStream>> stream;
   // The underlying stream, which we may or may not own. Get a reference to
   // this with getStream, rather than reading it directly.
 
   uint maxFdsPerMessage;
+  size_t memfdSegmentThreshold = 0;
   rpc::twoparty::Side side;
   MallocMessageBuilder peerVatId;
   ReaderOptions receiveOptions;
+  kj::Own<MessageBuilderPool> messageBuilderPool;
   bool accepted = false;
 
+  RpcFlowController::AdaptiveWindowOptions adaptiveWindowOptions;
+  kj::Maybe<kj::Own<AdaptiveStreamList>> adaptiveStreams;
+  // Set by setAdaptiveFlowControl(). The list is refcounted because the RpcSystem may hold on to
+  // a stream's controller after this network is gone.
+
   bool solSndbufUnimplemented = false;
   // Whether stream.getsockopt(SO_SNDBUF) has been observed to throw UNIMPLEMENTED.
 
@@ -174,6 +218,8 @@ private:
   kj::Own<RpcFlowController> newStream() override;
   rpc::twoparty::VatId::Reader getPeerVatId() override;
   kj::Own<OutgoingRpcMessage> newOutgoingMessage(uint firstSegmentWordSize) override;
+  kj::Own<OutgoingRpcMessage> newOutgoingMessageInArena(
+      uint firstSegmentWordSize, RpcMessageArena& arena) override;
   kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveIncomingMessage() override;
   kj::Promise<void> shutdown() override;
 
@@ -221,9 +267,24 @@ public:
   //
   // Only considers clients whose connections TwoPartyServer took ownership of.
 
+  void setMessageBuilderPool(kj::Own<MessageBuilderPool> pool);
+  // Use `pool` for outgoing messages on all connections accepted after this call. See
+  // `TwoPartyVatNetwork::setMessageBuilderPool()`.
+
+  void setCallObserver(kj::Maybe<RpcCallObserver&> observer);
+  // Report calls on all connections accepted after this call to `observer`. See
+  // `RpcSystem::setCallObserver()`.
+
+  void setCallArenaSize(size_t bytes);
+  // Give each call on connections accepted after this call an arena of `bytes` bytes. See
+  // `RpcSystem::setCallArenaSize()`.
+
 private:
   Capability::Client bootstrapInterface;
   kj::Maybe<kj::Function<kj::String(const kj::Exception&)>> traceEncoder;
+  kj::Maybe<kj::Own<MessageBuilderPool>> messageBuilderPool;
+  kj::Maybe<RpcCallObserver&> callObserver;
+  size_t callArenaSize = 0;
   kj::TaskSet tasks;
 
   struct AcceptedConnection;
@@ -231,6 +292,63 @@ private:
   void taskFailed(kj::Exception&& exception) override;
 };
 
+#if !_WIN32
+
+class ShardedTwoPartyServer final: private kj::TaskSet::ErrorHandler {
+  // Like TwoPartyServer, but spreads connections across a pool of worker threads, each with its
+  // own event loop, so that a single process can make use of multiple cores.
+  //
+  // Each worker runs a TwoPartyServer whose bootstrap capability comes from calling
+  // `bootstrapFactory` once, on the worker thread, at startup.  The factory is therefore called
+  // concurrently from several threads and must be thread-safe.  Capabilities belong to the thread
+  // that created them; use kj::Executor to reach objects shared between workers.
+  //
+  // Each connection is assigned to the worker currently serving the fewest connections and stays
+  // there for its lifetime.  Since a connection's stream belongs to the event loop that created
+  // it, connections are passed to workers as file descriptors, so only socket-backed streams can
+  // be accepted.
+
+public:
+  ShardedTwoPartyServer(uint threadCount, kj::Function<Capability::Client()> bootstrapFactory);
+  // Starts the worker threads.  If `bootstrapFactory` throws on any of them, the constructor
+  // stops the rest and rethrows.
+
+  ~ShardedTwoPartyServer() noexcept(false);
+  // Disconnects all clients and joins the worker threads.
+
+  KJ_DISALLOW_COPY_AND_MOVE(ShardedTwoPartyServer);
+
+  void accept(kj::Own<kj::AsyncIoStream>&& connection);
+  // Hands the connection to a worker.  `connection->getFd()` must be non-null.
+
+  void accept(kj::AutoCloseFd fd);
+  // Hands a connected socket to a worker.
+
+  kj::Promise<void> listen(kj::ConnectionReceiver& listener);
+  // Listens for connections on the given listener, as TwoPartyServer::listen() does.
+  //
+  // All of the above must be called on the thread that created the ShardedTwoPartyServer.
+
+  uint getThreadCount() { return workers.size(); }
+
+  kj::Array<uint> getConnectionCounts();
+  // Number of connections currently assigned to each worker.
+
+private:
+  struct Worker;
+
+  kj::Function<Capability::Client()> bootstrapFactory;
+  kj::Array<kj::Own<Worker>> workers;
+  uint nextWorker = 0;
+  kj::TaskSet tasks;
+
+  void dispatch(kj::AutoCloseFd fd, uint flags);
+  void stopWorkers();
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+#endif  // !_WIN32
+
 class TwoPartyClient {
   // Convenience class which implements a simple client.
 
@@ -251,10 +369,30 @@ public:
   void setTraceEncoder(kj::Function<kj::String(const kj::Exception&)> func);
   // Forwarded to rpcSystem.setTraceEncoder().
 
+  void setCallObserver(kj::Maybe<RpcCallObserver&> observer) {
+    rpcSystem.setCallObserver(observer);
+  }
+
+  void setCallArenaSize(size_t bytes) {
+    rpcSystem.setCallArenaSize(bytes);
+  }
+
   size_t getCurrentQueueSize() { return network.getCurrentQueueSize(); }
   size_t getCurrentQueueCount() { return network.getCurrentQueueCount(); }
   kj::Duration getOutgoingMessageWaitTime() { return network.getOutgoingMessageWaitTime(); }
 
+  void setMessageBuilderPool(kj::Own<MessageBuilderPool> pool) {
+    network.setMessageBuilderPool(kj::mv(pool));
+  }
+
+  void setAdaptiveFlowControl() { network.setAdaptiveFlowControl(); }
+  void setAdaptiveFlowControl(RpcFlowController::AdaptiveWindowOptions options) {
+    network.setAdaptiveFlowControl(options);
+  }
+  kj::Array<RpcFlowController::AdaptiveWindowStats> getFlowControlStats() {
+    return network.getFlowControlStats();
+  }
+
 private:
   TwoPartyVatNetwork network;
   RpcSystem<rpc::twoparty::VatId> rpcSystem;
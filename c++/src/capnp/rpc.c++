@@ -179,6 +179,129 @@ static constexpr Id highBit() {
   return 1u << (sizeof(Id) * 8 - 1);
 }
 
+static inline uint lg(uint value) {
+  // Compute floor(log2(value)).
+  //
+  // Undefined for value = 0.
+#if _MSC_VER && !defined(__clang__)
+  unsigned long i;
+  auto found = _BitScanReverse(&i, value);
+  KJ_DASSERT(found);  // !found means value = 0
+  return i;
+#else
+  return sizeof(uint) * 8 - 1 - __builtin_clz(value);
+#endif
+}
+
+template <typename T>
+class SlabVector {
+  // Storage for the ID tables below: slots indexed by integer, allocated in chunks which double in
+  // size and are never moved. Growing the table therefore never touches existing entries (unlike
+  // kj::Vector, which would move every entry -- including each entry's refcounted pointers -- on
+  // each reallocation), and references to entries stay valid.
+  //
+  // Each slot has a generation counter which is odd while the slot is in use and is incremented
+  // whenever the slot is filled or freed, so the counter also tells whether a slot has been reused.
+
+public:
+  static constexpr uint FIRST_CHUNK_SIZE = 16;
+  // Chunk 0 holds slots [0, 16), and each chunk k >= 1 holds slots [16 << (k - 1), 16 << k).
+
+  uint capacity() const { return capacity_; }
+  uint nextCapacity() const { return capacity_ == 0 ? FIRST_CHUNK_SIZE : capacity_ * 2; }
+  uint size() const { return liveCount; }
+
+  bool isLive(uint index) const {
+    return index < capacity_ && (slot(index).generation & 1) != 0;
+  }
+
+  uint32_t getGeneration(uint index) const { return slot(index).generation; }
+
+  T& operator[](uint index) {
+    KJ_DASSERT(isLive(index));
+    return slot(index).value;
+  }
+
+  T& fill(uint index) {
+    // Mark the slot as in use and return its (default-constructed) value. The slot must be free.
+
+    while (index >= capacity_) grow();
+    auto& s = slot(index);
+    KJ_DASSERT((s.generation & 1) == 0, "slot already in use");
+    ++s.generation;
+    ++liveCount;
+    return s.value;
+  }
+
+  T free(uint index) {
+    // Mark the slot as free and return its value, leaving a default-constructed value behind.
+
+    auto& s = slot(index);
+    KJ_DASSERT((s.generation & 1) != 0, "slot not in use");
+    ++s.generation;
+    --liveCount;
+    T result = kj::mv(s.value);
+    s.value = T();
+    return result;
+  }
+
+  void reserve(uint size) {
+    // Allocate chunks up front until slots [0, size) exist.
+
+    while (size > capacity_) grow();
+  }
+
+  void clear() {
+    // Free every chunk, leaving the table empty.
+
+    { auto drop = kj::mv(chunks); }
+    capacity_ = 0;
+    liveCount = 0;
+  }
+
+  template <typename Func>
+  void forEach(Func&& func) {
+    // Calls func(index, value) for each slot in use.
+
+    uint index = 0;
+    for (auto& chunk: chunks) {
+      for (auto& s: chunk) {
+        if (s.generation & 1) func(index, s.value);
+        ++index;
+      }
+    }
+  }
+
+private:
+  struct Slot {
+    T value;
+    uint32_t generation = 0;
+  };
+
+  kj::Vector<kj::Array<Slot>> chunks;
+  uint capacity_ = 0;
+  uint liveCount = 0;
+
+  void grow() {
+    auto size = nextCapacity() - capacity_;
+    chunks.add(kj::heapArray<Slot>(size));
+    capacity_ += size;
+  }
+
+  Slot& slot(uint index) {
+    KJ_DASSERT(index < capacity_);
+    if (index < FIRST_CHUNK_SIZE) {
+      return chunks[0][index];
+    } else {
+      uint k = lg(index / FIRST_CHUNK_SIZE);
+      return chunks[k + 1][index - (FIRST_CHUNK_SIZE << k)];
+    }
+  }
+  const Slot& slot(uint index) const {
+    return const_cast<SlabVector*>(this)->slot(index);
+  }
+};
+
 template <typename Id, typename T>
 class ExportTable {
   // Table mapping integers to T, where the integers are chosen locally.
@@ -191,13 +314,28 @@ public:
   kj::Maybe<T&> find(Id id) {
     if (isHigh(id)) {
       return highSlots.find(id);
-    } else if (id < slots.size() && slots[id] != nullptr) {
+    } else if (slots.isLive(id) && slots[id] != nullptr) {
       return slots[id];
     } else {
       return nullptr;
     }
   }
 
+  uint32_t getGeneration(Id id) {
+    // Identifies the current use of `id`, which must be in the table; see find(id, generation).
+    // High IDs, which are never reused while live, always have generation zero.
+    return isHigh(id) ? 0 : slots.getGeneration(id);
+  }
+
+  kj::Maybe<T&> find(Id id, uint32_t generation) {
+    // Like find(id), but returns null if `id` has been erased and reused since getGeneration()
+    // returned `generation`.
+    if (!isHigh(id) && (!slots.isLive(id) || slots.getGeneration(id) != generation)) {
+      return nullptr;
+    }
+    return find(id);
+  }
+
   T erase(Id id, T& entry) {
     // Remove an entry from the table and return it.  We return it so that the caller can be
     // careful to release it (possibly invoking arbitrary destructors) at a time that makes sense.
@@ -210,23 +348,31 @@ public:
       return highSlots.release(slot).value;
     } else {
       KJ_DREQUIRE(&entry == &slots[id]);
-      T toRelease = kj::mv(slots[id]);
-      slots[id] = T();
       freeIds.push(id);
-      return toRelease;
+      return slots.free(id);
     }
   }
 
   T& next(Id& id) {
+    // Lowest free IDs are reused first, which keeps the IDs -- and hence the peer's import table,
+    // which is indexed by them -- dense.
+
     if (freeIds.empty()) {
-      id = slots.size();
+      id = nextId++;
       KJ_ASSERT(!isHigh(id), "2^31 concurrent questions?!!?!");
-      return slots.add();
     } else {
       id = freeIds.top();
       freeIds.pop();
-      return slots[id];
     }
+    return slots.fill(id);
+  }
+
+  void reserve(uint count) {
+    // Make room for `count` more calls to next(), so that the table doesn't grow piecemeal while
+    // they are made.
+
+    uint reused = kj::min(count, freeIds.size());
+    slots.reserve(nextId + (count - reused));
   }
 
   T& nextHigh(Id& id) {
@@ -250,11 +396,11 @@ public:
 
   template <typename Func>
   void forEach(Func&& func) {
-    for (Id i = 0; i < slots.size(); i++) {
-      if (slots[i] != nullptr) {
-        func(i, slots[i]);
+    slots.forEach([&](Id id, T& entry) {
+      if (entry != nullptr) {
+        func(id, entry);
       }
-    }
+    });
     for (auto& slot: highSlots) {
       func(slot.key, slot.value);
     }
@@ -262,13 +408,15 @@ public:
 
   void release() {
     // Release memory backing the table.
-    { auto drop = kj::mv(slots); }
+    slots.clear();
     { auto drop = kj::mv(freeIds); }
     { auto drop = kj::mv(highSlots); }
+    nextId = 0;
   }
 
 private:
-  kj::Vector<T> slots;
+  SlabVector<T> slots;
+  Id nextId = 0;
   std::priority_queue<Id, std::vector<Id>, std::greater<Id>> freeIds;
 
   kj::HashMap<Id, T> highSlots;
@@ -278,19 +426,36 @@ private:
 template <typename Id, typename T>
 class ImportTable {
   // Table mapping integers to T, where the integers are chosen remotely.
+  //
+  // Well-behaved peers choose small, dense IDs (see ExportTable::next()), which we store directly
+  // in a SlabVector. The slab only grows to cover an ID if it is at least half full, so a peer
+  // cannot make us allocate much more than it actually uses by choosing sparse IDs; such IDs go to
+  // a hash map instead. An ID stays wherever it was first stored until it is erased.
 
 public:
   T& operator[](Id id) {
-    if (id < kj::size(low)) {
-      return low[id];
+    if (slots.isLive(id)) {
+      return slots[id];
+    } else if (!high.empty()) {
+      auto iter = high.find(id);
+      if (iter != high.end()) {
+        return iter->second;
+      }
+    }
+
+    if (id < slots.capacity() ||
+        (id < slots.nextCapacity() && slots.size() >= slots.capacity() / 2)) {
+      return slots.fill(id);
     } else {
       return high[id];
     }
   }
 
   kj::Maybe<T&> find(Id id) {
-    if (id < kj::size(low)) {
-      return low[id];
+    if (slots.isLive(id)) {
+      return slots[id];
+    } else if (high.empty()) {
+      return nullptr;
     } else {
       auto iter = high.find(id);
       if (iter == high.end()) {
@@ -301,37 +466,160 @@ public:
     }
   }
 
+  uint32_t getGeneration(Id id) {
+    // Identifies the current use of `id`, which must be in the table; see find(id, generation).
+    // IDs stored in the hash map always have generation zero.
+    return slots.isLive(id) ? slots.getGeneration(id) : 0;
+  }
+
+  kj::Maybe<T&> find(Id id, uint32_t generation) {
+    // Like find(id), but returns null if `id` has been erased and reused since getGeneration()
+    // returned `generation`.
+    if (slots.isLive(id) ? slots.getGeneration(id) != generation : generation != 0) {
+      return nullptr;
+    }
+    return find(id);
+  }
+
   T erase(Id id) {
     // Remove an entry from the table and return it.  We return it so that the caller can be
     // careful to release it (possibly invoking arbitrary destructors) at a time that makes sense.
-    if (id < kj::size(low)) {
-      T toRelease = kj::mv(low[id]);
-      low[id] = T();
-      return toRelease;
+    if (slots.isLive(id)) {
+      return slots.free(id);
     } else {
-      T toRelease = kj::mv(high[id]);
-      high.erase(id);
+      auto iter = high.find(id);
+      if (iter == high.end()) {
+        return T();
+      }
+      T toRelease = kj::mv(iter->second);
+      high.erase(iter);
       return toRelease;
     }
   }
 
   template <typename Func>
   void forEach(Func&& func) {
-    for (Id i: kj::indices(low)) {
-      func(i, low[i]);
-    }
+    slots.forEach(func);
     for (auto& entry: high) {
       func(entry.first, entry.second);
     }
   }
 
 private:
-  T low[16];
+  SlabVector<T> slots;
   std::unordered_map<Id, T> high;
 };
 
 // =======================================================================================
 
+class CallArena final: public RpcMessageArena, private kj::Disposer {
+  // The RpcMessageArena given to an incoming call when RpcSystem::setCallArenaSize() is in use,
+  // and to each outgoing request batch. The object and its space are a single allocation.
+  // Anything that doesn't fit is allocated on the heap and freed along with the arena -- one
+  // allocation per object, or, for a growable arena, one per new chunk.
+
+public:
+  static kj::Own<CallArena> make(size_t size) {
+    void* memory = operator new(sizeof(CallArena) + size);
+    CallArena* arena = new (kj::_::PlacementNew(), memory) CallArena(size);
+    return kj::Own<CallArena>(arena, *arena);
+  }
+
+  static kj::Own<CallArena> makeGrowable(size_t firstChunkSize) {
+    // Like make(), but when the space runs out, the arena starts a new chunk twice as big as the
+    // last one rather than allocating objects one by one. For when the total size isn't known up
+    // front.
+
+    auto result = make(firstChunkSize);
+    result->chunkSize = firstChunkSize;
+    return result;
+  }
+
+  void reserve(size_t bytes) {
+    // Make sure that the next `bytes` bytes of allocations come from one chunk, starting a new one
+    // if the current one doesn't have room. Only for growable arenas.
+
+    KJ_DASSERT(chunkSize > 0);
+    if (remaining() < bytes) startChunk(bytes);
+  }
+
+  template <typename T, typename... Params>
+  T& construct(Params&&... params) {
+    // Construct a T in the arena. The caller must destroy it before the arena goes away.
+    void* memory = allocate(sizeof(T), alignof(T));
+    return *new (kj::_::PlacementNew(), memory) T(kj::fwd<Params>(params)...);
+  }
+
+  void* allocate(size_t bytes, size_t alignment) override {
+    uintptr_t pos = (reinterpret_cast<uintptr_t>(next) + alignment - 1) & ~(alignment - 1);
+    if (pos + bytes <= reinterpret_cast<uintptr_t>(end)) {
+      next = reinterpret_cast<byte*>(pos + bytes);
+      return reinterpret_cast<void*>(pos);
+    }
+
+    KJ_ASSERT(alignment <= alignof(Overflow));
+    if (chunkSize > 0) {
+      startChunk(bytes);
+      return allocate(bytes, alignment);
+    }
+    return newOverflow(bytes) + 1;
+  }
+
+  size_t remaining() override {
+    return end - next;
+  }
+
+  kj::Own<void> addRef() override {
+    ++refcount;
+    return kj::Own<CallArena>(this, *this);
+  }
+
+private:
+  struct alignas(kj::max(alignof(void*), alignof(word))) Overflow {
+    Overflow* next;
+  };
+
+  mutable uint refcount = 1;
+  byte* next;
+  byte* end;
+  Overflow* overflowList = nullptr;
+
+  size_t chunkSize = 0;
+  // Size of the current chunk if the arena is growable, else zero.
+
+  explicit CallArena(size_t size)
+      : next(reinterpret_cast<byte*>(this + 1)), end(next + size) {}
+
+  Overflow* newOverflow(size_t bytes) {
+    Overflow* overflow = reinterpret_cast<Overflow*>(operator new(sizeof(Overflow) + bytes));
+    overflow->next = overflowList;
+    overflowList = overflow;
+    return overflow;
+  }
+
+  void startChunk(size_t bytes) {
+    chunkSize = kj::max(chunkSize * 2, bytes);
+    next = reinterpret_cast<byte*>(newOverflow(chunkSize) + 1);
+    end = next + chunkSize;
+  }
+
+  ~CallArena() noexcept(false) {
+    while (overflowList != nullptr) {
+      Overflow* overflow = overflowList;
+      overflowList = overflow->next;
+      operator delete(overflow);
+    }
+  }
+
+  void disposeImpl(void* pointer) const override {
+    if (--refcount == 0) {
+      CallArena* self = const_cast<CallArena*>(this);
+      self->~CallArena();
+      operator delete(self);
+    }
+  }
+};
+
 class RpcConnectionState final: public kj::TaskSet::ErrorHandler, public kj::Refcounted {
 public:
   struct DisconnectInfo {
@@ -344,10 +632,13 @@ public:
                      kj::Own<VatNetworkBase::Connection>&& connectionParam,
                      kj::Own<kj::PromiseFulfiller<DisconnectInfo>>&& disconnectFulfiller,
                      size_t flowLimit,
-                     kj::Maybe<kj::Function<kj::String(const kj::Exception&)>&> traceEncoder)
+                     kj::Maybe<kj::Function<kj::String(const kj::Exception&)>&> traceEncoder,
+                     kj::Maybe<RpcCallObserver&> callObserver,
+                     size_t callArenaSize)
       : bootstrapFactory(bootstrapFactory),
         restorer(restorer), disconnectFulfiller(kj::mv(disconnectFulfiller)), flowLimit(flowLimit),
-        traceEncoder(traceEncoder), tasks(*this) {
+        traceEncoder(traceEncoder), callObserver(callObserver), callArenaSize(callArenaSize),
+        tasks(*this) {
     connection.init<Connected>(kj::mv(connectionParam));
     tasks.add(messageLoop());
   }
@@ -396,10 +687,10 @@ public:
     // `tasks.add(exception)` to schedule a shutdown, since any error thrown by a task will be
     // passed to `disconnect()` later.
 
-    // After disconnect(), the RpcSystem could be destroyed, making `traceEncoder` a dangling
-    // reference, so null it out before we return from here. We don't need it anymore once
-    // disconnected anyway.
-    KJ_DEFER(traceEncoder = nullptr);
+    // After disconnect(), the RpcSystem could be destroyed, making `traceEncoder` and
+    // `callObserver` dangling references, so null them out before we return from here. We don't
+    // need them anymore once disconnected anyway.
+    KJ_DEFER(traceEncoder = nullptr; callObserver = nullptr);
 
     if (!connection.is<Connected>()) {
       // Already disconnected.
@@ -530,12 +821,21 @@ public:
     maybeUnblockFlow();
   }
 
+  void setCallObserver(kj::Maybe<RpcCallObserver&> observer) {
+    callObserver = observer;
+  }
+
+  void setCallArenaSize(size_t bytes) {
+    callArenaSize = bytes;
+  }
+
 private:
   class RpcClient;
   class ImportClient;
   class PromiseClient;
   class QuestionRef;
   class RpcPipeline;
+  class RpcCallBatch;
   class RpcCallContext;
   class RpcResponse;
 
@@ -711,6 +1011,13 @@ private:
 
   kj::Maybe<kj::Function<kj::String(const kj::Exception&)>&> traceEncoder;
 
+  kj::Maybe<RpcCallObserver&> callObserver;
+  kj::TimePoint messageReceivedTime = kj::origin<kj::TimePoint>();
+  // When `callObserver` is set, the time at which the message currently being handled was read.
+
+  size_t callArenaSize;
+  // Size of the CallArena given to each incoming call, or zero to allocate calls on the heap.
+
   kj::TaskSet tasks;
 
   bool gotReturnForHighQuestionId = false;
@@ -794,14 +1101,24 @@ private:
 
     Request<AnyPointer, AnyPointer> newCallNoIntercept(
         uint64_t interfaceId, uint16_t methodId, kj::Maybe<MessageSize> sizeHint,
-        CallHints hints) {
+        CallHints hints, kj::Maybe<CallArena&> arena = nullptr) {
+      // If `arena` is given, the request and its message are placed in it. The arena must outlive
+      // the returned Request.
+
       if (!connectionState->connection.is<Connected>()) {
         return newBrokenRequest(kj::cp(connectionState->connection.get<Disconnected>()), sizeHint);
       }
 
-      auto request = kj::heap<RpcRequest>(
-          *connectionState, *connectionState->connection.get<Connected>(),
-          sizeHint, kj::addRef(*this));
+      auto& connection = *connectionState->connection.get<Connected>();
+      kj::Own<RpcRequest> request;
+      KJ_IF_MAYBE(a, arena) {
+        request = kj::Own<RpcRequest>(
+            &a->construct<RpcRequest>(*connectionState, connection, sizeHint, kj::addRef(*this),
+                                      *a),
+            kj::DestructorOnlyDisposer<RpcRequest>::instance);
+      } else {
+        request = kj::heap<RpcRequest>(*connectionState, connection, sizeHint, kj::addRef(*this));
+      }
       auto callBuilder = request->getCall();
 
       callBuilder.setInterfaceId(interfaceId);
@@ -818,10 +1135,16 @@ private:
       return callNoIntercept(interfaceId, methodId, kj::mv(context), hints);
     }
 
+    kj::Own<CallBatchHook> newCallBatch(
+        uint64_t interfaceId, uint16_t methodId, CallHints hints) override {
+      return kj::heap<RpcCallBatch>(kj::addRef(*this), interfaceId, methodId, hints);
+    }
+
     VoidPromiseAndPipeline callNoIntercept(uint64_t interfaceId, uint16_t methodId,
                                            kj::Own<CallContextHook>&& context, CallHints hints) {
       // Implement call() by copying params and results messages.
 
+      context->delivered();
       auto params = context->getParams();
       auto request = newCallNoIntercept(interfaceId, methodId, params.targetSize(), hints);
 
@@ -850,12 +1173,13 @@ private:
   public:
     ImportClient(RpcConnectionState& connectionState, ImportId importId,
                  kj::Maybe<kj::AutoCloseFd> fd)
-        : RpcClient(connectionState), importId(importId), fd(kj::mv(fd)) {}
+        : RpcClient(connectionState), importId(importId),
+          importGeneration(connectionState.imports.getGeneration(importId)), fd(kj::mv(fd)) {}
 
     ~ImportClient() noexcept(false) {
       unwindDetector.catchExceptionsIfUnwinding([&]() {
         // Remove self from the import table, if the table is still pointing at us.
-        KJ_IF_MAYBE(import, connectionState->imports.find(importId)) {
+        KJ_IF_MAYBE(import, connectionState->imports.find(importId, importGeneration)) {
           KJ_IF_MAYBE(i, import->importClient) {
             if (i == this) {
               connectionState->imports.erase(importId);
@@ -918,6 +1242,9 @@ private:
 
   private:
     ImportId importId;
+    uint32_t importGeneration;
+    // Tells our own entry in the import table apart from a later one that reuses its ID.
+
     kj::Maybe<kj::AutoCloseFd> fd;
 
     uint remoteRefcount = 0;
@@ -1058,6 +1385,14 @@ private:
       return RpcClient::newCall(interfaceId, methodId, sizeHint, hints);
     }
 
+    kj::Own<CallBatchHook> newCallBatch(
+        uint64_t interfaceId, uint16_t methodId, CallHints hints) override {
+      receivedCall = true;
+
+      // Like newCall(), the batch's requests must target us, not `cap`.
+      return RpcClient::newCallBatch(interfaceId, methodId, hints);
+    }
+
     VoidPromiseAndPipeline call(uint64_t interfaceId, uint16_t methodId,
                                 kj::Own<CallContextHook>&& context, CallHints hints) override {
       receivedCall = true;
@@ -1363,7 +1698,8 @@ private:
     // resolve to happen and then sends the appropriate `Resolve` message to the peer.
 
     return promise.then(
-        [this,exportId](kj::Own<ClientHook>&& resolution) -> kj::Promise<void> {
+        [this,exportId,generation=exports.getGeneration(exportId)]
+        (kj::Own<ClientHook>&& resolution) -> kj::Promise<void> {
       // Successful resolution.
 
       KJ_ASSERT(connection.is<Connected>(),
@@ -1381,8 +1717,10 @@ private:
 
       // Update the export table to point at this object instead.  We know that our entry in the
       // export table is still live because when it is destroyed the asynchronous resolution task
-      // (i.e. this code) is canceled.
-      auto& exp = KJ_ASSERT_NONNULL(exports.find(exportId));
+      // (i.e. this code) is canceled.  Check the generation anyway, so that if that ever stops
+      // being true we fail rather than overwrite whatever has reused the ID.
+      auto& exp = KJ_ASSERT_NONNULL(exports.find(exportId, generation),
+          "exported promise's table entry was reused before it resolved", exportId);
       exportsByCap.erase(exp.clientHook);
       exp.clientHook = kj::mv(resolution);
 
@@ -1636,6 +1974,9 @@ private:
 
   kj::Array<kj::Maybe<kj::Own<ClientHook>>> receiveCaps(List<rpc::CapDescriptor>::Reader capTable,
                                                         kj::ArrayPtr<kj::AutoCloseFd> fds) {
+    // Most messages carry no capabilities; don't allocate an empty array for them.
+    if (capTable.size() == 0) return nullptr;
+
     auto result = kj::heapArrayBuilder<kj::Maybe<kj::Own<ClientHook>>>(capTable.size());
     for (auto cap: capTable) {
       result.add(receiveCap(cap, fds));
@@ -1735,15 +2076,20 @@ private:
   class RpcRequest final: public RequestHook {
   public:
     RpcRequest(RpcConnectionState& connectionState, VatNetworkBase::Connection& connection,
-               kj::Maybe<MessageSize> sizeHint, kj::Own<RpcClient>&& target)
+               kj::Maybe<MessageSize> sizeHint, kj::Own<RpcClient>&& target,
+               kj::Maybe<RpcMessageArena&> arena = nullptr)
         : connectionState(kj::addRef(connectionState)),
           target(kj::mv(target)),
-          message(connection.newOutgoingMessage(
-              firstSegmentSize(sizeHint, messageSizeHint<rpc::Call>() +
-                  sizeInWords<rpc::Payload>() + MESSAGE_TARGET_SIZE_HINT))),
+          message(newCallMessage(connection, sizeHint, arena)),
           callBuilder(message->getBody().getAs<rpc::Message>().initCall()),
           paramsBuilder(capTable.imbue(callBuilder.getParams().getContent())) {}
 
+    static uint callMessageWords(kj::Maybe<MessageSize> sizeHint) {
+      // First segment size to ask for when the params are expected to be `sizeHint`.
+      return firstSegmentSize(sizeHint, messageSizeHint<rpc::Call>() +
+          sizeInWords<rpc::Payload>() + MESSAGE_TARGET_SIZE_HINT);
+    }
+
     inline AnyPointer::Builder getRoot() {
       return paramsBuilder;
     }
@@ -1907,6 +2253,16 @@ private:
     rpc::Call::Builder callBuilder;
     AnyPointer::Builder paramsBuilder;
 
+    static kj::Own<OutgoingRpcMessage> newCallMessage(
+        VatNetworkBase::Connection& connection, kj::Maybe<MessageSize> sizeHint,
+        kj::Maybe<RpcMessageArena&> arena) {
+      KJ_IF_MAYBE(a, arena) {
+        return connection.newOutgoingMessageInArena(callMessageWords(sizeHint), *a);
+      } else {
+        return connection.newOutgoingMessage(callMessageWords(sizeHint));
+      }
+    }
+
     struct SendInternalResult {
       kj::Own<QuestionRef> questionRef;
       kj::Promise<kj::Own<RpcResponse>> promise = nullptr;
@@ -2048,6 +2404,76 @@ private:
     }
   };
 
+  class RpcCallBatch final: public CallBatchHook {
+    // Batch of calls over this connection. Each call is still its own question with its own Call
+    // message, but the requests and their messages are built in one growable arena, and the
+    // question table makes room for the whole batch before any of it is sent.
+
+  public:
+    RpcCallBatch(kj::Own<RpcClient>&& target, uint64_t interfaceId, uint16_t methodId,
+                 ClientHook::CallHints hints)
+        : target(kj::mv(target)), interfaceId(interfaceId), methodId(methodId), hints(hints),
+          arena(CallArena::makeGrowable(FIRST_CHUNK_SIZE)) {}
+    KJ_DISALLOW_COPY_AND_MOVE(RpcCallBatch);
+
+    AnyPointer::Builder add(kj::Maybe<MessageSize> sizeHint) override {
+      KJ_REQUIRE(!sent, "Already called send() on this batch.");
+
+      if (sizeHint == nullptr && !requests.empty()) {
+        // Guess that these params will be about as big as the last call's.
+        sizeHint = static_cast<AnyPointer::Builder&>(requests.back()).targetSize();
+      }
+
+      // Start a new chunk now if this call won't fit, rather than letting the message put its
+      // first segment on the heap.
+      arena->reserve(sizeof(RpcRequest) + MESSAGE_OBJECT_SIZE_HINT +
+                     RpcRequest::callMessageWords(sizeHint) * sizeof(word));
+
+      auto request = target->newCallNoIntercept(interfaceId, methodId, sizeHint, hints, *arena);
+      AnyPointer::Builder params = request;
+      requests.add(kj::mv(request));
+      return params;
+    }
+
+    size_t size() override {
+      return requests.size();
+    }
+
+    kj::Promise<kj::Array<Response<AnyPointer>>> send() override {
+      KJ_REQUIRE(!sent, "Already called send() on this batch.");
+      sent = true;
+
+      auto& connectionState = *target->connectionState;
+      if (connectionState.connection.is<Connected>()) {
+        connectionState.questions.reserve(requests.size());
+      }
+
+      auto promises = kj::heapArrayBuilder<kj::Promise<Response<AnyPointer>>>(requests.size());
+      for (auto& request: requests) {
+        promises.add(request.send());
+      }
+      requests.clear();
+      return kj::joinPromises(promises.finish());
+    }
+
+  private:
+    static constexpr size_t FIRST_CHUNK_SIZE = 4096;
+
+    static constexpr size_t MESSAGE_OBJECT_SIZE_HINT = 512;
+    // Room to leave for the message object itself, which the VatNetwork may place in the arena
+    // ahead of the first segment. If it's bigger, the first segment just goes on the heap.
+
+    kj::Own<RpcClient> target;
+    uint64_t interfaceId;
+    uint16_t methodId;
+    ClientHook::CallHints hints;
+    bool sent = false;
+
+    kj::Own<CallArena> arena;
+    kj::Vector<Request<AnyPointer, AnyPointer>> requests;
+    // Declared after `arena`, which holds them, so that they are destroyed first.
+  };
+
   class RpcPipeline final: public PipelineHook, public kj::Refcounted {
   public:
     RpcPipeline(RpcConnectionState& connectionState, kj::Own<QuestionRef>&& questionRef,
@@ -2218,6 +2644,10 @@ private:
       return capTable.getTable().size() > 0;
     }
 
+    size_t sizeInWords() {
+      return message->sizeInWords();
+    }
+
     kj::Maybe<kj::Array<ExportId>> send() {
       // Send the response and return the export list.  Returns nullptr if there were no caps.
       // (Could return a non-null empty array if there were caps but none of them were exports.)
@@ -2378,15 +2808,35 @@ private:
     }
   };
 
-  class RpcCallContext final: public CallContextHook, public kj::Refcounted {
+  class RpcCallContext final: public CallContextHook, private kj::Disposer {
+    // Reference-counted by hand, rather than via kj::Refcounted, so that it can live inside its
+    // own CallArena.
+
   public:
-    RpcCallContext(RpcConnectionState& connectionState, AnswerId answerId,
+    template <typename... Params>
+    static kj::Own<RpcCallContext> make(size_t arenaSize, Params&&... params) {
+      // Construct a context, inside a new CallArena of `arenaSize` bytes unless that's zero.
+
+      RpcCallContext* result;
+      if (arenaSize == 0) {
+        result = new RpcCallContext(nullptr, kj::fwd<Params>(params)...);
+      } else {
+        auto arena = CallArena::make(arenaSize);
+        CallArena& arenaRef = *arena;
+        result = &arenaRef.construct<RpcCallContext>(kj::mv(arena), kj::fwd<Params>(params)...);
+      }
+      return kj::Own<RpcCallContext>(result, *result);
+    }
+
+    RpcCallContext(kj::Maybe<kj::Own<CallArena>> arena,
+                   RpcConnectionState& connectionState, AnswerId answerId,
                    kj::Own<IncomingRpcMessage>&& request,
                    kj::Array<kj::Maybe<kj::Own<ClientHook>>> capTableArray,
                    const AnyPointer::Reader& params,
                    bool redirectResults, uint64_t interfaceId, uint16_t methodId,
                    ClientHook::CallHints hints)
-        : connectionState(kj::addRef(connectionState)),
+        : arena(kj::mv(arena)),
+          connectionState(kj::addRef(connectionState)),
           answerId(answerId),
           hints(hints),
           interfaceId(interfaceId),
@@ -2398,6 +2848,14 @@ private:
           returnMessage(nullptr),
           redirectResults(redirectResults) {
       connectionState.callWordsInFlight += requestSize;
+
+      if (connectionState.callObserver != nullptr) {
+        auto received = connectionState.messageReceivedTime;
+        callInfo = RpcCallObserver::CallInfo {
+          interfaceId, methodId, RpcCallObserver::Outcome::RESULTS, requestSize, 0,
+          received, received, received, received
+        };
+      }
     }
 
     ~RpcCallContext() noexcept(false) {
@@ -2427,6 +2885,12 @@ private:
             }
 
             message->send();
+            observeReturn(redirectResults ? RpcCallObserver::Outcome::SENT_ELSEWHERE
+                                          : RpcCallObserver::Outcome::CANCELED,
+                          message->sizeInWords());
+          } else {
+            observeReturn(hints.onlyPromisePipeline ? RpcCallObserver::Outcome::SENT_ELSEWHERE
+                                                    : RpcCallObserver::Outcome::CANCELED, 0);
           }
 
           cleanupAnswerTable(nullptr, shouldFreePipeline);
@@ -2458,6 +2922,7 @@ private:
 
         if (response == nullptr) getResults(MessageSize{0, 0});  // force initialization of response
 
+        observeReturned();
         returnMessage.setAnswerId(answerId);
         returnMessage.setReleaseParamCaps(false);
 
@@ -2487,6 +2952,7 @@ private:
           sendErrorReturn(kj::mv(*exception));
           return;
         }
+        observeReturn(RpcCallObserver::Outcome::RESULTS, responseImpl.sizeInWords());
 
         if (responseImpl.hasCapabilities()) {
           auto& answer = KJ_ASSERT_NONNULL(connectionState->answers.find(answerId));
@@ -2494,7 +2960,7 @@ private:
           // consistent with whatever the result caps resolved to as of the time the return was sent.
           answer.pipeline = answer.pipeline.map([&](kj::Own<PipelineHook>& inner) {
             return kj::refcounted<PostReturnRpcPipeline>(
-                kj::mv(inner), responseImpl, kj::addRef(*this));
+                kj::mv(inner), responseImpl, addRefSelf());
           });
         }
 
@@ -2526,7 +2992,9 @@ private:
           // then we could set `noFinishNeeded`, but optimizing the error case doesn't seem that
           // important.)
 
+          observeReturned();
           message->send();
+          observeReturn(RpcCallObserver::Outcome::EXCEPTION, message->sizeInWords());
         }
 
         // Do not allow releasing the pipeline because we want pipelined calls to propagate the
@@ -2551,7 +3019,9 @@ private:
         //   redundant after a redirect, but as this case is less common and more complicated I
         //   don't want to fully think through the implications right now.
 
+        observeReturned();
         message->send();
+        observeReturn(RpcCallObserver::Outcome::SENT_ELSEWHERE, message->sizeInWords());
 
         cleanupAnswerTable(nullptr, false);
       }
@@ -2581,12 +3051,27 @@ private:
         if (redirectResults || !connectionState->connection.is<Connected>()) {
           response = kj::refcounted<LocallyRedirectedRpcResponse>(sizeHint);
         } else {
-          auto message = connectionState->connection.get<Connected>()->newOutgoingMessage(
-              firstSegmentSize(sizeHint, messageSizeHint<rpc::Return>() +
-                               sizeInWords<rpc::Payload>()));
-          returnMessage = message->getBody().initAs<rpc::Message>().initReturn();
-          response = kj::heap<RpcServerResponseImpl>(
-              *connectionState, kj::mv(message), returnMessage.getResults());
+          auto& connection = *connectionState->connection.get<Connected>();
+          uint firstSegmentWords = firstSegmentSize(sizeHint, messageSizeHint<rpc::Return>() +
+                                                    sizeInWords<rpc::Payload>());
+          KJ_IF_MAYBE(a, arena) {
+            // Reserve space for the response before the message, which may use up the rest of
+            // the arena for its first segment.
+            CallArena& callArena = **a;
+            void* memory = callArena.allocate(
+                sizeof(RpcServerResponseImpl), alignof(RpcServerResponseImpl));
+            auto message = connection.newOutgoingMessageInArena(firstSegmentWords, callArena);
+            returnMessage = message->getBody().initAs<rpc::Message>().initReturn();
+            auto impl = new (kj::_::PlacementNew(), memory) RpcServerResponseImpl(
+                *connectionState, kj::mv(message), returnMessage.getResults());
+            response = kj::Own<RpcServerResponse>(
+                impl, kj::DestructorOnlyDisposer<RpcServerResponseImpl>::instance);
+          } else {
+            auto message = connection.newOutgoingMessage(firstSegmentWords);
+            returnMessage = message->getBody().initAs<rpc::Message>().initReturn();
+            response = kj::heap<RpcServerResponseImpl>(
+                *connectionState, kj::mv(message), returnMessage.getResults());
+          }
         }
 
         auto results = response->getResultsBuilder();
@@ -2629,7 +3114,9 @@ private:
               builder.setReleaseParamCaps(false);
               builder.setTakeFromOtherQuestion(tailInfo->questionId);
 
+              observeReturned();
               message->send();
+              observeReturn(RpcCallObserver::Outcome::SENT_ELSEWHERE, message->sizeInWords());
             }
 
             // There are no caps in our return message, but of course the tail results could have
@@ -2667,10 +3154,44 @@ private:
       return kj::mv(paf.promise);
     }
     kj::Own<CallContextHook> addRef() override {
-      return kj::addRef(*this);
+      return addRefSelf();
+    }
+    void delivered() override {
+      if (!wasDelivered) {
+        wasDelivered = true;
+        KJ_IF_MAYBE(o, connectionState->callObserver) {
+          KJ_IF_MAYBE(info, callInfo) {
+            info->dispatched = o->clock.now();
+          }
+        }
+      }
     }
 
   private:
+    kj::Maybe<kj::Own<CallArena>> arena;
+    // The arena this context lives in, if any. The response and its `Return` message are built
+    // in it too.
+
+    mutable uint refcount = 1;
+
+    kj::Own<RpcCallContext> addRefSelf() {
+      ++refcount;
+      return kj::Own<RpcCallContext>(this, *this);
+    }
+
+    void disposeImpl(void* pointer) const override {
+      if (--refcount == 0) {
+        auto self = const_cast<RpcCallContext*>(this);
+        KJ_IF_MAYBE(a, self->arena) {
+          // The destructor must finish before the arena's memory, which we're in, is freed.
+          auto ownArena = kj::mv(*a);
+          self->~RpcCallContext();
+        } else {
+          delete self;
+        }
+      }
+    }
+
     kj::Own<RpcConnectionState> connectionState;
     AnswerId answerId;
 
@@ -2680,6 +3201,42 @@ private:
     uint16_t methodId;
     // For debugging.
 
+    kj::Maybe<RpcCallObserver::CallInfo> callInfo;
+    // Timings collected for the connection's RpcCallObserver, if there was one when the call
+    // arrived.
+
+    bool wasDelivered = false;
+    // Whether delivered() has been called, i.e. the call reached the capability which executes or
+    // forwards it.
+
+    void observeReturned() {
+      KJ_IF_MAYBE(o, connectionState->callObserver) {
+        KJ_IF_MAYBE(info, callInfo) {
+          info->returned = o->clock.now();
+        }
+      }
+    }
+
+    void observeReturn(RpcCallObserver::Outcome outcome, size_t responseWords) {
+      KJ_IF_MAYBE(o, connectionState->callObserver) {
+        KJ_IF_MAYBE(info, callInfo) {
+          info->outcome = outcome;
+          info->responseWords = responseWords;
+          info->returnSent = o->clock.now();
+          if (outcome == RpcCallObserver::Outcome::CANCELED) {
+            info->returned = info->returnSent;
+          }
+          if (!wasDelivered) {
+            // Never reached its target, e.g. the target was broken or the call was canceled while
+            // queued, so all of its time counts as queueing.
+            info->dispatched = info->returned;
+          }
+          o->callCompleted(*info);
+          callInfo = nullptr;
+        }
+      }
+    }
+
     // Request ---------------------------------------------
 
     size_t requestSize;  // for flow limit purposes
@@ -2772,6 +3329,9 @@ private:
     return canceler.wrap(connection.get<Connected>()->receiveIncomingMessage()).then(
         [this](kj::Maybe<kj::Own<IncomingRpcMessage>>&& message) {
       KJ_IF_MAYBE(m, message) {
+        KJ_IF_MAYBE(o, callObserver) {
+          messageReceivedTime = o->clock.now();
+        }
         handleMessage(kj::mv(*m));
         return true;
       } else {
@@ -3028,7 +3588,7 @@ private:
     // useful in practice and would be complicated to handle "correctly".
     if (redirectResults) hints.onlyPromisePipeline = false;
 
-    auto context = kj::refcounted<RpcCallContext>(
+    auto context = RpcCallContext::make(callArenaSize,
         *this, answerId, kj::mv(message), kj::mv(capTableArray), payload.getContent(),
         redirectResults, call.getInterfaceId(), call.getMethodId(), hints);
 
@@ -3601,6 +4161,22 @@ public:
     traceEncoder = kj::mv(func);
   }
 
+  void setCallObserver(kj::Maybe<RpcCallObserver&> observer) {
+    callObserver = observer;
+
+    for (auto& conn: connections) {
+      conn.second->setCallObserver(observer);
+    }
+  }
+
+  void setCallArenaSize(size_t bytes) {
+    callArenaSize = bytes;
+
+    for (auto& conn: connections) {
+      conn.second->setCallArenaSize(bytes);
+    }
+  }
+
   kj::Promise<void> run() { return kj::mv(acceptLoopPromise); }
 
 private:
@@ -3610,6 +4186,8 @@ private:
   kj::Maybe<SturdyRefRestorerBase&> restorer;
   size_t flowLimit = kj::maxValue;
   kj::Maybe<kj::Function<kj::String(const kj::Exception&)>> traceEncoder;
+  kj::Maybe<RpcCallObserver&> callObserver;
+  size_t callArenaSize = 0;
   kj::Promise<void> acceptLoopPromise = nullptr;
   kj::TaskSet tasks;
 
@@ -3631,7 +4209,8 @@ private:
       }));
       auto newState = kj::refcounted<RpcConnectionState>(
           bootstrapFactory, restorer, kj::mv(connection),
-          kj::mv(onDisconnect.fulfiller), flowLimit, traceEncoder);
+          kj::mv(onDisconnect.fulfiller), flowLimit, traceEncoder, callObserver,
+          callArenaSize);
       RpcConnectionState& result = *newState;
       connections.insert(std::make_pair(connectionPtr, kj::mv(newState)));
       return result;
@@ -3694,6 +4273,19 @@ void RpcSystemBase::setTraceEncoder(kj::Function<kj::String(const kj::Exception&
   impl->setTraceEncoder(kj::mv(func));
 }
 
+void RpcSystemBase::setCallObserver(kj::Maybe<RpcCallObserver&> observer) {
+  impl->setCallObserver(observer);
+}
+
+void RpcSystemBase::setCallArenaSize(size_t bytes) {
+  impl->setCallArenaSize(bytes);
+}
+
+kj::Own<OutgoingRpcMessage> VatNetworkBase::Connection::newOutgoingMessageInArena(
+    uint firstSegmentWordSize, RpcMessageArena& arena) {
+  return newOutgoingMessage(firstSegmentWordSize);
+}
+
 kj::Promise<void> RpcSystemBase::run() {
   return impl->run();
 }
@@ -3832,6 +4424,166 @@ private:
   WindowFlowController inner;
 };
 
+class AdaptiveWindowFlowController final
+    : public RpcFlowController::AdaptiveWindowController,
+      private RpcFlowController::WindowGetter {
+  // Estimates the bandwidth-delay product of the stream in the style of BBR: each ack yields a
+  // delivery rate sample (bytes acked while the message was in flight, divided by its RTT), the
+  // bandwidth estimate is the max sample over the last few round trips, and the delay is the
+  // minimum RTT seen recently. Like Vegas, a smoothed RTT well above the minimum is taken to mean
+  // that messages are queuing, in which case we stop adding headroom above the BDP.
+
+public:
+  AdaptiveWindowFlowController(AdaptiveWindowOptions options, const kj::MonotonicClock& clock)
+      : options(options), clock(clock), inner(*this) {
+    KJ_REQUIRE(options.minWindow > 0 && options.minWindow <= options.maxWindow,
+        "invalid adaptive window bounds", options.minWindow, options.maxWindow);
+    window = clampWindow(options.initialWindow);
+  }
+
+  kj::Promise<void> send(kj::Own<OutgoingRpcMessage> message, kj::Promise<void> ack) override {
+    auto size = message->sizeInWords() * sizeof(capnp::word);
+    Sample sample { clock.now(), bytesAcked, size };
+    inFlight += size;
+    return inner.send(kj::mv(message), ack.then([this, sample]() {
+      onAck(sample);
+    }, [this, size](kj::Exception&& e) {
+      inFlight -= size;
+      kj::throwFatalException(kj::mv(e));
+    }));
+  }
+
+  kj::Promise<void> waitAllAcked() override {
+    return inner.waitAllAcked();
+  }
+
+  AdaptiveWindowStats getStats() override {
+    AdaptiveWindowStats stats;
+    stats.window = window;
+    stats.inFlight = inFlight;
+    stats.minRtt = minRtt;
+    stats.smoothedRtt = smoothedRtt;
+    stats.bandwidth = maxBandwidth();
+    stats.bytesAcked = bytesAcked;
+    stats.messagesAcked = messagesAcked;
+    stats.startup = startup;
+    return stats;
+  }
+
+private:
+  struct Sample {
+    kj::TimePoint sentTime;
+    uint64_t bytesAckedAtSend;
+    size_t size;
+  };
+
+  static constexpr uint BANDWIDTH_ROUNDS = 10;
+  // Number of round trips over which the bandwidth estimate is the max sample.
+
+  static constexpr uint STARTUP_FLAT_ROUNDS = 3;
+  // Startup ends once the bandwidth estimate has failed to grow by 25% for this many rounds.
+
+  AdaptiveWindowOptions options;
+  const kj::MonotonicClock& clock;
+
+  size_t window;
+  size_t inFlight = 0;
+  uint64_t bytesAcked = 0;
+  uint64_t messagesAcked = 0;
+
+  kj::Duration minRtt = 0 * kj::NANOSECONDS;
+  kj::TimePoint minRttStamp = kj::origin<kj::TimePoint>();
+  kj::Duration smoothedRtt = 0 * kj::NANOSECONDS;
+
+  uint64_t roundBandwidth[BANDWIDTH_ROUNDS] = {};
+  // Max delivery rate sample (bytes per second) in each of the last few rounds, indexed by
+  // round count modulo BANDWIDTH_ROUNDS.
+
+  uint64_t roundCount = 0;
+  uint64_t nextRoundBytesAcked = 0;
+  // A round ends when a message sent after the previous round ended is acked, i.e. once
+  // `bytesAckedAtSend` reaches this value.
+
+  bool startup = true;
+  uint64_t startupBandwidth = 0;
+  uint startupFlatRounds = 0;
+
+  WindowFlowController inner;
+
+  size_t getWindow() override { return window; }
+
+  size_t clampWindow(uint64_t value) {
+    return kj::max(options.minWindow, kj::min(options.maxWindow, value));
+  }
+
+  uint64_t maxBandwidth() {
+    uint64_t result = 0;
+    for (auto bw: roundBandwidth) result = kj::max(result, bw);
+    return result;
+  }
+
+  void onAck(const Sample& sample) {
+    auto now = clock.now();
+    inFlight -= sample.size;
+    bytesAcked += sample.size;
+    ++messagesAcked;
+
+    auto rtt = now - sample.sentTime;
+    if (messagesAcked == 1 || rtt <= minRtt || now - minRttStamp > options.minRttExpiry) {
+      minRtt = rtt;
+      minRttStamp = now;
+    }
+    smoothedRtt = messagesAcked == 1 ? rtt : (smoothedRtt * 7 + rtt) / 8;
+
+    bool newRound = sample.bytesAckedAtSend >= nextRoundBytesAcked;
+    if (newRound) {
+      ++roundCount;
+      nextRoundBytesAcked = bytesAcked;
+      roundBandwidth[roundCount % BANDWIDTH_ROUNDS] = 0;
+    }
+
+    int64_t rttNs = rtt / kj::NANOSECONDS;
+    if (rttNs > 0) {
+      uint64_t delivered = bytesAcked - sample.bytesAckedAtSend;
+      uint64_t rate = delivered * 1000000000ull / rttNs;
+      auto& slot = roundBandwidth[roundCount % BANDWIDTH_ROUNDS];
+      slot = kj::max(slot, rate);
+    }
+
+    bool queueing = smoothedRtt * 2 > minRtt * 3;
+
+    if (startup) {
+      if (newRound) {
+        auto bw = maxBandwidth();
+        if (bw >= startupBandwidth + startupBandwidth / 4) {
+          startupBandwidth = bw;
+          startupFlatRounds = 0;
+        } else {
+          ++startupFlatRounds;
+        }
+      }
+
+      if (queueing || startupFlatRounds >= STARTUP_FLAT_ROUNDS || window >= options.maxWindow) {
+        startup = false;
+      } else {
+        // Grow by the amount acked, doubling the window every round trip.
+        window = clampWindow(window + sample.size);
+        return;
+      }
+    }
+
+    // Aim for twice the BDP, leaving room for the bandwidth to grow, unless acks are delayed, in
+    // which case anything beyond the BDP would only sit in a queue.
+    double bdp = double(maxBandwidth()) * double(minRtt / kj::NANOSECONDS) / 1e9;
+    uint64_t target = clampWindow(uint64_t(queueing ? bdp : bdp * 2));
+    if (window < target) {
+      window = kj::min(target, window + sample.size);
+    } else {
+      window = target;
+    }
+  }
+};
+
 }  // namespace
 
 kj::Own<RpcFlowController> RpcFlowController::newFixedWindowController(size_t windowSize) {
@@ -3840,8 +4592,23 @@ kj::Own<RpcFlowController> RpcFlowController::newFixedWindowController(size_t wi
 kj::Own<RpcFlowController> RpcFlowController::newVariableWindowController(WindowGetter& getter) {
   return kj::heap<WindowFlowController>(getter);
 }
+kj::Own<RpcFlowController::AdaptiveWindowController>
+RpcFlowController::newAdaptiveWindowController() {
+  return newAdaptiveWindowController(AdaptiveWindowOptions());
+}
+kj::Own<RpcFlowController::AdaptiveWindowController>
+RpcFlowController::newAdaptiveWindowController(
+    AdaptiveWindowOptions options, const kj::MonotonicClock& clock) {
+  return kj::heap<AdaptiveWindowFlowController>(options, clock);
+}
 
 bool IncomingRpcMessage::isShortLivedRpcMessage(AnyPointer::Reader body) {
+  if (body.getPointerType() != PointerType::STRUCT) {
+    // Not an RPC message, e.g. one of TwoPartyVatNetwork's memfd segment manifests, which must
+    // outlive the message that follows it.
+    return false;
+  }
+
   switch (body.getAs<rpc::Message>().which()) {
     case rpc::Message::CALL:
     case rpc::Message::RETURN:
@@ -3857,4 +4624,104 @@ kj::Function<bool(MessageReader&)> IncomingRpcMessage::getShortLivedCallback() {
   };
 }
 
+// =======================================================================================
+
+void RpcLatencyHistogram::Histogram::add(kj::Duration duration) {
+  uint index = 0;
+  while (index < BUCKET_COUNT - 1 && duration > (int64_t(1) << index) * kj::MICROSECONDS) {
+    ++index;
+  }
+  ++buckets[index];
+  ++count;
+  sum += duration;
+}
+
+kj::Duration RpcLatencyHistogram::Histogram::percentile(double fraction) const {
+  uint64_t target = kj::max(uint64_t(1), uint64_t(fraction * count + 0.5));
+  uint64_t seen = 0;
+  for (uint i = 0; i < BUCKET_COUNT; i++) {
+    seen += buckets[i];
+    if (seen >= target) return (int64_t(1) << i) * kj::MICROSECONDS;
+  }
+  return (int64_t(1) << (BUCKET_COUNT - 1)) * kj::MICROSECONDS;
+}
+
+void RpcLatencyHistogram::callCompleted(const CallInfo& info) {
+  MethodKey key { info.interfaceId, info.methodId };
+  auto& stats = methods.findOrCreate(key, [&]() {
+    MethodStats stats;
+    stats.interfaceId = info.interfaceId;
+    stats.methodId = info.methodId;
+    return decltype(methods)::Entry { key, kj::mv(stats) };
+  });
+
+  ++stats.calls;
+  switch (info.outcome) {
+    case Outcome::EXCEPTION: ++stats.exceptions; break;
+    case Outcome::CANCELED: ++stats.canceled; break;
+    case Outcome::RESULTS:
+    case Outcome::SENT_ELSEWHERE:
+      break;
+  }
+  stats.requestWords += info.requestWords;
+  stats.responseWords += info.responseWords;
+
+  stats.queued.add(info.dispatched - info.received);
+  stats.processing.add(info.returned - info.dispatched);
+  stats.sending.add(info.returnSent - info.returned);
+  stats.total.add(info.returnSent - info.received);
+}
+
+kj::Array<RpcLatencyHistogram::MethodStats> RpcLatencyHistogram::getStats() const {
+  return KJ_MAP(entry, methods) { return entry.value; };
+}
+
+void RpcLatencyHistogram::reset() {
+  methods.clear();
+}
+
+kj::String RpcLatencyHistogram::toString() const {
+  kj::Vector<kj::String> lines;
+
+  auto counter = [&](kj::StringPtr name, auto getter) {
+    lines.add(kj::str("# TYPE ", name, " counter"));
+    for (auto& entry: methods) {
+      auto& stats = entry.value;
+      lines.add(kj::str(name, "{interface=\"0x", kj::hex(stats.interfaceId),
+                        "\",method=\"", stats.methodId, "\"} ", getter(stats)));
+    }
+  };
+  counter("capnp_rpc_calls_total", [](const MethodStats& s) { return s.calls; });
+  counter("capnp_rpc_call_exceptions_total", [](const MethodStats& s) { return s.exceptions; });
+  counter("capnp_rpc_call_canceled_total", [](const MethodStats& s) { return s.canceled; });
+  counter("capnp_rpc_request_words_total", [](const MethodStats& s) { return s.requestWords; });
+  counter("capnp_rpc_response_words_total", [](const MethodStats& s) { return s.responseWords; });
+
+  lines.add(kj::str("# TYPE capnp_rpc_call_seconds histogram"));
+  for (auto& entry: methods) {
+    auto& stats = entry.value;
+    auto addHistogram = [&](kj::StringPtr phase, const Histogram& histogram) {
+      auto labels = kj::str("interface=\"0x", kj::hex(stats.interfaceId),
+                            "\",method=\"", stats.methodId, "\",phase=\"", phase, "\"");
+      uint64_t cumulative = 0;
+      for (uint i = 0; i < BUCKET_COUNT; i++) {
+        cumulative += histogram.buckets[i];
+        auto le = i == BUCKET_COUNT - 1 ? kj::str("+Inf") : kj::str(double(int64_t(1) << i) / 1e6);
+        lines.add(kj::str("capnp_rpc_call_seconds_bucket{", labels, ",le=\"", le, "\"} ",
+                          cumulative));
+      }
+      lines.add(kj::str("capnp_rpc_call_seconds_sum{", labels, "} ",
+                        double(histogram.sum / kj::NANOSECONDS) / 1e9));
+      lines.add(kj::str("capnp_rpc_call_seconds_count{", labels, "} ", histogram.count));
+    };
+    addHistogram("queued", stats.queued);
+    addHistogram("processing", stats.processing);
+    addHistogram("sending", stats.sending);
+    addHistogram("total", stats.total);
+  }
+
+  lines.add(nullptr);
+  return kj::strArray(lines, "\n");
+}
+
 }  // namespace capnp
@@ -23,6 +23,8 @@
 
 #include "capnp/capability.h"
 #include "capnp/rpc-prelude.h"
+#include <kj/time.h>
+#include <kj/map.h>
 
 CAPNP_BEGIN_HEADER
 
@@ -154,6 +156,26 @@ public:
   // Stack traces can sometimes contain sensitive information, so you should think carefully about
   // what information you are willing to reveal to the remote party.
 
+  // void setCallObserver(kj::Maybe<RpcCallObserver&> observer);
+  //
+  // (Inherited from _::RpcSystemBase)
+  //
+  // Install an observer which is told about the timing of every call received by this RpcSystem,
+  // on all connections, existing and future. Pass nullptr to remove it. The observer must outlive
+  // the RpcSystem or be removed first. See RpcCallObserver, below, and RpcLatencyHistogram for a
+  // ready-made implementation.
+
+  // void setCallArenaSize(size_t bytes);
+  //
+  // (Inherited from _::RpcSystemBase)
+  //
+  // If non-zero, each incoming call's bookkeeping -- its call context, its response, and (if the
+  // VatNetwork supports it) its `Return` message including the first segment -- is carved out of
+  // a single `bytes`-sized block allocated when the call arrives, rather than out of separate heap
+  // allocations. Anything that doesn't fit spills over to the heap. The block is freed once the
+  // call and its `Return` are both done with it. Zero (the default) disables this. Applies to
+  // calls received after it is set, on all connections.
+
   kj::Promise<void> run() { return RpcSystemBase::run(); }
   // Listens for incoming RPC connections and handles them. Never returns normally, but could throw
   // an exception if the system becomes unable to accept new connections (e.g. because the
@@ -275,6 +297,26 @@ public:
   // implementations can compute the size more cheaply by summing segment sizes.
 };
 
+class RpcMessageArena {
+  // Memory which the RPC system sets aside for everything to do with one incoming call. Passed to
+  // `VatNetwork::Connection::newOutgoingMessageInArena()` so that the call's `Return` can be
+  // built in it too. See `RpcSystem::setCallArenaSize()`.
+
+public:
+  virtual void* allocate(size_t bytes, size_t alignment) = 0;
+  // Allocate uninitialized memory. Never fails; if the arena is full, the memory comes from the
+  // heap instead. Either way, it is freed when the arena is, so there is no way to free it early.
+
+  virtual size_t remaining() = 0;
+  // How many bytes `allocate()` can still hand out before it has to fall back to the heap,
+  // ignoring alignment padding.
+
+  virtual kj::Own<void> addRef() = 0;
+  // Keep the arena alive until the returned object is dropped. Does not allocate. Anything built
+  // in the arena which may outlive the call, e.g. an outgoing message that is still queued, must
+  // hold one of these.
+};
+
 class IncomingRpcMessage {
   // A message received from a `VatNetwork`.
 
@@ -357,6 +399,188 @@ public:
 
   static constexpr size_t DEFAULT_WINDOW_SIZE = 65536;
   // The window size used by the default implementation of Connection::newStream().
+
+  struct AdaptiveWindowOptions {
+    size_t initialWindow = DEFAULT_WINDOW_SIZE;
+    size_t minWindow = 4096;
+    size_t maxWindow = 16 << 20;
+    // Bounds on the window. The window starts at `initialWindow` and is never allowed to leave
+    // [minWindow, maxWindow].
+
+    kj::Duration minRttExpiry = 10 * kj::SECONDS;
+    // How long an observed minimum round-trip time is trusted before it is re-measured. This lets
+    // the controller notice when the path (or the remote application) gets permanently slower.
+  };
+
+  struct AdaptiveWindowStats {
+    size_t window;
+    // Current window size, in bytes.
+
+    size_t inFlight;
+    // Bytes sent but not yet acknowledged.
+
+    kj::Duration minRtt;
+    kj::Duration smoothedRtt;
+    // Minimum and exponentially-smoothed time between send() and the message's `ack`. Both are
+    // zero until the first ack arrives.
+
+    uint64_t bandwidth;
+    // Estimated delivery rate, in bytes per second, taken as the maximum of recent samples.
+
+    uint64_t bytesAcked;
+    uint64_t messagesAcked;
+    // Totals since the controller was created.
+
+    bool startup;
+    // True while the controller is still growing its window exponentially, before it has found
+    // the bottleneck.
+  };
+
+  class AdaptiveWindowController;
+
+  static kj::Own<AdaptiveWindowController> newAdaptiveWindowController();
+  static kj::Own<AdaptiveWindowController> newAdaptiveWindowController(
+      AdaptiveWindowOptions options,
+      const kj::MonotonicClock& clock = kj::systemPreciseMonotonicClock());
+  // Constructs a flow controller which sizes its window from the round-trip time of each message
+  // rather than from a fixed number or the socket buffer size. It starts by growing the window
+  // exponentially, like TCP slow start, until acks start taking noticeably longer than the
+  // fastest ack seen so far, indicating that a queue is building somewhere. From then on, the
+  // window tracks the estimated bandwidth-delay product (bandwidth times minimum RTT), with
+  // headroom when acks arrive promptly and none when they are delayed.
+  //
+  // Since `ack` includes the time for the remote application to process each message, this
+  // adapts both to high-latency links (by opening the window well past the default) and to slow
+  // consumers (by not piling up messages in the consumer's queue).
+};
+
+class RpcFlowController::AdaptiveWindowController: public RpcFlowController {
+public:
+  virtual AdaptiveWindowStats getStats() = 0;
+  // Get a snapshot of the controller's current state.
+};
+
+class RpcCallObserver {
+  // Receives timing information about calls handled by an RpcSystem, for monitoring purposes.
+  // Install one with RpcSystem::setCallObserver(). The observer is only ever called from the
+  // RpcSystem's thread.
+  //
+  // When no observer is installed, the RpcSystem does not read the clock at all.
+
+public:
+  explicit RpcCallObserver(
+      const kj::MonotonicClock& clock = kj::systemPreciseMonotonicClock())
+      : clock(clock) {}
+  virtual ~RpcCallObserver() noexcept(false) = default;
+
+  enum class Outcome {
+    RESULTS,         // A `Return` carrying results was sent.
+    EXCEPTION,       // A `Return` carrying an exception was sent.
+    CANCELED,        // The caller canceled the call before it completed.
+    SENT_ELSEWHERE   // No results went back to the caller: they were redirected, tail-called
+                     // back to the caller, or the caller only wanted to pipeline on them.
+  };
+
+  struct CallInfo {
+    uint64_t interfaceId;
+    uint16_t methodId;
+    Outcome outcome;
+
+    size_t requestWords;
+    size_t responseWords;
+    // Sizes of the `Call` and `Return` messages. `responseWords` is zero if no `Return` was sent.
+
+    kj::TimePoint received;
+    // When the `Call` message was read from the connection. Time spent before this, e.g. in the
+    // transport while the RpcSystem was over its flow limit, is not visible here.
+
+    kj::TimePoint dispatched;
+    // When the call reached the capability which executes it, or the connection which forwards
+    // it elsewhere. Time spent waiting for a promised target to resolve (e.g. a pipelined call)
+    // or behind an embargo counts as queueing. If the call never reached its target (e.g. it was
+    // canceled while queued), this equals `returned`.
+
+    kj::TimePoint returned;
+    // When the call completed and the RpcSystem began building the `Return`.
+
+    kj::TimePoint returnSent;
+    // When the `Return` was handed to the VatNetwork. The network may queue it further before
+    // it's actually written.
+  };
+
+  virtual void callCompleted(const CallInfo& info) = 0;
+  // Called once for each incoming call, after its `Return` has been sent (or it was canceled).
+
+  const kj::MonotonicClock& clock;
+  // Clock used to produce the timestamps given to this observer.
+};
+
+class RpcLatencyHistogram final: public RpcCallObserver {
+  // An RpcCallObserver which aggregates counts and latency histograms per method, to be
+  // periodically scraped by a monitoring system.
+
+public:
+  using RpcCallObserver::RpcCallObserver;
+
+  static constexpr uint BUCKET_COUNT = 28;
+
+  struct Histogram {
+    uint64_t buckets[BUCKET_COUNT] = {};
+    // buckets[i] counts durations of at most 2^i us which don't fit in an earlier bucket, i.e.
+    // durations in (2^(i-1), 2^i] us, matching the `le` bounds under which they're exported.
+    // The last bucket also counts everything longer, about two minutes and up.
+
+    uint64_t count = 0;
+    kj::Duration sum = 0 * kj::NANOSECONDS;
+
+    void add(kj::Duration duration);
+
+    kj::Duration percentile(double fraction) const;
+    // Returns the upper bound of the bucket containing the given fraction (0 to 1) of samples.
+  };
+
+  struct MethodStats {
+    uint64_t interfaceId;
+    uint16_t methodId;
+
+    uint64_t calls = 0;
+    uint64_t exceptions = 0;
+    uint64_t canceled = 0;
+    uint64_t requestWords = 0;
+    uint64_t responseWords = 0;
+
+    Histogram queued;      // received -> dispatched
+    Histogram processing;  // dispatched -> returned
+    Histogram sending;     // returned -> returnSent
+    Histogram total;       // received -> returnSent
+  };
+
+  kj::Array<MethodStats> getStats() const;
+  // Returns stats for each method that has been called, ordered by interface and method ID.
+
+  kj::String toString() const;
+  // Renders the stats in the Prometheus text exposition format.
+
+  void reset();
+  // Forget everything recorded so far.
+
+  void callCompleted(const CallInfo& info) override;
+
+private:
+  struct MethodKey {
+    uint64_t interfaceId;
+    uint16_t methodId;
+
+    inline bool operator==(const MethodKey& other) const {
+      return interfaceId == other.interfaceId && methodId == other.methodId;
+    }
+    inline bool operator<(const MethodKey& other) const {
+      return interfaceId < other.interfaceId ||
+          (interfaceId == other.interfaceId && methodId < other.methodId);
+    }
+  };
+
+  kj::TreeMap<MethodKey, MethodStats> methods;
 };
 
 template <typename VatId, typename ProvisionId, typename RecipientId,
@@ -438,6 +662,15 @@ public:
     //   the `Connection` itself. However, it will not call `send()` any more after the
     //   `Connection` is destroyed.
 
+    virtual kj::Own<OutgoingRpcMessage> newOutgoingMessageInArena(
+        uint firstSegmentWordSize, RpcMessageArena& arena) override
+        { return newOutgoingMessage(firstSegmentWordSize); }
+    // Like `newOutgoingMessage()`, but the connection may place the message object and its first
+    // segment in `arena`, which belongs to the call that the message is returning from. The message
+    // must then hold `arena.addRef()` for as long as it uses that memory.
+    //
+    // The default implementation ignores the arena.
+
     virtual kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveIncomingMessage() override = 0;
     // Wait for a message to be received and return it.  If the read stream cleanly terminates,
     // return null.  If any other problem occurs, throw an exception.
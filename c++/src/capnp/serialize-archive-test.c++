@@ -0,0 +1,141 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "serialize-archive.h"
+#include <kj/test.h>
+#include "test-util.h"
+
+namespace capnp {
+namespace _ {  // private
+namespace {
+
+kj::Own<const kj::File> writeArchive(uint count, bool withKeys) {
+  auto file = kj::newInMemoryFile(kj::nullClock());
+  auto appender = kj::newFileAppender(file->clone());
+
+  MessageArchiveWriter writer(*appender);
+  for (uint i = 0; i < count; i++) {
+    MallocMessageBuilder builder(i % 3 == 0 ? 0 : SUGGESTED_FIRST_SEGMENT_WORDS,
+                                 AllocationStrategy::FIXED_SIZE);
+    auto root = builder.initRoot<TestAllTypes>();
+    root.setUInt32Field(i);
+    root.setTextField(kj::str("message ", i));
+
+    // Every third message is keyless.
+    if (withKeys && i % 3 != 1) {
+      KJ_EXPECT(writer.add(builder, kj::str("key", i)) == i);
+    } else {
+      KJ_EXPECT(writer.add(builder) == i);
+    }
+  }
+  writer.finish();
+
+  return kj::mv(file);
+}
+
+KJ_TEST("MessageArchive random access") {
+  auto file = writeArchive(100, false);
+  MessageArchiveReader reader(*file);
+  KJ_ASSERT(reader.size() == 100);
+
+  for (uint i: {57u, 0u, 99u, 3u}) {
+    auto message = reader.get(i);
+    auto root = message->getRoot<TestAllTypes>();
+    KJ_EXPECT(root.getUInt32Field() == i);
+    KJ_EXPECT(root.getTextField() == kj::str("message ", i));
+    KJ_EXPECT(reader.getKey(i).size() == 0);
+  }
+
+  KJ_EXPECT(reader.find("key1") == nullptr);
+  KJ_EXPECT_THROW_MESSAGE("out of range", reader.get(100));
+}
+
+KJ_TEST("MessageArchive lookup by key") {
+  auto file = writeArchive(1000, true);
+  MessageArchiveReader reader(*file);
+  KJ_ASSERT(reader.size() == 1000);
+
+  for (uint i = 0; i < 1000; i++) {
+    auto key = kj::str("key", i);
+    KJ_IF_MAYBE(index, reader.find(key)) {
+      KJ_EXPECT(i % 3 != 1);
+      KJ_EXPECT(*index == i);
+      KJ_EXPECT(reader.getKey(i) == key.asBytes());
+      KJ_EXPECT(reader.get(*index)->getRoot<TestAllTypes>().getUInt32Field() == i);
+    } else {
+      KJ_EXPECT(i % 3 == 1, i);
+    }
+  }
+
+  KJ_EXPECT(reader.find("nope") == nullptr);
+  KJ_EXPECT(reader.find("") == nullptr);
+}
+
+KJ_TEST("MessageArchive is also a plain message stream") {
+  auto file = writeArchive(5, true);
+  MessageArchiveReader archive(*file);
+  auto bytes = file->readAllBytes();
+  auto words = kj::arrayPtr(reinterpret_cast<const word*>(bytes.begin()),
+                            bytes.size() / sizeof(word));
+
+  for (uint i = 0; i < 5; i++) {
+    FlatArrayMessageReader reader(words);
+    KJ_EXPECT(reader.getRoot<TestAllTypes>().getUInt32Field() == i);
+    KJ_EXPECT(archive.getWords(i).size() == size_t(reader.getEnd() - words.begin()));
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+  }
+}
+
+KJ_TEST("MessageArchive rejects bad input") {
+  {
+    MallocMessageBuilder builder;
+    builder.initRoot<TestAllTypes>();
+
+    kj::VectorOutputStream output;
+    MessageArchiveWriter writer(output);
+    writer.add(builder, "same");
+    writer.add(builder, "same");
+    KJ_EXPECT_THROW_MESSAGE("duplicate key", writer.finish());
+  }
+
+  {
+    auto file = kj::newInMemoryFile(kj::nullClock());
+    MallocMessageBuilder builder;
+    builder.initRoot<TestAllTypes>();
+    auto flat = messageToFlatArray(builder);
+    file->writeAll(flat.asBytes());
+    KJ_EXPECT_THROW_MESSAGE("not a Cap'n Proto archive", MessageArchiveReader reader(*file));
+  }
+
+  {
+    // Corrupt the message count in the trailer.
+    auto file = writeArchive(5, false);
+    auto size = file->stat().size;
+    _::WireValue<uint64_t> bogus;
+    bogus.set(12345);
+    file->write(size - 24, kj::arrayPtr(&bogus, 1).asBytes());
+    KJ_EXPECT_THROW_MESSAGE("corrupt archive index", MessageArchiveReader reader(*file));
+  }
+}
+
+}  // namespace
+}  // namespace _ (private)
+}  // namespace capnp
@@ -0,0 +1,223 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "serialize-archive.h"
+#include <kj/debug.h>
+
+namespace capnp {
+
+namespace {
+
+constexpr uint64_t ARCHIVE_MAGIC = 0x3130766863726163ull;  // "carchv01" in little-endian
+constexpr size_t TRAILER_WORDS = 4;
+
+uint64_t hashKey(kj::ArrayPtr<const byte> key) {
+  // FNV-1a.  The hash is part of the file format, so we can't use kj::hashCode(), which is allowed
+  // to change between versions.
+  uint64_t result = 0xcbf29ce484222325ull;
+  for (byte b: key) {
+    result = (result ^ b) * 0x100000001b3ull;
+  }
+  return result;
+}
+
+size_t hashSlotCountFor(size_t count) {
+  // Power of two, at most half full.
+  size_t result = 1;
+  while (result < count * 2) result <<= 1;
+  return result;
+}
+
+inline size_t padToWord(size_t bytes) {
+  return (bytes + sizeof(word) - 1) & ~(sizeof(word) - 1);
+}
+
+}  // namespace
+
+// =======================================================================================
+
+MessageArchiveWriter::MessageArchiveWriter(kj::OutputStream& output): output(output) {}
+MessageArchiveWriter::~MessageArchiveWriter() noexcept(false) {}
+
+size_t MessageArchiveWriter::add(MessageBuilder& builder, kj::ArrayPtr<const byte> key) {
+  return add(builder.getSegmentsForOutput(), key);
+}
+
+size_t MessageArchiveWriter::add(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                                 kj::ArrayPtr<const byte> key) {
+  KJ_REQUIRE(!finished, "can't add messages to an archive after finish()");
+
+  size_t index = messageOffsets.size();
+  messageOffsets.add(offset);
+  keyOffsets.add(keyData.size());
+  keyData.addAll(key);
+  if (key.size() > 0) hasKeys = true;
+
+  writeMessage(output, segments);
+  offset += computeSerializedSizeInWords(segments) * sizeof(word);
+  return index;
+}
+
+void MessageArchiveWriter::finish() {
+  KJ_REQUIRE(!finished, "finish() called twice");
+  finished = true;
+
+  size_t count = messageOffsets.size();
+  uint64_t indexOffset = offset;
+
+  // Entries, including the terminating one.
+  auto entries = kj::heapArray<_::WireValue<uint64_t>>((count + 1) * 2);
+  for (size_t i = 0; i < count; i++) {
+    entries[i * 2].set(messageOffsets[i]);
+    entries[i * 2 + 1].set(keyOffsets[i]);
+  }
+  entries[count * 2].set(indexOffset);
+  entries[count * 2 + 1].set(keyData.size());
+
+  keyOffsets.add(keyData.size());
+  auto keyAt = [&](size_t i) {
+    return keyData.asPtr().slice(keyOffsets[i], keyOffsets[i + 1]);
+  };
+
+  // Hash table, padded.
+  size_t slotCount = hasKeys ? hashSlotCountFor(count) : 0;
+  auto slots = kj::heapArray<_::WireValue<uint32_t>>(padToWord(slotCount * 4) / 4);
+  memset(slots.begin(), 0, slots.asBytes().size());
+  if (hasKeys) {
+    KJ_REQUIRE(count < 0xffffffffu, "too many keyed messages in archive", count);
+    size_t mask = slotCount - 1;
+    for (size_t i = 0; i < count; i++) {
+      auto key = keyAt(i);
+      if (key.size() == 0) continue;
+
+      for (size_t slot = hashKey(key) & mask;; slot = (slot + 1) & mask) {
+        uint32_t existing = slots[slot].get();
+        if (existing == 0) {
+          slots[slot].set(i + 1);
+          break;
+        }
+        KJ_REQUIRE(keyAt(existing - 1) != key, "duplicate key in archive", existing - 1, i);
+      }
+    }
+  }
+
+  // Key data, padded.
+  keyData.resize(padToWord(keyData.size()));
+
+  _::WireValue<uint64_t> trailer[TRAILER_WORDS];
+  trailer[0].set(indexOffset);
+  trailer[1].set(count);
+  trailer[2].set(slotCount);
+  trailer[3].set(ARCHIVE_MAGIC);
+
+  kj::ArrayPtr<const byte> pieces[] = {
+    entries.asBytes(), keyData.asPtr(), slots.asBytes(),
+    kj::arrayPtr(trailer, TRAILER_WORDS).asBytes()
+  };
+  output.write(pieces);
+}
+
+// =======================================================================================
+
+MessageArchiveReader::MessageArchiveReader(const kj::ReadableFile& file, ReaderOptions options)
+    : options(options) {
+  uint64_t fileSize = file.stat().size;
+  KJ_REQUIRE(fileSize >= TRAILER_WORDS * sizeof(word) && fileSize % sizeof(word) == 0,
+             "not a Cap'n Proto archive (bad size)", fileSize);
+
+  mapping = file.mmap(0, fileSize);
+
+  auto trailer = reinterpret_cast<const _::WireValue<uint64_t>*>(mapping.end()) - TRAILER_WORDS;
+  KJ_REQUIRE(trailer[3].get() == ARCHIVE_MAGIC, "not a Cap'n Proto archive (bad magic number)");
+
+  uint64_t indexOffset = trailer[0].get();
+  uint64_t messageCount = trailer[1].get();
+  uint64_t slotCount = trailer[2].get();
+  uint64_t trailerOffset = fileSize - TRAILER_WORDS * sizeof(word);
+
+  // Check that the index fits, being careful about overflow from bogus values.
+  KJ_REQUIRE(indexOffset % sizeof(word) == 0 && indexOffset <= trailerOffset &&
+             messageCount < (trailerOffset - indexOffset) / (2 * sizeof(word)) &&
+             slotCount <= trailerOffset / 4 && (slotCount & (slotCount - 1)) == 0,
+             "corrupt archive index");
+  count = messageCount;
+  entries = reinterpret_cast<const _::WireValue<uint64_t>*>(mapping.begin() + indexOffset);
+
+  uint64_t keyStart = indexOffset + (count + 1) * 2 * sizeof(word);
+  uint64_t keySize = entries[count * 2 + 1].get();
+  uint64_t slotStart = keyStart + padToWord(keySize);
+  KJ_REQUIRE(entries[count * 2].get() == indexOffset &&
+             keySize <= trailerOffset - keyStart &&
+             slotStart + padToWord(slotCount * 4) == trailerOffset,
+             "corrupt archive index");
+
+  messagesEnd = indexOffset;
+  keyData = mapping.slice(keyStart, keyStart + keySize);
+  hashSlots = kj::arrayPtr(
+      reinterpret_cast<const _::WireValue<uint32_t>*>(mapping.begin() + slotStart), slotCount);
+}
+
+MessageArchiveReader::~MessageArchiveReader() noexcept(false) {}
+
+kj::ArrayPtr<const word> MessageArchiveReader::getWords(size_t index) const {
+  KJ_REQUIRE(index < count, "archive index out of range", index, count);
+
+  // Entries are validated as they're used, so that opening the archive needn't scan the index.
+  uint64_t begin = entries[index * 2].get();
+  uint64_t end = entries[index * 2 + 2].get();
+  KJ_REQUIRE(begin <= end && end <= messagesEnd &&
+             begin % sizeof(word) == 0 && end % sizeof(word) == 0,
+             "corrupt archive index entry", index);
+
+  auto words = reinterpret_cast<const word*>(mapping.begin());
+  return kj::arrayPtr(words + begin / sizeof(word), words + end / sizeof(word));
+}
+
+kj::Own<MessageReader> MessageArchiveReader::get(size_t index) const {
+  return kj::heap<FlatArrayMessageReader>(getWords(index), options);
+}
+
+kj::ArrayPtr<const byte> MessageArchiveReader::getKey(size_t index) const {
+  KJ_REQUIRE(index < count, "archive index out of range", index, count);
+
+  uint64_t begin = entries[index * 2 + 1].get();
+  uint64_t end = entries[index * 2 + 3].get();
+  KJ_REQUIRE(begin <= end && end <= keyData.size(), "corrupt archive index entry", index);
+  return keyData.slice(begin, end);
+}
+
+kj::Maybe<size_t> MessageArchiveReader::find(kj::ArrayPtr<const byte> key) const {
+  if (hashSlots.size() == 0 || key.size() == 0) return nullptr;
+
+  size_t mask = hashSlots.size() - 1;
+  size_t slot = hashKey(key) & mask;
+  for (size_t probes = 0; probes < hashSlots.size(); probes++) {
+    uint32_t entry = hashSlots[slot].get();
+    if (entry == 0) return nullptr;
+    if (entry <= count && getKey(entry - 1) == key) return size_t(entry - 1);
+    slot = (slot + 1) & mask;
+  }
+
+  // Table is full (which finish() never produces) and the key isn't in it.
+  return nullptr;
+}
+
+}  // namespace capnp
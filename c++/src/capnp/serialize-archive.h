@@ -0,0 +1,130 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+// An archive is a file containing many messages plus an index, so that any message can be found
+// without scanning the ones before it.
+//
+// Format:  The messages come first, each in the standard stream format (see serialize.h), so an
+// archive can also be read sequentially with StreamFdMessageReader and friends as long as the
+// reader stops after the last message.  The index follows, then a fixed-size trailer at the very
+// end of the file.  All integers are little-endian and all parts are word-aligned:
+//
+//     message[0] ... message[n-1]
+//     entry[0] ... entry[n]       two words each: byte offset of the message, and byte offset of
+//                                 its key within the key data; entry[n] marks the ends of both
+//     key data                    padded to a word boundary
+//     key hash table              32-bit slots, each zero or an entry number plus one; padded;
+//                                 omitted if no message has a key
+//     trailer                     four words: byte offset of entry[0], n, number of hash slots,
+//                                 and a magic number identifying the format
+
+#include "message.h"
+#include "serialize.h"
+#include <kj/filesystem.h>
+
+CAPNP_BEGIN_HEADER
+
+namespace capnp {
+
+class MessageArchiveWriter {
+  // Writes an archive to a stream.  Offsets, keys, and the hash table are buffered in memory until
+  // finish(); the messages themselves are written through immediately.
+
+public:
+  explicit MessageArchiveWriter(kj::OutputStream& output);
+  // `output` should be positioned at the beginning of the (empty) archive file.
+
+  KJ_DISALLOW_COPY_AND_MOVE(MessageArchiveWriter);
+  ~MessageArchiveWriter() noexcept(false);
+
+  size_t add(MessageBuilder& builder, kj::ArrayPtr<const byte> key = nullptr);
+  size_t add(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+             kj::ArrayPtr<const byte> key = nullptr);
+  // Appends a message, returning its index.  If `key` is non-empty, the message can also be
+  // found by key.  Keys must be unique within the archive.
+
+  inline size_t add(MessageBuilder& builder, kj::StringPtr key) {
+    return add(builder, key.asBytes());
+  }
+
+  void finish();
+  // Writes the index and trailer.  Must be called exactly once, after the last add().  An archive
+  // which was never finished cannot be opened by MessageArchiveReader.
+
+private:
+  kj::OutputStream& output;
+  uint64_t offset = 0;
+  kj::Vector<uint64_t> messageOffsets;
+  kj::Vector<uint64_t> keyOffsets;
+  kj::Vector<byte> keyData;
+  bool hasKeys = false;
+  bool finished = false;
+};
+
+class MessageArchiveReader {
+  // Reads an archive by mapping the whole file.  Opening the archive reads only the trailer, and
+  // fetching a message touches only that message's index entry and content, so the cost of any
+  // operation is independent of the size of the archive.
+  //
+  // After construction the reader is immutable, so it may be shared by multiple threads, e.g. to
+  // process disjoint ranges of messages in parallel.
+
+public:
+  explicit MessageArchiveReader(const kj::ReadableFile& file,
+                                ReaderOptions options = ReaderOptions());
+  // The mapping keeps its own reference to the file's contents, so `file` need not outlive the
+  // reader.
+
+  KJ_DISALLOW_COPY_AND_MOVE(MessageArchiveReader);
+  ~MessageArchiveReader() noexcept(false);
+
+  inline size_t size() const { return count; }
+  // Number of messages in the archive.
+
+  kj::ArrayPtr<const word> getWords(size_t index) const;
+  // Returns the serialized message with the given index, including its segment table, suitable
+  // for passing to FlatArrayMessageReader.
+
+  kj::Own<MessageReader> get(size_t index) const;
+  // Returns a reader for the message with the given index.
+
+  kj::ArrayPtr<const byte> getKey(size_t index) const;
+  // Returns the key of the message with the given index, or an empty array if it has none.
+
+  kj::Maybe<size_t> find(kj::ArrayPtr<const byte> key) const;
+  inline kj::Maybe<size_t> find(kj::StringPtr key) const { return find(key.asBytes()); }
+  // Looks up the index of the message with the given key.
+
+private:
+  ReaderOptions options;
+  kj::Array<const byte> mapping;
+  const _::WireValue<uint64_t>* entries;
+  size_t count;
+  kj::ArrayPtr<const byte> keyData;
+  kj::ArrayPtr<const _::WireValue<uint32_t>> hashSlots;
+  uint64_t messagesEnd;
+};
+
+}  // namespace capnp
+
+CAPNP_END_HEADER
@@ -29,6 +29,7 @@
 
 #include "serialize-async.h"
 #include "serialize.h"
+#include "serialize-packed.h"
 #include <kj/debug.h>
 #include <kj/thread.h>
 #include <stdlib.h>
@@ -557,6 +558,258 @@ KJ_TEST("BufferedMessageStream many small messages") {
   KJ_EXPECT(callbackCallCount == 16);
 }
 
+void initPackedTestMessage(MessageBuilder& message, uint size) {
+  // A message which is part compressible and, if `size` is large, spans several packing batches.
+  auto root = message.initRoot<test::TestAllTypes>();
+  for (auto element: root.initStructList(2)) {
+    initTestMessage(element);
+  }
+  auto data = root.initDataField(size * sizeof(word));
+  for (auto i: kj::indices(data)) {
+    data[i] = i % 3 == 0 ? 0 : i * 7;
+  }
+  root.initInt64List(size);  // all zeros
+}
+
+void checkPackedTestMessage(MessageReader& message, uint size) {
+  auto root = message.getRoot<test::TestAllTypes>();
+  KJ_ASSERT(root.getStructList().size() == 2);
+  for (auto element: root.getStructList()) {
+    checkTestMessage(element);
+  }
+  auto data = root.getDataField();
+  KJ_ASSERT(data.size() == size * sizeof(word));
+  for (auto i: kj::indices(data)) {
+    KJ_ASSERT(data[i] == byte(i % 3 == 0 ? 0 : i * 7), i);
+  }
+  KJ_EXPECT(root.getInt64List().size() == size);
+}
+
+KJ_TEST("async packed messages round trip") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto pipe = kj::newTwoWayPipe();
+
+  uint sizes[] = { 0, 100, 40000 };
+  auto writePromise = kj::evalLater([&]() -> kj::Promise<void> {
+    auto promise = kj::Promise<void>(kj::READY_NOW);
+    for (uint size: sizes) {
+      promise = promise.then([&pipe,size]() {
+        kj::Own<MessageBuilder> message;
+        if (size == 100) {
+          message = kj::heap<TestMessageBuilder>(7);
+        } else {
+          message = kj::heap<MallocMessageBuilder>();
+        }
+        initPackedTestMessage(*message, size);
+        auto write = writePackedMessage(*pipe.ends[1], *message);
+        return write.attach(kj::mv(message));
+      });
+    }
+    return promise.then([&]() { pipe.ends[1]->shutdownWrite(); });
+  }).eagerlyEvaluate(nullptr);
+
+  for (uint size: sizes) {
+    auto message = readPackedMessage(*pipe.ends[0]).wait(waitScope);
+    checkPackedTestMessage(*message, size);
+  }
+  KJ_EXPECT(tryReadPackedMessage(*pipe.ends[0]).wait(waitScope) == nullptr);
+  writePromise.wait(waitScope);
+}
+
+KJ_TEST("async packed encoding matches synchronous") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  MallocMessageBuilder message(0, AllocationStrategy::FIXED_SIZE);
+  initPackedTestMessage(message, 20000);
+
+  kj::VectorOutputStream syncBytes;
+  writePackedMessage(syncBytes, message);
+
+  // The async writer splits large segments across batches, so the bytes differ, but both must be
+  // readable by either reader.
+  auto pipe = kj::newOneWayPipe();
+  auto writePromise = writePackedMessage(*pipe.out, message)
+      .then([&]() { pipe.out = nullptr; }).eagerlyEvaluate(nullptr);
+  auto asyncBytes = pipe.in->readAllBytes().wait(waitScope);
+  writePromise.wait(waitScope);
+
+  {
+    kj::ArrayInputStream input(asyncBytes);
+    PackedMessageReader reader(input);
+    checkPackedTestMessage(reader, 20000);
+  }
+
+  {
+    // Feed the synchronous encoding to the async reader a few bytes at a time.
+    auto pipe2 = kj::newOneWayPipe();
+    auto bytes = syncBytes.getArray();
+    auto dripPromise = kj::evalLater([&]() -> kj::Promise<void> {
+      auto promise = kj::Promise<void>(kj::READY_NOW);
+      for (size_t i = 0; i < bytes.size(); i += 7) {
+        promise = promise.then([&,i]() {
+          return pipe2.out->write(bytes.begin() + i, kj::min(size_t(7), bytes.size() - i));
+        });
+      }
+      return promise;
+    }).eagerlyEvaluate(nullptr);
+
+    auto reader = readPackedMessage(*pipe2.in).wait(waitScope);
+    checkPackedTestMessage(*reader, 20000);
+    dripPromise.wait(waitScope);
+  }
+}
+
+KJ_TEST("PackedMessageStream") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto pipe = kj::newTwoWayPipe();
+  PackedMessageStream writer(*pipe.ends[1]);
+  PackedMessageStream reader(*pipe.ends[0], 64);
+
+  MallocMessageBuilder big;
+  initPackedTestMessage(big, 10000);
+  kj::Vector<kj::Own<MallocMessageBuilder>> smalls;
+  for (auto i: kj::zeroTo(16)) {
+    auto message = kj::heap<MallocMessageBuilder>();
+    message->getRoot<test::TestAnyPointer>().getAnyPointerField()
+        .setAs<Text>(kj::str("12345678-", i));
+    smalls.add(kj::mv(message));
+  }
+
+  kj::Vector<MessageBuilder*> batch;
+  for (auto& message: smalls) batch.add(message.get());
+  batch.add(&big);
+
+  auto writePromise = writer.MessageStream::writeMessages(batch.asPtr())
+      .then([&]() { return writer.writeMessage(*smalls[0]); })
+      .then([&]() { return writer.end(); })
+      .eagerlyEvaluate(nullptr);
+
+  for (auto i: kj::zeroTo(16)) {
+    expectSmallMessage(reader, kj::str("12345678-", i), waitScope);
+  }
+  checkPackedTestMessage(*reader.readMessage().wait(waitScope), 10000);
+  expectSmallMessage(reader, "12345678-0", waitScope);
+  KJ_EXPECT(reader.MessageStream::tryReadMessage().wait(waitScope) == nullptr);
+
+  writePromise.wait(waitScope);
+}
+
+class WriteCountingStream final: public kj::AsyncIoStream {
+  // Forwards to another stream, counting write calls and the pieces in each.
+
+public:
+  explicit WriteCountingStream(kj::AsyncIoStream& inner): inner(inner) {}
+
+  uint writeCount = 0;
+  size_t maxPieces = 0;
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return inner.tryRead(buffer, minBytes, maxBytes);
+  }
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    ++writeCount;
+    maxPieces = kj::max(maxPieces, size_t(1));
+    return inner.write(buffer, size);
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    ++writeCount;
+    maxPieces = kj::max(maxPieces, pieces.size());
+    return inner.write(pieces);
+  }
+  kj::Promise<void> whenWriteDisconnected() override { return inner.whenWriteDisconnected(); }
+  void shutdownWrite() override { inner.shutdownWrite(); }
+
+private:
+  kj::AsyncIoStream& inner;
+};
+
+KJ_TEST("AsyncIoMessageStream write coalescing") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto pipe = kj::newTwoWayPipe();
+  WriteCountingStream counter(*pipe.ends[1]);
+  AsyncIoMessageStream writer(counter);
+  writer.setWriteCoalescing(WriteCoalescingOptions());
+  AsyncIoMessageStream reader(*pipe.ends[0]);
+
+  MallocMessageBuilder big;
+  initPackedTestMessage(big, 10000);
+  KJ_ASSERT(big.getSegmentsForOutput().size() > 1);
+  kj::Vector<kj::Own<MallocMessageBuilder>> smalls;
+  for (auto i: kj::zeroTo(16)) {
+    auto message = kj::heap<MallocMessageBuilder>();
+    message->getRoot<test::TestAnyPointer>().getAnyPointerField()
+        .setAs<Text>(kj::str("12345678-", i));
+    smalls.add(kj::mv(message));
+  }
+
+  kj::Vector<MessageBuilder*> batch;
+  for (auto& message: smalls) batch.add(message.get());
+  batch.add(&big);
+
+  auto writePromise = writer.MessageStream::writeMessages(batch.asPtr()).eagerlyEvaluate(nullptr);
+
+  for (auto i: kj::zeroTo(16)) {
+    expectSmallMessage(reader, kj::str("12345678-", i), waitScope);
+  }
+  checkPackedTestMessage(*reader.readMessage().wait(waitScope), 10000);
+  writePromise.wait(waitScope);
+
+  // One write, in which all the small messages and the big message's segment table share one
+  // piece, followed by the big message's segments, some of which may be small enough to copy.
+  KJ_EXPECT(counter.writeCount == 1);
+  KJ_EXPECT(counter.maxPieces <= big.getSegmentsForOutput().size() * 2, counter.maxPieces);
+  KJ_EXPECT(counter.maxPieces < 16, counter.maxPieces);
+}
+
+KJ_TEST("BufferedMessageStream delayed write coalescing") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  kj::TimerImpl timer(kj::origin<kj::TimePoint>());
+
+  auto pipe = kj::newTwoWayPipe();
+  WriteCountingStream counter(*pipe.ends[1]);
+  BufferedMessageStream writer(counter, [](MessageReader&) { return false; });
+  WriteCoalescingOptions options;
+  options.maxDelay = 100 * kj::MICROSECONDS;
+  writer.setWriteCoalescing(options, timer);
+  AsyncIoMessageStream reader(*pipe.ends[0]);
+
+  auto writeSmall = [&](kj::StringPtr text) {
+    MallocMessageBuilder message;
+    message.getRoot<test::TestAnyPointer>().getAnyPointerField().setAs<Text>(text);
+    // The message is copied, so we can wait for the write and destroy the builder right away.
+    writer.writeMessage(message).wait(waitScope);
+  };
+
+  writeSmall("foo");
+  writeSmall("bar");
+  writeSmall("baz");
+  KJ_EXPECT(counter.writeCount == 0);
+
+  // All three go out together once the delay elapses.
+  timer.advanceTo(timer.now() + 100 * kj::MICROSECONDS);
+  waitScope.poll();
+  KJ_EXPECT(counter.writeCount == 1);
+  expectSmallMessage(reader, "foo", waitScope);
+  expectSmallMessage(reader, "bar", waitScope);
+  expectSmallMessage(reader, "baz", waitScope);
+
+  // end() doesn't wait for the timer.
+  writeSmall("qux");
+  auto endPromise = writer.end().eagerlyEvaluate(nullptr);
+  expectSmallMessage(reader, "qux", waitScope);
+  endPromise.wait(waitScope);
+  KJ_EXPECT(counter.writeCount == 2);
+  KJ_EXPECT(reader.MessageStream::tryReadMessage().wait(waitScope) == nullptr);
+}
+
 // TODO(test): We should probably test BufferedMessageStream's FD handling here... but really it
 //   gets tested well enough by rpc-twoparty-test.
 
@@ -32,6 +32,7 @@
 
 #include "capnp/serialize-async.h"
 #include "capnp/serialize.h"
+#include "capnp/serialize-packed.h"
 #include <kj/debug.h>
 #include <kj/io.h>
 
@@ -257,11 +258,10 @@ inline size_t tableSizeForSegments(size_t segmentsSize) {
   return (segmentsSize + 2) & ~size_t(1);
 }
 
-// Helper function that allocates and fills the pointed-to table with info about the segments and
-// populates the pieces array with pointers to the segments.
-void fillWriteArraysWithMessage(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
-                                kj::ArrayPtr<_::WireValue<uint32_t>> table,
-                                kj::ArrayPtr<kj::ArrayPtr<const byte>> pieces) {
+// Fills the pointed-to table, which must be tableSizeForSegments() long, with info about the
+// segments.
+void fillSegmentTable(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                      kj::ArrayPtr<_::WireValue<uint32_t>> table) {
   KJ_REQUIRE(segments.size() > 0, "Tried to serialize uninitialized message.");
 
   // We write the segment count - 1 because this makes the first word zero for single-segment
@@ -275,6 +275,14 @@ void fillWriteArraysWithMessage(kj::ArrayPtr<const kj::ArrayPtr<const word>> seg
     // Set padding byte.
     table[segments.size() + 1].set(0);
   }
+}
+
+// Helper function that fills the pointed-to table with info about the segments and populates
+// the pieces array with pointers to the segments.
+void fillWriteArraysWithMessage(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                                kj::ArrayPtr<_::WireValue<uint32_t>> table,
+                                kj::ArrayPtr<kj::ArrayPtr<const byte>> pieces) {
+  fillSegmentTable(segments, table);
 
   KJ_ASSERT(pieces.size() == segments.size() + 1, "incorrectly sized pieces array during write");
   pieces[0] = table.asBytes();
@@ -333,6 +341,144 @@ kj::Promise<void> writeMessagesImpl(
 
 }  // namespace
 
+namespace _ {  // private
+
+class CoalescingMessageWriter {
+  // Implements WriteCoalescingOptions on top of an AsyncOutputStream.
+
+public:
+  CoalescingMessageWriter(kj::AsyncOutputStream& output, WriteCoalescingOptions options,
+                          kj::Maybe<kj::Timer&> timer)
+      : output(output), options(options), timer(timer) {
+    KJ_REQUIRE(options.maxDelay == 0 * kj::MICROSECONDS || timer != nullptr,
+               "write coalescing with a delay requires a timer");
+  }
+
+  kj::Promise<void> writeMessages(
+      kj::ArrayPtr<kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages) {
+    KJ_REQUIRE(messages.size() > 0, "Tried to serialize zero messages.");
+
+    auto& batch = pending.add();
+    bool hasReferences = append(batch, messages);
+
+    if (options.maxDelay == 0 * kj::MICROSECONDS || hasReferences ||
+        batch.bytes >= options.flushThresholdBytes) {
+      return flush();
+    }
+
+    if (!timerArmed) {
+      timerArmed = true;
+      delayedFlush = KJ_ASSERT_NONNULL(timer).afterDelay(options.maxDelay).then([this]() {
+        timerArmed = false;
+        if (!pending.empty()) flush();
+      }).eagerlyEvaluate(nullptr);
+    }
+    return lastWrite.addBranch();
+  }
+
+  kj::Promise<void> flush() {
+    // Write all pending batches, and return a promise for completion of all writes so far.
+
+    if (!pending.empty()) {
+      auto batches = kj::mv(pending);
+      lastWrite = lastWrite.addBranch().then([this, batches = kj::mv(batches)]() mutable {
+        size_t count = 0;
+        for (auto& batch: batches) count += batch.pieces.size();
+        auto pieces = kj::heapArrayBuilder<kj::ArrayPtr<const byte>>(count);
+        for (auto& batch: batches) pieces.addAll(batch.pieces);
+        auto piecesPtr = pieces.asPtr();
+        return output.write(piecesPtr).attach(kj::mv(pieces), kj::mv(batches));
+      }).fork();
+    }
+    return lastWrite.addBranch();
+  }
+
+  kj::Promise<void> writeInOrder(kj::Function<kj::Promise<void>()> write) {
+    // Writes anything pending, then calls `write` to perform some other write on the stream,
+    // ordered with respect to all others.
+
+    flush();
+    lastWrite = lastWrite.addBranch().then([write = kj::mv(write)]() mutable {
+      return write();
+    }).fork();
+    return lastWrite.addBranch();
+  }
+
+private:
+  struct Batch {
+    kj::Array<word> copied;
+    kj::Vector<kj::ArrayPtr<const byte>> pieces;
+    size_t bytes = 0;
+  };
+
+  kj::AsyncOutputStream& output;
+  WriteCoalescingOptions options;
+  kj::Maybe<kj::Timer&> timer;
+
+  kj::Vector<Batch> pending;
+  // Batches not yet handed to the stream. There's one batch per writeMessages() call, each with
+  // its own copy buffer.
+
+  kj::ForkedPromise<void> lastWrite = kj::Promise<void>(kj::READY_NOW).fork();
+  // Completes when everything flushed so far has been written. Writes are chained so that they
+  // happen in order; if one fails, all later ones fail too.
+
+  bool timerArmed = false;
+  kj::Promise<void> delayedFlush = nullptr;
+
+  bool shouldCopy(kj::ArrayPtr<const word> segment) {
+    return segment.size() * sizeof(word) < options.copyThresholdBytes;
+  }
+
+  bool append(Batch& batch,
+              kj::ArrayPtr<kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages) {
+    // Lays out `messages` in `batch`: tables and small segments are copied into one buffer, with
+    // large segments referenced in between. Returns whether there were any references.
+
+    size_t copiedWords = 0;
+    for (auto& segments: messages) {
+      copiedWords += tableSizeForSegments(segments.size()) / 2;
+      for (auto& segment: segments) {
+        if (shouldCopy(segment)) copiedWords += segment.size();
+      }
+    }
+    batch.copied = kj::heapArray<word>(copiedWords);
+
+    bool hasReferences = false;
+    word* pos = batch.copied.begin();
+    word* runStart = pos;
+    for (auto& segments: messages) {
+      size_t tableWords = tableSizeForSegments(segments.size()) / 2;
+      fillSegmentTable(segments, kj::arrayPtr(
+          reinterpret_cast<_::WireValue<uint32_t>*>(pos), tableWords * 2));
+      pos += tableWords;
+
+      for (auto& segment: segments) {
+        if (shouldCopy(segment)) {
+          memcpy(pos, segment.begin(), segment.size() * sizeof(word));
+          pos += segment.size();
+        } else {
+          if (pos > runStart) {
+            batch.pieces.add(kj::arrayPtr(runStart, pos).asBytes());
+            runStart = pos;
+          }
+          batch.pieces.add(segment.asBytes());
+          batch.bytes += segment.size() * sizeof(word);
+          hasReferences = true;
+        }
+      }
+    }
+    KJ_ASSERT(pos == batch.copied.end());
+    if (pos > runStart) {
+      batch.pieces.add(kj::arrayPtr(runStart, pos).asBytes());
+    }
+    batch.bytes += copiedWords * sizeof(word);
+    return hasReferences;
+  }
+};
+
+}  // namespace _ (private)
+
 kj::Promise<void> writeMessage(kj::AsyncOutputStream& output,
                                kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
   return writeMessageImpl(segments,
@@ -367,6 +513,159 @@ kj::Promise<void> writeMessages(
   return writeMessages(output, messages);
 }
 
+// =======================================================================================
+
+namespace _ {  // private
+
+class AsyncPackedInputStream final: public kj::AsyncInputStream {
+  // Async counterpart to PackedInputStream, with the same constraint that data must be read in
+  // the same pieces as it was written.  Each read fills the whole buffer unless EOF is reached.
+
+public:
+  AsyncPackedInputStream(kj::AsyncInputStream& inner, size_t bufferSize, bool readAhead)
+      : inner(inner), buffer(kj::heapArray<byte>(bufferSize)), readAhead(readAhead) {}
+  // If `readAhead` is false, the stream never reads more from `inner` than the current read could
+  // possibly need, so that whatever follows is left in `inner`.
+
+  kj::Promise<size_t> tryRead(void* dst, size_t minBytes, size_t maxBytes) override {
+    KJ_REQUIRE(maxBytes % sizeof(word) == 0, "AsyncPackedInputStream reads must be word-aligned.");
+    decoder.setOutput(kj::arrayPtr(reinterpret_cast<word*>(dst), maxBytes / sizeof(word)));
+    return decodeMore();
+  }
+
+private:
+  kj::AsyncInputStream& inner;
+  kj::Array<byte> buffer;
+  kj::ArrayPtr<const byte> pending;
+  // Part of `buffer` which has been read but not yet decoded.
+
+  bool readAhead;
+  PackedDecoder decoder;
+
+  kj::Promise<size_t> decodeMore() {
+    pending = pending.slice(decoder.decode(pending), pending.size());
+    if (decoder.isComplete()) {
+      return decoder.getWordsDecoded() * sizeof(word);
+    }
+
+    size_t maxBytes = buffer.size();
+    if (!readAhead) {
+      maxBytes = kj::min(maxBytes, decoder.minInputNeeded());
+    }
+    return inner.tryRead(buffer.begin(), 1, maxBytes).then([this](size_t n) -> kj::Promise<size_t> {
+      if (n == 0) {
+        // EOF.  Return what we have and let the caller decide whether that's premature.
+        return decoder.getWordsDecoded() * sizeof(word);
+      }
+      pending = buffer.slice(0, n);
+      return decodeMore();
+    });
+  }
+};
+
+class AsyncPackedOutputStream final: public kj::AsyncOutputStream {
+  // Async counterpart to PackedOutputStream.  Data is packed in batches.  Each batch is passed to
+  // the inner stream as soon as it is ready, and the next one is packed while that write is in
+  // flight.
+
+public:
+  explicit AsyncPackedOutputStream(kj::AsyncOutputStream& inner): inner(inner) {}
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    singlePiece = kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size);
+    return write(kj::arrayPtr(&singlePiece, 1));
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    this->pieces = pieces;
+    pieceIndex = 0;
+    pieceOffset = 0;
+    return pump(kj::READY_NOW, 0);
+  }
+
+  kj::Promise<void> whenWriteDisconnected() override {
+    return inner.whenWriteDisconnected();
+  }
+
+private:
+  static constexpr size_t BATCH_SIZE = 8192 * sizeof(word);
+  // Bytes of unpacked input per batch.
+
+  kj::AsyncOutputStream& inner;
+  kj::ArrayPtr<const byte> singlePiece;
+  kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces;
+  size_t pieceIndex = 0;
+  size_t pieceOffset = 0;
+  kj::VectorOutputStream batches[2];
+
+  kj::Promise<void> pump(kj::Promise<void> inFlight, uint next) {
+    // Packs the next batch while `inFlight` (the write of the other batch) completes, then starts
+    // writing it.
+    auto& batch = batches[next];
+    if (!packBatch(batch)) {
+      return kj::mv(inFlight);
+    }
+
+    return inFlight.then([this,&batch,next]() {
+      auto bytes = batch.getArray();
+      return pump(inner.write(bytes.begin(), bytes.size()), next ^ 1);
+    });
+  }
+
+  bool packBatch(kj::VectorOutputStream& batch) {
+    // Packs up to BATCH_SIZE bytes of the remaining input into `batch`.  Returns false if there
+    // was nothing left to pack.
+    //
+    // A piece may be split between batches.  That's fine for the reader, because runs never cross
+    // write() boundaries in the packed output, so a reader expecting the whole piece still sees
+    // runs which end within it.
+
+    batch.clear();
+    PackedOutputStream packer(batch);
+    size_t budget = BATCH_SIZE;
+    while (budget > 0 && pieceIndex < pieces.size()) {
+      auto piece = pieces[pieceIndex];
+      KJ_REQUIRE(piece.size() % sizeof(word) == 0,
+                 "AsyncPackedOutputStream writes must be word-aligned.");
+
+      size_t n = kj::min(piece.size() - pieceOffset, budget);
+      packer.write(piece.begin() + pieceOffset, n);
+      budget -= n;
+      pieceOffset += n;
+      if (pieceOffset == piece.size()) {
+        ++pieceIndex;
+        pieceOffset = 0;
+      }
+    }
+    return batch.getArray().size() > 0;
+  }
+};
+
+}  // namespace _ (private)
+
+kj::Promise<kj::Own<MessageReader>> readPackedMessage(
+    kj::AsyncInputStream& input, ReaderOptions options, kj::ArrayPtr<word> scratchSpace) {
+  auto packed = kj::heap<_::AsyncPackedInputStream>(input, 8192, false);
+  auto promise = readMessage(*packed, options, scratchSpace);
+  return promise.attach(kj::mv(packed));
+}
+
+kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadPackedMessage(
+    kj::AsyncInputStream& input, ReaderOptions options, kj::ArrayPtr<word> scratchSpace) {
+  auto packed = kj::heap<_::AsyncPackedInputStream>(input, 8192, false);
+  auto promise = tryReadMessage(*packed, options, scratchSpace);
+  return promise.attach(kj::mv(packed));
+}
+
+kj::Promise<void> writePackedMessage(kj::AsyncOutputStream& output,
+                                     kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  auto packed = kj::heap<_::AsyncPackedOutputStream>(output);
+  auto promise = writeMessage(*packed, segments);
+  return promise.attach(kj::mv(packed));
+}
+
+// =======================================================================================
+
 kj::Promise<void> MessageStream::writeMessages(kj::ArrayPtr<MessageAndFds> messages) {
   if (messages.size() == 0) return kj::READY_NOW;
   kj::ArrayPtr<MessageAndFds> remainingMessages;
@@ -431,14 +730,27 @@ kj::Promise<kj::Maybe<MessageReaderAndFds>> AsyncIoMessageStream::tryReadMessage
     });
 }
 
+AsyncIoMessageStream::~AsyncIoMessageStream() noexcept(false) {}
+
+void AsyncIoMessageStream::setWriteCoalescing(
+    WriteCoalescingOptions options, kj::Maybe<kj::Timer&> timer) {
+  coalescer = kj::heap<_::CoalescingMessageWriter>(stream, options, timer);
+}
+
 kj::Promise<void> AsyncIoMessageStream::writeMessage(
     kj::ArrayPtr<const int> fds,
     kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  KJ_IF_MAYBE(c, coalescer) {
+    return c->get()->writeMessages(kj::arrayPtr(&segments, 1));
+  }
   return capnp::writeMessage(stream, segments);
 }
 
 kj::Promise<void> AsyncIoMessageStream::writeMessages(
     kj::ArrayPtr<kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages) {
+  KJ_IF_MAYBE(c, coalescer) {
+    return c->get()->writeMessages(messages);
+  }
   return capnp::writeMessages(stream, messages);
 }
 
@@ -465,6 +777,9 @@ kj::Maybe<int> getSendBufferSize(kj::AsyncIoStream& stream) {
 }
 
 kj::Promise<void> AsyncIoMessageStream::end() {
+  KJ_IF_MAYBE(c, coalescer) {
+    return c->get()->flush().then([this]() { stream.shutdownWrite(); });
+  }
   stream.shutdownWrite();
   return kj::READY_NOW;
 }
@@ -588,9 +903,27 @@ kj::Promise<kj::Maybe<MessageReaderAndFds>> BufferedMessageStream::tryReadMessag
   return tryReadMessageImpl(fdSpace, 0, options, scratchSpace);
 }
 
+BufferedMessageStream::~BufferedMessageStream() noexcept(false) {}
+
+void BufferedMessageStream::setWriteCoalescing(
+    WriteCoalescingOptions options, kj::Maybe<kj::Timer&> timer) {
+  coalescer = kj::heap<_::CoalescingMessageWriter>(stream, options, timer);
+}
+
 kj::Promise<void> BufferedMessageStream::writeMessage(
     kj::ArrayPtr<const int> fds,
     kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  KJ_IF_MAYBE(c, coalescer) {
+    if (fds.size() == 0 || capStream == nullptr) {
+      return c->get()->writeMessages(kj::arrayPtr(&segments, 1));
+    }
+
+    // FDs have to go out with the message's first byte, so this message can't be coalesced.
+    return c->get()->writeInOrder([this, fds, segments]() {
+      return capnp::writeMessage(KJ_ASSERT_NONNULL(capStream), fds, segments);
+    });
+  }
+
   KJ_IF_MAYBE(cs, capStream) {
     return capnp::writeMessage(*cs, fds, segments);
   } else {
@@ -600,6 +933,9 @@ kj::Promise<void> BufferedMessageStream::writeMessage(
 
 kj::Promise<void> BufferedMessageStream::writeMessages(
     kj::ArrayPtr<kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages) {
+  KJ_IF_MAYBE(c, coalescer) {
+    return c->get()->writeMessages(messages);
+  }
   return capnp::writeMessages(stream, messages);
 }
 
@@ -608,6 +944,9 @@ kj::Maybe<int> BufferedMessageStream::getSendBufferSize() {
 }
 
 kj::Promise<void> BufferedMessageStream::end() {
+  KJ_IF_MAYBE(c, coalescer) {
+    return c->get()->flush().then([this]() { stream.shutdownWrite(); });
+  }
   stream.shutdownWrite();
   return kj::READY_NOW;
 }
@@ -839,4 +1178,47 @@ kj::Promise<kj::AsyncCapabilityStream::ReadResult> BufferedMessageStream::tryRea
   }
 }
 
+// =======================================================================================
+
+PackedMessageStream::PackedMessageStream(kj::AsyncIoStream& stream, size_t readBufferSize)
+    : stream(stream),
+      input(kj::heap<_::AsyncPackedInputStream>(stream, readBufferSize, true)),
+      output(kj::heap<_::AsyncPackedOutputStream>(stream)) {}
+
+PackedMessageStream::~PackedMessageStream() noexcept(false) {}
+
+kj::Promise<kj::Maybe<MessageReaderAndFds>> PackedMessageStream::tryReadMessage(
+    kj::ArrayPtr<kj::AutoCloseFd> fdSpace,
+    ReaderOptions options,
+    kj::ArrayPtr<word> scratchSpace) {
+  return capnp::tryReadMessage(*input, options, scratchSpace)
+    .then([](kj::Maybe<kj::Own<MessageReader>> maybeReader) -> kj::Maybe<MessageReaderAndFds> {
+      KJ_IF_MAYBE(reader, maybeReader) {
+        return MessageReaderAndFds { kj::mv(*reader), nullptr };
+      } else {
+        return nullptr;
+      }
+    });
+}
+
+kj::Promise<void> PackedMessageStream::writeMessage(
+    kj::ArrayPtr<const int> fds,
+    kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  return capnp::writeMessage(*output, segments);
+}
+
+kj::Promise<void> PackedMessageStream::writeMessages(
+    kj::ArrayPtr<kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages) {
+  return capnp::writeMessages(*output, messages);
+}
+
+kj::Maybe<int> PackedMessageStream::getSendBufferSize() {
+  return capnp::getSendBufferSize(stream);
+}
+
+kj::Promise<void> PackedMessageStream::end() {
+  stream.shutdownWrite();
+  return kj::READY_NOW;
+}
+
 }  // namespace capnp
@@ -29,6 +29,12 @@ CAPNP_BEGIN_HEADER
 
 namespace capnp {
 
+namespace _ {  // private
+class AsyncPackedInputStream;
+class AsyncPackedOutputStream;
+class CoalescingMessageWriter;
+}  // namespace _ (private)
+
 struct MessageReaderAndFds {
   kj::Own<MessageReader> reader;
   kj::ArrayPtr<kj::AutoCloseFd> fds;
@@ -107,10 +113,39 @@ public:
 
 };
 
+struct WriteCoalescingOptions {
+  // Options for MessageStream implementations which can coalesce outgoing messages. See
+  // AsyncIoMessageStream::setWriteCoalescing().
+
+  size_t copyThresholdBytes = 4096;
+  // Segments smaller than this are copied, along with the segment tables, into one contiguous
+  // buffer per batch. Larger segments are written from where they are, by reference. Without
+  // coalescing, every segment and every segment table is a separate piece of the write, so a
+  // batch of many small messages can exceed IOV_MAX and be split into several system calls.
+
+  size_t flushThresholdBytes = 65536;
+  // A delayed batch (see `maxDelay`) is written as soon as it grows to this size.
+
+  kj::Duration maxDelay = 0 * kj::MICROSECONDS;
+  // If non-zero, a batch consisting entirely of copied data may be held for up to this long, so
+  // that messages written shortly after it can go out in the same system call, in the manner of
+  // Nagle's algorithm. In this case the write promise doesn't wait for the batch itself, since
+  // the batch owns its copy, only for earlier writes; a failure of the delayed write is reported
+  // by a later write or by end().
+  // Batches containing segments written by reference, or reaching `flushThresholdBytes`, are
+  // written right away. Requires a timer.
+};
+
 class AsyncIoMessageStream final: public MessageStream {
   // A MessageStream that wraps an AsyncIoStream.
 public:
   explicit AsyncIoMessageStream(kj::AsyncIoStream& stream);
+  ~AsyncIoMessageStream() noexcept(false);
+
+  void setWriteCoalescing(WriteCoalescingOptions options, kj::Maybe<kj::Timer&> timer = nullptr);
+  // Coalesce outgoing messages as described by `options`. `timer` is required if
+  // `options.maxDelay` is non-zero, and must outlive the stream. Must be called before anything
+  // is written.
 
   // Implements MessageStream
   kj::Promise<kj::Maybe<MessageReaderAndFds>> tryReadMessage(
@@ -130,6 +165,7 @@ public:
   using MessageStream::writeMessage;
 private:
   kj::AsyncIoStream& stream;
+  kj::Maybe<kj::Own<_::CoalescingMessageWriter>> coalescer;
 };
 
 class AsyncCapabilityMessageStream final: public MessageStream {
@@ -177,6 +213,11 @@ public:
   explicit BufferedMessageStream(
       kj::AsyncCapabilityStream& stream, IsShortLivedCallback isShortLivedCallback,
       size_t bufferSizeInWords = 8192);
+  ~BufferedMessageStream() noexcept(false);
+
+  void setWriteCoalescing(WriteCoalescingOptions options, kj::Maybe<kj::Timer&> timer = nullptr);
+  // Same as AsyncIoMessageStream::setWriteCoalescing(). Messages with FDs attached are never
+  // delayed; any pending batch is written ahead of them.
 
   // Implements MessageStream
   kj::Promise<kj::Maybe<MessageReaderAndFds>> tryReadMessage(
@@ -198,6 +239,7 @@ private:
   kj::AsyncIoStream& stream;
   kj::Maybe<kj::AsyncCapabilityStream&> capStream;
   IsShortLivedCallback isShortLivedCallback;
+  kj::Maybe<kj::Own<_::CoalescingMessageWriter>> coalescer;
 
   kj::Array<word> buffer;
 
@@ -234,6 +276,42 @@ private:
   class MessageReaderImpl;
 };
 
+class PackedMessageStream final: public MessageStream {
+  // A MessageStream that wraps an AsyncIoStream, using the packed encoding (see
+  // serialize-packed.h).  Input is unpacked incrementally as it arrives, reading ahead into a
+  // buffer so that several small messages may be received in one system call.  Output is packed
+  // in batches, each handed to the stream as soon as it's ready, so that a large message starts
+  // going out before it has all been packed.
+  //
+  // FD passing is not supported; any FDs passed to writeMessage() are ignored, as with
+  // AsyncIoMessageStream.
+
+public:
+  explicit PackedMessageStream(kj::AsyncIoStream& stream, size_t readBufferSize = 65536);
+  ~PackedMessageStream() noexcept(false);
+
+  // Implements MessageStream
+  kj::Promise<kj::Maybe<MessageReaderAndFds>> tryReadMessage(
+      kj::ArrayPtr<kj::AutoCloseFd> fdSpace,
+      ReaderOptions options = ReaderOptions(), kj::ArrayPtr<word> scratchSpace = nullptr) override;
+  kj::Promise<void> writeMessage(
+      kj::ArrayPtr<const int> fds,
+      kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) override;
+  kj::Promise<void> writeMessages(
+      kj::ArrayPtr<kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages) override;
+  kj::Maybe<int> getSendBufferSize() override;
+  kj::Promise<void> end() override;
+
+  // Make sure the overridden virtual methods don't hide the non-virtual methods.
+  using MessageStream::tryReadMessage;
+  using MessageStream::writeMessage;
+
+private:
+  kj::AsyncIoStream& stream;
+  kj::Own<_::AsyncPackedInputStream> input;
+  kj::Own<_::AsyncPackedOutputStream> output;
+};
+
 // -----------------------------------------------------------------------------
 // Stand-alone functions for reading & writing messages on AsyncInput/AsyncOutputStreams.
 //
@@ -291,6 +369,31 @@ kj::Promise<void> writeMessages(
     kj::AsyncOutputStream& output, kj::ArrayPtr<MessageBuilder*> builders)
     KJ_WARN_UNUSED_RESULT;
 
+// -----------------------------------------------------------------------------
+// Stand-alone functions for reading & writing packed messages on AsyncInput/AsyncOutputStreams.
+//
+// These are equivalent to the functions above, but use the packed encoding.  The write functions
+// pack the message in batches, so a large message starts going out before it has all been packed.
+
+kj::Promise<kj::Own<MessageReader>> readPackedMessage(
+    kj::AsyncInputStream& input, ReaderOptions options = ReaderOptions(),
+    kj::ArrayPtr<word> scratchSpace = nullptr);
+
+kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadPackedMessage(
+    kj::AsyncInputStream& input, ReaderOptions options = ReaderOptions(),
+    kj::ArrayPtr<word> scratchSpace = nullptr);
+// Packed data can't be framed without decoding it, so to avoid consuming any bytes beyond the end
+// of the message, these read no more than the rest of the message could possibly be encoded in.
+// That can take many small reads for a message which packs well.  To read many messages from
+// the same stream, prefer PackedMessageStream, which reads ahead.
+
+kj::Promise<void> writePackedMessage(kj::AsyncOutputStream& output,
+                                     kj::ArrayPtr<const kj::ArrayPtr<const word>> segments)
+    KJ_WARN_UNUSED_RESULT;
+
+kj::Promise<void> writePackedMessage(kj::AsyncOutputStream& output, MessageBuilder& builder)
+    KJ_WARN_UNUSED_RESULT;
+
 // =======================================================================================
 // inline implementation details
 
@@ -301,6 +404,10 @@ inline kj::Promise<void> writeMessage(
     kj::AsyncCapabilityStream& output, kj::ArrayPtr<const int> fds, MessageBuilder& builder) {
   return writeMessage(output, fds, builder.getSegmentsForOutput());
 }
+inline kj::Promise<void> writePackedMessage(
+    kj::AsyncOutputStream& output, MessageBuilder& builder) {
+  return writePackedMessage(output, builder.getSegmentsForOutput());
+}
 
 inline kj::Promise<void> MessageStream::writeMessage(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
   return writeMessage(nullptr, segments);
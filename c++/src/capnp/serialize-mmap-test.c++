@@ -0,0 +1,104 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "serialize-mmap.h"
+#include "serialize.h"
+#include <kj/test.h>
+#include "test-util.h"
+
+#if !_WIN32
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+namespace capnp {
+namespace _ {  // private
+namespace {
+
+uint64_t appendMessage(const kj::File& file, MessageBuilder& builder) {
+  auto flat = messageToFlatArray(builder);
+  uint64_t offset = file.stat().size;
+  file.write(offset, flat.asBytes());
+  return offset;
+}
+
+void testFile(const kj::File& file) {
+  uint64_t offset1, offset2;
+  {
+    MallocMessageBuilder builder(0, AllocationStrategy::FIXED_SIZE);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    KJ_ASSERT(builder.getSegmentsForOutput().size() > 1);
+    offset1 = appendMessage(file, builder);
+  }
+  {
+    MallocMessageBuilder builder;
+    builder.initRoot<TestAllTypes>().setTextField("second message in file");
+    offset2 = appendMessage(file, builder);
+  }
+
+  MmapMessageReader reader1(file, offset1);
+  checkTestMessage(reader1.getRoot<TestAllTypes>());
+  KJ_EXPECT(reader1.getEnd() == offset2);
+
+  MmapMessageReader reader2(file, reader1.getEnd(), ReaderOptions(),
+                            { MmapAdvice::RANDOM, true });
+  KJ_EXPECT(reader2.getRoot<TestAllTypes>().getTextField() == "second message in file");
+  KJ_EXPECT(reader2.getEnd() == file.stat().size);
+
+  reader1.advise(MmapAdvice::SEQUENTIAL);
+  reader1.advise(1, MmapAdvice::WILLNEED);
+  reader1.advise(1000, MmapAdvice::WILLNEED);  // nonexistent segment is ignored
+
+  // Reading past the end of the file yields an empty message.
+  MmapMessageReader empty(file, file.stat().size);
+  KJ_EXPECT(empty.getSegment(0) == nullptr);
+}
+
+KJ_TEST("MmapMessageReader over in-memory file") {
+  auto file = kj::newInMemoryFile(kj::nullClock());
+  testFile(*file);
+}
+
+#if !_WIN32
+KJ_TEST("MmapMessageReader over disk file") {
+  char filename[] = "/tmp/capnproto-serialize-mmap-test-XXXXXX";
+  kj::AutoCloseFd fd(mkstemp(filename));
+  KJ_ASSERT(fd.get() >= 0);
+  KJ_ASSERT(unlink(filename) == 0);
+
+  testFile(*kj::newDiskFile(kj::mv(fd)));
+}
+#endif
+
+KJ_TEST("MmapMessageReader rejects truncated messages") {
+  auto file = kj::newInMemoryFile(kj::nullClock());
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  appendMessage(*file, builder);
+  file->truncate(file->stat().size - 8);
+
+  KJ_EXPECT_THROW_MESSAGE("Message ends prematurely", MmapMessageReader reader(*file));
+  KJ_EXPECT_THROW_MESSAGE("word-aligned", MmapMessageReader reader(*file, 4));
+}
+
+}  // namespace
+}  // namespace _ (private)
+}  // namespace capnp
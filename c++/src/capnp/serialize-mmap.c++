@@ -0,0 +1,161 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "serialize-mmap.h"
+#include <kj/debug.h>
+
+#if !_WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+namespace capnp {
+
+namespace {
+
+size_t pageSize() {
+#if _WIN32
+  return 4096;
+#else
+  static const size_t result = sysconf(_SC_PAGESIZE);
+  return result;
+#endif
+}
+
+void touchPages(kj::ArrayPtr<const byte> range) {
+  // Fault in every page of the range by reading one byte from each.
+  size_t step = pageSize();
+  for (size_t i = 0; i < range.size(); i += step) {
+    *static_cast<const volatile byte*>(range.begin() + i);
+  }
+}
+
+}  // namespace
+
+MmapMessageReader::MmapMessageReader(
+    const kj::ReadableFile& file, uint64_t offset, ReaderOptions options, MmapOptions mmapOptions)
+    : MessageReader(options), end(offset) {
+  KJ_REQUIRE(offset % sizeof(word) == 0, "message offset must be word-aligned", offset);
+
+  _::WireValue<uint32_t> firstWord[2];
+  size_t n = file.read(offset, kj::arrayPtr(firstWord, 2).asBytes());
+  if (n == 0) {
+    // Assume empty message, like FlatArrayMessageReader.
+    return;
+  }
+  KJ_REQUIRE(n == sizeof(firstWord), "Message ends prematurely in segment table.") {
+    return;
+  }
+
+  uint segmentCount = firstWord[0].get() + 1;
+
+  // Reject messages with too many segments for security reasons.
+  KJ_REQUIRE(segmentCount > 0 && segmentCount < 512, "Message has too many segments.") {
+    return;
+  }
+
+  // Read sizes for all segments except the first.  Include padding if necessary.
+  KJ_STACK_ARRAY(_::WireValue<uint32_t>, moreSizes, segmentCount & ~1, 16, 64);
+  uint64_t tableBytes = sizeof(firstWord) + moreSizes.asBytes().size();
+  if (segmentCount > 1) {
+    n = file.read(offset + sizeof(firstWord), moreSizes.asBytes());
+    KJ_REQUIRE(n == moreSizes.asBytes().size(), "Message ends prematurely in segment table.") {
+      return;
+    }
+  }
+
+  // Unlike InputStreamMessageReader, we don't reject messages above the traversal limit here:
+  // nothing is allocated up-front, and the limit is still enforced as the message is read.
+  auto starts = kj::heapArray<uint64_t>(segmentCount + 1);
+  starts[0] = tableBytes / sizeof(word);
+  starts[1] = starts[0] + firstWord[1].get();
+  for (uint i = 1; i < segmentCount; i++) {
+    starts[i + 1] = starts[i] + moreSizes[i - 1].get();
+  }
+
+  uint64_t totalBytes = starts[segmentCount] * sizeof(word);
+  KJ_REQUIRE(offset + totalBytes <= file.stat().size, "Message ends prematurely.") {
+    return;
+  }
+
+  mapping = file.mmap(offset, totalBytes);
+  segmentStarts = kj::mv(starts);
+  end = offset + totalBytes;
+
+  if (mmapOptions.advice != MmapAdvice::NORMAL) {
+    advise(mmapOptions.advice);
+  }
+
+  if (mmapOptions.populate) {
+#if defined(MADV_POPULATE_READ)
+    auto aligned = mapping.begin() - reinterpret_cast<uintptr_t>(mapping.begin()) % pageSize();
+    if (madvise(const_cast<byte*>(aligned), mapping.end() - aligned, MADV_POPULATE_READ) < 0) {
+      // Probably an older kernel; do it the hard way.
+      touchPages(mapping);
+    }
+#else
+    touchPages(mapping);
+#endif
+  }
+}
+
+MmapMessageReader::~MmapMessageReader() noexcept(false) {}
+
+kj::ArrayPtr<const word> MmapMessageReader::getSegment(uint id) {
+  if (id + 1 < segmentStarts.size()) {
+    auto words = reinterpret_cast<const word*>(mapping.begin());
+    return kj::arrayPtr(words + segmentStarts[id], words + segmentStarts[id + 1]);
+  } else {
+    return nullptr;
+  }
+}
+
+void MmapMessageReader::advise(MmapAdvice advice) {
+  adviseRange(mapping, advice);
+}
+
+void MmapMessageReader::advise(uint segmentId, MmapAdvice advice) {
+  adviseRange(getSegment(segmentId).asBytes(), advice);
+}
+
+void MmapMessageReader::adviseRange(kj::ArrayPtr<const byte> range, MmapAdvice advice) {
+#if !_WIN32
+  if (range.size() == 0) return;
+
+  int flag = MADV_NORMAL;
+  switch (advice) {
+    case MmapAdvice::NORMAL: flag = MADV_NORMAL; break;
+    case MmapAdvice::SEQUENTIAL: flag = MADV_SEQUENTIAL; break;
+    case MmapAdvice::RANDOM: flag = MADV_RANDOM; break;
+    case MmapAdvice::WILLNEED: flag = MADV_WILLNEED; break;
+  }
+
+  // madvise() requires a page-aligned start address.
+  auto aligned = range.begin() - reinterpret_cast<uintptr_t>(range.begin()) % pageSize();
+
+  // Advice is only a hint, so failure (e.g. because the "file" is really a heap buffer) is not
+  // an error.
+  madvise(const_cast<byte*>(aligned), range.end() - aligned, flag);
+#endif
+}
+
+}  // namespace capnp
@@ -0,0 +1,101 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include "message.h"
+#include <kj/filesystem.h>
+
+CAPNP_BEGIN_HEADER
+
+namespace capnp {
+
+enum class MmapAdvice: uint8_t {
+  // Hints passed to madvise() for a mapped message.  On platforms without madvise() these are
+  // ignored.
+
+  NORMAL,
+  SEQUENTIAL,
+  // The message will be read roughly front to back, so the kernel may read ahead aggressively.
+
+  RANDOM,
+  // The message will be accessed at scattered locations, so read-ahead would be wasted.
+
+  WILLNEED
+  // The message will be needed soon; start reading it in now, in the background.
+};
+
+struct MmapOptions {
+  MmapAdvice advice = MmapAdvice::NORMAL;
+
+  bool populate = false;
+  // If true, fault in the whole message before the constructor returns (like MAP_POPULATE), so
+  // that later reads never block on disk.  This makes opening the message O(message size).
+};
+
+class MmapMessageReader: public MessageReader {
+  // Reads a message in the standard (unpacked) stream format directly out of a memory-mapped
+  // file, with no copying.
+  //
+  // Opening a message reads only its segment table and maps the rest, so the cost is proportional
+  // to the number of segments rather than the size of the message.  Each segment's contents are
+  // faulted in and validated only as the application actually follows pointers into it (via the
+  // usual bounds checks and ReadLimiter), so a reader which only looks at a small part of a huge
+  // message only touches those pages.
+  //
+  // Like all mmap()-based I/O, if the file is modified while it is mapped, the reader may observe
+  // the changes; if it is truncated, reads may crash with SIGBUS.
+
+public:
+  MmapMessageReader(const kj::ReadableFile& file, uint64_t offset = 0,
+                    ReaderOptions options = ReaderOptions(), MmapOptions mmapOptions = {});
+  // Maps the message which starts at the given byte offset in `file`, which must be a multiple of
+  // 8.  The mapping keeps its own reference to the file's contents, so `file` need not outlive
+  // the reader.
+
+  KJ_DISALLOW_COPY_AND_MOVE(MmapMessageReader);
+  ~MmapMessageReader() noexcept(false);
+
+  kj::ArrayPtr<const word> getSegment(uint id) override;
+
+  uint64_t getEnd() const { return end; }
+  // Byte offset in the file just past the end of this message, i.e. where the next message in a
+  // stream of messages would begin.
+
+  void advise(MmapAdvice advice);
+  // Changes the access pattern hint for the whole message.
+
+  void advise(uint segmentId, MmapAdvice advice);
+  // Applies a hint to a single segment, e.g. WILLNEED on a segment you are about to scan.
+
+private:
+  kj::Array<const byte> mapping;
+  kj::Array<uint64_t> segmentStarts;
+  // Word offset of each segment in `mapping`, plus one final entry marking the end of the last.
+
+  uint64_t end;
+
+  void adviseRange(kj::ArrayPtr<const byte> range, MmapAdvice advice);
+};
+
+}  // namespace capnp
+
+CAPNP_END_HEADER
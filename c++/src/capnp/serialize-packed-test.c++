@@ -219,6 +219,39 @@ TEST(Packed, SimplePacking) {
       {0xed,8,100,6,1,1,2, 0,2, 0xd4,1,2,3,1});
 }
 
+TEST(Packed, EveryTag) {
+  // Exercise every possible tag byte, to make sure any vectorized packing and unpacking agrees
+  // with the straightforward encoding.
+
+  for (uint tag = 1; tag < 255; tag++) {
+    byte unpacked[16];
+    byte packed[11];
+    uint n = 0;
+    packed[n++] = tag;
+    for (uint i = 0; i < 8; i++) {
+      if (tag & (1u << i)) {
+        unpacked[i] = i + 1;
+        packed[n++] = i + 1;
+      } else {
+        unpacked[i] = 0;
+      }
+    }
+
+    // Follow with a word that has no zeros, so that the packed bytes end with a run length.
+    for (uint i = 0; i < 8; i++) {
+      unpacked[8 + i] = 0x80 | i;
+    }
+    packed[n++] = 0xff;
+
+    kj::Array<byte> expected = kj::heapArray<byte>(n + 9);
+    memcpy(expected.begin(), packed, n);
+    memcpy(expected.begin() + n, unpacked + 8, 8);
+    expected[n + 8] = 0;
+
+    expectPacksTo(kj::arrayPtr(unpacked, sizeof(unpacked)), expected);
+  }
+}
+
 // =======================================================================================
 
 class TestMessageBuilder: public MallocMessageBuilder {
@@ -583,6 +616,64 @@ TEST(Packed, RoundTripHugeStringEvenSegmentCountLazy) {
   EXPECT_TRUE(reader.getRoot<TestAllTypes>().getTextField() == huge);
 }
 
+// =======================================================================================
+
+TEST(Packed, LazyReaderUnpacksOnDemand) {
+  TestMessageBuilder builder(7);
+  auto root = builder.initRoot<TestAllTypes>();
+  initTestMessage(root);
+
+  TestMessageBuilder builder2(1);
+  builder2.initRoot<TestAllTypes>().setTextField("Second message.");
+
+  for (size_t readSize: {size_t(1), size_t(kj::maxValue)}) {
+    TestPipe pipe(readSize);
+    writePackedMessage(pipe, builder);
+    writePackedMessage(pipe, builder2);
+    uint segmentCount = builder.getSegmentsForOutput().size();
+    EXPECT_GT(segmentCount, 2u);
+
+    {
+      LazyPackedMessageReader reader(pipe);
+      EXPECT_EQ(0u, reader.getUnpackedSegmentCount());
+
+      // Reading a scalar field needs only the segments up to the one holding the root struct.
+      EXPECT_EQ(3456789012u, reader.getRoot<TestAllTypes>().getUInt32Field());
+      uint unpacked = reader.getUnpackedSegmentCount();
+      EXPECT_LT(unpacked, segmentCount);
+
+      EXPECT_TRUE(reader.getSegment(segmentCount) == nullptr);
+      EXPECT_EQ(unpacked, reader.getUnpackedSegmentCount());
+    }
+
+    {
+      // The rest of the first message was skipped, so the second can be read.
+      LazyPackedMessageReader reader(pipe);
+      EXPECT_EQ("Second message.", reader.getRoot<TestAllTypes>().getTextField());
+    }
+    EXPECT_TRUE(pipe.allRead());
+
+    pipe.resetRead(readSize);
+    {
+      LazyPackedMessageReader reader(pipe);
+      checkTestMessage(reader.getRoot<TestAllTypes>());
+      EXPECT_EQ(segmentCount, reader.getUnpackedSegmentCount());
+    }
+  }
+}
+
+TEST(Packed, LazyReaderRejectsHugeMessage) {
+  TestMessageBuilder builder(1);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+
+  TestPipe pipe;
+  writePackedMessage(pipe, builder);
+
+  ReaderOptions options;
+  options.traversalLimitInWords = 16;
+  KJ_EXPECT_THROW_MESSAGE("Message is too large", LazyPackedMessageReader reader(pipe, options));
+}
+
 // TODO(test):  Test error cases.
 
 }  // namespace
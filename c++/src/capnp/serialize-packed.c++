@@ -24,10 +24,137 @@
 #include "capnp/layout.h"
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CAPNP_PACKED_SSE2 1
+#include <emmintrin.h>
+#if defined(__SSSE3__) || defined(__AVX__)
+#define CAPNP_PACKED_SSSE3 1
+#include <tmmintrin.h>
+#endif
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && (defined(__aarch64__) || defined(_M_ARM64))
+#define CAPNP_PACKED_NEON 1
+#include <arm_neon.h>
+#endif
+
 namespace capnp {
 
 namespace _ {  // private
 
+namespace {
+
+// Each word is packed as a tag byte, whose bit N says whether byte N of the word is non-zero,
+// followed by the non-zero bytes themselves. The helpers below do the per-word work of packing
+// and unpacking. When the target has vector instructions, the tag is computed with a single
+// compare+movemask and the bytes are compressed or expanded with a byte shuffle driven by a
+// table indexed by tag. Otherwise we fall back to the branch-free scalar code. All variants
+// produce exactly the same bytes.
+//
+// Both `compressWord()` and `expandWord()` may read and write up to 8 bytes past the bytes that
+// are logically consumed/produced, so callers must guarantee that much slack in their buffers.
+
+struct ShuffleTables {
+  uint8_t compress[256][8];
+  // compress[tag][i] is the index of the i'th non-zero byte in a word with the given tag. Unused
+  // entries are 0x80, which both pshufb and NEON tbl treat as "produce zero".
+
+  uint8_t expand[256][8];
+  // expand[tag][i] is the index, among the packed bytes, of byte i of the unpacked word, or 0x80
+  // if byte i is zero.
+
+  uint8_t count[256];
+  // Number of non-zero bytes for each tag, i.e. the popcount.
+};
+
+constexpr ShuffleTables makeShuffleTables() {
+  ShuffleTables result {};
+  for (uint tag = 0; tag < 256; tag++) {
+    uint n = 0;
+    for (uint i = 0; i < 8; i++) {
+      result.compress[tag][i] = 0x80;
+      if (tag & (1u << i)) {
+        result.expand[tag][i] = n;
+        result.compress[tag][n] = i;
+        ++n;
+      } else {
+        result.expand[tag][i] = 0x80;
+      }
+    }
+    result.count[tag] = n;
+  }
+  return result;
+}
+
+constexpr ShuffleTables SHUFFLE_TABLES = makeShuffleTables();
+
+inline uint8_t computeTag(const uint8_t* in) {
+  // Returns a mask with bit N set iff in[N] is non-zero.
+
+#if CAPNP_PACKED_SSE2
+  __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in));
+  uint zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+  return ~zeros & 0xffu;
+#elif CAPNP_PACKED_NEON
+  static constexpr uint8_t BITS[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+  uint8x8_t nonzero = vtst_u8(vld1_u8(in), vld1_u8(in));
+  return vaddv_u8(vand_u8(nonzero, vld1_u8(BITS)));
+#else
+  return (uint8_t(in[0] != 0) << 0) | (uint8_t(in[1] != 0) << 1)
+       | (uint8_t(in[2] != 0) << 2) | (uint8_t(in[3] != 0) << 3)
+       | (uint8_t(in[4] != 0) << 4) | (uint8_t(in[5] != 0) << 5)
+       | (uint8_t(in[6] != 0) << 6) | (uint8_t(in[7] != 0) << 7);
+#endif
+}
+
+inline uint8_t* compressWord(uint8_t* __restrict__ out, const uint8_t* __restrict__ in,
+                             uint8_t tag) {
+  // Writes the non-zero bytes of the word at `in` to `out`, returning the new output position.
+  // Always stores 8 bytes.
+
+#if CAPNP_PACKED_SSSE3
+  __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in));
+  __m128i shuffle = _mm_loadl_epi64(
+      reinterpret_cast<const __m128i*>(SHUFFLE_TABLES.compress[tag]));
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(v, shuffle));
+  return out + SHUFFLE_TABLES.count[tag];
+#elif CAPNP_PACKED_NEON
+  vst1_u8(out, vtbl1_u8(vld1_u8(in), vld1_u8(SHUFFLE_TABLES.compress[tag])));
+  return out + SHUFFLE_TABLES.count[tag];
+#else
+  // Branch-free: always write the byte, but only advance if it was non-zero.
+  for (uint i = 0; i < 8; i++) {
+    *out = in[i];
+    out += (tag >> i) & 1;
+  }
+  return out;
+#endif
+}
+
+inline const uint8_t* expandWord(uint8_t* __restrict__ out, const uint8_t* __restrict__ in,
+                                 uint8_t tag) {
+  // Writes 8 unpacked bytes to `out`, consuming the packed bytes at `in` as described by `tag`.
+  // Returns the new input position. May read up to 8 bytes from `in`.
+
+#if CAPNP_PACKED_SSSE3
+  __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in));
+  __m128i shuffle = _mm_loadl_epi64(
+      reinterpret_cast<const __m128i*>(SHUFFLE_TABLES.expand[tag]));
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(v, shuffle));
+  return in + SHUFFLE_TABLES.count[tag];
+#elif CAPNP_PACKED_NEON
+  vst1_u8(out, vtbl1_u8(vld1_u8(in), vld1_u8(SHUFFLE_TABLES.expand[tag])));
+  return in + SHUFFLE_TABLES.count[tag];
+#else
+  for (uint i = 0; i < 8; i++) {
+    bool isNonzero = (tag & (1u << i)) != 0;
+    out[i] = *in & (-(int8_t)isNonzero);
+    in += isNonzero;
+  }
+  return in;
+#endif
+}
+
+}  // namespace
+
 PackedInputStream::PackedInputStream(kj::BufferedInputStream& inner): inner(inner) {}
 PackedInputStream::~PackedInputStream() noexcept(false) {}
 
@@ -98,24 +225,10 @@ size_t PackedInputStream::tryRead(void* dst, size_t minBytes, size_t maxBytes) {
         REFRESH_BUFFER();
       }
     } else {
+      // At least 9 bytes remain after the tag, so expandWord() can't over-read the buffer.
       tag = *in++;
-
-#define HANDLE_BYTE(n) \
-      { \
-         bool isNonzero = (tag & (1u << n)) != 0; \
-         *out++ = *in & (-(int8_t)isNonzero); \
-         in += isNonzero; \
-      }
-
-      HANDLE_BYTE(0);
-      HANDLE_BYTE(1);
-      HANDLE_BYTE(2);
-      HANDLE_BYTE(3);
-      HANDLE_BYTE(4);
-      HANDLE_BYTE(5);
-      HANDLE_BYTE(6);
-      HANDLE_BYTE(7);
-#undef HANDLE_BYTE
+      in = expandWord(out, in, tag);
+      out += sizeof(word);
     }
 
     if (tag == 0) {
@@ -227,19 +340,7 @@ void PackedInputStream::skip(size_t bytes) {
       }
     } else {
       tag = *in++;
-
-#define HANDLE_BYTE(n) \
-      in += (tag & (1u << n)) != 0
-
-      HANDLE_BYTE(0);
-      HANDLE_BYTE(1);
-      HANDLE_BYTE(2);
-      HANDLE_BYTE(3);
-      HANDLE_BYTE(4);
-      HANDLE_BYTE(5);
-      HANDLE_BYTE(6);
-      HANDLE_BYTE(7);
-#undef HANDLE_BYTE
+      in += SHUFFLE_TABLES.count[tag];
 
       bytes -= 8;
     }
@@ -298,6 +399,129 @@ void PackedInputStream::skip(size_t bytes) {
 
 // -------------------------------------------------------------------
 
+void PackedDecoder::setOutput(kj::ArrayPtr<word> output) {
+  KJ_REQUIRE(state == State::TAG, "previous packed output not complete");
+  outBegin = out = reinterpret_cast<byte*>(output.begin());
+  outEnd = reinterpret_cast<byte*>(output.end());
+}
+
+size_t PackedDecoder::decode(kj::ArrayPtr<const byte> input) {
+  const uint8_t* in = input.begin();
+  const uint8_t* const inEnd = input.end();
+
+  for (;;) {
+    switch (state) {
+      case State::TAG:
+        if (out == outEnd || in == inEnd) {
+          return in - input.begin();
+        }
+
+        tag = *in++;
+        if (inEnd - in >= 9) {
+          // Fast path:  the whole word is available, and expandWord() can't over-read.
+          in = expandWord(out, in, tag);
+          wordPos = 8;
+        } else {
+          wordPos = 0;
+        }
+        state = State::WORD;
+        break;
+
+      case State::WORD:
+        for (; wordPos < 8; wordPos++) {
+          if (tag & (1u << wordPos)) {
+            if (in == inEnd) {
+              return in - input.begin();
+            }
+            out[wordPos] = *in++;
+          } else {
+            out[wordPos] = 0;
+          }
+        }
+        out += sizeof(word);
+        state = tag == 0 ? State::ZERO_RUN_COUNT :
+                tag == 0xffu ? State::RAW_RUN_COUNT : State::TAG;
+        break;
+
+      case State::ZERO_RUN_COUNT: {
+        if (in == inEnd) {
+          return in - input.begin();
+        }
+
+        size_t runLength = *in++ * sizeof(word);
+        KJ_REQUIRE(runLength <= size_t(outEnd - out),
+                   "Packed input did not end cleanly on a segment boundary.");
+        memset(out, 0, runLength);
+        out += runLength;
+        state = State::TAG;
+        break;
+      }
+
+      case State::RAW_RUN_COUNT:
+        if (in == inEnd) {
+          return in - input.begin();
+        }
+
+        rawRemaining = *in++ * sizeof(word);
+        KJ_REQUIRE(rawRemaining <= size_t(outEnd - out),
+                   "Packed input did not end cleanly on a segment boundary.");
+        state = State::RAW_RUN;
+        break;
+
+      case State::RAW_RUN: {
+        size_t n = kj::min(rawRemaining, size_t(inEnd - in));
+        memcpy(out, in, n);
+        out += n;
+        in += n;
+        rawRemaining -= n;
+        if (rawRemaining > 0) {
+          return in - input.begin();
+        }
+        state = State::TAG;
+        break;
+      }
+    }
+  }
+}
+
+size_t PackedDecoder::minInputNeeded() const {
+  // The densest encoding is a zero tag followed by a count of 255, which covers 256 words in two
+  // bytes.  `coveredWords` is how many words the input we're waiting for could produce at most.
+  size_t words = (outEnd - out) / sizeof(word);
+  size_t needed;
+  size_t coveredWords;
+
+  switch (state) {
+    case State::TAG:
+      needed = 0;
+      coveredWords = 0;
+      break;
+    case State::WORD: {
+      uint8_t pending = tag & ~((1u << wordPos) - 1);
+      bool hasCount = tag == 0 || tag == 0xffu;
+      needed = kj::popCount(pending) + hasCount;
+      coveredWords = hasCount ? 256 : 1;
+      break;
+    }
+    case State::ZERO_RUN_COUNT:
+    case State::RAW_RUN_COUNT:
+      needed = 1;
+      coveredWords = 255;
+      break;
+    case State::RAW_RUN:
+      needed = rawRemaining;
+      coveredWords = rawRemaining / sizeof(word);
+      break;
+  }
+
+  if (words > coveredWords) {
+    needed += (words - coveredWords + 255) / 256 * 2;
+  }
+  return needed;
+}
+
+// -------------------------------------------------------------------
+
 PackedOutputStream::PackedOutputStream(kj::BufferedOutputStream& inner)
     : inner(inner) {}
 PackedOutputStream::~PackedOutputStream() noexcept(false) {}
@@ -325,26 +549,12 @@ void PackedOutputStream::write(const void* src, size_t size) {
       out = reinterpret_cast<uint8_t*>(buffer.begin());
     }
 
+    // We have at least 10 bytes of space, so compressWord() can store a full 8 bytes after the
+    // tag.
     uint8_t* tagPos = out++;
-
-#define HANDLE_BYTE(n) \
-    uint8_t bit##n = *in != 0; \
-    *out = *in; \
-    out += bit##n; /* out only advances if the byte was non-zero */ \
-    ++in
-
-    HANDLE_BYTE(0);
-    HANDLE_BYTE(1);
-    HANDLE_BYTE(2);
-    HANDLE_BYTE(3);
-    HANDLE_BYTE(4);
-    HANDLE_BYTE(5);
-    HANDLE_BYTE(6);
-    HANDLE_BYTE(7);
-#undef HANDLE_BYTE
-
-    uint8_t tag = (bit0 << 0) | (bit1 << 1) | (bit2 << 2) | (bit3 << 3)
-                | (bit4 << 4) | (bit5 << 5) | (bit6 << 6) | (bit7 << 7);
+    uint8_t tag = computeTag(in);
+    out = compressWord(out, in, tag);
+    in += sizeof(word);
     *tagPos = tag;
 
     if (tag == 0) {
@@ -389,20 +599,11 @@ void PackedOutputStream::write(const void* src, size_t size) {
 
       while (in < limit) {
         // Check eight input bytes for zeros.
-        uint c = *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-
-        if (c >= 2) {
-          // Un-read the word with multiple zeros, since we'll want to compress that one.
-          in -= 8;
+        if (SHUFFLE_TABLES.count[computeTag(in)] <= 6) {
+          // Stop at the word with multiple zeros, since we'll want to compress that one.
           break;
         }
+        in += sizeof(word);
       }
 
       // Write the count.
@@ -439,6 +640,70 @@ PackedMessageReader::PackedMessageReader(
 
 PackedMessageReader::~PackedMessageReader() noexcept(false) {}
 
+LazyPackedMessageReader::LazyPackedMessageReader(
+    kj::BufferedInputStream& inputStream, ReaderOptions options)
+    : PackedInputStream(inputStream), MessageReader(options) {
+  _::WireValue<uint32_t> firstWord[2];
+  read(firstWord, sizeof(firstWord));
+
+  uint segmentCount = firstWord[0].get() + 1;
+
+  // Reject messages with too many segments for security reasons.
+  KJ_REQUIRE(segmentCount > 0 && segmentCount < 512, "Message has too many segments.") {
+    return;
+  }
+
+  // Read sizes for all segments except the first.  Include padding if necessary.
+  KJ_STACK_ARRAY(_::WireValue<uint32_t>, moreSizes, segmentCount & ~1, 16, 64);
+  if (segmentCount > 1) {
+    read(moreSizes.begin(), moreSizes.size() * sizeof(moreSizes[0]));
+  }
+
+  segmentSizes = kj::heapArray<uint32_t>(segmentCount);
+  segmentSizes[0] = firstWord[1].get();
+  uint64_t totalWords = segmentSizes[0];
+  for (uint i = 1; i < segmentCount; i++) {
+    segmentSizes[i] = moreSizes[i - 1].get();
+    totalWords += segmentSizes[i];
+  }
+
+  // Nothing is allocated yet, but we'll allocate as we go, so apply the same limit as
+  // InputStreamMessageReader.
+  KJ_REQUIRE(totalWords <= options.traversalLimitInWords,
+             "Message is too large.  To increase the limit on the receiving end, see "
+             "capnp::ReaderOptions.") {
+    segmentSizes = nullptr;
+    return;
+  }
+
+  segments = kj::heapArray<kj::Array<word>>(segmentCount);
+}
+
+LazyPackedMessageReader::~LazyPackedMessageReader() noexcept(false) {
+  unwindDetector.catchExceptionsIfUnwinding([&]() {
+    // Leave the stream positioned after the message.  Skip one segment at a time, since that's
+    // how they were packed.
+    for (uint i = unpackedCount; i < segmentSizes.size(); i++) {
+      skip(segmentSizes[i] * sizeof(word));
+    }
+  });
+}
+
+kj::ArrayPtr<const word> LazyPackedMessageReader::getSegment(uint id) {
+  if (id >= segmentSizes.size()) {
+    return nullptr;
+  }
+
+  // Segments appear in order in the stream, so we must unpack everything before this one too.
+  while (unpackedCount <= id) {
+    auto segment = kj::heapArray<word>(segmentSizes[unpackedCount]);
+    read(segment.begin(), segment.asBytes().size());
+    segments[unpackedCount++] = kj::mv(segment);
+  }
+
+  return segments[id];
+}
+
 PackedFdMessageReader::PackedFdMessageReader(
     int fd, ReaderOptions options, kj::ArrayPtr<word> scratchSpace)
     : FdInputStream(fd),
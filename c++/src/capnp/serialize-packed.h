@@ -60,6 +60,48 @@ private:
   kj::BufferedOutputStream& inner;
 };
 
+class PackedDecoder {
+  // Unpacks packed data incrementally, for callers which receive input in arbitrary pieces (e.g.
+  // from an async stream) and therefore can't use PackedInputStream.  Like PackedInputStream,
+  // output must be requested in the same word-aligned pieces that were written, since runs never
+  // cross those boundaries.
+
+public:
+  void setOutput(kj::ArrayPtr<word> output);
+  // Begins a new output piece.  Must only be called when the previous one is complete.
+
+  size_t decode(kj::ArrayPtr<const byte> input);
+  // Unpacks as much of `input` as fits in the output, returning the number of bytes consumed.
+  // Input may end in the middle of a word or run; decoding resumes there on the next call.
+
+  inline bool isComplete() const { return out == outEnd && state == State::TAG; }
+  // True once the output has been filled.
+
+  inline size_t getWordsDecoded() const { return (out - outBegin) / sizeof(word); }
+
+  size_t minInputNeeded() const;
+  // A lower bound on the number of input bytes needed to fill the rest of the output.  Callers
+  // which must not consume input beyond the end of the current message can use this to size
+  // their reads.
+
+private:
+  enum class State: uint8_t {
+    TAG,             // expecting a tag byte
+    WORD,            // expecting the non-zero bytes of the current word
+    ZERO_RUN_COUNT,  // expecting the count following a zero tag
+    RAW_RUN_COUNT,   // expecting the count following a 0xff tag
+    RAW_RUN          // copying uncompressed words
+  };
+
+  byte* outBegin = nullptr;
+  byte* out = nullptr;
+  byte* outEnd = nullptr;
+  State state = State::TAG;
+  uint8_t tag = 0;
+  uint8_t wordPos = 0;       // next byte of the current word, in state WORD
+  size_t rawRemaining = 0;   // bytes left to copy, in state RAW_RUN
+};
+
 }  // namespace _ (private)
 
 class PackedMessageReader: private _::PackedInputStream, public InputStreamMessageReader {
@@ -70,6 +112,40 @@ public:
   ~PackedMessageReader() noexcept(false);
 };
 
+class LazyPackedMessageReader: private _::PackedInputStream, public MessageReader {
+  // Like PackedMessageReader, but rather than unpacking the whole message into one buffer up
+  // front, unpacks each segment into its own buffer when it is first needed, i.e. when the
+  // application first follows a pointer into it.  Reading fields near the front of a large
+  // multi-segment message thus costs time and memory proportional to the segments touched (plus
+  // any before them in the stream, which must be unpacked to get past them).  Segments which are
+  // never touched are skipped without being buffered when the reader is destroyed.
+  //
+  // Messages built with MallocMessageBuilder's default allocation strategy start with a small
+  // segment, so their first few fields are usually readable after unpacking only that segment.
+  //
+  // Each segment is unpacked with a separate read, which requires that segments were packed
+  // separately (see PackedInputStream).  writePackedMessage() always does this.
+
+public:
+  LazyPackedMessageReader(kj::BufferedInputStream& inputStream,
+                          ReaderOptions options = ReaderOptions());
+  KJ_DISALLOW_COPY_AND_MOVE(LazyPackedMessageReader);
+  ~LazyPackedMessageReader() noexcept(false);
+
+  inline uint getUnpackedSegmentCount() { return unpackedCount; }
+  // Number of segments unpacked so far.
+
+  // implements MessageReader ----------------------------------------
+  kj::ArrayPtr<const word> getSegment(uint id) override;
+
+private:
+  kj::Array<uint32_t> segmentSizes;
+  kj::Array<kj::Array<word>> segments;
+  uint unpackedCount = 0;
+
+  kj::UnwindDetector unwindDetector;
+};
+
 class PackedFdMessageReader: private kj::FdInputStream, private kj::BufferedInputStreamWrapper,
                              public PackedMessageReader {
 public:
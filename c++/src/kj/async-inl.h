@@ -1719,13 +1719,18 @@ private:
   // Membership in one of the linked lists in the target Executor's work list or cancel list. These
   // fields are protected by the target Executor's mutex.
 
+  XThreadEvent* nextQueued = nullptr;
+  // Link in the target Executor's lock-free queue of newly-sent asynchronous events, which are
+  // moved to state.start by whichever thread next takes the target Executor's mutex.
+
   enum {
     UNUSED,
     // Object was never queued on another thread.
 
     QUEUED,
-    // Target thread has not yet dequeued the event from the state.start list. The requesting
-    // thread can cancel execution by removing the event from the list.
+    // Target thread has not yet dequeued the event from the state.start list (or from the
+    // lock-free queue that feeds it). The requesting thread can cancel execution by removing the
+    // event from the list.
 
     EXECUTING,
     // Target thread has dequeued the event from state.start and moved it to state.executing. To
@@ -48,6 +48,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include "kj/async-unix.h"
 #endif
 
 namespace kj {
@@ -3422,5 +3423,121 @@ KJ_TEST("pump file to socket") {
   doTest(fs->getCurrent().createTemporary());
 }
 
+#if KJ_USE_IO_URING
+Maybe<AsyncIoContext> setupAsyncIoWithIoUring() {
+  AsyncIoOptions options;
+  options.useIoUring = true;
+  auto ioContext = setupAsyncIo(options);
+  if (ioContext.unixEventPort.getIoUring() == nullptr) {
+    KJ_LOG(WARNING, "io_uring is unavailable; skipping test");
+    return nullptr;
+  }
+  return kj::mv(ioContext);
+}
+
+KJ_TEST("io_uring stream reads and writes") {
+  KJ_IF_MAYBE(ioContext, setupAsyncIoWithIoUring()) {
+    auto& ws = ioContext->waitScope;
+    auto pipe = ioContext->provider->newTwoWayPipe();
+
+    pipe.ends[0]->write("foo", 3).wait(ws);
+    char buffer[16];
+    KJ_EXPECT(pipe.ends[1]->tryRead(buffer, 3, sizeof(buffer)).wait(ws) == 3);
+    KJ_EXPECT(kj::heapString(buffer, 3) == "foo");
+
+    ArrayPtr<const byte> pieces[] = { "bar"_kj.asBytes(), "baz"_kj.asBytes() };
+    pipe.ends[1]->write(pieces).wait(ws);
+    KJ_EXPECT(pipe.ends[0]->tryRead(buffer, 6, sizeof(buffer)).wait(ws) == 6);
+    KJ_EXPECT(kj::heapString(buffer, 6) == "barbaz");
+
+    // A big write can't complete in one sendmsg().
+    auto big = bigString(4'000'000);
+    auto readPromise = pipe.ends[0]->readAllText();
+    pipe.ends[1]->write(big.begin(), big.size())
+        .then([&]() { pipe.ends[1]->shutdownWrite(); })
+        .wait(ws);
+    KJ_EXPECT((readPromise.wait(ws) == big));
+  }
+}
+
+KJ_TEST("io_uring canceled read") {
+  KJ_IF_MAYBE(ioContext, setupAsyncIoWithIoUring()) {
+    auto& ws = ioContext->waitScope;
+    auto pipe = ioContext->provider->newTwoWayPipe();
+
+    char buffer[16];
+    {
+      auto promise = pipe.ends[1]->tryRead(buffer, 1, sizeof(buffer));
+      KJ_EXPECT(!promise.poll(ws));
+    }
+
+    // The canceled read must not have consumed anything.
+    pipe.ends[0]->write("foo", 3).wait(ws);
+    KJ_EXPECT(pipe.ends[1]->tryRead(buffer, 3, sizeof(buffer)).wait(ws) == 3);
+    KJ_EXPECT(kj::heapString(buffer, 3) == "foo");
+  }
+}
+
+KJ_TEST("io_uring network accept and connect") {
+  KJ_IF_MAYBE(ioContext, setupAsyncIoWithIoUring()) {
+    auto& ws = ioContext->waitScope;
+    auto& network = ioContext->provider->getNetwork();
+
+    auto listener = network.parseAddress("127.0.0.1").wait(ws)->listen();
+    auto acceptPromise = listener->accept();
+    auto client = network.parseAddress("127.0.0.1", listener->getPort()).wait(ws)
+        ->connect().wait(ws);
+    auto server = acceptPromise.wait(ws);
+
+    client->write("foo", 3).wait(ws);
+    char buffer[4];
+    KJ_EXPECT(server->tryRead(buffer, 3, 4).wait(ws) == 3);
+    KJ_EXPECT(kj::heapString(buffer, 3) == "foo");
+  }
+}
+
+KJ_TEST("io_uring falls back for pipes") {
+  KJ_IF_MAYBE(ioContext, setupAsyncIoWithIoUring()) {
+    auto& ws = ioContext->waitScope;
+    auto pipe = ioContext->provider->newOneWayPipe();
+
+    auto readPromise = pipe.in->readAllText();
+    pipe.out->write("foo", 3).wait(ws);
+    pipe.out = nullptr;
+    KJ_EXPECT(readPromise.wait(ws) == "foo");
+  }
+}
+
+KJ_TEST("io_uring batches submissions") {
+  KJ_IF_MAYBE(ioContext, setupAsyncIoWithIoUring()) {
+    auto& ws = ioContext->waitScope;
+    auto& ring = KJ_ASSERT_NONNULL(ioContext->unixEventPort.getIoUring());
+
+    constexpr size_t COUNT = 32;
+    Vector<TwoWayPipe> pipes;
+    for (auto i KJ_UNUSED: kj::zeroTo(COUNT)) {
+      pipes.add(ioContext->provider->newTwoWayPipe());
+    }
+
+    uint before = ring.getSubmitCount();
+
+    char buffers[COUNT][4];
+    Vector<Promise<void>> promises;
+    for (auto i: kj::zeroTo(COUNT)) {
+      promises.add(pipes[i].ends[0]->write("foo", 3));
+      promises.add(pipes[i].ends[1]->read(buffers[i], 3));
+    }
+    joinPromises(promises.releaseAsArray()).wait(ws);
+
+    // All the reads and writes were started in one turn, so they should be submitted together
+    // rather than one syscall each.
+    KJ_EXPECT(ring.getSubmitCount() - before < COUNT / 4, ring.getSubmitCount() - before);
+    for (auto i: kj::zeroTo(COUNT)) {
+      KJ_EXPECT(kj::heapString(buffers[i], 3) == "foo");
+    }
+  }
+}
+#endif  // KJ_USE_IO_URING
+
 }  // namespace
 }  // namespace kj
@@ -182,6 +182,13 @@ public:
   }
 
   Promise<void> write(const void* buffer, size_t size) override {
+#if KJ_USE_IO_URING
+    KJ_IF_MAYBE(r, ring) {
+      if (size == 0) return READY_NOW;
+      return writeViaRing(*r, arrayPtr(reinterpret_cast<const byte*>(buffer), size), nullptr);
+    }
+#endif
+
     ssize_t n;
     KJ_NONBLOCKING_SYSCALL(n = ::write(fd, buffer, size)) {
       // Error.
@@ -557,6 +564,101 @@ private:
   Maybe<ForkedPromise<void>> writeDisconnectedPromise;
   Maybe<Function<void(ArrayPtr<AncillaryMessage>)>> ancillaryMsgCallback;
 
+#if KJ_USE_IO_URING
+  Maybe<UnixEventPort::IoUring&> ring = eventPort.getIoUring();
+  // If set, plain reads and writes go through the event port's io_uring. Reset to null if the
+  // fd turns out not to be a socket.
+
+  Promise<ReadResult> tryReadViaRing(UnixEventPort::IoUring& ring, void* buffer,
+                                     size_t minBytes, size_t maxBytes, ReadResult alreadyRead) {
+    return ring.recv(fd, buffer, maxBytes)
+        .then([this,buffer,minBytes,maxBytes,alreadyRead](int n) mutable -> Promise<ReadResult> {
+      if (n < 0) {
+        switch (-n) {
+          case ENOTSOCK:
+            // Probably a pipe. Those are better off with plain read().
+            this->ring = nullptr;
+            return tryReadInternal(buffer, minBytes, maxBytes, nullptr, 0, alreadyRead);
+          case EINTR:
+            return tryReadInternal(buffer, minBytes, maxBytes, nullptr, 0, alreadyRead);
+          case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+          case EWOULDBLOCK:
+#endif
+            // The kernel normally waits for readiness itself, but it isn't obliged to.
+            return observer.whenBecomesReadable().then([=]() {
+              return tryReadInternal(buffer, minBytes, maxBytes, nullptr, 0, alreadyRead);
+            });
+          default:
+            KJ_FAIL_SYSCALL("recv()", -n) { break; }
+            return alreadyRead;
+        }
+      }
+
+      alreadyRead.byteCount += n;
+      if (n == 0 || implicitCast<size_t>(n) >= minBytes) {
+        // EOF, or we read enough to stop here.
+        return alreadyRead;
+      } else {
+        buffer = reinterpret_cast<byte*>(buffer) + n;
+        return tryReadInternal(buffer, minBytes - n, maxBytes - n, nullptr, 0, alreadyRead);
+      }
+    });
+  }
+
+  Promise<void> writeViaRing(UnixEventPort::IoUring& ring, ArrayPtr<const byte> firstPiece,
+                             ArrayPtr<const ArrayPtr<const byte>> morePieces) {
+    // If there are more than IOV_MAX pieces, we'll only write the first IOV_MAX for now, and
+    // then we'll loop later.
+    KJ_STACK_ARRAY(ArrayPtr<const byte>, pieces,
+        kj::min(1 + morePieces.size(), kj::miniposix::iovMax()), 16, 128);
+    pieces[0] = firstPiece;
+    for (uint i = 1; i < pieces.size(); i++) {
+      pieces[i] = morePieces[i - 1];
+    }
+
+    return ring.send(fd, pieces)
+        .then([this,firstPiece,morePieces](int n) mutable -> Promise<void> {
+      if (n < 0) {
+        switch (-n) {
+          case ENOTSOCK:
+            this->ring = nullptr;
+            return writeInternal(firstPiece, morePieces, nullptr);
+          case EINTR:
+            return writeInternal(firstPiece, morePieces, nullptr);
+          case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+          case EWOULDBLOCK:
+#endif
+            return observer.whenBecomesWritable().then([=]() {
+              return writeInternal(firstPiece, morePieces, nullptr);
+            });
+          default:
+            KJ_FAIL_SYSCALL("sendmsg()", -n) { break; }
+            return READY_NOW;
+        }
+      } else if (n == 0) {
+        // See the comment in writeInternal().
+        KJ_FAIL_ASSERT("non-empty sendmsg() returned 0");
+      }
+
+      // Discard all data that was written, then issue a new write for what's left (if any).
+      for (;;) {
+        if (n < firstPiece.size()) {
+          return writeInternal(firstPiece.slice(n, firstPiece.size()), morePieces, nullptr);
+        } else if (morePieces.size() == 0) {
+          KJ_DASSERT(n == firstPiece.size(), n);
+          return READY_NOW;
+        } else {
+          n -= firstPiece.size();
+          firstPiece = morePieces[0];
+          morePieces = morePieces.slice(1, morePieces.size());
+        }
+      }
+    });
+  }
+#endif  // KJ_USE_IO_URING
+
   Promise<ReadResult> tryReadInternal(void* buffer, size_t minBytes, size_t maxBytes,
                                       AutoCloseFd* fdBuffer, size_t maxFds,
                                       ReadResult alreadyRead) {
@@ -566,6 +668,12 @@ private:
 
     ssize_t n;
     if (maxFds == 0 && ancillaryMsgCallback == nullptr) {
+#if KJ_USE_IO_URING
+      KJ_IF_MAYBE(r, ring) {
+        return tryReadViaRing(*r, buffer, minBytes, maxBytes, alreadyRead);
+      }
+#endif
+
       KJ_NONBLOCKING_SYSCALL(n = ::read(fd, buffer, maxBytes)) {
         // Error.
 
@@ -773,6 +881,14 @@ private:
       return kj::READY_NOW;
     }
 
+#if KJ_USE_IO_URING
+    if (fds.size() == 0) {
+      KJ_IF_MAYBE(r, ring) {
+        return writeViaRing(*r, firstPiece, morePieces);
+      }
+    }
+#endif
+
     ssize_t n;
     if (fds.size() == 0) {
       KJ_NONBLOCKING_SYSCALL(n = ::writev(fd, iov.begin(), iov.size()), iovTotal, iov.size()) {
@@ -1328,6 +1444,12 @@ public:
   }
 
   Promise<AuthenticatedStream> acceptImpl(bool authenticated) {
+#if KJ_USE_IO_URING
+    KJ_IF_MAYBE(ring, eventPort.getIoUring()) {
+      return acceptViaRing(*ring, authenticated);
+    }
+#endif
+
     int newFd;
 
     struct sockaddr_storage addr;
@@ -1342,41 +1464,14 @@ public:
 #endif
 
     if (newFd >= 0) {
-      kj::AutoCloseFd ownFd(newFd);
-      if (!filter.shouldAllow(reinterpret_cast<struct sockaddr*>(&addr), addrlen)) {
-        // Ignore disallowed address.
-        return acceptImpl(authenticated);
-      } else {
-        // TODO(perf):  As a hack for the 0.4 release we are always setting
-        //   TCP_NODELAY because Nagle's algorithm pretty much kills Cap'n Proto's
-        //   RPC protocol.  Later, we should extend the interface to provide more
-        //   control over this.  Perhaps write() should have a flag which
-        //   specifies whether to pass MSG_MORE.
-        int one = 1;
-        KJ_SYSCALL_HANDLE_ERRORS(::setsockopt(
-              ownFd.get(), IPPROTO_TCP, TCP_NODELAY, (char*)&one, sizeof(one))) {
-          case EOPNOTSUPP:
-          case ENOPROTOOPT: // (returned for AF_UNIX in cygwin)
-#if __FreeBSD__
-          case EINVAL: // (returned for AF_UNIX in FreeBSD)
-#endif
-            break;
-          default:
-            KJ_FAIL_SYSCALL("setsocketopt(IPPROTO_TCP, TCP_NODELAY)", error);
-        }
-
-        AuthenticatedStream result;
-        result.stream = heap<AsyncStreamFd>(eventPort, ownFd.release(), NEW_FD_FLAGS,
-                                            UnixEventPort::FdObserver::OBSERVE_READ_WRITE);
-        if (authenticated) {
-          result.peerIdentity = SocketAddress(reinterpret_cast<struct sockaddr*>(&addr), addrlen)
-              .getIdentity(lowLevel, filter, *result.stream);
-        }
-        return kj::mv(result);
-      }
+      return finishAccept(kj::AutoCloseFd(newFd), addr, addrlen, authenticated);
     } else {
       int error = errno;
 
+      if (isTransientAcceptError(error)) {
+        goto retry;
+      }
+
       switch (error) {
         case EAGAIN:
 #if EAGAIN != EWOULDBLOCK
@@ -1387,27 +1482,95 @@ public:
             return acceptImpl(authenticated);
           });
 
-        case EINTR:
-        case ENETDOWN:
+        default:
+          KJ_FAIL_SYSCALL("accept", error);
+      }
+
+    }
+  }
+
+  static bool isTransientAcceptError(int error) {
+    switch (error) {
+      case EINTR:
+      case ENETDOWN:
 #ifdef EPROTO
-        // EPROTO is not defined on OpenBSD.
-        case EPROTO:
+      // EPROTO is not defined on OpenBSD.
+      case EPROTO:
+#endif
+      case EHOSTDOWN:
+      case EHOSTUNREACH:
+      case ENETUNREACH:
+      case ECONNABORTED:
+      case ETIMEDOUT:
+        // According to the Linux man page, accept() may report an error if the accepted
+        // connection is already broken.  In this case, we really ought to just ignore it and
+        // keep waiting.  But it's hard to say exactly what errors are such network errors and
+        // which ones are permanent errors.  We've made a guess here.
+        return true;
+      default:
+        return false;
+    }
+  }
+
+#if KJ_USE_IO_URING
+  Promise<AuthenticatedStream> acceptViaRing(UnixEventPort::IoUring& ring, bool authenticated) {
+    struct AcceptState {
+      struct sockaddr_storage addr;
+      uint addrlen = sizeof(addr);
+    };
+    auto state = heap<AcceptState>();
+    auto promise = ring.accept(fd, reinterpret_cast<struct sockaddr*>(&state->addr),
+                               &state->addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    return promise.then([this,&state=*state,authenticated](int newFd)
+                        -> Promise<AuthenticatedStream> {
+      if (newFd >= 0) {
+        return finishAccept(kj::AutoCloseFd(newFd), state.addr, state.addrlen, authenticated);
+      } else if (-newFd == EAGAIN || -newFd == EWOULDBLOCK) {
+        return observer.whenBecomesReadable().then([this,authenticated]() {
+          return acceptImpl(authenticated);
+        });
+      } else if (isTransientAcceptError(-newFd)) {
+        return acceptImpl(authenticated);
+      } else {
+        KJ_FAIL_SYSCALL("accept", -newFd);
+      }
+    }).attach(kj::mv(state));
+  }
 #endif
-        case EHOSTDOWN:
-        case EHOSTUNREACH:
-        case ENETUNREACH:
-        case ECONNABORTED:
-        case ETIMEDOUT:
-          // According to the Linux man page, accept() may report an error if the accepted
-          // connection is already broken.  In this case, we really ought to just ignore it and
-          // keep waiting.  But it's hard to say exactly what errors are such network errors and
-          // which ones are permanent errors.  We've made a guess here.
-          goto retry;
 
+  Promise<AuthenticatedStream> finishAccept(kj::AutoCloseFd ownFd,
+      const struct sockaddr_storage& addr, socklen_t addrlen, bool authenticated) {
+    if (!filter.shouldAllow(reinterpret_cast<const struct sockaddr*>(&addr), addrlen)) {
+      // Ignore disallowed address.
+      return acceptImpl(authenticated);
+    } else {
+      // TODO(perf):  As a hack for the 0.4 release we are always setting
+      //   TCP_NODELAY because Nagle's algorithm pretty much kills Cap'n Proto's
+      //   RPC protocol.  Later, we should extend the interface to provide more
+      //   control over this.  Perhaps write() should have a flag which
+      //   specifies whether to pass MSG_MORE.
+      int one = 1;
+      KJ_SYSCALL_HANDLE_ERRORS(::setsockopt(
+            ownFd.get(), IPPROTO_TCP, TCP_NODELAY, (char*)&one, sizeof(one))) {
+        case EOPNOTSUPP:
+        case ENOPROTOOPT: // (returned for AF_UNIX in cygwin)
+#if __FreeBSD__
+        case EINVAL: // (returned for AF_UNIX in FreeBSD)
+#endif
+          break;
         default:
-          KJ_FAIL_SYSCALL("accept", error);
+          KJ_FAIL_SYSCALL("setsocketopt(IPPROTO_TCP, TCP_NODELAY)", error);
       }
 
+      AuthenticatedStream result;
+      result.stream = heap<AsyncStreamFd>(eventPort, ownFd.release(), NEW_FD_FLAGS,
+                                          UnixEventPort::FdObserver::OBSERVE_READ_WRITE);
+      if (authenticated) {
+        result.peerIdentity = SocketAddress(
+            reinterpret_cast<const struct sockaddr*>(&addr), addrlen)
+            .getIdentity(lowLevel, filter, *result.stream);
+      }
+      return kj::mv(result);
     }
   }
 
@@ -1474,8 +1637,8 @@ public:
 
 class LowLevelAsyncIoProviderImpl final: public LowLevelAsyncIoProvider {
 public:
-  LowLevelAsyncIoProviderImpl()
-      : eventPort(), eventLoop(eventPort), waitScope(eventLoop) {}
+  LowLevelAsyncIoProviderImpl(UnixEventPort::Options options = {})
+      : eventPort(options), eventLoop(eventPort), waitScope(eventLoop) {}
 
   inline WaitScope& getWaitScope() { return waitScope; }
 
@@ -1498,6 +1661,29 @@ public:
     auto result = heap<AsyncStreamFd>(eventPort, fd, flags,
                                       UnixEventPort::FdObserver::OBSERVE_READ_WRITE);
 
+#if KJ_USE_IO_URING
+    KJ_IF_MAYBE(ring, eventPort.getIoUring()) {
+      return ring->connect(fd, addr, addrlen)
+          .then([fd,stream=kj::mv(result),address=SocketAddress(addr, addrlen)](int error) mutable
+                -> Promise<Own<AsyncIoStream>> {
+        switch (-error) {
+          case 0:
+            return Own<AsyncIoStream>(kj::mv(stream));
+          case EINPROGRESS:
+          case EALREADY:
+          case EINTR: {
+            // The kernel handed the wait back to us.
+            auto& streamRef = *stream;
+            return finishConnect(fd, streamRef.waitConnected(), kj::mv(stream));
+          }
+          default:
+            KJ_FAIL_SYSCALL("connect()", -error, address.toString()) { break; }
+            return Own<AsyncIoStream>();
+        }
+      });
+    }
+#endif
+
     // Unfortunately connect() doesn't fit the mold of KJ_NONBLOCKING_SYSCALL, since it indicates
     // non-blocking using EINPROGRESS.
     for (;;) {
@@ -1518,7 +1704,12 @@ public:
     }
 
     auto connected = result->waitConnected();
-    return connected.then([fd,stream=kj::mv(result)]() mutable -> Own<AsyncIoStream> {
+    return finishConnect(fd, kj::mv(connected), kj::mv(result));
+  }
+
+  static Promise<Own<AsyncIoStream>> finishConnect(
+      int fd, Promise<void> connected, Own<AsyncStreamFd> stream) {
+    return connected.then([fd,stream=kj::mv(stream)]() mutable -> Own<AsyncIoStream> {
       int err;
       socklen_t errlen = sizeof(err);
       KJ_SYSCALL(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen));
@@ -2053,14 +2244,21 @@ Own<AsyncIoProvider> newAsyncIoProvider(LowLevelAsyncIoProvider& lowLevel) {
   return kj::heap<AsyncIoProviderImpl>(lowLevel);
 }
 
-AsyncIoContext setupAsyncIo() {
-  auto lowLevel = heap<LowLevelAsyncIoProviderImpl>();
+AsyncIoContext setupAsyncIo(const AsyncIoOptions& options) {
+  UnixEventPort::Options portOptions;
+  portOptions.useIoUring = options.useIoUring;
+  portOptions.useTimerWheel = options.useTimerWheel;
+  auto lowLevel = heap<LowLevelAsyncIoProviderImpl>(portOptions);
   auto ioProvider = kj::heap<AsyncIoProviderImpl>(*lowLevel);
   auto& waitScope = lowLevel->getWaitScope();
   auto& eventPort = lowLevel->getEventPort();
   return { kj::mv(lowLevel), kj::mv(ioProvider), waitScope, eventPort };
 }
 
+AsyncIoContext setupAsyncIo() {
+  return setupAsyncIo(AsyncIoOptions());
+}
+
 }  // namespace kj
 
 #endif  // !_WIN32
@@ -1183,6 +1183,11 @@ AsyncIoContext setupAsyncIo() {
   return { kj::mv(lowLevel), kj::mv(ioProvider), waitScope, eventPort };
 }
 
+AsyncIoContext setupAsyncIo(const AsyncIoOptions& options) {
+  // None of the options apply to Windows.
+  return setupAsyncIo();
+}
+
 }  // namespace kj
 
 #endif  // _WIN32
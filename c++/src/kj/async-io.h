@@ -945,6 +945,20 @@ AsyncIoContext setupAsyncIo();
 //   note that this means that server processes which daemonize themselves at startup must wait
 //   until after daemonization to create an AsyncIoContext.
 
+struct AsyncIoOptions {
+  bool useIoUring = false;
+  // On Linux, submit socket reads, writes, accepts and connects through io_uring, batching each
+  // turn of the event loop into one syscall. Falls back to epoll if io_uring is unavailable. See
+  // `UnixEventPort::Options`. Ignored on other platforms.
+
+  bool useTimerWheel = false;
+  // Keep the timer's pending events in a timing wheel. See `TimerImpl::Options`. Ignored on
+  // Windows.
+};
+
+AsyncIoContext setupAsyncIo(const AsyncIoOptions& options);
+// Like `setupAsyncIo()`, but with options.
+
 // =======================================================================================
 // Convenience adapters.
 
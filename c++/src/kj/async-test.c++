@@ -1519,6 +1519,198 @@ KJ_TEST("fiber pool limit") {
   // likelihood that the new stack would be allocated in the same location.
 }
 
+KJ_TEST("fiber pool thread-local freelists") {
+  if (isLibcContextHandlingKnownBroken()) return;
+
+  FiberPool pool(65536);
+  pool.useThreadLocalFreelists();
+
+  pool.runSynchronously([]() {});
+  pool.runSynchronously([]() {});
+
+  auto stats = pool.getStats();
+  KJ_EXPECT(stats.misses == 1);
+  KJ_EXPECT(stats.hits == 1);
+  KJ_EXPECT(stats.threadLocalHits == 1);
+  KJ_EXPECT(pool.getFreelistSize() == 1);
+
+  // Another thread doesn't see our freelist, but its stack goes back to the global freelist when
+  // it exits.
+  kj::Thread([&]() {
+    pool.runSynchronously([]() {});
+    pool.runSynchronously([]() {});
+  });
+
+  stats = pool.getStats();
+  KJ_EXPECT(stats.misses == 2);
+  KJ_EXPECT(stats.hits == 2);
+  KJ_EXPECT(stats.threadLocalHits == 2);
+  KJ_EXPECT(pool.getFreelistSize() == 2);
+
+  // Stacks beyond what fits in the thread-local freelist go to the global one.
+  {
+    EventLoop loop;
+    WaitScope waitScope(loop);
+
+    auto paf = newPromiseAndFulfiller<void>();
+    auto forked = paf.promise.fork();
+    kj::Vector<Promise<void>> fibers;
+    for (auto i KJ_UNUSED: kj::zeroTo(8)) {
+      fibers.add(pool.startFiber([&](WaitScope& scope) {
+        forked.addBranch().wait(scope);
+      }));
+    }
+    for (auto& fiber: fibers) {
+      KJ_EXPECT(!fiber.poll(waitScope));
+    }
+
+    stats = pool.getStats();
+    KJ_EXPECT(stats.misses == 8);
+    KJ_EXPECT(stats.hits == 4);
+    KJ_EXPECT(stats.threadLocalHits == 3);
+    KJ_EXPECT(pool.getFreelistSize() == 0);
+
+    paf.fulfiller->fulfill();
+    joinPromises(fibers.releaseAsArray()).wait(waitScope);
+  }
+
+  KJ_EXPECT(pool.getFreelistSize() == 8);
+}
+
+KJ_TEST("fiber pool thread-local freelist outlives pool") {
+  if (isLibcContextHandlingKnownBroken()) return;
+
+  auto pool = kj::heap<FiberPool>(65536);
+  pool->useThreadLocalFreelists();
+
+  kj::MutexGuarded<uint> state;
+
+  kj::Thread thread([&]() noexcept {
+    pool->runSynchronously([]() {});
+    *state.lockExclusive() = 1;
+
+    {
+      auto lock = state.lockExclusive();
+      lock.wait([](uint val) { return val == 2; });
+    }
+
+    // Using a new pool after the old one is gone discards the old thread-local freelist.
+    FiberPool pool2(65536);
+    pool2.useThreadLocalFreelists();
+    pool2.runSynchronously([]() {});
+    pool2.runSynchronously([]() {});
+    KJ_EXPECT(pool2.getStats().threadLocalHits == 1);
+  });
+
+  {
+    auto lock = state.lockExclusive();
+    lock.wait([](uint val) { return val == 1; });
+  }
+
+  KJ_EXPECT(pool->getFreelistSize() == 1);
+  pool = nullptr;
+  *state.lockExclusive() = 2;
+}
+
+KJ_TEST("fiber pool prefault") {
+  if (isLibcContextHandlingKnownBroken()) return;
+
+  {
+    FiberPool pool(65536);
+    pool.prefault(3);
+    KJ_EXPECT(pool.getFreelistSize() == 3);
+
+    pool.runSynchronously([]() {});
+    auto stats = pool.getStats();
+    KJ_EXPECT(stats.hits == 1);
+    KJ_EXPECT(stats.misses == 0);
+    KJ_EXPECT(pool.getFreelistSize() == 3);
+  }
+
+  {
+    FiberPool pool(65536);
+    pool.setMaxFreelist(2);
+    pool.prefault(5);
+    KJ_EXPECT(pool.getFreelistSize() == 2);
+  }
+}
+
+KJ_TEST("fiber pool evicts its oldest stacks when full") {
+  if (isLibcContextHandlingKnownBroken()) return;
+
+  for (bool threadLocal: { false, true }) {
+    FiberPool pool(65536);
+    pool.setMaxFreelist(2);
+    if (threadLocal) pool.useThreadLocalFreelists();
+
+    EventLoop loop;
+    WaitScope waitScope(loop);
+
+    // Runs fibers on `count` stacks at once, recording where each stack is, then finishes them in
+    // order.
+    auto runFibers = [&](uint count, const void** stacks) {
+      kj::Vector<Own<PromiseFulfiller<void>>> fulfillers;
+      kj::Vector<Maybe<Promise<void>>> fibers;
+      for (auto i: kj::zeroTo(count)) {
+        auto paf = newPromiseAndFulfiller<void>();
+        fulfillers.add(kj::mv(paf.fulfiller));
+        fibers.add(pool.startFiber(
+            [stack = &stacks[i], promise = kj::mv(paf.promise)](WaitScope& scope) mutable {
+          char c;
+          *stack = &c;
+          promise.wait(scope);
+        }));
+      }
+      for (auto i: kj::zeroTo(count)) {
+        fulfillers[i]->fulfill();
+        KJ_ASSERT_NONNULL(fibers[i]).wait(waitScope);
+        fibers[i] = nullptr;
+      }
+    };
+
+    const void* first[3];
+    runFibers(3, first);
+    KJ_EXPECT(pool.getFreelistSize() == 2, threadLocal, pool.getFreelistSize());
+
+    // The first stack returned was evicted; the other two are reused.
+    const void* second[2];
+    runFibers(2, second);
+    KJ_EXPECT(pool.getStats().hits == 2, threadLocal);
+    for (auto stack: second) {
+      KJ_EXPECT(stack != first[0], threadLocal);
+    }
+  }
+}
+
+KJ_TEST("fiber pool concurrent use") {
+  if (isLibcContextHandlingKnownBroken()) return;
+
+  for (bool threadLocal: { false, true }) {
+    FiberPool pool(65536);
+    pool.setMaxFreelist(4);
+    if (threadLocal) pool.useThreadLocalFreelists();
+
+    constexpr uint THREADS = 4;
+    constexpr uint ITERATIONS = 500;
+
+    {
+      kj::Vector<Own<kj::Thread>> threads;
+      for (auto i KJ_UNUSED: kj::zeroTo(THREADS)) {
+        threads.add(kj::heap<kj::Thread>([&]() {
+          for (auto j KJ_UNUSED: kj::zeroTo(ITERATIONS)) {
+            pool.runSynchronously([]() {});
+          }
+        }));
+      }
+    }
+
+    auto stats = pool.getStats();
+    KJ_EXPECT(stats.hits + stats.misses == THREADS * ITERATIONS);
+    KJ_EXPECT(stats.hits > 0);
+    KJ_EXPECT(pool.getFreelistSize() <= 4, pool.getFreelistSize());
+  }
+}
+
 #if __GNUC__ >= 12 && !__clang__
 // The test below intentionally takes a pointer to a stack variable and stores it past the end
 // of the function. This seems to trigger a warning in newer GCCs.
@@ -36,6 +36,13 @@
 #if KJ_USE_EPOLL
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#if KJ_USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "kj/miniposix.h"
+#endif
 #elif KJ_USE_KQUEUE
 #include <sys/event.h>
 #include <fcntl.h>
@@ -409,9 +416,9 @@ void UnixEventPort::gotSignal(const siginfo_t& siginfo) {
 // =======================================================================================
 // epoll FdObserver implementation
 
-UnixEventPort::UnixEventPort()
+UnixEventPort::UnixEventPort(Options options)
     : clock(systemPreciseMonotonicClock()),
-      timerImpl(clock.now()) {
+      timerImpl(clock.now(), TimerImpl::Options { options.useTimerWheel }) {
   ignoreSigpipe();
 
   int fd;
@@ -432,6 +439,21 @@ UnixEventPort::UnixEventPort()
   // this against another mask with memcmp() for debug purposes.)
   memset(&originalMask, 0, sizeof(originalMask));
   KJ_SYSCALL(sigprocmask(0, nullptr, &originalMask));
+
+#if KJ_USE_IO_URING
+  if (options.useIoUring) {
+    ioUring = IoUring::tryCreate(options.ioUringEntries);
+    KJ_IF_MAYBE(ring, ioUring) {
+      // The ring's fd is readable whenever completions are waiting. Unlike FdObservers, it's
+      // level-triggered, since we always reap everything that's there.
+      struct epoll_event event;
+      memset(&event, 0, sizeof(event));
+      event.events = EPOLLIN;
+      event.data.u64 = 1;
+      KJ_SYSCALL(epoll_ctl(epollFd, EPOLL_CTL_ADD, ring->get()->ringFd, &event));
+    }
+  }
+#endif
 }
 
 UnixEventPort::~UnixEventPort() noexcept(false) {
@@ -441,6 +463,15 @@ UnixEventPort::~UnixEventPort() noexcept(false) {
   }
 }
 
+Maybe<UnixEventPort::IoUring&> UnixEventPort::getIoUring() {
+#if KJ_USE_IO_URING
+  KJ_IF_MAYBE(ring, ioUring) {
+    return **ring;
+  }
+#endif
+  return nullptr;
+}
+
 UnixEventPort::FdObserver::FdObserver(UnixEventPort& eventPort, int fd, uint flags)
     : eventPort(eventPort), fd(fd), flags(flags) {
   struct epoll_event event;
@@ -569,6 +600,14 @@ bool UnixEventPort::wait() {
   }
 #endif
 
+#if KJ_USE_IO_URING
+  KJ_IF_MAYBE(ring, ioUring) {
+    // Submit everything queued during this turn. If any of it completes right away, the ring's
+    // fd will be readable and epoll won't block.
+    ring->get()->submit();
+  }
+#endif
+
   int timeout = timerImpl.timeoutToNextEvent(clock.now(), MILLISECONDS, int(maxValue))
           .map([](uint64_t t) -> int { return t; })
           .orDefault(-1);
@@ -647,6 +686,10 @@ bool UnixEventPort::processEpollEvents(struct epoll_event events[], int n) {
 
       // We were woken. Need to return true.
       woken = true;
+#if KJ_USE_IO_URING
+    } else if (events[i].data.u64 == 1) {
+      KJ_ASSERT_NONNULL(ioUring)->reapCompletions();
+#endif
     } else {
       FdObserver* observer = reinterpret_cast<FdObserver*>(events[i].data.ptr);
       observer->fire(events[i].events);
@@ -705,6 +748,12 @@ bool UnixEventPort::poll() {
     }
   }
 
+#if KJ_USE_IO_URING
+  KJ_IF_MAYBE(ring, ioUring) {
+    ring->get()->submit();
+  }
+#endif
+
   struct epoll_event events[16];
   int n;
   KJ_SYSCALL(n = epoll_wait(epollFd, events, kj::size(events), 0));
@@ -712,13 +761,278 @@ bool UnixEventPort::poll() {
   return processEpollEvents(events, n);
 }
 
+#if KJ_USE_IO_URING
+// =======================================================================================
+// io_uring
+
+class UnixEventPort::IoUring::Operation {
+  // The PromiseAdapter behind each operation. It owns whatever the kernel needs to outlive the
+  // call that started the operation (the msghdr for sendmsg(), the address for connect()).
+
+public:
+  template <typename Prepare>
+  Operation(PromiseFulfiller<int>& fulfiller, IoUring& ring, Prepare&& prepare)
+      : fulfiller(fulfiller), ring(ring) {
+    // Callers validate their arguments before getting here, but if `prepare` throws anyway, turn
+    // the already-claimed entry into a no-op that doesn't point at us, since we won't exist by the
+    // time it completes.
+    struct io_uring_sqe& sqe = ring.startOperation(this);
+    KJ_ON_SCOPE_FAILURE({
+      memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = IORING_OP_NOP;
+    });
+    prepare(sqe, *this);
+  }
+
+  ~Operation() noexcept(false) {
+    if (!completed) {
+      canceling = true;
+      ring.cancel(*this);
+    }
+  }
+
+  KJ_DISALLOW_COPY_AND_MOVE(Operation);
+
+  void complete(int result) {
+    completed = true;
+    if (!canceling) {
+      fulfiller.fulfill(kj::mv(result));
+    }
+  }
+
+  struct msghdr msg;
+  Array<struct iovec> iov;
+  struct sockaddr_storage addr;
+
+private:
+  PromiseFulfiller<int>& fulfiller;
+  IoUring& ring;
+  bool completed = false;
+  bool canceling = false;
+
+  friend class IoUring;
+};
+
+Maybe<Own<UnixEventPort::IoUring>> UnixEventPort::IoUring::tryCreate(uint entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  // Sockets with a read outstanding sit in the completion queue's budget until data arrives, so
+  // make room for plenty of them. The kernel keeps any overflow (IORING_FEAT_NODROP) anyway.
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+
+  int fd = syscall(SYS_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    // ENOSYS on old kernels, EPERM if disabled by sysctl or seccomp, and so on. Stick with epoll.
+    return nullptr;
+  }
+  AutoCloseFd ownFd(fd);
+
+  // NODROP (5.5) means completions are never lost. FAST_POLL (5.7) means operations on sockets
+  // that aren't ready wait for readiness in the kernel rather than tying up a worker thread.
+  // SINGLE_MMAP (5.4) just simplifies things.
+  uint required = IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL | IORING_FEAT_SINGLE_MMAP;
+  if ((params.features & required) != required) {
+    return nullptr;
+  }
+
+  // Can't use heap() since the constructor is private.
+  return Own<IoUring>(new IoUring(kj::mv(ownFd), params), _::HeapDisposer<IoUring>::instance);
+}
+
+UnixEventPort::IoUring::IoUring(AutoCloseFd ringFdParam, const struct io_uring_params& params)
+    : ringFd(kj::mv(ringFdParam)) {
+  ringsSize = kj::max(params.sq_off.array + params.sq_entries * sizeof(uint),
+                      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+  rings = mmap(nullptr, ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               ringFd, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap(io_uring rings)", errno);
+  }
+  KJ_ON_SCOPE_FAILURE(munmap(rings, ringsSize));
+
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqesMemory = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ringFd, IORING_OFF_SQES);
+  if (sqesMemory == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap(io_uring sqes)", errno);
+  }
+  sqes = reinterpret_cast<struct io_uring_sqe*>(sqesMemory);
+
+  byte* base = reinterpret_cast<byte*>(rings);
+  sqHead = reinterpret_cast<uint*>(base + params.sq_off.head);
+  sqTail = reinterpret_cast<uint*>(base + params.sq_off.tail);
+  sqFlags = reinterpret_cast<uint*>(base + params.sq_off.flags);
+  sqArray = reinterpret_cast<uint*>(base + params.sq_off.array);
+  sqMask = *reinterpret_cast<uint*>(base + params.sq_off.ring_mask);
+  sqEntries = params.sq_entries;
+  cqHead = reinterpret_cast<uint*>(base + params.cq_off.head);
+  cqTail = reinterpret_cast<uint*>(base + params.cq_off.tail);
+  cqMask = *reinterpret_cast<uint*>(base + params.cq_off.ring_mask);
+  cqEntries = params.cq_entries;
+  cqes = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+
+  localSqTail = *sqTail;
+}
+
+UnixEventPort::IoUring::~IoUring() noexcept(false) {
+  munmap(sqes, sqesSize);
+  munmap(rings, ringsSize);
+}
+
+struct io_uring_sqe& UnixEventPort::IoUring::startOperation(Operation* op) {
+  while (localSqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+    submit();
+  }
+
+  uint index = localSqTail & sqMask;
+  struct io_uring_sqe& sqe = sqes[index];
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.user_data = reinterpret_cast<uintptr_t>(op);
+  sqArray[index] = index;
+  ++localSqTail;
+  return sqe;
+}
+
+void UnixEventPort::IoUring::submit(bool waitForCompletion) {
+  uint toSubmit = localSqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+  bool overflowed = __atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW;
+  if (toSubmit == 0 && !waitForCompletion && !overflowed) return;
+
+  __atomic_store_n(sqTail, localSqTail, __ATOMIC_RELEASE);
+
+  // GETEVENTS also moves completions that overflowed into kernel memory back into the ring.
+  uint flags = waitForCompletion || overflowed ? IORING_ENTER_GETEVENTS : 0;
+  for (;;) {
+    int n = syscall(SYS_io_uring_enter, ringFd.get(), toSubmit, waitForCompletion ? 1 : 0, flags,
+                    nullptr, 0);
+    if (n >= 0) break;
+
+    int error = errno;
+    if (error == EINTR) {
+      if (!waitForCompletion) break;
+    } else if (error == EAGAIN || error == EBUSY) {
+      // The kernel is short of room for completions. Make some, then try again.
+      if (!reapCompletions() && !waitForCompletion) break;
+    } else {
+      KJ_FAIL_SYSCALL("io_uring_enter()", error);
+    }
+  }
+  ++submitCount;
+}
+
+bool UnixEventPort::IoUring::reapCompletions() {
+  bool any = false;
+  for (;;) {
+    uint head = *cqHead;
+    uint tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    if (head == tail) break;
+
+    while (head != tail) {
+      struct io_uring_cqe& cqe = cqes[head & cqMask];
+      auto op = reinterpret_cast<Operation*>(static_cast<uintptr_t>(cqe.user_data));
+      int result = cqe.res;
+      __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+      any = true;
+
+      if (op != nullptr) {
+        op->complete(result);
+      }
+    }
+
+    if (__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+      // More completions are waiting in kernel memory. Have them copied into the ring.
+      submit();
+    }
+  }
+  return any;
+}
+
+void UnixEventPort::IoUring::cancel(Operation& op) {
+  struct io_uring_sqe& sqe = startOperation(nullptr);
+  sqe.opcode = IORING_OP_ASYNC_CANCEL;
+  sqe.addr = reinterpret_cast<uintptr_t>(&op);
+
+  // The operation's buffers belong to the caller, so we can't return until the kernel is done
+  // with them. Typically the operation is sitting on a socket's wait queue and the cancellation
+  // completes it immediately.
+  while (!op.completed) {
+    submit(true);
+    reapCompletions();
+  }
+}
+
+Promise<int> UnixEventPort::IoUring::recv(int fd, void* buffer, size_t size) {
+  return newAdaptedPromise<int, Operation>(*this,
+      [&](struct io_uring_sqe& sqe, Operation&) {
+    sqe.opcode = IORING_OP_RECV;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uintptr_t>(buffer);
+    sqe.len = kj::min(size, size_t(int(kj::maxValue)));  // result must fit in an int
+  });
+}
+
+Promise<int> UnixEventPort::IoUring::send(int fd, ArrayPtr<const ArrayPtr<const byte>> pieces) {
+  KJ_REQUIRE(pieces.size() <= miniposix::iovMax(), "too many pieces for one sendmsg()");
+
+  return newAdaptedPromise<int, Operation>(*this,
+      [&](struct io_uring_sqe& sqe, Operation& op) {
+    op.iov = heapArray<struct iovec>(pieces.size());
+    for (auto i: kj::indices(pieces)) {
+      // sendmsg() is not const-correct.
+      op.iov[i].iov_base = const_cast<byte*>(pieces[i].begin());
+      op.iov[i].iov_len = pieces[i].size();
+    }
+    memset(&op.msg, 0, sizeof(op.msg));
+    op.msg.msg_iov = op.iov.begin();
+    op.msg.msg_iovlen = op.iov.size();
+
+    sqe.opcode = IORING_OP_SENDMSG;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uintptr_t>(&op.msg);
+    sqe.len = 1;
+    sqe.msg_flags = MSG_NOSIGNAL;
+  });
+}
+
+Promise<int> UnixEventPort::IoUring::accept(
+    int fd, struct sockaddr* addr, uint* addrlen, int flags) {
+  static_assert(sizeof(socklen_t) == sizeof(uint), "socklen_t isn't uint");
+
+  return newAdaptedPromise<int, Operation>(*this,
+      [&](struct io_uring_sqe& sqe, Operation&) {
+    sqe.opcode = IORING_OP_ACCEPT;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uintptr_t>(addr);
+    sqe.addr2 = reinterpret_cast<uintptr_t>(addrlen);
+    sqe.accept_flags = flags;
+  });
+}
+
+Promise<int> UnixEventPort::IoUring::connect(int fd, const struct sockaddr* addr, uint addrlen) {
+  KJ_REQUIRE(addrlen <= sizeof(sockaddr_storage), "address too long");
+
+  return newAdaptedPromise<int, Operation>(*this,
+      [&](struct io_uring_sqe& sqe, Operation& op) {
+    memcpy(&op.addr, addr, addrlen);
+
+    sqe.opcode = IORING_OP_CONNECT;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uintptr_t>(&op.addr);
+    sqe.off = addrlen;
+  });
+}
+
+#endif  // KJ_USE_IO_URING
+
 #elif KJ_USE_KQUEUE
 // =======================================================================================
 // kqueue FdObserver implementation
 
-UnixEventPort::UnixEventPort()
+UnixEventPort::UnixEventPort(Options options)
     : clock(systemPreciseMonotonicClock()),
-      timerImpl(clock.now()) {
+      timerImpl(clock.now(), TimerImpl::Options { options.useTimerWheel }) {
   ignoreSigpipe();
 
   int fd;
@@ -1153,9 +1467,9 @@ bool UnixEventPort::poll() {
 #define POLLRDHUP 0
 #endif
 
-UnixEventPort::UnixEventPort()
+UnixEventPort::UnixEventPort(Options options)
     : clock(systemPreciseMonotonicClock()),
-      timerImpl(clock.now()) {
+      timerImpl(clock.now(), TimerImpl::Options { options.useTimerWheel }) {
 #if KJ_USE_PIPE_FOR_WAKEUP
   // Allocate a pipe to which we'll write a byte in order to wake this thread.
   int fds[2];
@@ -1583,6 +1897,14 @@ void UnixEventPort::wake() const {
 
 #endif  // KJ_USE_EPOLL, else KJ_USE_KQUEUE, else
 
+UnixEventPort::UnixEventPort(): UnixEventPort(Options()) {}
+
+#if !KJ_USE_EPOLL
+Maybe<UnixEventPort::IoUring&> UnixEventPort::getIoUring() {
+  return nullptr;
+}
+#endif
+
 }  // namespace kj
 
 #endif  // !_WIN32
@@ -47,6 +47,20 @@ KJ_BEGIN_HEADER
 #error "Both KJ_USE_EPOLL and KJ_USE_KQUEUE are set. Please choose only one of these."
 #endif
 
+#if !defined(KJ_USE_IO_URING)
+#if KJ_USE_EPOLL && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+// Build in io_uring support where the kernel headers have it. It's only used if requested with
+// UnixEventPort::Options, and only if the running kernel allows it.
+#define KJ_USE_IO_URING 1
+#endif
+#endif
+#endif
+
+#if KJ_USE_IO_URING && !KJ_USE_EPOLL
+#error "KJ_USE_IO_URING requires KJ_USE_EPOLL."
+#endif
+
 #if __CYGWIN__ && !defined(KJ_USE_PIPE_FOR_WAKEUP)
 // Cygwin has serious issues with the intersection of signals and threads, reported here:
 //     https://cygwin.com/ml/cygwin/2019-07/msg00052.html
@@ -57,6 +71,12 @@ KJ_BEGIN_HEADER
 
 #if KJ_USE_EPOLL
 struct epoll_event;
+#if KJ_USE_IO_URING
+struct io_uring_params;
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct sockaddr;
+#endif
 #elif KJ_USE_KQUEUE
 struct kevent;
 struct timespec;
@@ -89,13 +109,34 @@ class UnixEventPort: public EventPort {
   //   processes!
 
 public:
+  struct Options {
+    bool useIoUring = false;
+    // On Linux, also set up an io_uring, through which the streams and listeners created by
+    // LowLevelAsyncIoProvider submit their reads, writes, accepts and connects instead of making
+    // one syscall for each. If io_uring is unavailable (an old kernel, or disabled by sysctl or
+    // seccomp), everything quietly runs on epoll as usual. Ignored on other platforms.
+
+    uint ioUringEntries = 256;
+    // Size of the io_uring's submission queue.
+
+    bool useTimerWheel = false;
+    // Keep the timer's pending events in a timing wheel. See `TimerImpl::Options`.
+  };
+
   UnixEventPort();
+  explicit UnixEventPort(Options options);
 
   ~UnixEventPort() noexcept(false);
 
   class FdObserver;
   // Class that watches an fd for readability or writability. See definition below.
 
+  class IoUring;
+  // Interface for submitting I/O through io_uring. See definition below.
+
+  Maybe<IoUring&> getIoUring();
+  // Returns the io_uring, if `Options::useIoUring` was set and io_uring is available.
+
   Promise<siginfo_t> onSignal(int signum);
   // When the given signal is delivered to this thread, return the corresponding siginfo_t.
   // The signal must have been captured using `captureSignal()`.
@@ -204,6 +245,10 @@ private:
   AutoCloseFd epollFd;
   AutoCloseFd eventFd;   // Used for cross-thread wakeups.
 
+#if KJ_USE_IO_URING
+  Maybe<Own<IoUring>> ioUring;
+#endif
+
   bool processEpollEvents(struct epoll_event events[], int n);
 #elif KJ_USE_KQUEUE
   AutoCloseFd kqueueFd;
@@ -373,6 +418,93 @@ private:
   friend class UnixEventPort;
 };
 
+#if KJ_USE_IO_URING
+class UnixEventPort::IoUring {
+  // Submits I/O operations through a Linux io_uring. Operations started during a turn of the
+  // event loop are submitted to the kernel together, in one syscall, when the event port next
+  // polls or waits. Their completions are read from memory shared with the kernel, which takes
+  // no syscall at all.
+  //
+  // Each operation resolves to what the equivalent syscall would have returned, except that
+  // errors come back as a negative errno rather than being thrown. Operations on non-blocking
+  // sockets wait for readiness inside the kernel rather than failing with EAGAIN.
+  //
+  // Canceling an operation (by dropping its promise) cancels it in the kernel and waits for the
+  // kernel to confirm, so any buffers it was given may be freed as soon as the promise is gone.
+
+public:
+  ~IoUring() noexcept(false);
+  KJ_DISALLOW_COPY_AND_MOVE(IoUring);
+
+  Promise<int> recv(int fd, void* buffer, size_t size);
+  // recv() into `buffer`, which must remain valid until the operation completes or is canceled.
+
+  Promise<int> send(int fd, ArrayPtr<const ArrayPtr<const byte>> pieces);
+  // sendmsg() the given pieces, of which there must be no more than IOV_MAX. The pieces' contents
+  // must remain valid until the operation completes or is canceled, but the array of pieces
+  // itself need not. Never raises SIGPIPE.
+
+  Promise<int> accept(int fd, struct sockaddr* addr, uint* addrlen, int flags);
+  // accept4(). `addr` and `addrlen` must remain valid until the operation completes or is
+  // canceled.
+
+  Promise<int> connect(int fd, const struct sockaddr* addr, uint addrlen);
+  // connect(). `addr` is copied.
+
+  uint getSubmitCount() { return submitCount; }
+  // Number of times the ring has been submitted to the kernel, for testing and monitoring.
+
+private:
+  class Operation;
+
+  AutoCloseFd ringFd;
+
+  void* rings;
+  size_t ringsSize;
+  struct io_uring_sqe* sqes;
+  size_t sqesSize;
+
+  uint* sqHead;
+  uint* sqTail;
+  uint* sqFlags;
+  uint* sqArray;
+  uint sqMask;
+  uint sqEntries;
+  uint* cqHead;
+  uint* cqTail;
+  uint cqMask;
+  uint cqEntries;
+  struct io_uring_cqe* cqes;
+
+  uint localSqTail;
+  // Tail of the submission queue as we've filled it in. Entries up to here but past `*sqTail`
+  // are waiting to be submitted.
+
+  uint submitCount = 0;
+
+  IoUring(AutoCloseFd ringFd, const struct io_uring_params& params);
+  static Maybe<Own<IoUring>> tryCreate(uint entries);
+  // Returns null if io_uring is unavailable or lacks features we need.
+
+  struct io_uring_sqe& startOperation(Operation* op);
+  // Return the next free submission queue entry, zeroed, with its user_data pointing at `op`
+  // (which may be null if no completion is wanted). Submits queued entries first if the queue is
+  // full.
+
+  void submit(bool waitForCompletion = false);
+  // Submit all queued entries to the kernel. If `waitForCompletion` is true, also block until at
+  // least one completion is available.
+
+  bool reapCompletions();
+  // Deliver all available completions. Returns true if there were any.
+
+  void cancel(Operation& op);
+  // Cancel `op` in the kernel and wait for it to complete.
+
+  friend class UnixEventPort;
+};
+#endif  // KJ_USE_IO_URING
+
 }  // namespace kj
 
 KJ_END_HEADER
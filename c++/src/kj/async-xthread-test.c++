@@ -568,6 +568,111 @@ KJ_TEST("call own thread's executor") {
   }
 }
 
+KJ_TEST("many asynchronous cross-thread events from many threads") {
+  // Each sender's events must be delivered in order, even though the target thread takes them off
+  // its queue in batches.
+
+  MutexGuarded<kj::Maybe<const Executor&>> executor;  // to get the Executor from the other thread
+  Own<PromiseFulfiller<void>> done;  // accessed only from the subthread
+
+  static constexpr uint SENDERS = 4;
+  static constexpr uint COUNT = 1000;
+  uint lastSeen[SENDERS] = {};  // accessed only from the subthread
+
+  Thread thread([&]() noexcept {
+    KJ_XTHREAD_TEST_SETUP_LOOP;
+
+    auto paf = newPromiseAndFulfiller<void>();
+    done = kj::mv(paf.fulfiller);
+
+    *executor.lockExclusive() = getCurrentThreadExecutor();
+
+    paf.promise.wait(waitScope);
+  });
+
+  ([&]() noexcept {
+    const Executor* exec;
+    {
+      auto lock = executor.lockExclusive();
+      lock.wait([&](kj::Maybe<const Executor&> value) { return value != nullptr; });
+      exec = &KJ_ASSERT_NONNULL(*lock);
+    }
+
+    {
+      auto sender = [&](uint id) {
+        return [&, id]() noexcept {
+          KJ_XTHREAD_TEST_SETUP_LOOP;
+
+          auto promises = kj::heapArrayBuilder<Promise<void>>(COUNT);
+          for (auto i: kj::range(1u, COUNT + 1)) {
+            promises.add(exec->executeAsync([&lastSeen, id, i]() {
+              KJ_ASSERT(lastSeen[id] + 1 == i, id, i, lastSeen[id]);
+              lastSeen[id] = i;
+            }));
+          }
+          joinPromises(promises.finish()).wait(waitScope);
+        };
+      };
+
+      Thread sender0(sender(0));
+      Thread sender1(sender(1));
+      Thread sender2(sender(2));
+      Thread sender3(sender(3));
+    }
+
+    exec->executeSync([&]() {
+      for (auto seen: lastSeen) {
+        KJ_EXPECT(seen == COUNT);
+      }
+      done->fulfill();
+    });
+  })();
+}
+
+KJ_TEST("benchmark: asynchronous cross-thread event throughput") {
+  // Each iteration sends a burst of 10,000 trivial executeAsync() calls to another thread and
+  // waits for them all. Run with --benchmark=<iters> to time it.
+
+  MutexGuarded<kj::Maybe<const Executor&>> executor;  // to get the Executor from the other thread
+  Own<PromiseFulfiller<void>> done;  // accessed only from the subthread
+
+  Thread thread([&]() noexcept {
+    KJ_XTHREAD_TEST_SETUP_LOOP;
+
+    auto paf = newPromiseAndFulfiller<void>();
+    done = kj::mv(paf.fulfiller);
+
+    *executor.lockExclusive() = getCurrentThreadExecutor();
+
+    paf.promise.wait(waitScope);
+  });
+
+  ([&]() noexcept {
+    KJ_XTHREAD_TEST_SETUP_LOOP;
+
+    const Executor* exec;
+    {
+      auto lock = executor.lockExclusive();
+      lock.wait([&](kj::Maybe<const Executor&> value) { return value != nullptr; });
+      exec = &KJ_ASSERT_NONNULL(*lock);
+    }
+
+    uint count = 0;
+    doBenchmark([&]() {
+      auto promises = kj::heapArrayBuilder<Promise<void>>(10000);
+      for (auto i KJ_UNUSED: kj::zeroTo(10000)) {
+        promises.add(exec->executeAsync([&count]() { ++count; }));
+      }
+      joinPromises(promises.finish()).wait(waitScope);
+    });
+
+    exec->executeSync([&]() {
+      KJ_EXPECT(count % 10000 == 0 && count > 0, count);
+      done->fulfill();
+    });
+  })();
+}
+
 KJ_TEST("synchronous cross-thread event disconnected") {
   MutexGuarded<kj::Maybe<const Executor&>> executor;  // to get the Executor from the other thread
   Own<PromiseFulfiller<void>> fulfiller;  // accessed only from the subthread
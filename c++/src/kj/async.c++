@@ -47,7 +47,6 @@
 #include "kj/one-of.h"
 #include "kj/function.h"
 #include "kj/list.h"
-#include <deque>
 #include <atomic>
 
 #if _WIN32 || __CYGWIN__
@@ -107,6 +106,10 @@ static std::atomic<T>* reinterpretAtomic(T* ptr) { return reinterpret_cast<std::
         reinterpretAtomic(ptr), expected, desired, succ, fail)
 #define __atomic_exchange_n(ptr, val, order) \
     std::atomic_exchange_explicit(reinterpretAtomic(ptr), val, order)
+#define __atomic_fetch_add(ptr, val, order) \
+    std::atomic_fetch_add_explicit(reinterpretAtomic(ptr), val, order)
+#define __atomic_fetch_sub(ptr, val, order) \
+    std::atomic_fetch_sub_explicit(reinterpretAtomic(ptr), val, order)
 #define __ATOMIC_RELAXED std::memory_order_relaxed
 #define __ATOMIC_ACQUIRE std::memory_order_acquire
 #define __ATOMIC_RELEASE std::memory_order_release
@@ -473,6 +476,10 @@ public:
   void switchToFiber();
   void switchToMain();
 
+  void prefault();
+  // Touch every page of the stack so that the OS commits memory for it now rather than on first
+  // use.
+
   void trace(TraceBuilder& builder) {
     // TODO(someday): Trace through fiber stack? Can it be done???
     builder.add(getMethodStartAddress(*this, &FiberStack::trace));
@@ -482,6 +489,10 @@ private:
   size_t stackSize;
   OneOf<FiberBase*, SynchronousFunc*> main;
 
+  FiberStack* newerFree = nullptr;
+  FiberStack* olderFree = nullptr;
+  // Links in FiberPool's global freelist.
+
   friend class FiberBase;
   friend class FiberPool::Impl;
 
@@ -514,10 +525,26 @@ static const size_t CACHE_LINE_SIZE = 64;
 // Most modern architectures have 64-byte cache lines.
 #endif
 
+static const size_t THREAD_LOCAL_FREELIST_SIZE = 4;
+// Max stacks each thread keeps in its own freelist when useThreadLocalFreelists() is enabled.
+
 class FiberPool::Impl final: private Disposer {
 public:
   Impl(size_t stackSize): stackSize(stackSize) {}
   ~Impl() noexcept(false) {
+    if (poolId != 0) {
+      // Free stacks held by threads that are still alive. When they exit, they'll see that the
+      // pool is gone and just free their bookkeeping.
+      auto lock = getRegistry().lockExclusive();
+      for (auto list: threadFreelists) {
+        for (auto i: kj::zeroTo(list->count)) {
+          delete list->stacks[i];
+        }
+        list->count = 0;
+        list->pool = nullptr;
+      }
+    }
+
 #if USE_CORE_LOCAL_FREELISTS
     if (coreLocalFreelists != nullptr) {
       KJ_DEFER(free(coreLocalFreelists));
@@ -533,9 +560,7 @@ public:
 #endif
 
     // Make sure we're not leaking anything from the global freelist either.
-    auto lock = freelist.lockExclusive();
-    auto dangling = kj::mv(*lock);
-    for (auto& stack: dangling) {
+    while (_::FiberStack* stack = popGlobal()) {
       delete stack;
     }
   }
@@ -545,7 +570,23 @@ public:
   }
 
   size_t getFreelistSize() const {
-    return freelist.lockShared()->size();
+    return __atomic_load_n(&freeCount, __ATOMIC_RELAXED);
+  }
+
+  Stats getStats() const {
+    Stats result {
+      __atomic_load_n(&hits, __ATOMIC_RELAXED), 0,
+      __atomic_load_n(&misses, __ATOMIC_RELAXED)
+    };
+    if (poolId != 0) {
+      auto lock = getRegistry().lockExclusive();
+      result.threadLocalHits = exitedThreadHits;
+      for (auto list: threadFreelists) {
+        result.threadLocalHits += __atomic_load_n(&list->hits, __ATOMIC_RELAXED);
+      }
+    }
+    result.hits += result.threadLocalHits;
+    return result;
   }
 
   void useCoreLocalFreelists() {
@@ -570,17 +611,48 @@ public:
 #endif
   }
 
+  void useThreadLocalFreelists() {
+    if (poolId != 0) {
+      // Ignore repeat call.
+      return;
+    }
+
+    // Thread-local freelists are keyed by ID rather than by pool address, since a new pool could
+    // be allocated at the address of one that was destroyed.
+    poolId = ++*getRegistry().lockExclusive();
+  }
+
+  void prefault(size_t count) {
+    for (auto i KJ_UNUSED: kj::zeroTo(kj::min(count, maxFreelist))) {
+      auto stack = new _::FiberStack(stackSize);
+      stack->prefault();
+      pushGlobal(stack, false);
+    }
+  }
+
   Own<_::FiberStack> takeStack() const {
     // Get a stack from the pool. The disposer on the returned Own pointer will return the stack
     // to the pool, provided that reset() has been called to indicate that the stack is not in
     // a weird state.
 
+    if (poolId != 0) {
+      ThreadFreelist& list = getThreadFreelist();
+      if (list.count > 0) {
+        _::FiberStack* result = list.stacks[list.count - 1];
+        __atomic_store_n(&list.count, list.count - 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&list.hits, list.hits + 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&freeCount, 1, __ATOMIC_RELAXED);
+        return { result, *this };
+      }
+    }
+
 #if USE_CORE_LOCAL_FREELISTS
     KJ_IF_MAYBE(core, lookupCoreLocalFreelist()) {
       for (auto& stackPtr: core->stacks) {
         _::FiberStack* result = __atomic_exchange_n(&stackPtr, nullptr, __ATOMIC_ACQUIRE);
         if (result != nullptr) {
           // Found a stack in this slot!
+          __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
           return { result, *this };
         }
       }
@@ -588,15 +660,12 @@ public:
     }
 #endif
 
-    {
-      auto lock = freelist.lockExclusive();
-      if (!lock->empty()) {
-        _::FiberStack* result = lock->back();
-        lock->pop_back();
-        return { result, *this };
-      }
+    if (_::FiberStack* result = popGlobal()) {
+      __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+      return { result, *this };
     }
 
+    __atomic_fetch_add(&misses, 1, __ATOMIC_RELAXED);
     _::FiberStack* result = new _::FiberStack(stackSize);
     return { result, *this };
   }
@@ -604,7 +673,185 @@ public:
 private:
   size_t stackSize;
   size_t maxFreelist = kj::maxValue;
-  MutexGuarded<std::deque<_::FiberStack*>> freelist;
+
+  mutable _::FiberStack* globalNewest = nullptr;
+  mutable _::FiberStack* globalOldest = nullptr;
+  mutable bool globalLock = false;
+  // The global freelist: a list of FiberStacks linked through `newerFree` and `olderFree`. Stacks
+  // are taken from the newest end, since their memory is the most likely to still be cached, and
+  // evicted from the oldest end. It's guarded by `globalLock`, a spinlock, which is only held for
+  // a few pointer updates; stacks are allocated and freed outside of it. This is not lock-free,
+  // but with thread-local freelists in front of it, it's rarely contended.
+
+  mutable size_t freeCount = 0;
+  // Stacks in the global and thread-local freelists, which together are bounded by `maxFreelist`.
+  // Updated atomically, without taking any lock.
+
+  mutable size_t hits = 0;
+  mutable size_t misses = 0;
+  // Counters for getStats(), excluding hits on thread-local freelists.
+
+  struct ThreadFreelist {
+    // A freelist belonging to one thread and one pool. Only the owning thread modifies it, except
+    // that the pool's destructor empties it while holding the registry lock.
+
+    uint64_t poolId;
+
+    Impl* pool;
+    // Null once the pool has been destroyed. Guarded by the registry lock.
+
+    ThreadFreelist* next;
+    // Next freelist belonging to the same thread.
+
+    _::FiberStack* stacks[THREAD_LOCAL_FREELIST_SIZE];
+    // Oldest first. Stacks are taken from the end.
+
+    uint count;
+    size_t hits;
+    // `count` and `hits` may be read by other threads while holding the registry lock, so the
+    // owning thread updates them atomically.
+  };
+
+  struct ThreadFreelists {
+    ThreadFreelist* head = nullptr;
+    ~ThreadFreelists() noexcept(false);
+  };
+
+  static thread_local ThreadFreelists threadLocalFreelists;
+  // All of the current thread's freelists, one for each pool the thread has used.
+
+  uint64_t poolId = 0;
+  // Nonzero if useThreadLocalFreelists() has been called.
+
+  mutable Vector<ThreadFreelist*> threadFreelists;
+  mutable size_t exitedThreadHits = 0;
+  // All threads' freelists for this pool, and the hits counted by freelists of threads that have
+  // since exited. Guarded by the registry lock.
+
+  static MutexGuarded<uint64_t>& getRegistry() {
+    // The registry lock guards the bookkeeping shared between pools and thread-local freelists.
+    // The value is the last pool ID assigned.
+    static MutexGuarded<uint64_t>* registry = new MutexGuarded<uint64_t>(0);
+    return *registry;
+  }
+
+  ThreadFreelist& getThreadFreelist() const {
+    for (auto list = threadLocalFreelists.head; list != nullptr; list = list->next) {
+      if (list->poolId == poolId) {
+        return *list;
+      }
+    }
+
+    // First use of this pool on this thread.
+    auto lock = getRegistry().lockExclusive();
+
+    // While we're here, clean up after any pools that have been destroyed.
+    ThreadFreelist** link = &threadLocalFreelists.head;
+    while (*link != nullptr) {
+      ThreadFreelist* list = *link;
+      if (list->pool == nullptr) {
+        *link = list->next;
+        delete list;
+      } else {
+        link = &list->next;
+      }
+    }
+
+    auto list = new ThreadFreelist {
+      poolId, const_cast<Impl*>(this), threadLocalFreelists.head, {}, 0, 0
+    };
+    threadLocalFreelists.head = list;
+    threadFreelists.add(list);
+    return *list;
+  }
+
+  bool reserveFreelistSlot() const {
+    // Count one more stack against `maxFreelist`, if there's room.
+
+    if (__atomic_fetch_add(&freeCount, 1, __ATOMIC_RELAXED) + 1 <= maxFreelist) {
+      return true;
+    }
+    __atomic_fetch_sub(&freeCount, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  void lockGlobal() const {
+    while (__atomic_exchange_n(&globalLock, true, __ATOMIC_ACQUIRE)) {
+#if _WIN32
+      Sleep(0);
+#else
+      sched_yield();
+#endif
+    }
+  }
+
+  void unlockGlobal() const {
+    __atomic_store_n(&globalLock, false, __ATOMIC_RELEASE);
+  }
+
+  void pushGlobal(_::FiberStack* stack, bool counted) const {
+    // Add a stack to the global freelist. `counted` is true if the stack has already been counted
+    // against `maxFreelist`. If not, and the pool's freelists are full, the oldest stack in the
+    // global freelist is evicted to make room, or if there is none, `stack` is deleted.
+
+    bool reserved = counted || reserveFreelistSlot();
+    _::FiberStack* toDelete = stack;
+
+    {
+      lockGlobal();
+      KJ_DEFER(unlockGlobal());
+
+      if (reserved) {
+        toDelete = nullptr;
+      } else if (globalOldest != nullptr) {
+        // Take over the oldest stack's slot.
+        toDelete = globalOldest;
+        globalOldest = toDelete->newerFree;
+        if (globalOldest == nullptr) {
+          __atomic_store_n(&globalNewest, nullptr, __ATOMIC_RELAXED);
+        } else {
+          globalOldest->olderFree = nullptr;
+        }
+        toDelete->newerFree = nullptr;
+      }
+
+      if (toDelete != stack) {
+        stack->olderFree = globalNewest;
+        if (globalNewest == nullptr) {
+          globalOldest = stack;
+        } else {
+          globalNewest->newerFree = stack;
+        }
+        __atomic_store_n(&globalNewest, stack, __ATOMIC_RELAXED);
+      }
+    }
+
+    delete toDelete;
+  }
+
+  _::FiberStack* popGlobal() const {
+    // Take the newest stack from the global freelist, or return null if it is empty.
+
+    if (__atomic_load_n(&globalNewest, __ATOMIC_RELAXED) == nullptr) {
+      return nullptr;
+    }
+
+    lockGlobal();
+    KJ_DEFER(unlockGlobal());
+
+    _::FiberStack* result = globalNewest;
+    if (result != nullptr) {
+      __atomic_store_n(&globalNewest, result->olderFree, __ATOMIC_RELAXED);
+      if (result->olderFree == nullptr) {
+        globalOldest = nullptr;
+      } else {
+        result->olderFree->newerFree = nullptr;
+        result->olderFree = nullptr;
+      }
+      __atomic_fetch_sub(&freeCount, 1, __ATOMIC_RELAXED);
+    }
+    return result;
+  }
 
 #if USE_CORE_LOCAL_FREELISTS
   struct CoreLocalFreelist {
@@ -645,37 +892,86 @@ private:
 
   void disposeImpl(void* pointer) const {
     _::FiberStack* stack = reinterpret_cast<_::FiberStack*>(pointer);
-    KJ_DEFER(delete stack);
 
     // Verify that the stack was reset before returning, otherwise it might be in a weird state
     // where we don't want to reuse it.
-    if (stack->isReset()) {
+    if (!stack->isReset()) {
+      delete stack;
+      return;
+    }
+
+    if (poolId != 0) {
+      ThreadFreelist& list = getThreadFreelist();
+      if (reserveFreelistSlot()) {
+        if (list.count < THREAD_LOCAL_FREELIST_SIZE) {
+          list.stacks[list.count] = stack;
+          __atomic_store_n(&list.count, list.count + 1, __ATOMIC_RELAXED);
+          return;
+        }
+
+        // Our freelist is full, so try the shared ones.
+        __atomic_fetch_sub(&freeCount, 1, __ATOMIC_RELAXED);
+      } else if (list.count > 0 && __atomic_load_n(&globalNewest, __ATOMIC_RELAXED) == nullptr) {
+        // The pool is full, and the only stacks we could evict are in our own freelist, so evict
+        // the oldest of those.
+        delete list.stacks[0];
+        for (auto i: kj::range(1u, list.count)) {
+          list.stacks[i - 1] = list.stacks[i];
+        }
+        list.stacks[list.count - 1] = stack;
+        return;
+      }
+    }
+
 #if USE_CORE_LOCAL_FREELISTS
-      KJ_IF_MAYBE(core, lookupCoreLocalFreelist()) {
-        for (auto& stackPtr: core->stacks) {
-          stack = __atomic_exchange_n(&stackPtr, stack, __ATOMIC_RELEASE);
-          if (stack == nullptr) {
-            // Cool, we inserted the stack into an unused slot. We're done.
-            return;
-          }
+    KJ_IF_MAYBE(core, lookupCoreLocalFreelist()) {
+      for (auto& stackPtr: core->stacks) {
+        stack = __atomic_exchange_n(&stackPtr, stack, __ATOMIC_RELEASE);
+        if (stack == nullptr) {
+          // Cool, we inserted the stack into an unused slot. We're done.
+          return;
         }
-        // All slots were occupied, so we inserted the new stack in the front, pushed the rest back,
-        // and now `stack` refers to the stack that fell off the end of the core-local list. That
-        // needs to go into the global freelist.
       }
+      // All slots were occupied, so we inserted the new stack in the front, pushed the rest back,
+      // and now `stack` refers to the stack that fell off the end of the core-local list. That
+      // needs to go into the global freelist.
+    }
 #endif
 
-      auto lock = freelist.lockExclusive();
-      lock->push_back(stack);
-      if (lock->size() > maxFreelist) {
-        stack = lock->front();
-        lock->pop_front();
-      } else {
-        stack = nullptr;
+    pushGlobal(stack, false);
+  }
+};
+
+thread_local FiberPool::Impl::ThreadFreelists FiberPool::Impl::threadLocalFreelists;
+
+FiberPool::Impl::ThreadFreelists::~ThreadFreelists() noexcept(false) {
+  // The thread is exiting. Hand its stacks back to the pools' global freelists.
+
+  auto lock = getRegistry().lockExclusive();
+  while (head != nullptr) {
+    ThreadFreelist* list = head;
+    head = list->next;
+
+    if (list->pool != nullptr) {
+      Impl& pool = *list->pool;
+      for (auto i: kj::zeroTo(list->count)) {
+        pool.pushGlobal(list->stacks[i], true);
+      }
+      pool.exitedThreadHits += list->hits;
+
+      auto& lists = pool.threadFreelists;
+      for (auto& entry: lists) {
+        if (entry == list) {
+          entry = lists.back();
+          lists.removeLast();
+          break;
+        }
       }
     }
+
+    delete list;
   }
-};
+}
 
 FiberPool::FiberPool(size_t stackSize) : impl(kj::heap<FiberPool::Impl>(stackSize)) {}
 FiberPool::~FiberPool() noexcept(false) {}
@@ -692,6 +988,18 @@ void FiberPool::useCoreLocalFreelists() {
   impl->useCoreLocalFreelists();
 }
 
+void FiberPool::useThreadLocalFreelists() {
+  impl->useThreadLocalFreelists();
+}
+
+void FiberPool::prefault(size_t count) {
+  impl->prefault(count);
+}
+
+FiberPool::Stats FiberPool::getStats() const {
+  return impl->getStats();
+}
+
 void FiberPool::runSynchronously(kj::FunctionParam<void()> func) const {
   ensureThreadCanRunFibers();
 
@@ -799,6 +1107,49 @@ struct Executor::Impl {
   kj::MutexGuarded<State> state;
   // After modifying state from another thread, the loop's port.wake() must be called.
 
+  mutable _::XThreadEvent* queued = nullptr;
+  // Events sent by executeAsync(), which are pushed here without taking the lock: a lock-free
+  // stack linked through XThreadEvent::nextQueued, newest first. Only a thread holding the lock
+  // on `state` may take events off of it (see takeQueued()), so there's never more than one
+  // consumer and pushes can't suffer from ABA. Set to QUEUE_CLOSED once the loop is gone.
+  //
+  // Only a push onto an empty stack wakes the target thread. Events pushed after that, but before
+  // the target thread takes the stack, ride along on the same wakeup.
+
+  static _::XThreadEvent* const QUEUE_CLOSED;
+
+  bool hasQueued() const {
+    auto head = __atomic_load_n(&queued, __ATOMIC_ACQUIRE);
+    return head != nullptr && head != QUEUE_CLOSED;
+  }
+
+  void takeQueued(State& lockedState, _::XThreadEvent* replacement = nullptr) const {
+    // Move everything on the lock-free stack to `lockedState.start`, oldest first. The caller must
+    // hold the lock on `state`.
+
+    if (__atomic_load_n(&queued, __ATOMIC_RELAXED) == QUEUE_CLOSED) {
+      // Closing happens under the lock, so this can't race.
+      return;
+    }
+
+    _::XThreadEvent* head = __atomic_exchange_n(&queued, replacement, __ATOMIC_ACQUIRE);
+
+    _::XThreadEvent* oldest = nullptr;
+    while (head != nullptr) {
+      auto next = head->nextQueued;
+      head->nextQueued = oldest;
+      oldest = head;
+      head = next;
+    }
+
+    while (oldest != nullptr) {
+      auto next = oldest->nextQueued;
+      oldest->nextQueued = nullptr;
+      lockedState.start.add(*oldest);
+      oldest = next;
+    }
+  }
+
   void processAsyncCancellations(Vector<_::XThreadEvent*>& eventsToCancelOutsideLock) {
     // After calling dispatchAll() or dispatchCancels() with the lock held, it may be that some
     // cancellations require dropping the lock before destroying the promiseNode. In that case
@@ -819,7 +1170,13 @@ struct Executor::Impl {
   }
 
   void disconnect() {
-    state.lockExclusive()->loop = nullptr;
+    {
+      auto lock = state.lockExclusive();
+      lock->loop = nullptr;
+
+      // Also close the lock-free queue, so that later sends fail immediately.
+      takeQueued(*lock, QUEUE_CLOSED);
+    }
 
     // Now that `loop` is set null in `state`, other threads will no longer try to manipulate our
     // lists, so we can access them without a lock. That's convenient because a bunch of the things
@@ -875,6 +1232,10 @@ struct Executor::Impl {
     }
   }};
 
+_::XThreadEvent* const Executor::Impl::QUEUE_CLOSED =
+    reinterpret_cast<_::XThreadEvent*>(static_cast<uintptr_t>(1));
+// Not a real event; just a value that a real pointer can't have.
+
 namespace _ {  // (private)
 
 XThreadEvent::XThreadEvent(
@@ -907,6 +1268,8 @@ void XThreadEvent::ensureDoneOrCanceled() {
         // Nothing to do.
         break;
       case QUEUED:
+        // The event might still be in the lock-free queue; it'll be in `start` after this.
+        targetExecutor->impl->takeQueued(*lock);
         lock->start.remove(*this);
         // No wake needed since we removed work rather than adding it.
         state = DONE;
@@ -1281,6 +1644,37 @@ void Executor::send(_::XThreadEvent& event, bool sync) const {
     // Note that async requests will "just work" even if the target executor is our own thread's
     // executor. In theory we could detect this case to avoid some locking and signals but that
     // would be extra code complexity for probably little benefit.
+
+    // Async requests go on the lock-free queue. The target thread may take the event as soon as
+    // it's pushed, so set the state first.
+    event.state = _::XThreadEvent::QUEUED;
+    _::XThreadEvent* head = __atomic_load_n(&impl->queued, __ATOMIC_RELAXED);
+    do {
+      if (head == Impl::QUEUE_CLOSED) {
+        event.state = _::XThreadEvent::UNUSED;
+        event.setDisconnected();
+        return;
+      }
+      event.nextQueued = head;
+    } while (!__atomic_compare_exchange_n(&impl->queued, &head, &event, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head == nullptr) {
+      // The target thread has taken everything queued before this event, so it may be asleep.
+      // We have to hold the lock to wake it, since otherwise its loop could be destroyed under us.
+      auto lock = impl->state.lockExclusive();
+      KJ_IF_MAYBE(l, lock->loop) {
+        KJ_IF_MAYBE(p, l->port) {
+          p->wake();
+        } else {
+          // Event loop will be waiting on executor.wait(), which will be woken when we unlock the
+          // mutex.
+        }
+      } else {
+        // disconnect() will have taken the event off the queue and will reply to it.
+      }
+    }
+    return;
   }
 
   auto lock = impl->state.lockExclusive();
@@ -1292,6 +1686,9 @@ void Executor::send(_::XThreadEvent& event, bool sync) const {
     return;
   }
 
+  // Make sure async requests sent earlier are dispatched first.
+  impl->takeQueued(*lock);
+
   event.state = _::XThreadEvent::QUEUED;
   lock->start.add(event);
 
@@ -1312,10 +1709,11 @@ void Executor::wait() {
 
   auto lock = impl->state.lockExclusive();
 
-  lock.wait([](const Impl::State& state) {
-    return state.isDispatchNeeded();
+  lock.wait([this](const Impl::State& state) {
+    return state.isDispatchNeeded() || impl->hasQueued();
   });
 
+  impl->takeQueued(*lock);
   lock->dispatchAll(eventsToCancelOutsideLock);
 }
 
@@ -1324,6 +1722,7 @@ bool Executor::poll() {
   KJ_DEFER(impl->processAsyncCancellations(eventsToCancelOutsideLock));
 
   auto lock = impl->state.lockExclusive();
+  impl->takeQueued(*lock);
   if (lock->isDispatchNeeded()) {
     lock->dispatchAll(eventsToCancelOutsideLock);
     return true;
@@ -1555,6 +1954,19 @@ FiberStack::~FiberStack() noexcept(false) {
 #endif
 }
 
+void FiberStack::prefault() {
+#if KJ_USE_FIBERS && !(_WIN32 || __CYGWIN__)
+  size_t pageSize = Impl::getPageSize();
+  byte* top = reinterpret_cast<byte*>(impl + 1);
+  for (byte* page = top - stackSize; page < top; page += pageSize) {
+    // Write back whatever is already there, since the top of the stack holds `Impl` and the
+    // fiber's initial frame.
+    volatile byte* ptr = page;
+    *ptr = *ptr;
+  }
+#endif
+}
+
 void FiberStack::initialize(FiberBase& fiber) {
   KJ_REQUIRE(this->main == nullptr);
   this->main = &fiber;
@@ -543,8 +543,36 @@ public:
   // TODO(someday): If func() returns a value, return it from runSynchronously? Current use case
   //   doesn't need it.
 
+  void useThreadLocalFreelists();
+  // Give each thread that uses this pool a small freelist of its own, in front of the shared one.
+  // A fiber that starts and finishes on the same thread then takes and returns its stack without
+  // taking the spinlock which guards the shared freelist. (That lock is only held for a few
+  // pointer updates, but threads contend for it.) Each thread keeps at most 4 stacks. These count toward the limit
+  // set with setMaxFreelist() along with the shared freelist's, so when the pool is full, stacks
+  // are returned to the shared freelist, evicting its oldest. A thread's stacks go back to the
+  // shared freelist when the thread exits. Must be called before the pool is first used.
+
+  void prefault(size_t count);
+  // Allocate `count` stacks now, touching every page of each so that the OS commits the memory
+  // up front, and put them in the freelist (subject to setMaxFreelist()). Fibers started later
+  // then don't take page faults the first time they use their stacks. Has no effect on Windows.
+
   size_t getFreelistSize() const;
-  // Get the number of stacks currently in the freelist. Does not count stacks that are active.
+  // Get the number of stacks currently in the freelist, including thread-local freelists. Does not
+  // count stacks that are active.
+
+  struct Stats {
+    size_t hits;
+    // Number of times a stack was taken from a freelist.
+
+    size_t threadLocalHits;
+    // How many of `hits` were served by a thread-local freelist.
+
+    size_t misses;
+    // Number of times a new stack had to be allocated because the freelists were empty.
+  };
+
+  Stats getStats() const;
 
 private:
   class Impl;
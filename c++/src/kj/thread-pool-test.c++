@@ -0,0 +1,232 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "kj/thread-pool.h"
+#include "kj/debug.h"
+#include "kj/mutex.h"
+#include "kj/thread.h"
+#include "kj/vector.h"
+#include "kj/test.h"
+
+namespace kj {
+namespace {
+
+class Gate {
+  // Lets a test hold a worker busy until it's ready.
+
+public:
+  void wait() const {
+    auto lock = open.lockExclusive();
+    lock.wait([](bool open) { return open; });
+  }
+
+  void release() const {
+    *open.lockExclusive() = true;
+  }
+
+private:
+  MutexGuarded<bool> open;
+};
+
+KJ_TEST("ThreadPool runs functions on worker threads") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  ThreadPool pool(2);
+  KJ_EXPECT(pool.getThreadCount() == 2);
+
+  const Executor* mainExecutor = &getCurrentThreadExecutor();
+  KJ_EXPECT(pool.run([&]() {
+    KJ_EXPECT(&getCurrentThreadExecutor() != mainExecutor);
+    return 123;
+  }).wait(waitScope) == 123);
+
+  bool ran = false;
+  pool.run([&]() { ran = true; }).wait(waitScope);
+  KJ_EXPECT(ran);
+
+  KJ_EXPECT_THROW_MESSAGE("worker failed",
+      pool.run([]() -> int { KJ_FAIL_ASSERT("worker failed"); }).wait(waitScope));
+
+  KJ_EXPECT(pool.run([]() { return kj::str("foo"); }).wait(waitScope) == "foo");
+}
+
+KJ_TEST("ThreadPool defaults to one thread per CPU") {
+  ThreadPool pool;
+  KJ_EXPECT(pool.getThreadCount() >= 1);
+}
+
+KJ_TEST("ThreadPool waits for promises returned by tasks") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  ThreadPool pool(2);
+
+  // A task that queues more work on the pool and waits for it. The inner task goes to the outer
+  // task's own worker, which runs it or lets the other worker steal it.
+  auto promise = pool.run([&]() {
+    return pool.run([]() { return 5; }).then([](int i) { return i * 2; });
+  });
+  KJ_EXPECT(promise.wait(waitScope) == 10);
+}
+
+KJ_TEST("ThreadPool with one thread runs tasks queued by pending tasks") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  ThreadPool pool(1);
+
+  // The only worker has to take the inner tasks while the outer ones are waiting for them.
+  auto promise = pool.run([&]() {
+    return pool.run([&]() {
+      return pool.run([]() { return 5; }).then([](int i) { return i + 1; });
+    }).then([](int i) { return i * 2; });
+  });
+  KJ_EXPECT(promise.wait(waitScope) == 12);
+
+  // A task waiting on another thread doesn't hold up the worker either.
+  MutexGuarded<Maybe<Own<CrossThreadPromiseFulfiller<int>>>> fulfiller;
+  auto waiting = pool.run([&]() {
+    auto paf = newPromiseAndCrossThreadFulfiller<int>();
+    *fulfiller.lockExclusive() = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  });
+  KJ_EXPECT(pool.run([]() { return 7; }).wait(waitScope) == 7);
+  KJ_ASSERT_NONNULL(*fulfiller.lockExclusive())->fulfill(3);
+  KJ_EXPECT(waiting.wait(waitScope) == 3);
+}
+
+KJ_TEST("ThreadPool runs higher priorities first") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  ThreadPool pool(1);
+  Gate gate;
+  MutexGuarded<Vector<uint>> order;
+
+  auto blocker = pool.run([&]() { gate.wait(); });
+
+  auto add = [&](uint i, ThreadPool::Priority priority) {
+    ThreadPool::RunOptions options;
+    options.priority = priority;
+    return pool.run([&order, i]() { order.lockExclusive()->add(i); }, options);
+  };
+
+  Vector<Promise<void>> promises;
+  promises.add(add(5, ThreadPool::Priority::LOW));
+  promises.add(add(3, ThreadPool::Priority::NORMAL));
+  promises.add(add(1, ThreadPool::Priority::HIGH));
+  promises.add(add(6, ThreadPool::Priority::LOW));
+  promises.add(add(4, ThreadPool::Priority::NORMAL));
+  promises.add(add(2, ThreadPool::Priority::HIGH));
+
+  gate.release();
+  blocker.wait(waitScope);
+  joinPromises(promises.releaseAsArray()).wait(waitScope);
+
+  auto lock = order.lockExclusive();
+  KJ_EXPECT(kj::str(kj::strArray(*lock, ",")) == "1,2,3,4,5,6", *lock);
+}
+
+KJ_TEST("ThreadPool affinity") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  ThreadPool pool(3);
+
+  Vector<Promise<uint>> promises;
+  for (auto i: kj::zeroTo(30u)) {
+    ThreadPool::RunOptions options;
+    options.affinity = i;
+    promises.add(pool.run([i]() { return i * i; }, options));
+  }
+
+  auto results = joinPromises(promises.releaseAsArray()).wait(waitScope);
+  for (auto i: kj::indices(results)) {
+    KJ_EXPECT(results[i] == i * i);
+  }
+}
+
+KJ_TEST("ThreadPool skips tasks whose promise was dropped") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  ThreadPool pool(1);
+  Gate gate;
+  bool ran = false;
+
+  auto blocker = pool.run([&]() { gate.wait(); });
+  pool.run([&]() { ran = true; });  // promise dropped immediately
+
+  gate.release();
+  blocker.wait(waitScope);
+  pool.run([]() {}).wait(waitScope);
+
+  KJ_EXPECT(!ran);
+}
+
+KJ_TEST("ThreadPool rejects tasks dropped by its destructor") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  Gate gate;
+  Promise<void> pending = nullptr;
+
+  {
+    ThreadPool pool(1);
+    auto blocker = pool.run([&]() { gate.wait(); });
+
+    // The worker can't get to this task until the gate opens, and the gate only opens when the
+    // task's function is destroyed, i.e. when the pool's destructor drops it.
+    pending = pool.run([release = kj::defer([&gate]() { gate.release(); })]() {});
+  }
+
+  KJ_EXPECT_THROW_MESSAGE("PromiseFulfiller was destroyed", pending.wait(waitScope));
+}
+
+KJ_TEST("ThreadPool from many threads") {
+  ThreadPool pool(4);
+
+  Vector<Own<Thread>> threads;
+  MutexGuarded<uint64_t> total(0);
+  for (auto t KJ_UNUSED: kj::zeroTo(4)) {
+    threads.add(kj::heap<Thread>([&]() {
+      EventLoop loop;
+      WaitScope waitScope(loop);
+
+      Vector<Promise<uint64_t>> promises;
+      for (auto i: kj::zeroTo<uint64_t>(1000)) {
+        promises.add(pool.run([i]() { return i; }));
+      }
+      uint64_t sum = 0;
+      for (auto i: joinPromises(promises.releaseAsArray()).wait(waitScope)) {
+        sum += i;
+      }
+      *total.lockExclusive() += sum;
+    }));
+  }
+  threads.clear();
+
+  KJ_EXPECT(*total.lockExclusive() == 4 * (999 * 1000 / 2));
+}
+
+}  // namespace
+}  // namespace kj
@@ -0,0 +1,297 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#if _WIN32
+#include "kj/win32-api-version.h"
+#endif
+
+#include "kj/thread-pool.h"
+#include "kj/debug.h"
+#include "kj/mutex.h"
+#include "kj/thread.h"
+#include "kj/vector.h"
+#include <atomic>
+#include <deque>
+
+#if _WIN32
+#include <windows.h>
+#include "kj/windows-sanity.h"
+#else
+#include <unistd.h>
+#endif
+
+namespace kj {
+
+namespace {
+
+constexpr uint PRIORITY_COUNT = 3;
+
+uint getCpuCount() {
+#if _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? count : 1;
+#endif
+}
+
+}  // namespace
+
+class ThreadPool::Impl final: private TaskSet::ErrorHandler {
+public:
+  Impl(uint threadCount) {
+    if (threadCount == 0) threadCount = getCpuCount();
+
+    auto builder = kj::heapArrayBuilder<Own<Worker>>(threadCount);
+    for (auto i KJ_UNUSED: kj::zeroTo(threadCount)) {
+      builder.add(kj::heap<Worker>());
+    }
+    workers = builder.finish();
+
+    for (auto& lane: queued) lane.store(0, std::memory_order_relaxed);
+
+    threads.reserve(threadCount);
+    for (auto i: kj::zeroTo(threadCount)) {
+      threads.add(kj::heap<Thread>([this, i]() { runWorker(i); }));
+    }
+  }
+
+  ~Impl() noexcept(false) {
+    // Drop everything that hasn't started yet, then wait for running tasks and stop the workers.
+    // Running tasks may still queue more work meanwhile, so `queued` is decremented for each task
+    // actually dropped rather than reset.
+    Vector<Own<Task>> dropped;
+    for (auto& worker: workers) {
+      auto lock = worker->lanes.lockExclusive();
+      for (uint lane: kj::zeroTo(PRIORITY_COUNT)) {
+        auto& tasks = (*lock)[lane];
+        for (auto& task: tasks) dropped.add(kj::mv(task));
+        queued[lane].fetch_sub(tasks.size(), std::memory_order_relaxed);
+        tasks.clear();
+      }
+    }
+    dropped.clear();
+
+    *shutdown.lockExclusive() = true;
+    threads.clear();
+  }
+
+  uint getThreadCount() const {
+    return workers.size();
+  }
+
+  void queue(Own<Task> task, RunOptions options) const {
+    uint index;
+    KJ_IF_MAYBE(affinity, options.affinity) {
+      index = *affinity % workers.size();
+    } else if (currentPool == this) {
+      // Queued by a task running in this pool. Keep it on this worker; if the worker stays busy
+      // for long, an idle peer will steal it.
+      index = currentIndex;
+    } else {
+      index = nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    }
+
+    uint lane = static_cast<uint>(options.priority);
+    {
+      // `queued` is updated under the same lock as the lane, so that it never undercounts.
+      auto lock = workers[index]->lanes.lockExclusive();
+      (*lock)[lane].push_back(kj::mv(task));
+
+      // Sleeping workers wait for `queued` to become non-zero. A worker increments `sleepers`
+      // before checking `queued`, and we increment `queued` before checking `sleepers`, so at
+      // least one of us sees the other.
+      queued[lane].fetch_add(1);
+    }
+    if (sleepers.load() > 0) {
+      // Unlocking the mutex makes it re-check the conditions the sleeping workers are waiting on.
+      auto lock = shutdown.lockExclusive();
+    }
+    if (loopSleepers.load() > 0) {
+      // Workers waiting in their event loops don't watch the mutex. Wake them all, since any of
+      // them may steal the task.
+      for (auto& worker: workers) {
+        auto lock = worker->wakeup.lockExclusive();
+        KJ_IF_MAYBE(fulfiller, *lock) {
+          (*fulfiller)->fulfill();
+          *lock = nullptr;
+        }
+      }
+    }
+  }
+
+private:
+  typedef std::deque<Own<Task>> Lanes[PRIORITY_COUNT];
+
+  struct Worker {
+    MutexGuarded<Lanes> lanes;
+    // One queue per priority. The worker takes tasks from the front; other workers steal from
+    // the back.
+
+    MutexGuarded<Maybe<Own<CrossThreadPromiseFulfiller<void>>>> wakeup;
+    // Set while the worker is waiting in its event loop for tasks it has started. Fulfilling it
+    // makes the worker look for new tasks.
+  };
+
+  Array<Own<Worker>> workers;
+  Vector<Own<Thread>> threads;
+
+  mutable std::atomic<uint> queued[PRIORITY_COUNT];
+  // Number of tasks queued in each lane across all workers. Lets a worker skip lanes that are
+  // empty everywhere without locking every queue.
+
+  std::atomic<uint> sleepers { 0 };
+  // Workers with nothing running, waiting on `shutdown`.
+
+  std::atomic<uint> loopSleepers { 0 };
+  // Workers waiting in their event loops, with their `wakeup` set.
+
+  mutable std::atomic<uint> nextWorker { 0 };
+
+  MutexGuarded<bool> shutdown;
+  // Idle workers wait on this mutex for work or shutdown.
+
+  static thread_local Impl* currentPool;
+  static thread_local uint currentIndex;
+  // The pool and worker index that the current thread belongs to, if it's a worker.
+
+  uint totalQueued() const {
+    uint result = 0;
+    for (auto& lane: queued) result += lane.load();
+    return result;
+  }
+
+  void runWorker(uint index) {
+    EventLoop loop;
+    WaitScope waitScope(loop);
+
+    currentPool = this;
+    currentIndex = index;
+
+    TaskSet running(*this);
+    // Tasks started on this worker whose promises haven't resolved yet.
+
+    for (;;) {
+      KJ_IF_MAYBE(task, takeTask(index)) {
+        auto promise = (*task)->run();
+        running.add(promise.attach(kj::mv(*task)));
+
+        // Let the task get as far as it can before taking the next one.
+        waitScope.poll();
+        continue;
+      }
+
+      if (!running.isEmpty()) {
+        waitInLoop(*workers[index], running, waitScope);
+        continue;
+      }
+
+      auto lock = shutdown.lockExclusive();
+      sleepers.fetch_add(1);
+      lock.wait([this](bool shutdown) { return shutdown || totalQueued() > 0; });
+      sleepers.fetch_sub(1);
+      if (*lock) break;
+    }
+  }
+
+  void waitInLoop(Worker& worker, TaskSet& running, WaitScope& waitScope) {
+    // Some of this worker's tasks are waiting on events from other threads (or other tasks),
+    // which arrive through its event loop. Wait there until they're all done or more work is
+    // queued. On shutdown, this keeps the worker around until its tasks finish.
+
+    auto paf = newPromiseAndCrossThreadFulfiller<void>();
+    *worker.wakeup.lockExclusive() = kj::mv(paf.fulfiller);
+
+    // As with `sleepers`, we increment `loopSleepers` before checking `queued`, and queue()
+    // does the opposite.
+    loopSleepers.fetch_add(1);
+    if (totalQueued() == 0) {
+      paf.promise.exclusiveJoin(running.onEmpty()).wait(waitScope);
+    }
+    loopSleepers.fetch_sub(1);
+
+    *worker.wakeup.lockExclusive() = nullptr;
+  }
+
+  void taskFailed(Exception&& exception) override {
+    // Task::run() reports errors to the caller, so this shouldn't happen.
+    KJ_LOG(ERROR, "uncaught exception in thread pool task", exception);
+  }
+
+  Maybe<Own<Task>> takeTask(uint index) {
+    for (uint lane: kj::zeroTo(PRIORITY_COUNT)) {
+      if (queued[lane].load(std::memory_order_relaxed) == 0) continue;
+
+      KJ_IF_MAYBE(task, takeFrom(*workers[index], lane, false)) {
+        return kj::mv(*task);
+      }
+
+      for (auto i: kj::range<uint>(1, workers.size())) {
+        auto& victim = *workers[(index + i) % workers.size()];
+        KJ_IF_MAYBE(task, takeFrom(victim, lane, true)) {
+          return kj::mv(*task);
+        }
+      }
+    }
+
+    return nullptr;
+  }
+
+  Maybe<Own<Task>> takeFrom(Worker& worker, uint lane, bool steal) {
+    auto lock = worker.lanes.lockExclusive();
+    auto& tasks = (*lock)[lane];
+    if (tasks.empty()) return nullptr;
+
+    Own<Task> result;
+    if (steal) {
+      result = kj::mv(tasks.back());
+      tasks.pop_back();
+    } else {
+      result = kj::mv(tasks.front());
+      tasks.pop_front();
+    }
+    queued[lane].fetch_sub(1, std::memory_order_relaxed);
+    return kj::mv(result);
+  }
+};
+
+thread_local ThreadPool::Impl* ThreadPool::Impl::currentPool = nullptr;
+thread_local uint ThreadPool::Impl::currentIndex = 0;
+
+ThreadPool::ThreadPool(uint threadCount): impl(kj::heap<Impl>(threadCount)) {}
+ThreadPool::~ThreadPool() noexcept(false) {}
+
+uint ThreadPool::getThreadCount() const {
+  return impl->getThreadCount();
+}
+
+void ThreadPool::queue(Own<Task> task, RunOptions options) const {
+  impl->queue(kj::mv(task), options);
+}
+
+Promise<void> ThreadPool::deliver(Promise<void>&& promise,
+                                  const CrossThreadPromiseFulfiller<void>& fulfiller) {
+  return promise.then([&fulfiller]() { fulfiller.fulfill(); });
+}
+
+}  // namespace kj
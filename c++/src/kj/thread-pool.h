@@ -0,0 +1,154 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include "kj/async.h"
+
+KJ_BEGIN_HEADER
+
+namespace kj {
+
+class ThreadPool {
+  // A set of worker threads for offloading CPU-bound work (encoding, compression, validation...)
+  // from an event loop. run() queues a function on the pool and returns a promise, belonging to
+  // the calling thread's event loop, for its result.
+  //
+  // Each worker has its own task queue. Tasks queued from outside the pool are spread across the
+  // workers, while tasks queued by code already running on a worker go to that worker's queue. A
+  // worker runs tasks from its own queue in order, and when that runs dry, steals tasks from the
+  // other end of its peers' queues, so a burst of work queued on one worker still spreads across
+  // the whole pool.
+  //
+  // Each worker thread runs its own EventLoop, so a function may return a promise (e.g. it may
+  // be a coroutine). While that promise is pending, the worker goes on to take other tasks, so a
+  // task may wait for work that it queues on the pool, even if the pool has only one thread.
+  // There is no I/O on worker threads, though, so such promises can only depend on other work in
+  // the pool or on cross-thread events.
+
+public:
+  enum class Priority {
+    HIGH,
+    NORMAL,
+    LOW
+  };
+  // Each queue has one lane per priority. An idle worker takes a HIGH task from anywhere in the
+  // pool before it takes a NORMAL one, and a NORMAL one before a LOW one. Tasks that have
+  // already started are never preempted.
+
+  struct RunOptions {
+    Priority priority = Priority::NORMAL;
+
+    Maybe<uint> affinity;
+    // If set, queue the task on worker number `affinity % getThreadCount()`. Tasks with the same
+    // affinity start in order relative to each other as long as no other worker is idle enough to
+    // steal them, and they tend to run on the same worker thread, which helps if they touch the
+    // same data.
+  };
+
+  explicit ThreadPool(uint threadCount = 0);
+  // Start `threadCount` worker threads, or one per CPU core if zero.
+
+  ~ThreadPool() noexcept(false);
+  // Waits for tasks that are already running to finish, then stops the workers. Tasks that
+  // hadn't started are dropped, rejecting their promises.
+
+  KJ_DISALLOW_COPY_AND_MOVE(ThreadPool);
+
+  uint getThreadCount() const;
+
+  template <typename Func>
+  PromiseForResult<Func, void> run(Func&& func, RunOptions options) const;
+  template <typename Func>
+  PromiseForResult<Func, void> run(Func&& func) const { return run(kj::fwd<Func>(func), {}); }
+  // Queue `func()` to run on a worker thread. May be called from any thread that has an
+  // EventLoop, including the pool's own workers. The returned promise belongs to the calling
+  // thread and resolves to func()'s result (or the result of the promise func() returns), or is
+  // rejected with the exception func() throws.
+  //
+  // `func` is moved to the worker and destroyed there, so it must not capture anything that can't
+  // be used and destroyed from another thread. The same goes for its return value, which is
+  // constructed on the worker and consumed on the calling thread.
+  //
+  // If the returned promise is destroyed before a worker gets to the task, the task is skipped.
+  // Once the task has started, it runs to completion and its result is discarded.
+
+private:
+  class Task {
+  public:
+    virtual ~Task() noexcept(false) = default;
+    virtual Promise<void> run() = 0;
+    // Starts the task on the current worker. The returned promise resolves once the result has
+    // been delivered to the caller, and never rejects.
+  };
+
+  template <typename T, typename Func>
+  class TaskImpl;
+
+  class Impl;
+  Own<Impl> impl;
+
+  void queue(Own<Task> task, RunOptions options) const;
+
+  template <typename T>
+  static Promise<void> deliver(Promise<T>&& promise,
+                               const CrossThreadPromiseFulfiller<T>& fulfiller) {
+    return promise.then([&fulfiller](T&& value) { fulfiller.fulfill(kj::mv(value)); });
+  }
+  static Promise<void> deliver(Promise<void>&& promise,
+                               const CrossThreadPromiseFulfiller<void>& fulfiller);
+};
+
+// =======================================================================================
+// inline implementation details
+
+template <typename T, typename Func>
+class ThreadPool::TaskImpl final: public Task {
+public:
+  TaskImpl(Func&& func, Own<CrossThreadPromiseFulfiller<T>> fulfiller)
+      : func(kj::fwd<Func>(func)), fulfiller(kj::mv(fulfiller)) {}
+
+  Promise<void> run() override {
+    if (!fulfiller->isWaiting()) {
+      // The caller has already dropped the promise.
+      return READY_NOW;
+    }
+
+    return deliver(Promise<void>(READY_NOW).then(kj::mv(func)), *fulfiller)
+        .catch_([this](Exception&& exception) { fulfiller->reject(kj::mv(exception)); });
+  }
+
+private:
+  Decay<Func> func;
+  Own<CrossThreadPromiseFulfiller<T>> fulfiller;
+};
+
+template <typename Func>
+PromiseForResult<Func, void> ThreadPool::run(Func&& func, RunOptions options) const {
+  typedef _::UnwrapPromise<PromiseForResult<Func, void>> T;
+  auto paf = newPromiseAndCrossThreadFulfiller<T>();
+  queue(kj::heap<TaskImpl<T, Func>>(kj::fwd<Func>(func), kj::mv(paf.fulfiller)), options);
+  return kj::mv(paf.promise);
+}
+
+}  // namespace kj
+
+KJ_END_HEADER
@@ -0,0 +1,210 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "kj/timer.h"
+#include "kj/debug.h"
+#include "kj/vector.h"
+#include "kj/test.h"
+
+namespace kj {
+namespace {
+
+class TimerLog {
+  // Arms timers on a TimerImpl and records the order in which they fire.
+
+public:
+  TimerLog(TimerImpl& timer, WaitScope& waitScope): timer(timer), waitScope(waitScope) {}
+
+  void at(TimePoint time, uint id) {
+    auto promise = timer.atTime(time).then([this,id]() { fired.add(id); });
+    pending.add(Pending { id, promise.eagerlyEvaluate(nullptr) });
+  }
+
+  void cancel(uint id) {
+    for (auto& p: pending) {
+      if (p.id == id) p.promise = nullptr;
+    }
+  }
+
+  void advanceTo(TimePoint time) {
+    timer.advanceTo(time);
+    waitScope.poll();
+  }
+
+  Vector<uint> fired;
+
+private:
+  struct Pending {
+    uint id;
+    Maybe<Promise<void>> promise;
+  };
+
+  TimerImpl& timer;
+  WaitScope& waitScope;
+  Vector<Pending> pending;
+};
+
+class Rand {
+public:
+  uint next(uint range) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return (state >> 33) % range;
+  }
+
+private:
+  uint64_t state = 12345;
+};
+
+TimerImpl::Options wheelOptions() {
+  TimerImpl::Options options;
+  options.useTimerWheel = true;
+  return options;
+}
+
+KJ_TEST("timer wheel fires in order") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  auto start = origin<TimePoint>() + 1000 * SECONDS;
+  TimerImpl timer(start, wheelOptions());
+  TimerLog log(timer, waitScope);
+
+  KJ_EXPECT(timer.nextEvent() == nullptr);
+
+  log.at(start + 5 * SECONDS, 5);
+  log.at(start + 100 * NANOSECONDS, 2);
+  log.at(start + 10 * NANOSECONDS, 1);
+  log.at(start + 100 * NANOSECONDS, 3);   // same time as 2; must fire after it
+  log.at(start + 3 * MILLISECONDS, 4);
+  log.at(start + 365 * 24 * 3600 * SECONDS, 7);
+  log.at(start + 2 * 3600 * SECONDS, 6);
+  log.at(start - 1 * SECONDS, 0);         // already in the past
+
+  KJ_EXPECT(timer.nextEvent() == start - 1 * SECONDS);
+
+  log.advanceTo(start);
+  KJ_EXPECT(log.fired == kj::arr(0u));
+  KJ_EXPECT(timer.nextEvent() == start + 10 * NANOSECONDS);
+
+  log.advanceTo(start + 100 * NANOSECONDS);
+  KJ_EXPECT(log.fired == kj::arr(0u, 1u, 2u, 3u));
+  KJ_EXPECT(timer.nextEvent() == start + 3 * MILLISECONDS);
+
+  log.advanceTo(start + 2 * MILLISECONDS);
+  KJ_EXPECT(log.fired.size() == 4);
+
+  log.advanceTo(start + 3 * 3600 * SECONDS);
+  KJ_EXPECT(log.fired == kj::arr(0u, 1u, 2u, 3u, 4u, 5u, 6u));
+  KJ_EXPECT(timer.nextEvent() == start + 365 * 24 * 3600 * SECONDS);
+
+  // A timer that's nearer than the remaining one, armed after the cursor has jumped ahead.
+  log.at(start + 3 * 3600 * SECONDS + 1 * MILLISECONDS, 8);
+  KJ_EXPECT(timer.nextEvent() == start + 3 * 3600 * SECONDS + 1 * MILLISECONDS);
+
+  log.advanceTo(start + 400 * 24 * 3600 * SECONDS);
+  KJ_EXPECT(log.fired == kj::arr(0u, 1u, 2u, 3u, 4u, 5u, 6u, 8u, 7u));
+  KJ_EXPECT(timer.nextEvent() == nullptr);
+}
+
+KJ_TEST("timer wheel cancellation") {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  auto start = origin<TimePoint>();
+  TimerImpl timer(start, wheelOptions());
+  TimerLog log(timer, waitScope);
+
+  log.at(start + 1 * MILLISECONDS, 1);
+  log.at(start + 2 * MILLISECONDS, 2);
+  log.at(start + 10 * SECONDS, 3);
+  log.at(start + 10 * SECONDS, 4);
+
+  log.cancel(1);
+  KJ_EXPECT(timer.nextEvent() == start + 2 * MILLISECONDS);
+  log.cancel(2);
+  KJ_EXPECT(timer.nextEvent() == start + 10 * SECONDS);
+
+  log.advanceTo(start + 5 * SECONDS);
+  log.cancel(3);
+  KJ_EXPECT(timer.nextEvent() == start + 10 * SECONDS);
+  log.advanceTo(start + 20 * SECONDS);
+  KJ_EXPECT(log.fired == kj::arr(4u));
+  KJ_EXPECT(timer.nextEvent() == nullptr);
+}
+
+KJ_TEST("timer wheel matches the default implementation") {
+  // Apply the same random sequence of arms, cancels and advances to both implementations.
+
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  auto start = origin<TimePoint>() + 123456789 * NANOSECONDS;
+  TimerImpl setTimer(start);
+  TimerImpl wheelTimer(start, wheelOptions());
+  TimerLog setLog(setTimer, waitScope);
+  TimerLog wheelLog(wheelTimer, waitScope);
+
+  // A spread of delays from nanoseconds to days, so that every level of the wheel is used.
+  static constexpr Duration SCALES[] = {
+    1 * NANOSECONDS, 1 * MICROSECONDS, 100 * MICROSECONDS, 1 * MILLISECONDS,
+    50 * MILLISECONDS, 1 * SECONDS, 60 * SECONDS, 3600 * SECONDS, 24 * 3600 * SECONDS
+  };
+
+  Rand rand;
+  auto now = start;
+  uint nextId = 0;
+  for (auto i KJ_UNUSED: kj::zeroTo(20000)) {
+    switch (rand.next(4)) {
+      case 0:
+      case 1: {
+        auto time = now + rand.next(1000) * SCALES[rand.next(kj::size(SCALES))];
+        if (rand.next(10) == 0) time = now - rand.next(1000) * NANOSECONDS;
+        setLog.at(time, nextId);
+        wheelLog.at(time, nextId);
+        ++nextId;
+        break;
+      }
+      case 2:
+        if (nextId > 0) {
+          auto id = rand.next(nextId);
+          setLog.cancel(id);
+          wheelLog.cancel(id);
+        }
+        break;
+      case 3:
+        now = now + rand.next(1000) * SCALES[rand.next(kj::size(SCALES) - 2)];
+        setLog.advanceTo(now);
+        wheelLog.advanceTo(now);
+        break;
+    }
+
+    KJ_ASSERT(setTimer.nextEvent() == wheelTimer.nextEvent());
+  }
+
+  setLog.advanceTo(now + 1000 * 24 * 3600 * SECONDS);
+  wheelLog.advanceTo(now + 1000 * 24 * 3600 * SECONDS);
+
+  KJ_EXPECT(setLog.fired.size() > 1000);
+  KJ_EXPECT(setLog.fired == wheelLog.fired);
+}
+
+}  // namespace
+}  // namespace kj
@@ -22,54 +22,399 @@
 
 #include "kj/timer.h"
 #include "kj/debug.h"
+#include "kj/vector.h"
 #include <set>
+#include <algorithm>
+
+#if _MSC_VER && !defined(__clang__)
+#include <intrin.h>
+#endif
 
 namespace kj {
 
+namespace {
+
+inline uint lg64(uint64_t value) {
+  // Compute floor(log2(value)).
+  //
+  // Undefined for value = 0.
+#if _MSC_VER && !defined(__clang__)
+  unsigned long i;
+  _BitScanReverse64(&i, value);
+  return i;
+#else
+  return 63 - __builtin_clzll(value);
+#endif
+}
+
+inline uint lowestBit(uint64_t value) {
+  // Compute the index of the lowest set bit.
+  //
+  // Undefined for value = 0.
+#if _MSC_VER && !defined(__clang__)
+  unsigned long i;
+  _BitScanForward64(&i, value);
+  return i;
+#else
+  return __builtin_ctzll(value);
+#endif
+}
+
+}  // namespace
+
 kj::Exception Timer::makeTimeoutException() {
   return KJ_EXCEPTION(OVERLOADED, "operation timed out");
 }
 
 struct TimerImpl::Impl {
+  // The collection of pending timers.
+
+  virtual ~Impl() noexcept(false) {}
+
+  virtual void add(TimerPromiseAdapter& timer) = 0;
+  virtual void remove(TimerPromiseAdapter& timer) = 0;
+
+  virtual Maybe<TimePoint> nextEvent() = 0;
+  // Returns the earliest scheduled time of any pending timer.
+
+  virtual TimerPromiseAdapter* nextExpired(TimePoint time) = 0;
+  // Returns the earliest pending timer scheduled at or before `time`, or null if there is none.
+  // Among timers scheduled for the same time, returns the one added first.
+};
+
+class TimerImpl::SetImpl final: public Impl {
+  // Timers kept in a balanced tree, ordered by time.
+
+public:
+  void add(TimerPromiseAdapter& timer) override;
+  void remove(TimerPromiseAdapter& timer) override;
+  Maybe<TimePoint> nextEvent() override;
+  TimerPromiseAdapter* nextExpired(TimePoint time) override;
+
   struct TimerBefore {
     bool operator()(TimerPromiseAdapter* lhs, TimerPromiseAdapter* rhs) const;
   };
   using Timers = std::multiset<TimerPromiseAdapter*, TimerBefore>;
+
+private:
   Timers timers;
 };
 
+class TimerImpl::WheelImpl final: public Impl {
+  // Timers kept in a hierarchical timing wheel.
+  //
+  // Time is divided into ticks of `resolution` each, counted from `origin`. The wheel has a
+  // cursor, the tick of the last time it was advanced to, and LEVELS levels of SLOTS slots each.
+  // A timer due at a later tick than the cursor goes in the level numbered by the highest 6-bit
+  // digit in which the two ticks differ, in the slot numbered by the timer's digit there. So
+  // level 0 holds timers due within the cursor's current run of 64 ticks, level 1 those due
+  // within its current run of 4096 ticks but not the first, and so on, and the earliest timers
+  // are always in the lowest occupied slot of the lowest occupied level. Adding or removing a
+  // timer is a constant-time list operation.
+  //
+  // As the cursor advances, slots it passes come due, and the slot it lands in at the level of
+  // the highest digit that changed is redistributed into the (now empty) levels below. Timers
+  // due at or before the cursor's tick are sorted by time and kept in `current`, from which they
+  // are fired once their exact time is reached.
+
+public:
+  WheelImpl(TimePoint origin, Duration resolution): origin(origin), resolution(resolution) {
+    KJ_REQUIRE(resolution > 0 * NANOSECONDS, "timer wheel resolution must be positive");
+    for (auto level: kj::indices(slots)) {
+      for (auto index: kj::indices(slots[level])) {
+        slots[level][index].level = level;
+      }
+    }
+    current.level = LEVELS;
+  }
+
+  void add(TimerPromiseAdapter& timer) override;
+  void remove(TimerPromiseAdapter& timer) override;
+  Maybe<TimePoint> nextEvent() override;
+  TimerPromiseAdapter* nextExpired(TimePoint time) override;
+
+  struct Slot {
+    TimerPromiseAdapter* head = nullptr;
+    TimerPromiseAdapter* tail = nullptr;
+    uint level;   // LEVELS for `current`
+  };
+
+private:
+  static constexpr uint BITS = 6;
+  static constexpr uint SLOTS = 1u << BITS;
+  static constexpr uint LEVELS = (64 + BITS - 1) / BITS;
+
+  const TimePoint origin;
+  const Duration resolution;
+
+  uint64_t cursor = 0;
+  uint64_t nextSeq = 0;
+
+  Slot slots[LEVELS][SLOTS];
+  uint64_t occupied[LEVELS] = {};
+  // Bit i of occupied[level] is set when slots[level][i] is non-empty.
+
+  Slot current;
+  // Timers due at or before the cursor's tick, in order.
+
+  bool nextEventKnown = true;
+  Maybe<TimePoint> knownNextEvent;
+  // Cache for nextEvent(), which otherwise may need to search a slot.
+
+  Vector<TimerPromiseAdapter*> scratch;
+
+  uint64_t tickOf(TimePoint time) {
+    return time <= origin ? 0 : (time - origin) / resolution;
+  }
+
+  static uint digit(uint64_t tick, uint level) {
+    return (tick >> (level * BITS)) & (SLOTS - 1);
+  }
+
+  void place(TimerPromiseAdapter& timer);
+  void append(Slot& slot, TimerPromiseAdapter& timer);
+  void unlink(TimerPromiseAdapter& timer);
+  void takeAll(Slot& slot);
+  void advance(uint64_t newCursor);
+};
+
 class TimerImpl::TimerPromiseAdapter {
 public:
   TimerPromiseAdapter(PromiseFulfiller<void>& fulfiller, TimerImpl::Impl& impl, TimePoint time)
       : time(time), fulfiller(fulfiller), impl(impl) {
-    pos = impl.timers.insert(this);
+    impl.add(*this);
   }
 
   ~TimerPromiseAdapter() {
-    if (pos != impl.timers.end()) {
-      impl.timers.erase(pos);
+    if (pending) {
+      impl.remove(*this);
     }
   }
 
   void fulfill() {
     fulfiller.fulfill();
-    impl.timers.erase(pos);
-    pos = impl.timers.end();
+    impl.remove(*this);
+    pending = false;
   }
 
   const TimePoint time;
 
+  // Bookkeeping for the Impl.
+  SetImpl::Timers::const_iterator pos;
+  TimerPromiseAdapter* prev;
+  TimerPromiseAdapter* next;
+  WheelImpl::Slot* slot;
+  uint64_t seq;
+
 private:
   PromiseFulfiller<void>& fulfiller;
   TimerImpl::Impl& impl;
-  Impl::Timers::const_iterator pos;
+  bool pending = true;
 };
 
-inline bool TimerImpl::Impl::TimerBefore::operator()(
+// -------------------------------------------------------------------
+
+inline bool TimerImpl::SetImpl::TimerBefore::operator()(
     TimerPromiseAdapter* lhs, TimerPromiseAdapter* rhs) const {
   return lhs->time < rhs->time;
 }
 
+void TimerImpl::SetImpl::add(TimerPromiseAdapter& timer) {
+  timer.pos = timers.insert(&timer);
+}
+
+void TimerImpl::SetImpl::remove(TimerPromiseAdapter& timer) {
+  timers.erase(timer.pos);
+}
+
+Maybe<TimePoint> TimerImpl::SetImpl::nextEvent() {
+  auto iter = timers.begin();
+  if (iter == timers.end()) {
+    return nullptr;
+  } else {
+    return (*iter)->time;
+  }
+}
+
+TimerImpl::TimerPromiseAdapter* TimerImpl::SetImpl::nextExpired(TimePoint time) {
+  auto front = timers.begin();
+  if (front == timers.end() || (*front)->time > time) {
+    return nullptr;
+  }
+  return *front;
+}
+
+// -------------------------------------------------------------------
+
+void TimerImpl::WheelImpl::add(TimerPromiseAdapter& timer) {
+  timer.seq = nextSeq++;
+  if (nextEventKnown) {
+    KJ_IF_MAYBE(t, knownNextEvent) {
+      if (timer.time < *t) *t = timer.time;
+    } else {
+      knownNextEvent = timer.time;
+    }
+  }
+  place(timer);
+}
+
+void TimerImpl::WheelImpl::remove(TimerPromiseAdapter& timer) {
+  KJ_IF_MAYBE(t, knownNextEvent) {
+    if (timer.time == *t) nextEventKnown = false;
+  }
+  unlink(timer);
+}
+
+Maybe<TimePoint> TimerImpl::WheelImpl::nextEvent() {
+  if (!nextEventKnown) {
+    knownNextEvent = nullptr;
+    if (current.head != nullptr) {
+      knownNextEvent = current.head->time;
+    } else {
+      for (auto level: kj::zeroTo(LEVELS)) {
+        if (occupied[level] != 0) {
+          // The earliest timers are in this slot, but not in any order.
+          auto& slot = slots[level][lowestBit(occupied[level])];
+          TimePoint earliest = slot.head->time;
+          for (auto timer = slot.head->next; timer != nullptr; timer = timer->next) {
+            earliest = kj::min(earliest, timer->time);
+          }
+          knownNextEvent = earliest;
+          break;
+        }
+      }
+    }
+    nextEventKnown = true;
+  }
+  return knownNextEvent;
+}
+
+TimerImpl::TimerPromiseAdapter* TimerImpl::WheelImpl::nextExpired(TimePoint time) {
+  uint64_t tick = tickOf(time);
+  if (tick > cursor) {
+    advance(tick);
+  }
+
+  auto front = current.head;
+  if (front == nullptr || front->time > time) {
+    return nullptr;
+  }
+  return front;
+}
+
+void TimerImpl::WheelImpl::place(TimerPromiseAdapter& timer) {
+  uint64_t tick = tickOf(timer.time);
+  if (tick <= cursor) {
+    // Insert into `current` in order. The timer is most likely due at about the same time as
+    // the others (if any), so search from the back.
+    auto after = current.tail;
+    while (after != nullptr && after->time > timer.time) {
+      after = after->prev;
+    }
+    timer.slot = &current;
+    timer.prev = after;
+    if (after == nullptr) {
+      timer.next = current.head;
+      current.head = &timer;
+    } else {
+      timer.next = after->next;
+      after->next = &timer;
+    }
+    if (timer.next == nullptr) {
+      current.tail = &timer;
+    } else {
+      timer.next->prev = &timer;
+    }
+  } else {
+    uint level = lg64(tick ^ cursor) / BITS;
+    uint index = digit(tick, level);
+    append(slots[level][index], timer);
+    occupied[level] |= uint64_t(1) << index;
+  }
+}
+
+void TimerImpl::WheelImpl::append(Slot& slot, TimerPromiseAdapter& timer) {
+  timer.slot = &slot;
+  timer.prev = slot.tail;
+  timer.next = nullptr;
+  if (slot.tail == nullptr) {
+    slot.head = &timer;
+  } else {
+    slot.tail->next = &timer;
+  }
+  slot.tail = &timer;
+}
+
+void TimerImpl::WheelImpl::unlink(TimerPromiseAdapter& timer) {
+  auto& slot = *timer.slot;
+  if (timer.prev == nullptr) {
+    slot.head = timer.next;
+  } else {
+    timer.prev->next = timer.next;
+  }
+  if (timer.next == nullptr) {
+    slot.tail = timer.prev;
+  } else {
+    timer.next->prev = timer.prev;
+  }
+
+  if (slot.head == nullptr && slot.level < LEVELS) {
+    occupied[slot.level] &= ~(uint64_t(1) << (&slot - slots[slot.level]));
+  }
+}
+
+void TimerImpl::WheelImpl::takeAll(Slot& slot) {
+  // Move all of `slot`'s timers to `scratch`.
+
+  for (auto timer = slot.head; timer != nullptr; timer = timer->next) {
+    scratch.add(timer);
+  }
+  slot.head = nullptr;
+  slot.tail = nullptr;
+}
+
+void TimerImpl::WheelImpl::advance(uint64_t newCursor) {
+  uint top = lg64(cursor ^ newCursor) / BITS;
+
+  // Every timer in the levels below `top` is now due, as is every timer at `top` in a slot
+  // before the new cursor's. The timers in the new cursor's slot at `top` may or may not be.
+  // Gather all of them up.
+  uint64_t topMask = (uint64_t(1) << digit(newCursor, top) << 1) - 1;
+  for (auto level: kj::zeroTo(top + 1)) {
+    uint64_t mask = level < top ? occupied[level] : occupied[level] & topMask;
+    for (uint64_t bits = mask; bits != 0; bits &= bits - 1) {
+      takeAll(slots[level][lowestBit(bits)]);
+    }
+    occupied[level] &= ~mask;
+  }
+
+  cursor = newCursor;
+
+  // Timers that are still in the future go back into the (lower) levels. The rest are due by the
+  // new cursor's tick, and since they were all in the wheel, they come after everything already
+  // in `current`.
+  size_t due = 0;
+  for (auto timer: scratch) {
+    if (tickOf(timer->time) > cursor) {
+      place(*timer);
+    } else {
+      scratch[due++] = timer;
+    }
+  }
+  scratch.resize(due);
+
+  std::sort(scratch.begin(), scratch.end(),
+      [](TimerPromiseAdapter* lhs, TimerPromiseAdapter* rhs) {
+    return lhs->time < rhs->time || (lhs->time == rhs->time && lhs->seq < rhs->seq);
+  });
+  for (auto timer: scratch) {
+    append(current, *timer);
+  }
+  scratch.clear();
+}
+
+// -------------------------------------------------------------------
+
 Promise<void> TimerImpl::atTime(TimePoint time) {
   return newAdaptedPromise<void, TimerPromiseAdapter>(*impl, time);
 }
@@ -79,17 +424,21 @@ Promise<void> TimerImpl::afterDelay(Duration delay) {
 }
 
 TimerImpl::TimerImpl(TimePoint startTime)
-    : time(startTime), impl(heap<Impl>()) {}
+    : time(startTime), impl(heap<SetImpl>()) {}
+
+TimerImpl::TimerImpl(TimePoint startTime, Options options)
+    : time(startTime) {
+  if (options.useTimerWheel) {
+    impl = heap<WheelImpl>(startTime, options.wheelResolution);
+  } else {
+    impl = heap<SetImpl>();
+  }
+}
 
 TimerImpl::~TimerImpl() noexcept(false) {}
 
 Maybe<TimePoint> TimerImpl::nextEvent() {
-  auto iter = impl->timers.begin();
-  if (iter == impl->timers.end()) {
-    return nullptr;
-  } else {
-    return (*iter)->time;
-  }
+  return impl->nextEvent();
 }
 
 Maybe<uint64_t> TimerImpl::timeoutToNextEvent(TimePoint start, Duration unit, uint64_t max) {
@@ -121,12 +470,8 @@ void TimerImpl::advanceTo(TimePoint newTime) {
   time = newTime;
 #endif
 
-  for (;;) {
-    auto front = impl->timers.begin();
-    if (front == impl->timers.end() || (*front)->time > time) {
-      break;
-    }
-    (*front)->fulfill();
+  while (auto timer = impl->nextExpired(time)) {
+    timer->fulfill();
   }
 }
 
@@ -82,7 +82,20 @@ class TimerImpl final: public Timer {
   // implementation -- to tell it when time has advanced.
 
 public:
+  struct Options {
+    bool useTimerWheel = false;
+    // Keep pending timers in a hierarchical timing wheel rather than a balanced tree. Arming and
+    // canceling a timer then take constant time and allocate nothing, which pays off when very
+    // many timers are pending and most are canceled before they fire, as with per-request
+    // timeouts in a busy server. Timers still fire in exactly the order of their scheduled times.
+
+    Duration wheelResolution = 1 * MILLISECONDS;
+    // Span of time covered by each slot of the wheel's finest level. Timers falling in the same
+    // slot are sorted when the slot comes due, so this affects performance but not precision.
+  };
+
   TimerImpl(TimePoint startTime);
+  TimerImpl(TimePoint startTime, Options options);
   ~TimerImpl() noexcept(false);
 
   Maybe<TimePoint> nextEvent();
@@ -115,6 +128,8 @@ public:
 
 private:
   struct Impl;
+  class SetImpl;
+  class WheelImpl;
   class TimerPromiseAdapter;
   TimePoint time;
   Own<Impl> impl;